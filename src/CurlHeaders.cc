@@ -0,0 +1,109 @@
+/*
+* mod_dup - duplicates apache requests
+*
+* Copyright (C) 2017 Orange
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "CurlHeaders.hh"
+
+#include <boost/static_assert.hpp>
+#include <strings.h>
+
+namespace DupModule {
+
+BOOST_STATIC_ASSERT(HeaderName::COUNT <= 64);
+
+// The headers sent with every duplication, whatever its destination. curl only reads the list.
+static curl_slist gCommonHeaders[] = {
+    // This avoids the Expect: 100 continue
+    // Which is generated by curl when it's a POST and the body is long
+    { const_cast<char *>("Expect:"), &gCommonHeaders[1] },
+    // Setting X-DUPLICATED-REQUEST to 1 in the header
+    { const_cast<char *>("X-DUPLICATED-REQUEST: 1"), &gCommonHeaders[2] },
+    // Setting mod-dup as the real agent for tracability
+    { const_cast<char *>("User-RealAgent: mod-dup"), NULL },
+};
+
+static const uint64_t cCommonHeaders = (uint64_t(1) << HeaderName::EXPECT) |
+    (uint64_t(1) << HeaderName::X_DUPLICATED_REQUEST) | (uint64_t(1) << HeaderName::USER_REALAGENT);
+
+tCurlHeaders::tCurlHeaders()
+    : mSeen(cCommonHeaders) {
+}
+
+void
+tCurlHeaders::reserve(size_t pCount, size_t pBytes) {
+    // ": " and the NUL of each line
+    mBuffer.reserve(mBuffer.size() + pBytes + 3 * pCount);
+    mLines.reserve(mLines.size() + pCount);
+}
+
+void
+tCurlHeaders::add(HeaderName::eHeaderName pId, boost::string_ref pValue) {
+    add(HeaderName::toString(pId), pId, pValue);
+}
+
+void
+tCurlHeaders::add(boost::string_ref pName, HeaderName::eHeaderName pId, boost::string_ref pValue) {
+    tLine lLine;
+    lLine.mOffset = mBuffer.size();
+    lLine.mNameSize = pName.size();
+    lLine.mId = pId;
+    mBuffer.append(pName.data(), pName.size()).append(": ", 2).append(pValue.data(), pValue.size()).push_back('\0');
+    mLines.push_back(lLine);
+    mSeen |= bit(pId);
+}
+
+bool
+tCurlHeaders::hasOther(boost::string_ref pName) const {
+    for (std::vector<tLine>::const_iterator it = mLines.begin(); it != mLines.end(); ++it) {
+        if (it->mId == HeaderName::OTHER && it->mNameSize == pName.size() &&
+                !strncasecmp(mBuffer.data() + it->mOffset, pName.data(), pName.size())) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool
+tCurlHeaders::addOnce(boost::string_ref pName, HeaderName::eHeaderName pId, boost::string_ref pValue) {
+    if (pId == HeaderName::OTHER ? hasOther(pName) : has(pId)) {
+        return false;
+    }
+    add(pName, pId, pValue);
+    return true;
+}
+
+curl_slist *
+tCurlHeaders::list() {
+    if (mLines.empty()) {
+        return gCommonHeaders;
+    }
+    // The buffer does not move anymore
+    for (size_t i = 0; i < mLines.size(); ++i) {
+        mLines[i].mNode.data = &mBuffer[mLines[i].mOffset];
+        mLines[i].mNode.next = i + 1 < mLines.size() ? &mLines[i + 1].mNode : gCommonHeaders;
+    }
+    return &mLines.front().mNode;
+}
+
+void
+tCurlHeaders::clear() {
+    mBuffer.clear();
+    mLines.clear();
+    mSeen = cCommonHeaders;
+}
+
+}
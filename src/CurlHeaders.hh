@@ -0,0 +1,109 @@
+/*
+* mod_dup - duplicates apache requests
+*
+* Copyright (C) 2017 Orange
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <boost/utility/string_ref.hpp>
+#include <curl/curl.h>
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "Headers.hh"
+
+namespace DupModule {
+
+/**
+ * @brief The headers sent with a duplication, handed to curl as a curl_slist without a malloc per header
+ * The lines are written one after the other into a single buffer and linked by nodes held in a single vector,
+ * the last one linking to the headers common to all the duplications, which are built once for the process.
+ * A header is only added once per name if asked: the well-known names already added are a bitset.
+ */
+class tCurlHeaders {
+public:
+    tCurlHeaders();
+
+    /**
+     * @brief Makes room for this number of headers totalling about this number of bytes of names and values
+     */
+    void reserve(size_t pCount, size_t pBytes);
+
+    /**
+     * @brief Adds a header with a well-known name
+     */
+    void add(HeaderName::eHeaderName pId, boost::string_ref pValue);
+
+    /**
+     * @brief Adds a header, even if one of the same name was added
+     */
+    void add(boost::string_ref pName, HeaderName::eHeaderName pId, boost::string_ref pValue);
+
+    /**
+     * @brief Adds a header unless one with the same name, case insensitive, is already there
+     * @return true if it was added
+     */
+    bool addOnce(boost::string_ref pName, HeaderName::eHeaderName pId, boost::string_ref pValue);
+
+    /**
+     * @brief Returns true if a header with this well-known name is there, the common ones included
+     */
+    bool has(HeaderName::eHeaderName pId) const { return mSeen & bit(pId); }
+
+    /**
+     * @brief Links the headers, followed by the common ones, valid until the next change
+     */
+    curl_slist *list();
+
+    /**
+     * @brief Removes the headers added, keeping the memory for the next duplication
+     */
+    void clear();
+
+    /**
+     * @brief The headers added, without the common ones
+     */
+    size_t size() const { return mLines.size(); }
+
+private:
+    struct tLine {
+        /** @brief Points into the buffer once linked */
+        curl_slist mNode;
+        uint32_t mOffset;
+        uint32_t mNameSize;
+        HeaderName::eHeaderName mId;
+    };
+
+    tCurlHeaders(const tCurlHeaders &);
+    tCurlHeaders &operator=(const tCurlHeaders &);
+
+    static uint64_t bit(HeaderName::eHeaderName pId) { return uint64_t(1) << pId; }
+
+    /**
+     * @brief Returns true if a header of this name which is not a well-known one was added
+     */
+    bool hasOther(boost::string_ref pName) const;
+
+    /** @brief The lines, each ended by a NUL for curl */
+    std::string mBuffer;
+    std::vector<tLine> mLines;
+    /** @brief The well-known names added, one bit per id */
+    uint64_t mSeen;
+};
+
+}
@@ -0,0 +1,147 @@
+/*
+* mod_dup - duplicates apache requests
+*
+* Copyright (C) 2017 Orange
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "FilterProfiler.hh"
+
+#include <algorithm>
+#include <boost/lexical_cast.hpp>
+
+namespace DupModule {
+
+tFilterCounters::tFilterCounters()
+    : mEvaluations(0)
+    , mMatches(0)
+    , mPrevents(0)
+    , mNs(0)
+{
+}
+
+tDecayedFilterCounters::tDecayedFilterCounters()
+    : mEvaluations(0)
+    , mMatches(0)
+    , mNs(0)
+{
+}
+
+void tDecayedFilterCounters::update(const tFilterCounters &pDelta, double pDecay)
+{
+    mEvaluations = mEvaluations * pDecay + pDelta.mEvaluations;
+    mMatches = mMatches * pDecay + pDelta.mMatches;
+    mNs = mNs * pDecay + pDelta.mNs;
+}
+
+unsigned FilterProfiler::add(const std::string &pLabel)
+{
+    boost::lock_guard<boost::mutex> lLock(mMutex);
+    mLabels.push_back(pLabel);
+    mTotals.push_back(tFilterCounters());
+    return mLabels.size() - 1;
+}
+
+void FilterProfiler::record(unsigned pIndex, bool pPrevent, bool pMatched, uint64_t pNs)
+{
+    if (pIndex == cNotProfiled) {
+        return;
+    }
+    boost::shared_ptr<tThreadCounters> *lThreadCounters = mThreadCounters.get();
+    if (!lThreadCounters) {
+        lThreadCounters = new boost::shared_ptr<tThreadCounters>(new tThreadCounters());
+        mThreadCounters.reset(lThreadCounters);
+        boost::lock_guard<boost::mutex> lLock(mMutex);
+        mAllCounters.push_back(*lThreadCounters);
+    }
+    tThreadCounters &lCounters = **lThreadCounters;
+    // Only this thread adds slots, it can index them without locking
+    if (pIndex >= lCounters.mCounters.size()) {
+        boost::lock_guard<boost::mutex> lLock(lCounters.mMutex);
+        lCounters.mCounters.resize(pIndex + 1);
+    }
+    tFilterCounters &lFilter = lCounters.mCounters[pIndex];
+    __sync_fetch_and_add(&lFilter.mEvaluations, 1);
+    __sync_fetch_and_add(&lFilter.mNs, pNs);
+    if (pMatched) {
+        __sync_fetch_and_add(pPrevent ? &lFilter.mPrevents : &lFilter.mMatches, 1);
+    }
+}
+
+void FilterProfiler::getTotals(std::vector<std::pair<std::string, tFilterCounters> > &pTotals)
+{
+    boost::lock_guard<boost::mutex> lLock(mMutex);
+    std::list<boost::shared_ptr<tThreadCounters> >::iterator lThread = mAllCounters.begin();
+    while (lThread != mAllCounters.end()) {
+        // Checked first: a thread which exits while we merge may record again
+        const bool lExited = lThread->unique();
+        {
+            boost::lock_guard<boost::mutex> lThreadLock((*lThread)->mMutex);
+            std::vector<tFilterCounters> &lCounters = (*lThread)->mCounters;
+            for (size_t i = 0; i < lCounters.size() && i < mTotals.size(); ++i) {
+                // Atomic read + reset
+                mTotals[i].mEvaluations += __sync_fetch_and_and(&lCounters[i].mEvaluations, 0);
+                mTotals[i].mMatches += __sync_fetch_and_and(&lCounters[i].mMatches, 0);
+                mTotals[i].mPrevents += __sync_fetch_and_and(&lCounters[i].mPrevents, 0);
+                mTotals[i].mNs += __sync_fetch_and_and(&lCounters[i].mNs, 0);
+            }
+        }
+        // Forget the threads which exited once merged
+        if (lExited) {
+            lThread = mAllCounters.erase(lThread);
+        } else {
+            ++lThread;
+        }
+    }
+
+    pTotals.clear();
+    for (size_t i = 0; i < mLabels.size(); ++i) {
+        pTotals.push_back(std::make_pair(mLabels[i], mTotals[i]));
+    }
+}
+
+namespace {
+
+bool moreExpensive(const std::pair<std::string, tFilterCounters> &pLeft, const std::pair<std::string, tFilterCounters> &pRight)
+{
+    return pLeft.second.mNs > pRight.second.mNs;
+}
+
+}
+
+const std::string FilterProfiler::getSummary()
+{
+    std::vector<std::pair<std::string, tFilterCounters> > lTotals;
+    getTotals(lTotals);
+    std::stable_sort(lTotals.begin(), lTotals.end(), moreExpensive);
+
+    std::string lSummary;
+    for (size_t i = 0; i < lTotals.size(); ++i) {
+        const tFilterCounters &lFilter = lTotals[i].second;
+        if (!lFilter.mEvaluations) {
+            continue;
+        }
+        if (!lSummary.empty()) {
+            lSummary += " ";
+        }
+        lSummary += lTotals[i].first + "=" +
+            boost::lexical_cast<std::string>(lFilter.mEvaluations) + "/" +
+            boost::lexical_cast<std::string>(lFilter.mMatches) + "/" +
+            boost::lexical_cast<std::string>(lFilter.mPrevents) + "/" +
+            boost::lexical_cast<std::string>(lFilter.mNs / 1000);
+    }
+    return lSummary.empty() ? "-" : lSummary;
+}
+
+}
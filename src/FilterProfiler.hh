@@ -0,0 +1,122 @@
+/*
+* mod_dup - duplicates apache requests
+*
+* Copyright (C) 2017 Orange
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <list>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/tss.hpp>
+
+namespace DupModule {
+
+/**
+ * @brief What was counted for one filter
+ */
+struct tFilterCounters {
+    tFilterCounters();
+
+    /** @brief The number of times its regex was run */
+    uint64_t mEvaluations;
+    /** @brief The number of times it selected a request for duplication */
+    uint64_t mMatches;
+    /** @brief The number of times it prevented a duplication */
+    uint64_t mPrevents;
+    /** @brief The time spent running its regex in nano sec */
+    uint64_t mNs;
+};
+
+/**
+ * @brief The counters of a filter as sums decayed on each update, which follow what was counted recently
+ */
+struct tDecayedFilterCounters {
+    tDecayedFilterCounters();
+
+    /**
+     * @brief Decays the sums then adds what was counted since the previous update
+     * @param pDelta the counts since the previous update
+     * @param pDecay the share of the sums kept, from 0 to 1
+     */
+    void update(const tFilterCounters &pDelta, double pDecay);
+
+    double mEvaluations;
+    double mMatches;
+    double mNs;
+};
+
+/**
+ * @brief Counts the evaluations, matches and cost of each filter into slots owned by the evaluating threads, without locking
+ * The slots of all the threads are merged into totals when read, which count since the start of the child.
+ */
+class FilterProfiler {
+public:
+    /** @brief The index of the filters which are not profiled */
+    static const unsigned cNotProfiled = ~0u;
+
+    /**
+     * @brief Declares a filter to profile, done at configuration time
+     * @param pLabel how the filter is named in the stats
+     * @return the index to record the evaluations of the filter with
+     */
+    unsigned add(const std::string &pLabel);
+
+    /**
+     * @brief Records an evaluation of a filter in the slots of the calling thread
+     * @param pIndex the index of the filter, no-op if cNotProfiled
+     * @param pPrevent true if the filter prevents the duplication when it matches
+     * @param pMatched whether the filter matched
+     * @param pNs the time spent evaluating it in nano sec
+     */
+    void record(unsigned pIndex, bool pPrevent, bool pMatched, uint64_t pNs);
+
+    /**
+     * @brief Merges the slots of all the threads into the totals
+     * @param pTotals receives the label and totals of each declared filter, in declaration order
+     */
+    void getTotals(std::vector<std::pair<std::string, tFilterCounters> > &pTotals);
+
+    /**
+     * @brief Formats the totals of the filters which were evaluated, the most expensive first
+     * @return "label=evaluations/matches/prevents/us ..." or "-" if none was evaluated
+     */
+    const std::string getSummary();
+
+private:
+    /** @brief The counters of one thread, indexed like the filters */
+    struct tThreadCounters {
+        /** @brief Taken by the thread only to add slots, and to merge */
+        boost::mutex mMutex;
+        std::vector<tFilterCounters> mCounters;
+    };
+
+    /** @brief The counters of the calling thread */
+    boost::thread_specific_ptr<boost::shared_ptr<tThreadCounters> > mThreadCounters;
+    /** @brief Protects the members below */
+    boost::mutex mMutex;
+    /** @brief The counters of all the threads which recorded, kept after they exit until merged */
+    std::list<boost::shared_ptr<tThreadCounters> > mAllCounters;
+    /** @brief The label of each filter */
+    std::vector<std::string> mLabels;
+    /** @brief What was merged from the threads so far */
+    std::vector<tFilterCounters> mTotals;
+};
+
+}
@@ -0,0 +1,194 @@
+/*
+* mod_dup - duplicates apache requests
+*
+* Copyright (C) 2017 Orange
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "Headers.hh"
+#include "KeyIndex.hh"
+
+#include <string.h>
+#include <strings.h>
+
+namespace DupModule {
+
+namespace HeaderName {
+
+    // Indexed by eHeaderName
+    static const char *const c_NAMES[COUNT] = {
+        "",
+        "Host",
+        "Content-Length",
+        "Content-Type",
+        "Transfer-Encoding",
+        "Expect",
+        "Connection",
+        "Accept",
+        "Accept-Encoding",
+        "Accept-Language",
+        "Authorization",
+        "Cache-Control",
+        "Cookie",
+        "Origin",
+        "Referer",
+        "User-Agent",
+        "X-Forwarded-For",
+        "Duplication-Type",
+        "ELAPSED_TIME_BY_DUP",
+        "User-RealAgent",
+        "X_COMP_LOG",
+        "X-COMP-STATUS",
+        "X_DUP_CONTENT_TYPE",
+        "X-DUP-COUNT",
+        "X_DUP_HTTP_STATUS",
+        "X_DUP_LOG",
+        "X_DUP_METHOD",
+        "X-DUPLICATED-REQUEST",
+        "X-HTTP-METHOD-OVERRIDE",
+        "X-MATCHED-PATTERN",
+    };
+
+    static tKeyIndex<eHeaderName>
+    buildNames() {
+        tKeyIndex<eHeaderName> lNames;
+        for (int i = OTHER + 1; i < COUNT; ++i) {
+            lNames.insert(c_NAMES[i], static_cast<eHeaderName>(i));
+        }
+        return lNames;
+    }
+
+    /*
+     * The well-known names by name, built on first use
+     */
+    static const tKeyIndex<eHeaderName> &
+    names() {
+        static const tKeyIndex<eHeaderName> lNames = buildNames();
+        return lNames;
+    }
+
+    eHeaderName intern(const char *pName, size_t pSize) {
+        const tKeyIndex<eHeaderName>::tRange lRange = names().equal_range(pName, pSize);
+        return lRange.first != lRange.second ? lRange.first->second : OTHER;
+    }
+
+    const char *toString(eHeaderName pId) {
+        return c_NAMES[pId];
+    }
+
+};
+
+const size_t tHeaders::npos;
+const uint32_t tHeaders::cInterned;
+
+tHeaders::tHeaders(const allocator_type &pAllocator)
+    : mBytes(pAllocator),
+      mEntries(tArenaAllocator<tEntry>(pAllocator.arena())) {
+}
+
+uint32_t
+tHeaders::append(boost::string_ref pBytes) {
+    const uint32_t lOffset = mBytes.size();
+    if (pBytes.empty()) {
+        return lOffset;
+    }
+    const char *lBegin = mBytes.data();
+    if (pBytes.data() >= lBegin && pBytes.data() < lBegin + mBytes.size()) {
+        // Copying from the buffer itself, which may move when it grows
+        const size_t lFrom = pBytes.data() - lBegin;
+        mBytes.resize(lOffset + pBytes.size());
+        memmove(mBytes.data() + lOffset, mBytes.data() + lFrom, pBytes.size());
+    } else {
+        mBytes.insert(mBytes.end(), pBytes.begin(), pBytes.end());
+    }
+    return lOffset;
+}
+
+void
+tHeaders::push_back(boost::string_ref pName, boost::string_ref pValue) {
+    tEntry lEntry;
+    lEntry.mId = HeaderName::intern(pName.data(), pName.size());
+    lEntry.mNameSize = pName.size();
+    if (lEntry.mId != HeaderName::OTHER && !memcmp(HeaderName::c_NAMES[lEntry.mId], pName.data(), pName.size())) {
+        lEntry.mName = cInterned;
+    } else {
+        lEntry.mName = append(pName);
+    }
+    lEntry.mValueSize = pValue.size();
+    lEntry.mValue = append(pValue);
+    mEntries.push_back(lEntry);
+}
+
+void
+tHeaders::setValue(size_t pIndex, boost::string_ref pValue) {
+    const uint32_t lOffset = append(pValue);
+    mEntries[pIndex].mValue = lOffset;
+    mEntries[pIndex].mValueSize = pValue.size();
+}
+
+size_t
+tHeaders::find(HeaderName::eHeaderName pId) const {
+    for (size_t i = 0; i < mEntries.size(); ++i) {
+        if (mEntries[i].mId == pId) {
+            return i;
+        }
+    }
+    return npos;
+}
+
+size_t
+tHeaders::find(boost::string_ref pName) const {
+    const HeaderName::eHeaderName lId = HeaderName::intern(pName.data(), pName.size());
+    if (lId != HeaderName::OTHER) {
+        return find(lId);
+    }
+    for (size_t i = 0; i < mEntries.size(); ++i) {
+        const tEntry &lEntry = mEntries[i];
+        if (lEntry.mId == HeaderName::OTHER && lEntry.mNameSize == pName.size() &&
+                !strncasecmp(mBytes.data() + lEntry.mName, pName.data(), pName.size())) {
+            return i;
+        }
+    }
+    return npos;
+}
+
+boost::string_ref
+tHeaders::name(size_t pIndex) const {
+    const tEntry &lEntry = mEntries[pIndex];
+    if (lEntry.mName == cInterned) {
+        return boost::string_ref(HeaderName::c_NAMES[lEntry.mId], lEntry.mNameSize);
+    }
+    return boost::string_ref(mBytes.data() + lEntry.mName, lEntry.mNameSize);
+}
+
+tHeaders::tHeader
+tHeaders::operator[](size_t pIndex) const {
+    const tHeader lHeader = {id(pIndex), name(pIndex), value(pIndex)};
+    return lHeader;
+}
+
+void
+tHeaders::toMap(std::map<std::string, std::string> &pMap) const {
+    for (size_t i = 0; i < mEntries.size(); ++i) {
+        pMap[name(i).to_string()] = value(i).to_string();
+    }
+}
+
+void
+tHeaders::clear() {
+    mBytes.clear();
+    mEntries.clear();
+}
+
+}
@@ -0,0 +1,207 @@
+/*
+* mod_dup - duplicates apache requests
+*
+* Copyright (C) 2017 Orange
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <boost/utility/string_ref.hpp>
+
+#include <iterator>
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "RequestArena.hh"
+
+namespace DupModule {
+
+/*
+ * The header names known in advance, interned to an id so that they are compared as integers
+ */
+namespace HeaderName {
+
+enum eHeaderName {
+    OTHER = 0,              // Any name not in the table below
+    HOST,
+    CONTENT_LENGTH,
+    CONTENT_TYPE,
+    TRANSFER_ENCODING,
+    EXPECT,
+    CONNECTION,
+    ACCEPT,
+    ACCEPT_ENCODING,
+    ACCEPT_LANGUAGE,
+    AUTHORIZATION,
+    CACHE_CONTROL,
+    COOKIE,
+    ORIGIN,
+    REFERER,
+    USER_AGENT,
+    X_FORWARDED_FOR,
+    DUPLICATION_TYPE,
+    ELAPSED_TIME_BY_DUP,
+    USER_REALAGENT,
+    X_COMP_LOG,
+    X_COMP_STATUS,
+    X_DUP_CONTENT_TYPE,
+    X_DUP_COUNT,
+    X_DUP_HTTP_STATUS,
+    X_DUP_LOG,
+    X_DUP_METHOD,
+    X_DUPLICATED_REQUEST,
+    X_HTTP_METHOD_OVERRIDE,
+    X_MATCHED_PATTERN,
+    COUNT                   // Number of ids, not a name
+};
+
+/*
+ * Returns the id of a name, case insensitive, OTHER if it is not a well-known one
+ */
+eHeaderName intern(const char *pName, size_t pSize);
+
+/*
+ * Returns the usual spelling of a well-known name, the empty string for OTHER
+ */
+const char *toString(eHeaderName pId);
+
+};
+
+/**
+ * @brief The headers of a request or an answer, in order, with their bytes in a single buffer
+ * Each header is an entry of offsets into the buffer and the id of its name, so that a request
+ * holds two allocations whatever its number of headers, and that the well-known names are found by id.
+ * A well-known name spelled the usual way is not even copied. The names keep their case.
+ */
+class tHeaders {
+public:
+    typedef tArenaAllocator<char> allocator_type;
+
+    static const size_t npos = size_t(-1);
+
+    /**
+     * @brief A header, pointing into the buffer: invalidated by the next insertion or update
+     */
+    struct tHeader {
+        HeaderName::eHeaderName mId;
+        boost::string_ref mName;
+        boost::string_ref mValue;
+    };
+
+    class const_iterator {
+    public:
+        typedef std::input_iterator_tag iterator_category;
+        typedef tHeader value_type;
+        typedef ptrdiff_t difference_type;
+        typedef const tHeader *pointer;
+        typedef tHeader reference;
+
+        const_iterator(const tHeaders &pHeaders, size_t pIndex) : mHeaders(&pHeaders), mIndex(pIndex) {}
+
+        tHeader operator*() const { return (*mHeaders)[mIndex]; }
+
+        const_iterator &operator++() { ++mIndex; return *this; }
+
+        const_iterator operator++(int) { const_iterator lPrevious(*this); ++mIndex; return lPrevious; }
+
+        bool operator==(const const_iterator &pOther) const { return mIndex == pOther.mIndex; }
+
+        bool operator!=(const const_iterator &pOther) const { return mIndex != pOther.mIndex; }
+
+    private:
+        const tHeaders *mHeaders;
+        size_t mIndex;
+    };
+
+    explicit tHeaders(const allocator_type &pAllocator = allocator_type());
+
+    /**
+     * @brief Appends a header, interning its name
+     */
+    void push_back(boost::string_ref pName, boost::string_ref pValue);
+
+    /**
+     * @brief Replaces the value of the header at this index, the new one is appended to the buffer
+     */
+    void setValue(size_t pIndex, boost::string_ref pValue);
+
+    /**
+     * @brief The index of the first header with this well-known name, npos if there is none
+     */
+    size_t find(HeaderName::eHeaderName pId) const;
+
+    /**
+     * @brief The index of the first header with this name, case insensitive, npos if there is none
+     */
+    size_t find(boost::string_ref pName) const;
+
+    tHeader operator[](size_t pIndex) const;
+
+    HeaderName::eHeaderName id(size_t pIndex) const { return mEntries[pIndex].mId; }
+
+    boost::string_ref name(size_t pIndex) const;
+
+    boost::string_ref value(size_t pIndex) const {
+        const tEntry &lEntry = mEntries[pIndex];
+        return boost::string_ref(mBytes.data() + lEntry.mValue, lEntry.mValueSize);
+    }
+
+    /**
+     * @brief Copies the headers into a map, the last value of a name winning as in the apache tables
+     */
+    void toMap(std::map<std::string, std::string> &pMap) const;
+
+    size_t size() const { return mEntries.size(); }
+
+    bool empty() const { return mEntries.empty(); }
+
+    void clear();
+
+    /**
+     * @brief The number of bytes held by the names and values, including the values replaced
+     */
+    size_t bytes() const { return mBytes.size(); }
+
+    const_iterator begin() const { return const_iterator(*this, 0); }
+
+    const_iterator end() const { return const_iterator(*this, mEntries.size()); }
+
+    allocator_type get_allocator() const { return mBytes.get_allocator(); }
+
+private:
+    struct tEntry {
+        /** @brief Offset of the name in the buffer, cInterned if it is spelled as in the table of well-known names */
+        uint32_t mName;
+        uint32_t mNameSize;
+        uint32_t mValue;
+        uint32_t mValueSize;
+        HeaderName::eHeaderName mId;
+    };
+
+    static const uint32_t cInterned = uint32_t(-1);
+
+    /**
+     * @brief Copies bytes at the end of the buffer, which they may come from, and returns their offset
+     */
+    uint32_t append(boost::string_ref pBytes);
+
+    /** @brief The names and values, back to back */
+    std::vector<char, allocator_type> mBytes;
+    std::vector<tEntry, tArenaAllocator<tEntry> > mEntries;
+};
+
+}
@@ -0,0 +1,239 @@
+/*
+* mod_dup - duplicates apache requests
+*
+* Copyright (C) 2017 Orange
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "Histogram.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <time.h>
+#include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
+
+namespace DupModule {
+
+uint64_t monotonicNs()
+{
+    struct timespec lNow;
+    clock_gettime(CLOCK_MONOTONIC, &lNow);
+    return static_cast<uint64_t>(lNow.tv_sec) * 1000000000 + lNow.tv_nsec;
+}
+
+template <unsigned SubBucketBits, unsigned MaxBits>
+LogLinearHistogram<SubBucketBits, MaxBits>::LogLinearHistogram()
+    : mMax(0)
+    , mSum(0)
+{
+    memset(mCounts, 0, sizeof(mCounts));
+}
+
+template <unsigned SubBucketBits, unsigned MaxBits>
+unsigned LogLinearHistogram<SubBucketBits, MaxBits>::bucketOf(uint64_t pValue)
+{
+    if (pValue < cSubBuckets) {
+        return pValue;
+    }
+    // The power of two holding the value, split in cSubBuckets buckets
+    const unsigned lMagnitude = 63 - __builtin_clzll(pValue);
+    if (lMagnitude >= cSubBucketBits + cMagnitudes) {
+        return cBuckets - 1;
+    }
+    const unsigned lShift = lMagnitude - cSubBucketBits;
+    return cSubBuckets + lShift * cSubBuckets + (pValue >> lShift) - cSubBuckets;
+}
+
+template <unsigned SubBucketBits, unsigned MaxBits>
+uint64_t LogLinearHistogram<SubBucketBits, MaxBits>::highestValueOf(unsigned pBucket)
+{
+    if (pBucket < cSubBuckets) {
+        return pBucket;
+    }
+    const unsigned lShift = (pBucket - cSubBuckets) / cSubBuckets;
+    const uint64_t lSubBucket = (pBucket - cSubBuckets) % cSubBuckets;
+    return ((cSubBuckets + lSubBucket + 1) << lShift) - 1;
+}
+
+template <unsigned SubBucketBits, unsigned MaxBits>
+void LogLinearHistogram<SubBucketBits, MaxBits>::record(uint64_t pValue)
+{
+    __sync_fetch_and_add(&mCounts[bucketOf(pValue)], 1);
+    __sync_fetch_and_add(&mSum, pValue);
+    uint64_t lMax = mMax;
+    while (pValue > lMax) {
+        const uint64_t lPrevious = __sync_val_compare_and_swap(&mMax, lMax, pValue);
+        if (lPrevious == lMax) {
+            break;
+        }
+        lMax = lPrevious;
+    }
+}
+
+template <unsigned SubBucketBits, unsigned MaxBits>
+void LogLinearHistogram<SubBucketBits, MaxBits>::drainInto(LogLinearHistogram &pTotal)
+{
+    for (unsigned i = 0; i < cBuckets; ++i) {
+        if (mCounts[i]) {
+            // Atomic read + reset
+            pTotal.mCounts[i] += __sync_fetch_and_and(&mCounts[i], 0);
+        }
+    }
+    pTotal.mMax = std::max(pTotal.mMax, __sync_fetch_and_and(&mMax, 0));
+    pTotal.mSum += __sync_fetch_and_and(&mSum, 0);
+}
+
+template <unsigned SubBucketBits, unsigned MaxBits>
+void LogLinearHistogram<SubBucketBits, MaxBits>::addTo(LogLinearHistogram &pTotal) const
+{
+    for (unsigned i = 0; i < cBuckets; ++i) {
+        pTotal.mCounts[i] += mCounts[i];
+    }
+    pTotal.mMax = std::max(pTotal.mMax, mMax);
+    pTotal.mSum += mSum;
+}
+
+template <unsigned SubBucketBits, unsigned MaxBits>
+uint64_t LogLinearHistogram<SubBucketBits, MaxBits>::count() const
+{
+    uint64_t lCount = 0;
+    for (unsigned i = 0; i < cBuckets; ++i) {
+        lCount += mCounts[i];
+    }
+    return lCount;
+}
+
+template <unsigned SubBucketBits, unsigned MaxBits>
+uint64_t LogLinearHistogram<SubBucketBits, MaxBits>::percentile(double pPercent) const
+{
+    const uint64_t lCount = count();
+    if (!lCount) {
+        return 0;
+    }
+    const uint64_t lRank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(lCount * pPercent / 100)));
+    uint64_t lSeen = 0;
+    for (unsigned i = 0; i < cBuckets; ++i) {
+        lSeen += mCounts[i];
+        if (lSeen >= lRank) {
+            // The last bucket also holds everything beyond
+            return (i == cBuckets - 1) ? mMax : std::min(highestValueOf(i), mMax);
+        }
+    }
+    return mMax;
+}
+
+template <unsigned SubBucketBits, unsigned MaxBits>
+std::string LogLinearHistogram<SubBucketBits, MaxBits>::summary() const
+{
+    if (!count()) {
+        return "-";
+    }
+    return boost::lexical_cast<std::string>(percentile(50)) + "/" +
+        boost::lexical_cast<std::string>(percentile(90)) + "/" +
+        boost::lexical_cast<std::string>(percentile(99)) + "/" +
+        boost::lexical_cast<std::string>(mMax);
+}
+
+template class LogLinearHistogram<4, 40>;
+template class LogLinearHistogram<2, 28>;
+
+namespace Latency {
+
+const char *enumToString(eLatency pLatency)
+{
+    switch (pLatency) {
+    case FILTER:
+        return "filter";
+    case SUBSTITUTION:
+        return "subst";
+    case SEND:
+        return "send";
+    case END_TO_END:
+        return "e2e";
+    default:
+        return "?";
+    }
+}
+
+}
+
+void LatencyRecorder::record(Latency::eLatency pLatency, const std::string &pDestination, uint64_t pValue)
+{
+    boost::shared_ptr<tThreadHistograms> *lThreadHistograms = mThreadHistograms.get();
+    if (!lThreadHistograms) {
+        lThreadHistograms = new boost::shared_ptr<tThreadHistograms>(new tThreadHistograms());
+        mThreadHistograms.reset(lThreadHistograms);
+        boost::lock_guard<boost::mutex> lLock(mMutex);
+        mAllHistograms.push_back(*lThreadHistograms);
+    }
+    tThreadHistograms &lHistograms = **lThreadHistograms;
+    // Only this thread adds destinations, it can look them up without locking
+    tHistogramsByDestination::iterator lIt = lHistograms.mHistograms.find(pDestination);
+    if (lIt == lHistograms.mHistograms.end()) {
+        boost::lock_guard<boost::mutex> lLock(lHistograms.mMutex);
+        lIt = lHistograms.mHistograms.insert(std::make_pair(pDestination, tHistograms())).first;
+    }
+    lIt->second.mLatencies[pLatency].record(pValue);
+}
+
+const std::string LatencyRecorder::getSummary()
+{
+    tHistogramsByDestination lTotals;
+    {
+        boost::lock_guard<boost::mutex> lLock(mMutex);
+        std::list<boost::shared_ptr<tThreadHistograms> >::iterator lThread = mAllHistograms.begin();
+        while (lThread != mAllHistograms.end()) {
+            // Checked first: a thread which exits while we drain may record again
+            const bool lExited = lThread->unique();
+            {
+                boost::lock_guard<boost::mutex> lThreadLock((*lThread)->mMutex);
+                BOOST_FOREACH(tHistogramsByDestination::value_type &lDestination, (*lThread)->mHistograms) {
+                    tHistograms &lTotal = lTotals[lDestination.first];
+                    for (unsigned i = 0; i < Latency::NB_LATENCIES; ++i) {
+                        lDestination.second.mLatencies[i].drainInto(lTotal.mLatencies[i]);
+                    }
+                }
+            }
+            // Forget the threads which exited once drained
+            if (lExited) {
+                lThread = mAllHistograms.erase(lThread);
+            } else {
+                ++lThread;
+            }
+        }
+    }
+
+    std::string lSummary;
+    BOOST_FOREACH(const tHistogramsByDestination::value_type &lDestination, lTotals) {
+        for (unsigned i = 0; i < Latency::NB_LATENCIES; ++i) {
+            const LatencyHistogram &lHistogram = lDestination.second.mLatencies[i];
+            if (!lHistogram.count()) {
+                continue;
+            }
+            if (!lSummary.empty()) {
+                lSummary += " ";
+            }
+            lSummary += Latency::enumToString(static_cast<Latency::eLatency>(i));
+            if (!lDestination.first.empty()) {
+                lSummary += "@" + lDestination.first;
+            }
+            lSummary += "=" + lHistogram.summary();
+        }
+    }
+    return lSummary.empty() ? "-" : lSummary;
+}
+
+}
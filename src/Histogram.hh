@@ -0,0 +1,191 @@
+/*
+* mod_dup - duplicates apache requests
+*
+* Copyright (C) 2017 Orange
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <list>
+#include <map>
+#include <string>
+#include <stdint.h>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/tss.hpp>
+
+namespace DupModule {
+
+/**
+ * @brief The current time in nano sec on a clock which does not jump, to measure durations
+ */
+uint64_t monotonicNs();
+
+/**
+ * @brief A log-linear histogram of durations in micro sec
+ * Each power of two is split into 2^SubBucketBits buckets, so the percentiles are within 1/2^SubBucketBits of the recorded
+ * values whatever their magnitude, up to 2^MaxBits micro sec, for a fixed size.
+ * Recording is a few atomic operations: one thread may record while another one drains the histogram.
+ * Instantiated in Histogram.cc for LatencyHistogram and CoarseLatencyHistogram only.
+ */
+template <unsigned SubBucketBits, unsigned MaxBits>
+class LogLinearHistogram {
+public:
+    /** @brief The number of buckets per power of two, as a power of two */
+    static const unsigned cSubBucketBits = SubBucketBits;
+    /** @brief The number of buckets per power of two */
+    static const unsigned cSubBuckets = 1 << cSubBucketBits;
+    /** @brief The number of powers of two covered above the linear buckets, up to 2^MaxBits micro sec */
+    static const unsigned cMagnitudes = MaxBits - cSubBucketBits;
+    /** @brief The number of buckets */
+    static const unsigned cBuckets = cSubBuckets + cMagnitudes * cSubBuckets;
+
+    LogLinearHistogram();
+
+    /**
+     * @brief Records a duration
+     * @param pValue the duration in micro sec
+     */
+    void record(uint64_t pValue);
+
+    /**
+     * @brief Moves the recorded durations to another histogram, atomically against record
+     * @param pTotal the histogram receiving the durations, not recorded into concurrently
+     */
+    void drainInto(LogLinearHistogram &pTotal);
+
+    /**
+     * @brief Adds the recorded durations to another histogram, leaving them recorded
+     * @param pTotal the histogram receiving the durations, not recorded into concurrently
+     */
+    void addTo(LogLinearHistogram &pTotal) const;
+
+    /**
+     * @brief The number of recorded durations
+     */
+    uint64_t count() const;
+
+    /**
+     * @brief The duration below which a share of the recorded ones are
+     * @param pPercent the share, from 0 to 100
+     * @return the highest duration of the bucket holding the percentile, 0 if empty
+     */
+    uint64_t percentile(double pPercent) const;
+
+    /**
+     * @brief The longest recorded duration
+     */
+    uint64_t max() const { return mMax; }
+
+    /**
+     * @brief The sum of the recorded durations in micro sec
+     */
+    uint64_t sum() const { return mSum; }
+
+    /**
+     * @brief Formats the percentiles of the histogram
+     * @return "p50/p90/p99/max" in micro sec, "-" if empty
+     */
+    std::string summary() const;
+
+private:
+    /**
+     * @brief The bucket holding a duration
+     */
+    static unsigned bucketOf(uint64_t pValue);
+
+    /**
+     * @brief The highest duration held by a bucket
+     */
+    static uint64_t highestValueOf(unsigned pBucket);
+
+    /** @brief The number of durations recorded per bucket, wide enough to count for the life of the server */
+    uint64_t mCounts[cBuckets];
+    /** @brief The longest recorded duration */
+    uint64_t mMax;
+    /** @brief The sum of the recorded durations */
+    uint64_t mSum;
+};
+
+/** @brief Within 6% of the recorded values up to 2^40 micro sec, in 4.7KB */
+typedef LogLinearHistogram<4, 40> LatencyHistogram;
+
+/** @brief Within 25% of the recorded values up to 2^28 micro sec (4.5 min), in 0.9KB, where many are kept */
+typedef LogLinearHistogram<2, 28> CoarseLatencyHistogram;
+
+/*
+ * The durations measured by the duplication
+ */
+namespace Latency {
+
+enum eLatency {
+    FILTER                  = 0,    // Running the filters on a request
+    SUBSTITUTION            = 1,    // Running the substitutions of a destination
+    SEND                    = 2,    // Sending a duplication, as measured by curl
+    END_TO_END              = 3,    // From the start of the request to the end of the duplication, retries included
+    NB_LATENCIES            = 4,
+};
+
+/*
+ * The name of a duration in the stats
+ */
+const char *enumToString(eLatency pLatency);
+
+};
+
+/**
+ * @brief Records durations per destination into histograms owned by the recording threads, without locking
+ * The histograms of all the threads are merged when the stats are emitted.
+ */
+class LatencyRecorder {
+public:
+    /**
+     * @brief Records a duration in the histograms of the calling thread
+     * @param pLatency what was measured
+     * @param pDestination the destination it was measured for, empty if none
+     * @param pValue the duration in micro sec
+     */
+    void record(Latency::eLatency pLatency, const std::string &pDestination, uint64_t pValue);
+
+    /**
+     * @brief Merges the histograms of all the threads, then resets them
+     * @return the percentiles of each duration with recorded values, in the "name[@destination]=p50/p90/p99/max" format
+     */
+    const std::string getSummary();
+
+private:
+    /** @brief The histograms of one destination */
+    struct tHistograms {
+        LatencyHistogram mLatencies[Latency::NB_LATENCIES];
+    };
+
+    typedef std::map<std::string, tHistograms> tHistogramsByDestination;
+
+    /** @brief The histograms of one thread */
+    struct tThreadHistograms {
+        /** @brief Taken by the thread only to add a destination, and to merge */
+        boost::mutex mMutex;
+        tHistogramsByDestination mHistograms;
+    };
+
+    /** @brief The histograms of the calling thread */
+    boost::thread_specific_ptr<boost::shared_ptr<tThreadHistograms> > mThreadHistograms;
+    /** @brief Protects mAllHistograms */
+    boost::mutex mMutex;
+    /** @brief The histograms of all the threads which recorded, kept after they exit until merged */
+    std::list<boost::shared_ptr<tThreadHistograms> > mAllHistograms;
+};
+
+}
@@ -0,0 +1,151 @@
+/*
+* mod_dup - duplicates apache requests
+*
+* Copyright (C) 2017 Orange
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <string>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+#include <strings.h>
+
+namespace DupModule {
+
+/**
+ * @brief FNV-1a hash of a key with its ASCII letters folded to lower case
+ */
+inline uint32_t
+caseFoldedHash(const char *pKey, size_t pSize) {
+    uint32_t lHash = 2166136261u;
+    for (size_t i = 0; i < pSize; ++i) {
+        unsigned char c = pKey[i];
+        if (c >= 'A' && c <= 'Z') {
+            c += 'a' - 'A';
+        }
+        lHash = (lHash ^ c) * 16777619u;
+    }
+    return lHash;
+}
+
+/**
+ * @brief Values indexed by a case insensitive key, looked up through an open addressed hash table
+ * The values of a key are contiguous, in insertion order. Filled at configuration time: the table is
+ * built again on each insertion, so that a lookup hashes the key once and then usually reads a single slot.
+ */
+template <class T>
+class tKeyIndex {
+public:
+    typedef std::pair<std::string, T> value_type;
+    typedef typename std::vector<value_type>::const_iterator const_iterator;
+    typedef std::pair<const_iterator, const_iterator> tRange;
+
+    tKeyIndex() : mMask(0) {}
+
+    /**
+     * @brief Adds a value after the ones of the same key
+     * @return the value inserted, valid until the next insertion
+     */
+    T &
+    insert(const std::string &pKey, const T &pValue) {
+        const tRange lSameKey = equal_range(pKey);
+        typename std::vector<value_type>::iterator lIt = mEntries.insert(
+            mEntries.begin() + (lSameKey.second - mEntries.begin()), value_type(pKey, pValue));
+        rebuild();
+        return lIt->second;
+    }
+
+    /**
+     * @brief The values of a key, an empty range if it has none
+     */
+    tRange
+    equal_range(const char *pKey, size_t pSize) const {
+        if (mSlots.empty()) {
+            return tRange(mEntries.end(), mEntries.end());
+        }
+        const uint32_t lHash = caseFoldedHash(pKey, pSize);
+        for (size_t i = lHash & mMask; mSlots[i].mBegin != mSlots[i].mEnd; i = (i + 1) & mMask) {
+            const tSlot &lSlot = mSlots[i];
+            const std::string &lKey = mEntries[lSlot.mBegin].first;
+            if (lSlot.mHash == lHash && lKey.size() == pSize && !strncasecmp(lKey.data(), pKey, pSize)) {
+                return tRange(mEntries.begin() + lSlot.mBegin, mEntries.begin() + lSlot.mEnd);
+            }
+        }
+        return tRange(mEntries.end(), mEntries.end());
+    }
+
+    tRange
+    equal_range(const std::string &pKey) const {
+        return equal_range(pKey.data(), pKey.size());
+    }
+
+    bool
+    count(const std::string &pKey) const {
+        const tRange lRange = equal_range(pKey);
+        return lRange.first != lRange.second;
+    }
+
+    const_iterator begin() const { return mEntries.begin(); }
+
+    const_iterator end() const { return mEntries.end(); }
+
+    size_t size() const { return mEntries.size(); }
+
+    bool empty() const { return mEntries.empty(); }
+
+private:
+    struct tSlot {
+        uint32_t mHash;
+        /** @brief The values of the key in mEntries, a free slot if empty */
+        uint32_t mBegin;
+        uint32_t mEnd;
+    };
+
+    void
+    rebuild() {
+        // At most half full
+        size_t lSize = 8;
+        while (lSize < 2 * mEntries.size()) {
+            lSize *= 2;
+        }
+        const tSlot lFree = {0, 0, 0};
+        mSlots.assign(lSize, lFree);
+        mMask = lSize - 1;
+        for (size_t lBegin = 0, lEnd; lBegin < mEntries.size(); lBegin = lEnd) {
+            const std::string &lKey = mEntries[lBegin].first;
+            for (lEnd = lBegin + 1; lEnd < mEntries.size() && lKey.size() == mEntries[lEnd].first.size() &&
+                     !strncasecmp(lKey.data(), mEntries[lEnd].first.data(), lKey.size()); ++lEnd) {
+            }
+            const uint32_t lHash = caseFoldedHash(lKey.data(), lKey.size());
+            size_t i = lHash & mMask;
+            while (mSlots[i].mBegin != mSlots[i].mEnd) {
+                i = (i + 1) & mMask;
+            }
+            mSlots[i].mHash = lHash;
+            mSlots[i].mBegin = lBegin;
+            mSlots[i].mEnd = lEnd;
+        }
+    }
+
+    /** @brief The keys and values, grouped by key */
+    std::vector<value_type> mEntries;
+    /** @brief The hash table, a power of two in size */
+    std::vector<tSlot> mSlots;
+    size_t mMask;
+};
+
+}
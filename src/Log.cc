@@ -23,14 +23,29 @@
 
 
 #include <cstdarg>
+#include <cstring>
 #include <strings.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <list>
 #include <map>
+#include <vector>
 #include <boost/algorithm/string/case_conv.hpp>
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/tss.hpp>
 
 /// Pointer to the only instance of this class
 Log* Log::gInstance = 0;
 int Log::gLogLevel = LOG_DEBUG;
+AsyncLog* Log::gAsync = 0;
 
 
 const char *Log::STRDEBUG = "debug";
@@ -139,20 +154,397 @@ const char * Log::stringLevel(int pLevel) {
     }
 }
 
+int Log::levelOf(const std::string &pLevel) {
+    static const int lLevels[] = { LOG_DEBUG, LOG_INFO, LOG_NOTICE, LOG_WARNING, LOG_ERR, LOG_CRIT };
+    for (unsigned i = 0; i < sizeof(lLevels) / sizeof(lLevels[0]); ++i) {
+        if (strcasecmp(pLevel.c_str(), stringLevel(lLevels[i])) == 0) {
+            return lLevels[i];
+        }
+    }
+    return -1;
+}
+
+void Log::setLevel(int pLevel) {
+    gLogLevel = pLevel;
+}
+
+/// @brief The maximum size of a message buffered by the asynchronous writer, longer ones are truncated
+static const size_t cAsyncRecordSize = 2048;
+/// @brief Ends the messages truncated by the asynchronous writer
+static const char c_ASYNC_TRUNCATED[] = " [truncated]";
+/// @brief The number of counters of the messages logged per code in the current second
+static const unsigned cAsyncRateBuckets = 1024;
+/// @brief How long the writer sleeps when no thread has buffered messages
+static const unsigned cAsyncWriterPeriodMs = 10;
+
+/// @brief A message buffered by a thread until written
+struct tAsyncRecord {
+    /// @brief The syslog priority, level and facility
+    int mPriority;
+    int mCode;
+    time_t mTime;
+    char mText[cAsyncRecordSize];
+};
+
+/// @brief The messages buffered by one thread, filled by it and emptied by the writer without locking
+struct tAsyncRing {
+    tAsyncRing(unsigned pCapacity) : mRecords(pCapacity), mHead(0), mTail(0) {}
+
+    std::vector<tAsyncRecord> mRecords;
+    /// @brief The number of records written, only changed by the writer
+    volatile unsigned mHead;
+    /// @brief The number of records filled, only changed by the thread
+    volatile unsigned mTail;
+};
+
+/// @brief Writes the messages buffered by all the threads from a thread of its own
+class AsyncLog {
+public:
+    enum eTarget {
+        SYSLOG,
+        LOCAL_FILE,
+        UDP,
+    };
+
+    AsyncLog() : mTarget(SYSLOG), mCapacity(0), mRatePerCode(0), mFd(-1),
+                 mWriter(NULL), mRunning(false), mStopping(false), mDropped(0), mRateLimited(0) {
+        memset(mCodeRates, 0, sizeof(mCodeRates));
+        memset(&mAddress, 0, sizeof(mAddress));
+    }
+
+    /// @brief Sets where the messages are written, before starting
+    std::string configure(const std::string &pTarget, unsigned pCapacity, unsigned pRatePerCode);
+
+    /// @brief Stops and forgets the target, start does nothing until configured again
+    void reset();
+
+    void start();
+
+    void stop();
+
+    /// @brief Buffers a message in the ring of the calling thread, in constant time
+    /// @return false if the writer is not running and the message must be written synchronously
+    bool push(int pPriority, int pCode, const char *pMsg, va_list pArgs);
+
+    std::string getDrops();
+
+private:
+    /// @brief Whether a message of a code is within the rate of its code
+    bool allow(int pCode);
+
+    void run();
+
+    /// @brief Writes the messages buffered by all the threads
+    /// @return the number of messages written
+    size_t drain();
+
+    void write(const tAsyncRecord &pRecord, std::string &pBatch);
+
+    eTarget mTarget;
+    std::string mPath;
+    struct sockaddr_storage mAddress;
+    socklen_t mAddressLength;
+    unsigned mCapacity;
+    unsigned mRatePerCode;
+    /// @brief The file or the socket, opened by start
+    int mFd;
+    boost::thread *mWriter;
+    volatile bool mRunning;
+    volatile bool mStopping;
+    /// @brief The ring of the calling thread
+    boost::thread_specific_ptr<boost::shared_ptr<tAsyncRing> > mThreadRing;
+    /// @brief Protects mRings
+    boost::mutex mMutex;
+    /// @brief The rings of all the threads which logged, kept after they exit until emptied
+    std::list<boost::shared_ptr<tAsyncRing> > mRings;
+    /// @brief The second and the number of messages logged in it, packed as second << 32 | count, per code modulo the size
+    uint64_t mCodeRates[cAsyncRateBuckets];
+    unsigned mDropped;
+    unsigned mRateLimited;
+};
+
+std::string AsyncLog::configure(const std::string &pTarget, unsigned pCapacity, unsigned pRatePerCode) {
+    if (mRunning) {
+        return "The log writer is already running";
+    }
+    if (!pCapacity) {
+        return "The number of buffered messages must be positive";
+    }
+    if (pTarget == "syslog") {
+        mTarget = SYSLOG;
+    } else if (pTarget.compare(0, 5, "file:") == 0 && pTarget.size() > 5) {
+        mTarget = LOCAL_FILE;
+        mPath = pTarget.substr(5);
+    } else if (pTarget.compare(0, 4, "udp:") == 0) {
+        const size_t lColon = pTarget.rfind(':');
+        if (lColon <= 4 || lColon == pTarget.size() - 1) {
+            return "Invalid udp log target, must be udp:<host>:<port>";
+        }
+        struct addrinfo lHints;
+        memset(&lHints, 0, sizeof(lHints));
+        lHints.ai_socktype = SOCK_DGRAM;
+        struct addrinfo *lAddresses = NULL;
+        if (getaddrinfo(pTarget.substr(4, lColon - 4).c_str(), pTarget.substr(lColon + 1).c_str(), &lHints, &lAddresses) || !lAddresses) {
+            return "Cannot resolve the udp log target";
+        }
+        memcpy(&mAddress, lAddresses->ai_addr, lAddresses->ai_addrlen);
+        mAddressLength = lAddresses->ai_addrlen;
+        freeaddrinfo(lAddresses);
+        mTarget = UDP;
+    } else {
+        return "Invalid log target, must be syslog, file:<path> or udp:<host>:<port>";
+    }
+    mCapacity = pCapacity;
+    mRatePerCode = pRatePerCode;
+    return std::string();
+}
+
+void AsyncLog::reset() {
+    stop();
+    mTarget = SYSLOG;
+    mPath.clear();
+    mCapacity = 0;
+    mRatePerCode = 0;
+}
+
+void AsyncLog::start() {
+    if (mRunning || !mCapacity) {
+        return;
+    }
+    if (mTarget == LOCAL_FILE) {
+        mFd = open(mPath.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0640);
+        if (mFd < 0) {
+            syslog(LOG_ERR, "code:%d - Cannot open the log file %s, logging synchronously. What: %s", 402, mPath.c_str(), strerror(errno));
+            return;
+        }
+    } else if (mTarget == UDP) {
+        mFd = socket(mAddress.ss_family, SOCK_DGRAM, 0);
+        if (mFd < 0) {
+            syslog(LOG_ERR, "code:%d - Cannot open the log socket, logging synchronously. What: %s", 402, strerror(errno));
+            return;
+        }
+    }
+    mStopping = false;
+    mWriter = new boost::thread(boost::bind(&AsyncLog::run, this));
+    mRunning = true;
+}
+
+void AsyncLog::stop() {
+    if (!mRunning) {
+        return;
+    }
+    // The threads logging from now on write synchronously
+    mRunning = false;
+    mStopping = true;
+    mWriter->join();
+    delete mWriter;
+    mWriter = NULL;
+    if (mFd >= 0) {
+        close(mFd);
+        mFd = -1;
+    }
+}
+
+bool AsyncLog::allow(int pCode) {
+    if (!mRatePerCode || !pCode) {
+        return true;
+    }
+    const uint64_t lNow = static_cast<uint64_t>(time(NULL)) << 32;
+    uint64_t &lRate = mCodeRates[static_cast<unsigned>(pCode) % cAsyncRateBuckets];
+    while (true) {
+        const uint64_t lPrevious = lRate;
+        uint64_t lNext;
+        if ((lPrevious & 0xffffffff00000000ULL) != lNow) {
+            lNext = lNow | 1;
+        } else if ((lPrevious & 0xffffffffULL) >= mRatePerCode) {
+            return false;
+        } else {
+            lNext = lPrevious + 1;
+        }
+        if (__sync_bool_compare_and_swap(&lRate, lPrevious, lNext)) {
+            return true;
+        }
+    }
+}
+
+bool AsyncLog::push(int pPriority, int pCode, const char *pMsg, va_list pArgs) {
+    if (!mRunning) {
+        return false;
+    }
+    if (!allow(pCode)) {
+        __sync_fetch_and_add(&mRateLimited, 1);
+        return true;
+    }
+    boost::shared_ptr<tAsyncRing> *lThreadRing = mThreadRing.get();
+    if (!lThreadRing) {
+        lThreadRing = new boost::shared_ptr<tAsyncRing>(new tAsyncRing(mCapacity));
+        mThreadRing.reset(lThreadRing);
+        boost::lock_guard<boost::mutex> lLock(mMutex);
+        mRings.push_back(*lThreadRing);
+    }
+    tAsyncRing &lRing = **lThreadRing;
+    const unsigned lTail = lRing.mTail;
+    if (lTail - lRing.mHead >= lRing.mRecords.size()) {
+        __sync_fetch_and_add(&mDropped, 1);
+        return true;
+    }
+    tAsyncRecord &lRecord = lRing.mRecords[lTail % lRing.mRecords.size()];
+    lRecord.mPriority = pPriority;
+    lRecord.mCode = pCode;
+    lRecord.mTime = time(NULL);
+    va_list lArgs;
+    va_copy(lArgs, pArgs);
+    if (vsnprintf(lRecord.mText, sizeof(lRecord.mText), pMsg, lArgs) >= static_cast<int>(sizeof(lRecord.mText))) {
+        // Tells the message was cut, the marker replacing its end
+        memcpy(lRecord.mText + sizeof(lRecord.mText) - sizeof(c_ASYNC_TRUNCATED), c_ASYNC_TRUNCATED, sizeof(c_ASYNC_TRUNCATED));
+    }
+    va_end(lArgs);
+    // The record is complete before the writer sees it
+    __sync_synchronize();
+    lRing.mTail = lTail + 1;
+    return true;
+}
+
+std::string AsyncLog::getDrops() {
+    return boost::lexical_cast<std::string>(__sync_fetch_and_and(&mDropped, 0)) + "/" +
+        boost::lexical_cast<std::string>(__sync_fetch_and_and(&mRateLimited, 0));
+}
+
+void AsyncLog::run() {
+    while (true) {
+        // Read before draining, so that what was logged before stop is written
+        const bool lStopping = mStopping;
+        const size_t lWritten = drain();
+        if (lStopping) {
+            break;
+        }
+        if (!lWritten) {
+            boost::this_thread::sleep(boost::posix_time::milliseconds(cAsyncWriterPeriodMs));
+        }
+    }
+}
+
+size_t AsyncLog::drain() {
+    std::list<boost::shared_ptr<tAsyncRing> > lRings;
+    {
+        boost::lock_guard<boost::mutex> lLock(mMutex);
+        lRings = mRings;
+    }
+    size_t lWritten = 0;
+    std::string lBatch;
+    BOOST_FOREACH(const boost::shared_ptr<tAsyncRing> &lRing, lRings) {
+        const unsigned lTail = lRing->mTail;
+        // The records up to the tail are complete
+        __sync_synchronize();
+        for (unsigned lHead = lRing->mHead; lHead != lTail; ++lHead) {
+            write(lRing->mRecords[lHead % lRing->mRecords.size()], lBatch);
+            ++lWritten;
+        }
+        // The records are written before the thread reuses them
+        __sync_synchronize();
+        lRing->mHead = lTail;
+    }
+    if (!lBatch.empty() && mFd >= 0) {
+        // One write per batch, appended at once even if several children share the file
+        if (::write(mFd, lBatch.data(), lBatch.size()) < 0) {
+            __sync_fetch_and_add(&mDropped, lWritten);
+        }
+    }
+
+    // Forget the threads which exited once emptied, only referenced by the list and the copy
+    boost::lock_guard<boost::mutex> lLock(mMutex);
+    std::list<boost::shared_ptr<tAsyncRing> >::iterator lIt = mRings.begin();
+    while (lIt != mRings.end()) {
+        if (lIt->use_count() <= 2 && (*lIt)->mHead == (*lIt)->mTail) {
+            lIt = mRings.erase(lIt);
+        } else {
+            ++lIt;
+        }
+    }
+    return lWritten;
+}
+
+void AsyncLog::write(const tAsyncRecord &pRecord, std::string &pBatch) {
+    if (mTarget == SYSLOG) {
+        syslog(pRecord.mPriority, "%s", pRecord.mText);
+        return;
+    }
+    char lHeader[128];
+    if (mTarget == LOCAL_FILE) {
+        struct tm lTime;
+        localtime_r(&pRecord.mTime, &lTime);
+        const size_t lLength = strftime(lHeader, sizeof(lHeader), "%Y-%m-%d %H:%M:%S", &lTime);
+        snprintf(lHeader + lLength, sizeof(lHeader) - lLength, " [%d] [%s] code:%d - ",
+                 getpid(), Log::stringLevel(LOG_PRI(pRecord.mPriority)), pRecord.mCode);
+        pBatch += lHeader;
+        pBatch += pRecord.mText;
+        pBatch += '\n';
+    } else {
+        // The BSD syslog format, the receiving daemon adds the time and host
+        snprintf(lHeader, sizeof(lHeader), "<%d>mod_dup[%d]: code:%d - ", pRecord.mPriority, getpid(), pRecord.mCode);
+        std::string lDatagram(lHeader);
+        lDatagram += pRecord.mText;
+        sendto(mFd, lDatagram.data(), lDatagram.size(), MSG_DONTWAIT,
+               reinterpret_cast<const struct sockaddr *>(&mAddress), mAddressLength);
+    }
+}
+
+/// @brief The only writer, never deleted: threads may still be logging when the module is unloaded
+static AsyncLog *getAsyncLog() {
+    static AsyncLog *lAsyncLog = new AsyncLog();
+    return lAsyncLog;
+}
+
+std::string Log::setAsync(const std::string &pTarget, unsigned pCapacity, unsigned pRatePerCode) {
+    return getAsyncLog()->configure(pTarget, pCapacity, pRatePerCode);
+}
+
+void Log::resetAsync() {
+    getAsyncLog()->reset();
+}
+
+void Log::startAsync() {
+    getAsyncLog()->start();
+    gAsync = getAsyncLog();
+}
+
+void Log::stopAsync() {
+    if (gAsync) {
+        gAsync->stop();
+    }
+}
+
+std::string Log::getAsyncDrops() {
+    return getAsyncLog()->getDrops();
+}
+
 #define LOG_LENGTH 16384
 
-#define VLOG(level, code, msg) va_list l_ap;\
-        char longmsg[LOG_LENGTH];\
-        snprintf(longmsg, LOG_LENGTH,"code:%d - %s", code, msg); \
+#ifdef UNIT_TESTING
+// The tests also see the messages on stdout, never the module: stdio takes a lock on each message
+#define VLOG_ECHO(level, code, msg, ap) { \
+            va_list l_ap2;\
+            va_copy(l_ap2, ap);\
+            char longmsg2[LOG_LENGTH];\
+            snprintf(longmsg2, LOG_LENGTH,"[%s] code:%d - %s\n", Log::stringLevel(level), code, msg); \
+            vprintf(longmsg2, l_ap2); \
+            va_end(l_ap2);\
+        }
+#else
+#define VLOG_ECHO(level, code, msg, ap)
+#endif
+
+#define VLOG(level, code, msg) if ( level > gLogLevel ) { \
+            return; \
+        } \
+        va_list l_ap;\
         va_start(l_ap, msg); \
-        va_list l_ap2;\
-        va_copy(l_ap2, l_ap);\
+        if ( gAsync && gAsync->push(level|gInstance->mFacility, code, msg, l_ap) ) { \
+            va_end(l_ap); \
+            return; \
+        } \
+        VLOG_ECHO(level, code, msg, l_ap) \
         vsyslog(level|gInstance->mFacility, msg, l_ap); \
-        char longmsg2[LOG_LENGTH];\
-        if ( level <= gLogLevel ) { \
-        snprintf(longmsg2, LOG_LENGTH,"[%s] code:%d - %s\n", Log::stringLevel(level), code, msg); \
-        vprintf(longmsg2, l_ap2); } \
-        va_end(l_ap2);\
         va_end(l_ap);\
 
         
@@ -19,6 +19,9 @@
 #pragma once
 
 #include <string>
+#include <syslog.h>
+
+class AsyncLog;
 
 /// @brief logging utility.
 /// syslog calls are wrapped
@@ -75,12 +78,46 @@ public:
 
     static const char * stringLevel(int pLevel);
 
+    /// @brief Parses a level name as given by stringLevel
+    /// @return the syslog level, -1 if unknown
+    static int levelOf(const std::string &pLevel);
+
+    /// @brief Sets the most verbose level logged, LOG_DEBUG by default
+    static void setLevel(int pLevel);
+
+    /// @brief Whether the messages of a level are logged, checked by the macros below before formatting anything
+    static bool isEnabled(int pLevel) { return pLevel <= gLogLevel; }
+
+    /// @brief Hands the messages to a writer thread instead of writing them from the logging threads,
+    /// once started by startAsync. Each thread buffers its messages without locking, the messages beyond are dropped.
+    /// @param pTarget syslog, file:<path> or udp:<host>:<port>
+    /// @param pCapacity the number of messages buffered per thread
+    /// @param pRatePerCode the number of messages per second logged per code other than 0, 0 for no limit
+    /// @return an empty string if the target is valid, the error otherwise
+    static std::string setAsync(const std::string &pTarget, unsigned pCapacity, unsigned pRatePerCode);
+
+    /// @brief Stops the writer thread and forgets the settings of setAsync, before the configuration is read again
+    static void resetAsync();
+
+    /// @brief Starts the writer thread if setAsync was called, in each process which logs
+    static void startAsync();
+
+    /// @brief Writes the buffered messages and stops the writer thread, the messages are then written synchronously
+    static void stopAsync();
+
+    /// @brief The messages not logged since the last call
+    /// @return "<dropped by a full buffer>/<beyond the rate of their code>"
+    static std::string getAsyncDrops();
+
 protected:
     /// @brief pointer to the only instance of this class
     static Log* gInstance;
 
     static int gLogLevel;
 
+    /// @brief The writer of the messages, NULL if they are written synchronously
+    static AsyncLog* gAsync;
+
     static const char *STRDEBUG;
     static const char *STRINFO;
     static const char *STRNOTICE;
@@ -106,3 +143,14 @@ public:
 
 
 };
+
+/// @brief Logs a debug message on the hot paths: the arguments are only evaluated if the debug level is enabled,
+/// never in the builds without DEBUG
+#ifdef DEBUG
+#define LOG_DEBUG_IF_ENABLED(...) do { if (Log::isEnabled(LOG_DEBUG)) { Log::debug(__VA_ARGS__); } } while (0)
+#else
+#define LOG_DEBUG_IF_ENABLED(...) do { } while (0)
+#endif
+
+/// @brief Logs an info message on the hot paths: the arguments are only evaluated if the info level is enabled
+#define LOG_INFO_IF_ENABLED(pCode, ...) do { if (Log::isEnabled(LOG_INFO)) { Log::info(pCode, __VA_ARGS__); } } while (0)
@@ -24,50 +24,225 @@
 namespace DupModule {
         template <typename T> void MultiThreadQueue<T>::push(const T object)
         {
+            const uint64_t lNow = monotonicNs() / 1000;
+            const unsigned lPriority = mPriority ? std::min<unsigned>(mPriority(object), QueuePriority::PROTECTED) : QueuePriority::NORMAL;
+            const size_t lBytes = mSizeOf ? mSizeOf(object) : 0;
+            T lDropped;
+            bool lInserted = true;
+            bool lDrop = false;
             {
                 boost::lock_guard<boost::mutex> lLock(mMutex);
-                if (mDropSize > 0 && mQueue.size() >= mDropSize) {
-                    mDropCount++;
-                } else {
-                    mQueue.push_back(object);
+                mTimings.mPushed++;
+                if (mDropSize > 0 && mSize >= mDropSize) {
+                    const bool lProtected = lPriority == QueuePriority::PROTECTED;
+                    lDrop = makeRoom(lPriority, lProtected, lDropped);
+                    if (!lDrop && !lProtected) {
+                        lDrop = true;
+                        lInserted = false;
+                        lDropped = object;
+                    }
+                    if (lDrop) {
+                        mDropCount++;
+                    }
+                }
+                if (lInserted) {
+                    mLevels[lPriority].push_back(tQueued(object, lNow, mNextBackSeq++, lBytes));
+                    mSize++;
+                    mBytes += lBytes;
                     mInCount++;
                 }
             }
-            mAvailableCondition.notify_one();
+            if (lDrop && mOnDrop) {
+                mOnDrop(lDropped, lInserted ? DropReason::EVICTED : DropReason::REFUSED);
+            }
+            if (lInserted) {
+                mAvailableCondition.notify_one();
+            }
         }
         
         template <typename T> void MultiThreadQueue<T>::push_front(const T object)
         {
+            const size_t lBytes = mSizeOf ? mSizeOf(object) : 0;
+            T lDropped;
+            bool lDrop = false;
             {
                 boost::lock_guard<boost::mutex> lLock(mMutex);
-                if (mDropSize > 0 && mQueue.size() >= mDropSize) {
+                if (mDropSize > 0 && mSize >= mDropSize && makeRoom(QueuePriority::PROTECTED, true, lDropped)) {
+                    lDrop = true;
                     mDropCount++;
-                    mQueue.pop_back();
                 }
-                mQueue.push_front(object);
+                mLevels[QueuePriority::PROTECTED].push_front(tQueued(object, monotonicNs() / 1000, mNextFrontSeq--, lBytes));
+                mSize++;
+                mBytes += lBytes;
+            }
+            if (lDrop && mOnDrop) {
+                mOnDrop(lDropped, DropReason::EVICTED);
             }
             mAvailableCondition.notify_one();
         }
+
+        template <typename T> typename MultiThreadQueue<T>::tLevel *MultiThreadQueue<T>::oldestLevel(unsigned pBelow)
+        {
+            tLevel *lOldest = NULL;
+            for (unsigned i = 0; i < pBelow; ++i) {
+                if (!mLevels[i].empty() && (!lOldest || mLevels[i].front().mSeq < lOldest->front().mSeq)) {
+                    lOldest = &mLevels[i];
+                }
+            }
+            return lOldest;
+        }
+
+        template <typename T> T MultiThreadQueue<T>::takeFront(uint64_t pNow)
+        {
+            tLevel &lLevel = *oldestLevel(QueuePriority::NB_PRIORITIES);
+            T lObject = lLevel.front().mObject;
+            mTimings.mWaitUs += pNow - lLevel.front().mQueuedUs;
+            mWaitHistogram.record(pNow - lLevel.front().mQueuedUs);
+            mBytes -= lLevel.front().mBytes;
+            lLevel.pop_front();
+            mSize--;
+            return lObject;
+        }
+
+        template <typename T> bool MultiThreadQueue<T>::makeRoom(unsigned pPriority, bool pFront, T &pDropped)
+        {
+            tLevel *lLevel = NULL;
+            switch (mDropPolicy) {
+            case DropPolicy::NEWEST:
+                if (!pFront) {
+                    return false;
+                }
+                // The newest object which can be dropped
+                for (unsigned i = 0; i < QueuePriority::PROTECTED; ++i) {
+                    if (!mLevels[i].empty() && (!lLevel || mLevels[i].back().mSeq > lLevel->back().mSeq)) {
+                        lLevel = &mLevels[i];
+                    }
+                }
+                if (!lLevel) {
+                    return false;
+                }
+                pDropped = lLevel->back().mObject;
+                mBytes -= lLevel->back().mBytes;
+                lLevel->pop_back();
+                mSize--;
+                return true;
+            case DropPolicy::OLDEST:
+                lLevel = oldestLevel(QueuePriority::PROTECTED);
+                break;
+            case DropPolicy::LOWEST_PRIORITY:
+                for (unsigned i = 0; !lLevel && i < QueuePriority::PROTECTED; ++i) {
+                    if (!mLevels[i].empty()) {
+                        lLevel = &mLevels[i];
+                    }
+                }
+                if (lLevel && !pFront && static_cast<unsigned>(lLevel - mLevels) > pPriority) {
+                    // The new object has the lowest priority
+                    return false;
+                }
+                break;
+            }
+            if (!lLevel) {
+                return false;
+            }
+            pDropped = lLevel->front().mObject;
+            mBytes -= lLevel->front().mBytes;
+            lLevel->pop_front();
+            mSize--;
+            return true;
+        }
         
         template <typename T> T MultiThreadQueue<T>::pop()
         {
+            const uint64_t lIdleSince = monotonicNs() / 1000;
+
             boost::unique_lock<boost::mutex> lLock(mMutex);
-            while (mQueue.empty()) {
+            tLastPop &lLastPop = served(lIdleSince);
+            while (!mSize) {
                 mAvailableCondition.wait(lLock);
             }
-            T lObject = mQueue.front();
-            mQueue.pop_front();
+            lLastPop.mPoppedUs = monotonicNs() / 1000;
+            lLastPop.mCount = 1;
+            mTimings.mPopped++;
             mOutCount++;
-            return lObject;
+            return takeFront(lLastPop.mPoppedUs);
+        }
+
+        template <typename T> size_t MultiThreadQueue<T>::popBatch(std::vector<T> &pObjects, size_t pMax, unsigned pTimeoutUs)
+        {
+            const uint64_t lIdleSince = monotonicNs() / 1000;
+
+            boost::unique_lock<boost::mutex> lLock(mMutex);
+            tLastPop &lLastPop = served(lIdleSince);
+            if (pTimeoutUs) {
+                const boost::system_time lDeadline = boost::get_system_time() + boost::posix_time::microseconds(pTimeoutUs);
+                while (!mSize) {
+                    if (!mAvailableCondition.timed_wait(lLock, lDeadline) && !mSize) {
+                        lLastPop.mCount = 0;
+                        return 0;
+                    }
+                }
+            } else {
+                while (!mSize) {
+                    mAvailableCondition.wait(lLock);
+                }
+            }
+            lLastPop.mPoppedUs = monotonicNs() / 1000;
+            const size_t lCount = std::min(pMax, mSize);
+            for (size_t i = 0; i < lCount; ++i) {
+                pObjects.push_back(takeFront(lLastPop.mPoppedUs));
+            }
+            lLastPop.mCount = lCount;
+            mTimings.mPopped += lCount;
+            mOutCount += lCount;
+            if (mSize) {
+                // Another consumer might be waiting while we only took part of the queue
+                mAvailableCondition.notify_one();
+            }
+            return lCount;
+        }
+
+        template <typename T> typename MultiThreadQueue<T>::tLastPop &MultiThreadQueue<T>::served(uint64_t pNow)
+        {
+            tLastPop *lLastPop = mLastPop.get();
+            if (!lLastPop) {
+                lLastPop = new tLastPop();
+                mLastPop.reset(lLastPop);
+            }
+            if (lLastPop->mCount) {
+                mTimings.mServed += lLastPop->mCount;
+                mTimings.mServiceUs += pNow - lLastPop->mPoppedUs;
+            }
+            lLastPop->mCount = 0;
+            return *lLastPop;
         }
         
         template <typename T> size_t MultiThreadQueue<T>::size() const {
-            return mQueue.size();
+            return mSize;
+        }
+
+        template <typename T> size_t MultiThreadQueue<T>::bytes() const {
+            return mBytes;
         }
         
         template <typename T> void MultiThreadQueue<T>::setDropSize(size_t pDropSize) {
             mDropSize = pDropSize;
         }
+
+        template <typename T> void MultiThreadQueue<T>::setDropPolicy(DropPolicy::eDropPolicy pDropPolicy) {
+            mDropPolicy = pDropPolicy;
+        }
+
+        template <typename T> void MultiThreadQueue<T>::setPriority(tPriorityFunction pPriority) {
+            mPriority = pPriority;
+        }
+
+        template <typename T> void MultiThreadQueue<T>::setDropHandler(tDropHandler pOnDrop) {
+            mOnDrop = pOnDrop;
+        }
+
+        template <typename T> void MultiThreadQueue<T>::setSizeFunction(tSizeFunction pSize) {
+            mSizeOf = pSize;
+        }
         
         template <typename T> void MultiThreadQueue<T>::getCounters(unsigned &pInCount, unsigned &pOutCount, unsigned &pDropCount) {
             pInCount = mInCount;
@@ -75,6 +250,16 @@ namespace DupModule {
             pDropCount = mDropCount;
             mInCount = mOutCount = mDropCount = 0;
         }
+
+        template <typename T> void MultiThreadQueue<T>::getTimings(tQueueTimings &pTimings) {
+            boost::lock_guard<boost::mutex> lLock(mMutex);
+            pTimings = mTimings;
+            mTimings = tQueueTimings();
+        }
+
+        template <typename T> void MultiThreadQueue<T>::getWaitHistogram(LatencyHistogram &pTotal) {
+            mWaitHistogram.drainInto(pTotal);
+        }
    
    template class MultiThreadQueue<boost::shared_ptr<RequestInfo>>;
    template class MultiThreadQueue<int>;
@@ -19,34 +19,122 @@
 #pragma once
 
 #include <deque>
+#include <vector>
+#include <stdint.h>
+#include <boost/function.hpp>
 #include <boost/thread.hpp>
+#include <boost/thread/tss.hpp>
 #include <apr_poll.h>
 
+#include "Histogram.hh"
+
 namespace DupModule {
 
+/*
+ * The priorities of the queued items, the lowest ones get dropped first with the LOWEST_PRIORITY policy
+ */
+namespace QueuePriority {
+
+enum eQueuePriority {
+    LOW                     = 0,
+    NORMAL                  = 1,
+    HIGH                    = 2,
+    PROTECTED               = 3,    // Never dropped, even beyond the maximum size of the queue
+    NB_PRIORITIES           = 4,
+};
+
+};
+
+/*
+ * What a full queue drops to make room for a new item
+ */
+namespace DropPolicy {
+
+enum eDropPolicy {
+    NEWEST                  = 0,    // The new item
+    OLDEST                  = 1,    // The item queued for the longest time, to keep the recent ones
+    LOWEST_PRIORITY         = 2,    // The oldest item of the lowest priority, the new item if its priority is lower
+};
+
+};
+
+/*
+ * Why a full queue dropped an item
+ */
+namespace DropReason {
+
+enum eDropReason {
+    REFUSED                 = 0,    // The new item, with the NEWEST policy or a priority lower than all the queued ones
+    EVICTED                 = 1,    // A queued item, to make room for a new one
+    NB_REASONS              = 2,
+};
+
+/*
+ * The name of a reason in the stats and the exported metrics
+ */
+inline const char *enumToString(eDropReason pReason) {
+    return pReason == REFUSED ? "refused" : "evicted";
+}
+
+};
+
 /**
- * @brief A thread safe (using boost::mutex and boost::condition_variable) wrapper around a std::deque.
+ * @brief What the consumers of a queue went through since the last call to MultiThreadQueue::getTimings
+ */
+struct tQueueTimings {
+
+    tQueueTimings() : mPushed(0), mPopped(0), mWaitUs(0), mServed(0), mServiceUs(0) {}
+
+    /** @brief The number of items pushed, dropped ones included */
+    unsigned mPushed;
+    /** @brief The number of items popped */
+    unsigned mPopped;
+    /** @brief The total time in micro sec the popped items spent in the queue */
+    uint64_t mWaitUs;
+    /** @brief The number of items whose handling time is known */
+    unsigned mServed;
+    /** @brief The total time in micro sec a consumer spent between returning an item and popping the next one */
+    uint64_t mServiceUs;
+};
+
+/**
+ * @brief A thread safe (using boost::mutex and boost::condition_variable) wrapper around a std::deque per priority.
  * It exposes the typical FIFO methods pop and push as well as push_front which makes it possible to add a prioritized item to the front of the queue.
+ * The items are popped in the order they were pushed whatever their priority, which only matters when the queue is full:
+ * the drop policy then picks the item to drop by looking at the front or back of each priority, never scanning the queue.
  * It also keeps track of 3 counters for the number of pushed, popped and dropped items. getCounters will return those values and reset them.
+ * getTimings returns how long the items waited in the queue and how long the consumers took to handle them, for a pool to size itself.
  * The class gets the queue item type as its template argument. This makes it independent of any business needs and therefore more easily reusable.
  */
 template <typename T>
 class MultiThreadQueue
 {
 public:
+    /** @brief The type of the function object giving the priority of an item */
+    typedef boost::function1<QueuePriority::eQueuePriority, const T &> tPriorityFunction;
+
+    /** @brief The type of the function object called with each dropped item and why, out of the queue lock */
+    typedef boost::function2<void, const T &, DropReason::eDropReason> tDropHandler;
+
+    /** @brief The type of the function object giving the memory held by an item, in bytes */
+    typedef boost::function1<size_t, const T &> tSizeFunction;
+
     /**
      * @brief Constructs a MultiThreadQueue
      */
-    MultiThreadQueue() : mInCount(0), mOutCount(0), mDropCount(0), mDropSize(0), mRunning(true) {};
+    MultiThreadQueue() : mSize(0), mBytes(0), mNextBackSeq(0), mNextFrontSeq(-1), mDropPolicy(DropPolicy::NEWEST),
+                         mInCount(0), mOutCount(0), mDropCount(0), mDropSize(0), mRunning(true) {};
     
     /**
      * @brief Adds the given object to the back of the queue so it will be the last one to be pulled
+     * If the queue is full, the drop policy decides whether it or an older object gets dropped
      * @param object The object to be inserted
      */
     void push(const T object);
     
     /**
      * @brief Adds the given object to the front of the queue so it will be the next one to be pulled
+     * It is never dropped: if the queue is full, the drop policy picks another object to drop
      * @param object The object to be inserted
      */
     void push_front(const T object);
@@ -56,18 +144,58 @@ public:
      * @return the object
      */
     T pop();
+
+    /**
+     * @brief Remove the first objects in the queue, up to a maximum number. Blocks until something is available or the timeout expires.
+     * Takes the lock and wakes the consumer up once for the whole batch.
+     * @param pObjects receives the objects, appended in queue order
+     * @param pMax the maximum number of objects to remove
+     * @param pTimeoutUs the maximum time in micro sec to wait for a first object, 0 to wait as long as needed
+     * @return the number of objects removed, 0 if the timeout expired
+     */
+    size_t popBatch(std::vector<T> &pObjects, size_t pMax, unsigned pTimeoutUs);
     
     /**
      * @brief Returns the size of the queue
      * @return the size of the queue
      */
     size_t size() const;
+
+    /**
+     * @brief Returns the memory held by the queued objects, 0 without a size function
+     * @return the size in bytes
+     */
+    size_t bytes() const;
     
     /**
      * @brief Sets the maximum size of the queue. Beyond this size, pushed elements will not be inserted anymnore
      * @param pDropSize the maximum size of the queue. A value <= 0 means there's no maximum size.
      */
     void setDropSize(size_t pDropSize);
+
+    /**
+     * @brief Sets what gets dropped when the queue is full
+     * @param pDropPolicy the drop policy, NEWEST by default
+     */
+    void setDropPolicy(DropPolicy::eDropPolicy pDropPolicy);
+
+    /**
+     * @brief Sets the function giving the priority of the pushed objects, all of them are NORMAL without one
+     * @param pPriority the priority function, called out of the queue lock
+     */
+    void setPriority(tPriorityFunction pPriority);
+
+    /**
+     * @brief Sets the function called with the dropped objects, to account for them
+     * @param pOnDrop the drop handler
+     */
+    void setDropHandler(tDropHandler pOnDrop);
+
+    /**
+     * @brief Sets the function giving the memory held by the pushed objects, to account for it
+     * @param pSize the size function, called out of the queue lock
+     */
+    void setSizeFunction(tSizeFunction pSize);
     
     /**
      * @brief Gets various counters. Then resets all counters.
@@ -76,6 +204,19 @@ public:
      * @param pDropCount the number of elements dropped since last call
      */
     void getCounters(unsigned &pInCount, unsigned &pOutCount, unsigned &pDropCount);
+
+    /**
+     * @brief Gets the timings of the items since last call. Then resets them.
+     * Independent from getCounters so that the stats and the pool manager can sample at their own pace.
+     * @param pTimings receives the timings
+     */
+    void getTimings(tQueueTimings &pTimings);
+
+    /**
+     * @brief Moves the time the popped items spent in the queue since last call to a histogram
+     * @param pTotal the histogram receiving the durations
+     */
+    void getWaitHistogram(LatencyHistogram &pTotal);
     
     /// @brief stop queue faster than a poison pill
     void stop() { mRunning = false;};
@@ -85,8 +226,62 @@ public:
     const bool & isRunning() const { return mRunning; } ;
     
 private:
-    /** @brief The underlying queue holding the itms */
-    std::deque<T> mQueue;
+    /** @brief An item with the time it got queued at */
+    struct tQueued {
+        tQueued(const T &pObject, uint64_t pQueuedUs, int64_t pSeq, size_t pBytes) :
+            mObject(pObject), mQueuedUs(pQueuedUs), mSeq(pSeq), mBytes(pBytes) {}
+
+        T mObject;
+        uint64_t mQueuedUs;
+        /** @brief The position of the item in the queue, across priorities */
+        int64_t mSeq;
+        /** @brief The memory held by the item */
+        size_t mBytes;
+    };
+
+    typedef std::deque<tQueued> tLevel;
+
+    /**
+     * @brief Returns the priority holding the first object in the queue, called with the lock held on a non empty queue
+     * @param pBelow only the priorities lower than this one are looked at
+     * @return the priority holding the oldest object, NULL if they are all empty
+     */
+    tLevel *oldestLevel(unsigned pBelow);
+
+    /**
+     * @brief Removes and returns the first object in the queue, called with the lock held on a non empty queue
+     * @param pNow the current time, to account for the time the object waited
+     * @return the object
+     */
+    T takeFront(uint64_t pNow);
+
+    /**
+     * @brief Drops an object according to the drop policy to make room for a new one, called with the lock held
+     * @param pPriority the priority of the new object
+     * @param pFront true if the new object must not be dropped: it goes to the front of the queue or is protected
+     * @param pDropped receives the dropped object
+     * @return true if an object was dropped, false if the new object should be dropped instead
+     */
+    bool makeRoom(unsigned pPriority, bool pFront, T &pDropped);
+
+    /** @brief The underlying queues holding the items, one per priority */
+    tLevel mLevels[QueuePriority::NB_PRIORITIES];
+    /** @brief The number of items in all the priorities */
+    size_t mSize;
+    /** @brief The memory held by the items in all the priorities */
+    size_t mBytes;
+    /** @brief The position of the next item pushed to the back */
+    int64_t mNextBackSeq;
+    /** @brief The position of the next item pushed to the front */
+    int64_t mNextFrontSeq;
+    /** @brief What gets dropped when the queue is full */
+    DropPolicy::eDropPolicy mDropPolicy;
+    /** @brief Gives the priority of the pushed items */
+    tPriorityFunction mPriority;
+    /** @brief Called with the dropped items */
+    tDropHandler mOnDrop;
+    /** @brief Gives the memory held by the pushed items */
+    tSizeFunction mSizeOf;
     /** @brief The mutex used to ensure thread safety */
     boost::mutex mMutex;
     /** @brief Used to make pull-clients wait and wake them up when necessary */
@@ -101,6 +296,29 @@ private:
     size_t mDropSize;
     /// @brief true by default, false to exit faster than a poison pill
     bool mRunning;
+    /** @brief The timings since last call to getTimings */
+    tQueueTimings mTimings;
+    /** @brief The time the items popped since last call to getWaitHistogram spent in the queue */
+    LatencyHistogram mWaitHistogram;
+    /** @brief What a consumer last popped */
+    struct tLastPop {
+        tLastPop() : mPoppedUs(0), mCount(0) {}
+
+        /** @brief The time the consumer returned from its last pop */
+        uint64_t mPoppedUs;
+        /** @brief The number of objects it returned */
+        size_t mCount;
+    };
+
+    /**
+     * @brief Accounts the time the calling consumer took to handle its last objects, called with the lock held
+     * @param pNow the time the consumer came back to the queue
+     * @return what the consumer last popped, to be updated
+     */
+    tLastPop &served(uint64_t pNow);
+
+    /** @brief What the calling consumer last popped */
+    boost::thread_specific_ptr<tLastPop> mLastPop;
 
 };
 
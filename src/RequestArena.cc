@@ -0,0 +1,133 @@
+/*
+* mod_dup - duplicates apache requests
+*
+* Copyright (C) 2017 Orange
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "RequestArena.hh"
+
+#include <algorithm>
+#include <stdint.h>
+#include <stdlib.h>
+
+namespace DupModule {
+
+const unsigned RequestArena::cPoolSize;
+const size_t RequestArena::cMinBlockSize;
+
+namespace {
+
+/** @brief The arenas ready to be taken, NULL for a free slot */
+RequestArena *volatile gPool[RequestArena::cPoolSize];
+
+/** @brief What recent requests used, in bytes */
+volatile size_t gRecentSize = 4 * RequestArena::cMinBlockSize;
+
+}
+
+RequestArena *
+RequestArena::acquire() {
+    for (unsigned i = 0; i < cPoolSize; ++i) {
+        RequestArena *lArena = gPool[i];
+        if (lArena && __sync_bool_compare_and_swap(&gPool[i], lArena, static_cast<RequestArena *>(NULL))) {
+            return lArena;
+        }
+    }
+    return new RequestArena(recentSize());
+}
+
+void
+RequestArena::release(RequestArena *pArena) {
+    // Moving average over the last 16 requests or so
+    size_t lRecent = gRecentSize;
+    const size_t lNext = lRecent - lRecent / 16 + pArena->used() / 16;
+    __sync_bool_compare_and_swap(&gRecentSize, lRecent, lNext);
+
+    pArena->reset();
+    for (unsigned i = 0; i < cPoolSize; ++i) {
+        if (!gPool[i] && __sync_bool_compare_and_swap(&gPool[i], static_cast<RequestArena *>(NULL), pArena)) {
+            return;
+        }
+    }
+    delete pArena;
+}
+
+size_t
+RequestArena::recentSize() {
+    return std::max(cMinBlockSize, static_cast<size_t>(gRecentSize));
+}
+
+RequestArena::tBlock *
+RequestArena::newBlock(size_t pSize) {
+    tBlock *lBlock = static_cast<tBlock *>(malloc(sizeof(tBlock) + pSize));
+    if (!lBlock) {
+        throw std::bad_alloc();
+    }
+    lBlock->mNext = NULL;
+    lBlock->mSize = pSize;
+    return lBlock;
+}
+
+RequestArena::RequestArena(size_t pFirstBlockSize)
+    : mCurrent(newBlock(pFirstBlockSize))
+    , mFree(reinterpret_cast<char *>(mCurrent + 1))
+    , mEnd(mFree + pFirstBlockSize)
+    , mUsed(0)
+{
+}
+
+RequestArena::~RequestArena() {
+    while (mCurrent) {
+        tBlock *lNext = mCurrent->mNext;
+        free(mCurrent);
+        mCurrent = lNext;
+    }
+}
+
+void *
+RequestArena::allocate(size_t pSize, size_t pAlign) {
+    char *lStart = reinterpret_cast<char *>((reinterpret_cast<uintptr_t>(mFree) + pAlign - 1) & ~(pAlign - 1));
+    if (lStart + pSize > mEnd) {
+        tBlock *lBlock = newBlock(std::max(2 * mCurrent->mSize, pSize + pAlign));
+        lBlock->mNext = mCurrent;
+        mCurrent = lBlock;
+        mFree = reinterpret_cast<char *>(lBlock + 1);
+        mEnd = mFree + lBlock->mSize;
+        lStart = reinterpret_cast<char *>((reinterpret_cast<uintptr_t>(mFree) + pAlign - 1) & ~(pAlign - 1));
+    }
+    mFree = lStart + pSize;
+    mUsed += pSize;
+    return lStart;
+}
+
+void
+RequestArena::reset() {
+    while (mCurrent->mNext) {
+        tBlock *lNext = mCurrent->mNext;
+        free(mCurrent);
+        mCurrent = lNext;
+    }
+    // Grown if the request did not fit, shrunk if a large request left it much bigger than the recent ones
+    const size_t lRecent = recentSize();
+    if (mUsed > mCurrent->mSize || mCurrent->mSize > 8 * lRecent) {
+        free(mCurrent);
+        mCurrent = newBlock(std::max(mUsed + mUsed / 4, lRecent));
+    }
+    mFree = reinterpret_cast<char *>(mCurrent + 1);
+    mEnd = mFree + mCurrent->mSize;
+    mUsed = 0;
+}
+
+}
@@ -0,0 +1,189 @@
+/*
+* mod_dup - duplicates apache requests
+*
+* Copyright (C) 2017 Orange
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <utility>
+
+namespace DupModule {
+
+/**
+ * @brief Monotonic memory of a request: allocations bump a pointer in blocks, freeing does nothing until the arena is reset
+ * Arenas are recycled through a lock-free pool shared by all the threads, with their first block sized
+ * after the recent requests, so that the memory of most requests is a single block taken and given back at once.
+ */
+class RequestArena {
+public:
+    /** @brief The number of arenas kept in the pool, the others are freed */
+    static const unsigned cPoolSize = 256;
+    /** @brief The smallest block allocated */
+    static const size_t cMinBlockSize = 1024;
+
+    /**
+     * @brief Takes an arena from the pool, or creates one sized after the recent requests if the pool is empty
+     */
+    static RequestArena *acquire();
+
+    /**
+     * @brief Resets an arena and gives it back to the pool
+     */
+    static void release(RequestArena *pArena);
+
+    /**
+     * @brief The size of the first block of the new arenas, a moving average of what recent requests used
+     */
+    static size_t recentSize();
+
+    /**
+     * @brief Allocates from the current block, or from a new one twice as large if it is full
+     */
+    void *allocate(size_t pSize, size_t pAlign);
+
+    /**
+     * @brief Frees the blocks beyond the first one, which is grown to what was used so that the next request fits in it
+     */
+    void reset();
+
+    /**
+     * @brief The number of bytes allocated since the last reset
+     */
+    size_t used() const { return mUsed; }
+
+    ~RequestArena();
+
+private:
+    struct tBlock {
+        tBlock *mNext;
+        size_t mSize;
+    };
+
+    explicit RequestArena(size_t pFirstBlockSize);
+
+    RequestArena(const RequestArena &);
+    RequestArena &operator=(const RequestArena &);
+
+    static tBlock *newBlock(size_t pSize);
+
+    /** @brief The block allocations are made from, its predecessors linked by mNext */
+    tBlock *mCurrent;
+    /** @brief The next free byte of the current block */
+    char *mFree;
+    /** @brief The end of the current block */
+    char *mEnd;
+    /** @brief The bytes allocated since the last reset */
+    size_t mUsed;
+};
+
+/**
+ * @brief The arena of an object, taken from the pool on construction and given back when destroyed
+ * A copy has no arena: what it allocates then comes from the heap.
+ */
+class tArenaHandle {
+public:
+    tArenaHandle() : mArena(RequestArena::acquire()) {}
+
+    tArenaHandle(const tArenaHandle &) : mArena(NULL) {}
+
+    tArenaHandle &operator=(const tArenaHandle &) { return *this; }
+
+    ~tArenaHandle() {
+        if (mArena) {
+            RequestArena::release(mArena);
+        }
+    }
+
+    RequestArena *get() const { return mArena; }
+
+private:
+    RequestArena *mArena;
+};
+
+/**
+ * @brief Allocator of the containers of a request, from its arena or from the heap if it has none
+ * The copies of a container are made on the heap: they may outlive the request.
+ */
+template <class T>
+class tArenaAllocator {
+public:
+    typedef T value_type;
+    typedef T *pointer;
+    typedef const T *const_pointer;
+    typedef T &reference;
+    typedef const T &const_reference;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+
+    template <class U>
+    struct rebind {
+        typedef tArenaAllocator<U> other;
+    };
+
+    tArenaAllocator() : mArena(NULL) {}
+
+    explicit tArenaAllocator(RequestArena *pArena) : mArena(pArena) {}
+
+    template <class U>
+    tArenaAllocator(const tArenaAllocator<U> &pOther) : mArena(pOther.arena()) {}
+
+    T *
+    allocate(size_t pCount, const void * = 0) {
+        if (mArena) {
+            return static_cast<T *>(mArena->allocate(pCount * sizeof(T), alignof(T)));
+        }
+        return static_cast<T *>(::operator new(pCount * sizeof(T)));
+    }
+
+    void
+    deallocate(T *pPointer, size_t) {
+        if (!mArena) {
+            ::operator delete(pPointer);
+        }
+    }
+
+    tArenaAllocator
+    select_on_container_copy_construction() const {
+        return tArenaAllocator();
+    }
+
+    size_t max_size() const { return size_t(-1) / sizeof(T); }
+
+    template <class U, class... Args>
+    void construct(U *pPointer, Args&&... pArgs) { ::new(static_cast<void *>(pPointer)) U(std::forward<Args>(pArgs)...); }
+
+    template <class U>
+    void destroy(U *pPointer) { pPointer->~U(); }
+
+    RequestArena *arena() const { return mArena; }
+
+private:
+    RequestArena *mArena;
+};
+
+template <class T, class U>
+inline bool operator==(const tArenaAllocator<T> &pLeft, const tArenaAllocator<U> &pRight) {
+    return pLeft.arena() == pRight.arena();
+}
+
+template <class T, class U>
+inline bool operator!=(const tArenaAllocator<T> &pLeft, const tArenaAllocator<U> &pRight) {
+    return pLeft.arena() != pRight.arena();
+}
+
+}
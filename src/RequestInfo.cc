@@ -67,10 +67,16 @@ RequestInfo::RequestInfo(std::string id, const std::string &pConfPath, const std
       mMethod(pMethod),
       mPath(pPath),
       mArgs(pArgs),
+      mParsedArgs(tArenaAllocator<tArgSpan>(mArena.get())),
+      mReqHeader(tArenaAllocator<char>(mArena.get())),
+      mCurlCompResponseHeader(tArenaAllocator<char>(mArena.get())),
       mCurlCompResponseStatus(-1),
+      mHeadersIn(tArenaAllocator<char>(mArena.get())),
+      mHeadersOut(tArenaAllocator<char>(mArena.get())),
       mValidationHeaderDup(false),
       mValidationHeaderComp(false),
       mConf(nullptr),
+      mCaptureBodies(true),
       mEOS(false),
       mStartTime(boost::posix_time::microsec_clock::universal_time()),
       mElapsedTime()
@@ -82,29 +88,43 @@ RequestInfo::RequestInfo(std::string id, const std::string &pConfPath, const std
 RequestInfo::RequestInfo(const mapStr &reqHeader, const std::string &reqBody, const mapStr &respHeader,
                          const std::string &respBody, const mapStr &dupHeader, const std::string &dupBody):
 	mPoison(false),
-	mReqHeader(reqHeader),
+	mParsedArgs(tArenaAllocator<tArgSpan>(mArena.get())),
+	mReqHeader(tArenaAllocator<char>(mArena.get())),
 	mReqBody(reqBody),
 	mResponseHeader(respHeader),
 	mResponseBody(respBody),
 	mDupResponseHeader(dupHeader),
 	mDupResponseBody(dupBody),
+	mCurlCompResponseHeader(tArenaAllocator<char>(mArena.get())),
 	mCurlCompResponseStatus(-1),
+	mHeadersIn(tArenaAllocator<char>(mArena.get())),
+	mHeadersOut(tArenaAllocator<char>(mArena.get())),
 	mValidationHeaderDup(false),
 	mValidationHeaderComp(false),
 	mConf(nullptr),
+	mCaptureBodies(true),
     mEOS(false),
     mStartTime(boost::posix_time::microsec_clock::universal_time()),
     mElapsedTime()
 {
+    for (mapStr::const_iterator it = reqHeader.begin(); it != reqHeader.end(); ++it) {
+        mReqHeader.push_back(it->first, it->second);
+    }
 }
 
 RequestInfo::RequestInfo(const std::string &id, int64_t startTime)
     : mPoison(false),
       mId(id),
+      mParsedArgs(tArenaAllocator<tArgSpan>(mArena.get())),
+      mReqHeader(tArenaAllocator<char>(mArena.get())),
+      mCurlCompResponseHeader(tArenaAllocator<char>(mArena.get())),
       mCurlCompResponseStatus(-1),
+      mHeadersIn(tArenaAllocator<char>(mArena.get())),
+      mHeadersOut(tArenaAllocator<char>(mArena.get())),
       mValidationHeaderDup(false),
       mValidationHeaderComp(false),
       mConf(nullptr),
+      mCaptureBodies(true),
       mEOS(false)
 {
           namespace pt = boost::posix_time;
@@ -113,23 +133,30 @@ RequestInfo::RequestInfo(const std::string &id, int64_t startTime)
 
 RequestInfo::RequestInfo() :
     mPoison(true),
+    mParsedArgs(tArenaAllocator<tArgSpan>(mArena.get())),
+    mReqHeader(tArenaAllocator<char>(mArena.get())),
+    mCurlCompResponseHeader(tArenaAllocator<char>(mArena.get())),
     mCurlCompResponseStatus(-1),
+    mHeadersIn(tArenaAllocator<char>(mArena.get())),
+    mHeadersOut(tArenaAllocator<char>(mArena.get())),
     mValidationHeaderDup(false),
     mValidationHeaderComp(false),
     mConf(nullptr),
+    mCaptureBodies(true),
     mEOS(false),
     mStartTime(boost::posix_time::microsec_clock::universal_time()),
     mElapsedTime()
     {
 }
 
-std::string RequestInfo::flatten(const tKeyValList &kvl, std::string sep)
+std::string RequestInfo::flatten(const tHeaders &pHeaders, std::string sep)
 {
     std::string out;
-    for( const auto &item : kvl ) {
-        out += item.first;
+    out.reserve(pHeaders.bytes() + pHeaders.size() * sep.size());
+    for( const tHeaders::tHeader &item : pHeaders ) {
+        out.append(item.mName.data(), item.mName.size());
         out += sep;
-        out += item.second;
+        out.append(item.mValue.data(), item.mValue.size());
     }
     return out;
 }
@@ -155,5 +182,50 @@ RequestInfo::getElapsedTimeMS() const {
     return mElapsedTime.total_milliseconds();
 }
 
+RequestOverlay::RequestOverlay(const RequestInfo &pBase)
+    : mBase(&pBase) {
+}
+
+RequestOverlay::RequestOverlay(const boost::shared_ptr<const RequestInfo> &pBase)
+    : mBase(pBase.get()),
+      mOwner(pBase) {
+}
+
+void
+RequestOverlay::setPath(const std::string &pPath) {
+    mPath.reset(new std::string(pPath));
+}
+
+void
+RequestOverlay::setArgs(const std::string &pArgs) {
+    mArgs.reset(new std::string(pArgs));
+}
+
+void
+RequestOverlay::setBody(const std::string &pBody) {
+    mBody.reset(new std::string(pBody));
+}
+
+void
+RequestOverlay::setHeadersIn(const tHeaders &pHeadersIn) {
+    mHeadersIn.reset(new tHeaders(pHeadersIn));
+}
+
+void
+RequestOverlay::apply(RequestInfo &pRequest) const {
+    if (mPath) {
+        pRequest.mPath = *mPath;
+    }
+    if (mArgs) {
+        pRequest.mArgs = *mArgs;
+    }
+    if (mBody) {
+        pRequest.mBody = *mBody;
+    }
+    if (mHeadersIn) {
+        pRequest.mHeadersIn = *mHeadersIn;
+    }
+}
+
 
 }
@@ -25,13 +25,19 @@
 #include <boost/date_time/posix_time/posix_time.hpp>
 
 #include <boost/serialization/map.hpp>
+#include <boost/serialization/split_member.hpp>
 #include <boost/serialization/string.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/utility/string_ref.hpp>
 
 #include <list>
 #include <map>
 #include <string>
 #include <sstream>
+#include <vector>
+
+#include "Headers.hh"
+#include "RequestArena.hh"
 
 
 struct apr_bucket_brigade;
@@ -55,8 +61,21 @@ struct RequestInfo {
 
 namespace DupModule {
 
-typedef std::pair<std::string, std::string> tKeyVal;
-typedef std::list<tKeyVal> tKeyValList;
+/**
+ * @brief A parameter of a query string or urlencoded body, located by its offsets so that parsing copies nothing
+ * The offsets stay valid when the request is copied. The value is raw, decoded only when a filter needs it.
+ */
+struct tArgSpan {
+    size_t mKey;
+    size_t mKeySize;
+    size_t mValue;
+    size_t mValueSize;
+
+    boost::string_ref key(const std::string &pArgs) const { return boost::string_ref(pArgs.data() + mKey, mKeySize); }
+
+    boost::string_ref value(const std::string &pArgs) const { return boost::string_ref(pArgs.data() + mValue, mValueSize); }
+};
+typedef std::vector<tArgSpan, tArenaAllocator<tArgSpan> > tArgSpans;
     
 /*
  * Different duplication modes supported by mod_dup
@@ -89,17 +108,38 @@ struct RequestInfo {
     // When the class Archive corresponds to an output archive, the
     // & operator is defined similar to <<.  Likewise, when the class Archive
     // is a type of input archive the & operator is defined similar to >>.
+    // The request headers are archived as a map, as they were before being held in a tHeaders
     template<typename Archive>
-    void serialize(Archive & ar, const unsigned int version)
+    void save(Archive & ar, const unsigned int version) const
     {
+        mapStr lReqHeader;
+        mReqHeader.toMap(lReqHeader);
         ar & mRequest;
-        ar & mReqHeader;
+        ar & lReqHeader;
         ar & mReqBody;
         ar & mResponseHeader;
         ar & mResponseBody;
         ar & mDupResponseHeader;
         ar & mDupResponseBody;
     }
+
+    template<typename Archive>
+    void load(Archive & ar, const unsigned int version)
+    {
+        mapStr lReqHeader;
+        ar & mRequest;
+        ar & lReqHeader;
+        ar & mReqBody;
+        ar & mResponseHeader;
+        ar & mResponseBody;
+        ar & mDupResponseHeader;
+        ar & mDupResponseBody;
+        mReqHeader.clear();
+        for (mapStr::const_iterator it = lReqHeader.begin(); it != lReqHeader.end(); ++it) {
+            mReqHeader.push_back(it->first, it->second);
+        }
+    }
+    BOOST_SERIALIZATION_SPLIT_MEMBER()
    
     /** @brief True if the request processor should stop ater seeing this object. */
     bool mPoison;
@@ -111,8 +151,10 @@ struct RequestInfo {
     std::string mPath;
     /** @brief The parameters part of the query (query string without leading ?). */
     std::string mArgs;
-    /** @brief The parameters part of the query (without leading ?). */
-    tKeyValList mParsedArgs;
+    /** @brief Backs the parsed arguments and the headers, given back to the pool in one go with the request */
+    tArenaHandle mArena;
+    /** @brief The parameters of mArgs */
+    tArgSpans mParsedArgs;
     /** @brief The body part of the query */
     std::string mBody;
     /** @brief The query answer */
@@ -120,7 +162,7 @@ struct RequestInfo {
     /** @brief The request uri */
     std::string mRequest;
     /** @brief The header part of the query */
-    mapStr mReqHeader;
+    tHeaders mReqHeader;
     /** @brief The header part of the query */
     std::string mReqBody;
     /** @brief The header part of the answer */
@@ -132,16 +174,16 @@ struct RequestInfo {
     /** @brief The body part of the answer of the duplicated request*/
     std::string mDupResponseBody;
     /** @brief The response header of the CURL command sent from MOD_DUP to MOD_COMP */
-    mapStr mCurlCompResponseHeader;
+    tHeaders mCurlCompResponseHeader;
     /** @brief The response status of the CURL command sent from MOD_DUP to MOD_COMP */
     int mCurlCompResponseStatus;
 
 
-    /** @brief list that represents the headers of the incoming request */
-    tKeyValList mHeadersIn;
+    /** @brief The headers of the incoming request */
+    tHeaders mHeadersIn;
 
-    /** @brief list that represents the headers of the request answer */
-    tKeyValList mHeadersOut;
+    /** @brief The headers of the request answer */
+    tHeaders mHeadersOut;
 
     unsigned int offset;
 
@@ -158,6 +200,9 @@ struct RequestInfo {
     /** @brief The conf object for the location of this Request */
     void * mConf;
 
+    /** @brief false once the early filter evaluation found that no filter can match, bodies are then not buffered */
+    bool mCaptureBodies;
+
     /**
      * @brief Constructs the object using the three strings.
      * @param id The query unique ID
@@ -189,9 +234,9 @@ struct RequestInfo {
     RequestInfo();
 
     /**
-     * reconstitute the list flat with no line break but with separator
+     * reconstitute the headers flat with no line break but with separator
      */
-    static std::string flatten(const tKeyValList &kvl, std::string sep = ": ");
+    static std::string flatten(const tHeaders &pHeaders, std::string sep = ": ");
     
     
     /**
@@ -234,6 +279,11 @@ struct RequestInfo {
     int getElapsedTimeMS() const;
 
 
+    /**
+     * @brief Returns the start time of the request
+     */
+    const boost::posix_time::ptime &getStartTime() const { return mStartTime; }
+
     /**
      * @brief Reset the startTime to NOW
      */
@@ -258,4 +308,59 @@ private:
 
 
 };
+
+/**
+ * @brief The request as sent to one destination
+ * The original request is shared by all the destinations and amplified copies and never modified,
+ * the fields rewritten by the substitutions of a destination are held aside as immutable buffers
+ * which the copies of the overlay share in turn
+ */
+class RequestOverlay {
+public:
+
+    /**
+     * @brief Overlay on a request owned by the caller, which must outlive the overlay
+     */
+    RequestOverlay(const RequestInfo &pBase);
+
+    /**
+     * @brief Overlay sharing the ownership of the request, it can be kept once the caller moved on
+     */
+    RequestOverlay(const boost::shared_ptr<const RequestInfo> &pBase);
+
+    /**
+     * @brief Returns the original request, for the fields which are never substituted
+     */
+    const RequestInfo &base() const { return *mBase; }
+
+    /** @brief The path, substituted or the original one */
+    const std::string &path() const { return mPath ? *mPath : mBase->mPath; }
+    /** @brief The query string, substituted or the original one */
+    const std::string &args() const { return mArgs ? *mArgs : mBase->mArgs; }
+    /** @brief The body, substituted or the original one */
+    const std::string &body() const { return mBody ? *mBody : mBase->mBody; }
+    /** @brief The headers of the incoming request, substituted or the original ones */
+    const tHeaders &headersIn() const { return mHeadersIn ? *mHeadersIn : mBase->mHeadersIn; }
+
+    void setPath(const std::string &pPath);
+    void setArgs(const std::string &pArgs);
+    void setBody(const std::string &pBody);
+    void setHeadersIn(const tHeaders &pHeadersIn);
+
+    /**
+     * @brief Copies the substituted fields into the given request
+     */
+    void apply(RequestInfo &pRequest) const;
+
+private:
+
+    const RequestInfo *mBase;
+    /** @brief Keeps the original request alive when the overlay outlives its caller */
+    boost::shared_ptr<const RequestInfo> mOwner;
+
+    boost::shared_ptr<const std::string> mPath;
+    boost::shared_ptr<const std::string> mArgs;
+    boost::shared_ptr<const std::string> mBody;
+    boost::shared_ptr<const tHeaders> mHeadersIn;
+};
 }
@@ -17,15 +17,14 @@
  */
 
 #include <boost/foreach.hpp>
-#include <boost/tokenizer.hpp>
 #include <boost/algorithm/string.hpp>
-#include <boost/algorithm/string/join.hpp>
 #include <boost/lexical_cast.hpp>
 
 #include <httpd.h>
 // Work-around boost::chrono 1.53 conflict on CR typedef vs define in apache
 #undef CR
 #include <iomanip>
+#include <limits>
 #include <set>
 
 using namespace std;
@@ -38,22 +37,34 @@ namespace DupModule {
 
 const char * gUserAgent = "mod-dup";
 
+/** @brief The headers a duplication sends besides the ones of the request, room is made for them at once */
+static const size_t cAddedHeaders = 8;
+static const size_t cAddedHeadersBytes = 256;
+
+/** @brief The maximum number of bytes of the body logged for a failed duplication by default */
+static const unsigned int cDefaultErrorLogMaxBody = 1024;
+
 static size_t
 getCurlResponseHeaderCallback(char *buffer, size_t size, size_t nitems, void *userp)
 {
 
-    std::map< std::string, std::string>* lresponseHeader = reinterpret_cast< std::map< std::string, std::string> *>(userp);
-    std::string lheaderLine(buffer);
+    tHeaders* lresponseHeader = reinterpret_cast<tHeaders *>(userp);
+    std::string lheaderLine(buffer, size * nitems);
 
     lheaderLine.erase(std::remove(lheaderLine.begin(), lheaderLine.end(), '\r'), lheaderLine.end());
 
-    string lheaderKey = lheaderLine.substr(0,lheaderLine.find(":"));
-    string lheaderValue = lheaderLine.substr(lheaderLine.find(":") + 1,string::npos);
+    // The status line and the empty line ending the headers have no colon
+    const size_t lColon = lheaderLine.find(":");
+    if (lColon == string::npos) {
+        return size * nitems;
+    }
+    string lheaderKey = lheaderLine.substr(0, lColon);
+    string lheaderValue = lheaderLine.substr(lColon + 1, string::npos);
 
     boost::algorithm::trim(lheaderKey);
     boost::algorithm::trim(lheaderValue);
 
-    (*lresponseHeader)[lheaderKey] = lheaderValue;
+    lresponseHeader->push_back(lheaderKey, lheaderValue);
 
     return size * nitems;
 }
@@ -65,6 +76,181 @@ size_t my_dummy_write(char *ptr, size_t size, size_t nmemb, void *userdata)
     return size * nmemb;
 }
 
+/**
+ * @brief Appends a part of a label, with its spaces, '=', '%' and control characters escaped as %XX
+ * so that the stats line stays a list of label=counters separated by spaces
+ */
+static void
+appendEscaped(std::string &pLabel, const std::string &pPart)
+{
+    static const char c_HEX[] = "0123456789ABCDEF";
+    for (std::string::const_iterator it = pPart.begin(); it != pPart.end(); ++it) {
+        const unsigned char c = *it;
+        if (c <= ' ' || c == '=' || c == '%' || c == 0x7f) {
+            pLabel.push_back('%');
+            pLabel.push_back(c_HEX[c >> 4]);
+            pLabel.push_back(c_HEX[c & 0xf]);
+        } else {
+            pLabel.push_back(c);
+        }
+    }
+}
+
+/**
+ * @brief Names a filter in the stats: "[!]<key or *>~<regex>@<destination>", ! marking the prevent filters, the parts escaped
+ */
+static std::string
+filterLabel(const tFilter &pFilter, const std::string &pKey)
+{
+    std::string lLabel(pFilter.mFilterType == tFilter::PREVENT_DUPLICATION ? "!" : "");
+    appendEscaped(lLabel, pKey);
+    lLabel += "~";
+    appendEscaped(lLabel, pFilter.mRegex.str());
+    lLabel += "@";
+    appendEscaped(lLabel, pFilter.mDestination);
+    return lLabel;
+}
+
+/** @brief The substitution buffers of each thread, workers and apache threads in synchronous mode */
+static boost::thread_specific_ptr<tSubstitutionScratch> gSubstitutionScratch;
+
+void
+tSubstitutionProgram::addKeyRule(const std::string &pKey, const tSubstitute &pRule) {
+    mKeyRules.insert(pKey, pRule);
+}
+
+void
+tSubstitutionProgram::addRawRule(const tSubstitute &pRule) {
+    mRawRules.push_back(pRule);
+}
+
+void
+tSubstitutionProgram::apply(const tSubstitute &pRule, std::string &pValue, std::string &pBuffer) {
+    pBuffer.clear();
+    boost::regex_replace(std::back_inserter(pBuffer), pValue.begin(), pValue.end(),
+                         pRule.mRegex, pRule.mReplacement, boost::match_default | boost::format_all);
+    pValue.swap(pBuffer);
+}
+
+void
+tSubstitutionProgram::apply(const std::vector<tSubstitute> &pRules, std::string &pValue, std::string &pBuffer) {
+    BOOST_FOREACH(const tSubstitute &lRule, pRules) {
+        apply(lRule, pValue, pBuffer);
+    }
+}
+
+void
+tSubstitutionProgram::apply(const tKeyIndex<tSubstitute>::tRange &pRules, std::string &pValue, std::string &pBuffer) {
+    for (tKeyIndex<tSubstitute>::const_iterator lRule = pRules.first; lRule != pRules.second; ++lRule) {
+        apply(lRule->second, pValue, pBuffer);
+    }
+}
+
+bool
+tSubstitutionProgram::runKeyRules(const std::string &pIn, const IUrlCodec &pCodec, tSubstitutionScratch &pScratch) const {
+    std::string &lOut = pScratch.mOut;
+    lOut.clear();
+    bool lDidSubstitute = false;
+
+    // Same splitting as RequestProcessor::parseArgs: empty tokens are dropped
+    std::string::size_type lStart = 0;
+    while (lStart <= pIn.size()) {
+        std::string::size_type lEnd = pIn.find('&', lStart);
+        if (lEnd == std::string::npos) {
+            lEnd = pIn.size();
+        }
+        if (lEnd > lStart) {
+            std::string::size_type lEqualPos = pIn.find('=', lStart);
+            if (lEqualPos > lEnd) {
+                lEqualPos = lEnd;
+            }
+            if (!lOut.empty()) {
+                lOut.push_back('&');
+            }
+            std::string::size_type lKeyPos = lOut.size();
+            lOut.append(pIn, lStart, lEqualPos - lStart);
+            std::transform(lOut.begin() + lKeyPos, lOut.end(), lOut.begin() + lKeyPos, ::toupper);
+
+            std::string::size_type lValPos = std::min(lEqualPos + 1, lEnd);
+            const tKeyIndex<tSubstitute>::tRange lRules = mKeyRules.equal_range(lOut.data() + lKeyPos, lOut.size() - lKeyPos);
+            if (lRules.first == lRules.second) {
+                // Untouched value, copied as it is
+                if (lEnd > lValPos) {
+                    lOut.push_back('=');
+                    lOut.append(pIn, lValPos, lEnd - lValPos);
+                }
+            } else {
+                std::string &lDecoded = pScratch.mDecoded;
+                lDecoded.clear();
+                pCodec.decodeTo(pIn.data() + lValPos, lEnd - lValPos, lDecoded);
+                pScratch.mValue = lDecoded;
+                apply(lRules, pScratch.mValue, pScratch.mBuffer);
+                lDidSubstitute = true;
+                LOG_DEBUG_IF_ENABLED("[DUP] Key substitute %s res: %s", lRules.first->first.c_str(), pScratch.mValue.c_str());
+                if (!pScratch.mValue.empty()) {
+                    lOut.push_back('=');
+                    if (pScratch.mValue == lDecoded) {
+                        lOut.append(pIn, lValPos, lEnd - lValPos);
+                    } else {
+                        pCodec.encodeTo(pScratch.mValue.data(), pScratch.mValue.size(), lOut);
+                    }
+                }
+            }
+        }
+        lStart = lEnd + 1;
+    }
+    return lDidSubstitute;
+}
+
+bool
+tSubstitutionProgram::run(const std::string &pIn, const IUrlCodec &pCodec, tSubstitutionScratch &pScratch) const {
+    bool lDidSubstitute = !mKeyRules.empty() && runKeyRules(pIn, pCodec, pScratch);
+    if (!mRawRules.empty()) {
+        if (!lDidSubstitute) {
+            pScratch.mOut = pIn;
+        }
+        apply(mRawRules, pScratch.mOut, pScratch.mBuffer);
+        lDidSubstitute = true;
+    }
+    return lDidSubstitute;
+}
+
+bool
+tSubstitutionProgram::matches(const tHeaders &pHeaders) const {
+    for (size_t i = 0; i < pHeaders.size(); ++i) {
+        const boost::string_ref lName = pHeaders.name(i);
+        const tKeyIndex<tSubstitute>::tRange lRules = mKeyRules.equal_range(lName.data(), lName.size());
+        if (lRules.first != lRules.second) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool
+tSubstitutionProgram::run(tHeaders &pHeaders, tSubstitutionScratch &pScratch) const {
+    bool lDidSubstitute = false;
+    for (size_t i = 0; i < pHeaders.size(); ++i) {
+        const boost::string_ref lName = pHeaders.name(i);
+        const tKeyIndex<tSubstitute>::tRange lRules = mKeyRules.equal_range(lName.data(), lName.size());
+        if (lRules.first != lRules.second) {
+            const boost::string_ref lValue = pHeaders.value(i);
+            pScratch.mValue.assign(lValue.data(), lValue.size());
+            apply(lRules, pScratch.mValue, pScratch.mBuffer);
+            pHeaders.setValue(i, pScratch.mValue);
+            lDidSubstitute = true;
+            LOG_DEBUG_IF_ENABLED("[DUP] Header substitute %s : %s ", pHeaders.name(i).to_string().c_str(), pScratch.mValue.c_str());
+        }
+    }
+    return lDidSubstitute;
+}
+
+bool
+Commands::hasSubstitutions() const {
+    return !mQueryStringSubstitutions.empty() || !mHeadersSubstitutions.empty() ||
+        !mBodySubstitutions.empty() || !mPathSubstitutions.empty();
+}
+
 unsigned int Commands::toDuplicateInt()
 {
     // round to the lower 100;
@@ -147,11 +333,13 @@ RequestProcessor::addFilter(const std::string &pField, const std::string &pFilte
         Log::error(405, "[DUP] DupFilter %s requires DupApplicationScope BODY|HEADERS|QUERY_STRING, incompatible with %d", pFilter.c_str(),pAssociatedConf.currentApplicationScope);
         throw std::exception();
     }
-    mCommands[&pAssociatedConf][pAssociatedConf.currentDupDestination].mFilters.insert(std::pair<std::string, tFilter>(boost::to_upper_copy(pField),
+    const std::string lKey = boost::to_upper_copy(pField);
+    tFilter &lFilter = mCommands[&pAssociatedConf][pAssociatedConf.currentDupDestination].mFilters.insert(lKey,
             tFilter(pFilter, pAssociatedConf.currentApplicationScope,
                     pAssociatedConf.currentDupDestination, pAssociatedConf.getCurrentDuplicationType(),
                     pAssociatedConf.errorLogBodyMatch,
-            fType)));
+            fType));
+    lFilter.mProfileIndex = mFilterProfiler.add(filterLabel(lFilter, lKey));
 }
 
 void
@@ -164,63 +352,132 @@ void
 RequestProcessor::addRawFilter(const std::string &pFilter,
         const DupConf &pAssociatedConf, tFilter::eFilterTypes fType) {
 
-    mCommands[&pAssociatedConf][pAssociatedConf.currentDupDestination].mRawFilters.push_back(tFilter(pFilter, pAssociatedConf.currentApplicationScope,
+    std::list<tFilter> &lRawFilters = mCommands[&pAssociatedConf][pAssociatedConf.currentDupDestination].mRawFilters;
+    lRawFilters.push_back(tFilter(pFilter, pAssociatedConf.currentApplicationScope,
             pAssociatedConf.currentDupDestination, pAssociatedConf.getCurrentDuplicationType(),
-            pAssociatedConf.errorLogBodyMatch,                                                                                         
+            pAssociatedConf.errorLogBodyMatch,
             fType));
+    lRawFilters.back().mProfileIndex = mFilterProfiler.add(filterLabel(lRawFilters.back(), "*"));
 }
 
 void
 RequestProcessor::addSubstitution(const std::string &pField, const std::string &pMatch,
         const std::string &pReplace,  const DupConf &pAssociatedConf) {
-    mCommands[&pAssociatedConf][pAssociatedConf.currentDupDestination].mSubstitutions[boost::to_upper_copy(pField)].push_back(tSubstitute(pMatch, pReplace,
-            pAssociatedConf.currentApplicationScope));
+    Commands &lCommands = mCommands[&pAssociatedConf][pAssociatedConf.currentDupDestination];
+    const tSubstitute lSubstitute(pMatch, pReplace, pAssociatedConf.currentApplicationScope);
+    const std::string lKey = boost::to_upper_copy(pField);
+    // Compiled into the program of each field in its scope
+    if (lSubstitute.mScope & ApplicationScope::QUERY_STRING) {
+        lCommands.mQueryStringSubstitutions.addKeyRule(lKey, lSubstitute);
+    }
+    if (lSubstitute.mScope & ApplicationScope::HEADERS) {
+        lCommands.mHeadersSubstitutions.addKeyRule(lKey, lSubstitute);
+    }
+    if (lSubstitute.mScope & ApplicationScope::BODY) {
+        lCommands.mBodySubstitutions.addKeyRule(lKey, lSubstitute);
+    }
 }
 
 void
 RequestProcessor::addRawSubstitution(const std::string &pRegex, const std::string &pReplace,
         const DupConf &pAssociatedConf){
-    mCommands[&pAssociatedConf][pAssociatedConf.currentDupDestination].mRawSubstitutions.push_back(tSubstitute(pRegex, pReplace,
-            pAssociatedConf.currentApplicationScope));
+    Commands &lCommands = mCommands[&pAssociatedConf][pAssociatedConf.currentDupDestination];
+    const tSubstitute lSubstitute(pRegex, pReplace, pAssociatedConf.currentApplicationScope);
+    if (lSubstitute.mScope & ApplicationScope::URL) {
+        lCommands.mPathSubstitutions.addRawRule(lSubstitute);
+    }
+    if (lSubstitute.mScope & ApplicationScope::BODY) {
+        lCommands.mBodySubstitutions.addRawRule(lSubstitute);
+    }
+    if (lSubstitute.mScope & ApplicationScope::QUERY_STRING) {
+        lCommands.mQueryStringSubstitutions.addRawRule(lSubstitute);
+    }
 }
 
 void
-RequestProcessor::parseArgs(std::list<tKeyVal> &pParsedArgs, const std::string &pArgs) {
-    const boost::char_separator<char> lSep("&");
-    boost::tokenizer<boost::char_separator<char> > lTokens(pArgs, lSep);
-    BOOST_FOREACH (const std::string &lToken, lTokens) {
-        size_t lEqualPos = lToken.find('=');
-        if (lEqualPos == std::string::npos) {
-            std::string lKey = boost::to_upper_copy(lToken);
-
-            pParsedArgs.push_back(tKeyVal(lKey, std::string()));
-        } else {
-            std::string lKey = lToken.substr(0, lEqualPos);
-            boost::to_upper(lKey);
-            std::string lVal = mUrlCodec->decode(lToken.substr(lEqualPos+1, std::string::npos));
-            pParsedArgs.push_back(tKeyVal(lKey, lVal));
+RequestProcessor::parseArgs(tArgSpans &pParsedArgs, const std::string &pArgs) {
+    pParsedArgs.clear();
+    // Empty tokens are dropped
+    std::string::size_type lStart = 0;
+    while (lStart < pArgs.size()) {
+        std::string::size_type lEnd = pArgs.find('&', lStart);
+        if (lEnd == std::string::npos) {
+            lEnd = pArgs.size();
+        }
+        if (lEnd > lStart) {
+            std::string::size_type lEqualPos = pArgs.find('=', lStart);
+            if (lEqualPos > lEnd) {
+                lEqualPos = lEnd;
+            }
+            const std::string::size_type lValPos = std::min(lEqualPos + 1, lEnd);
+            const tArgSpan lArg = {lStart, lEqualPos - lStart, lValPos, lEnd - lValPos};
+            pParsedArgs.push_back(lArg);
         }
+        lStart = lEnd + 1;
     }
 }
 
 const tFilter *
-RequestProcessor::keyFilterMatch(const tFiltersMap &pFilters, const tKeyValList &pParsedArgs,
-        ApplicationScope::eApplicationScope scope, tFilter::eFilterTypes fType){
-
-    BOOST_FOREACH (const tKeyVal &lKeyVal, pParsedArgs) {
-        // Key Iteration, case insensitive, because headers are and query string params can be
-        const auto & lFilterIter = pFilters.equal_range(lKeyVal.first);
-        // FilterIteration
-        for (auto it = lFilterIter.first; it != lFilterIter.second; ++it) {
-            if ((it->second.mScope & scope) &&                                  // Scope check
-                    it->second.mFilterType == fType) {                              // Filter type check
-                if (boost::regex_search(lKeyVal.second, it->second.mRegex)) {
+RequestProcessor::valueFilterMatch(const tFiltersMap::tRange &pFilters, const std::string &pValue,
+        ApplicationScope::eApplicationScope scope, tFilter::eFilterTypes fType,
+        bool pRecordMatch){
+    for (tFiltersMap::const_iterator it = pFilters.first; it != pFilters.second; ++it) {
+        if ((it->second.mScope & scope) &&                                  // Scope check
+                it->second.mFilterType == fType) {                              // Filter type check
+            // Only the evaluations deciding the duplication are profiled, not the early ones
+            if (pRecordMatch ? searchFilter(it->second, pValue) : boost::regex_search(pValue, it->second.mRegex)) {
+                if (pRecordMatch) {
                     it->second.mMatch = it->second.mRegex.str();
-                    return &it->second;
                 }
+                return &it->second;
             }
         }
     }
+    return NULL;
+}
+
+const tFilter *
+RequestProcessor::keyFilterMatch(const tFiltersMap &pFilters, const tHeaders &pHeaders,
+        ApplicationScope::eApplicationScope scope, tFilter::eFilterTypes fType,
+        bool pRecordMatch){
+
+    // Reused from a header to the next
+    std::string lValue;
+    for (size_t i = 0; i < pHeaders.size(); ++i) {
+        // Key Iteration, case insensitive, because headers are
+        const boost::string_ref lName = pHeaders.name(i);
+        const tFiltersMap::tRange lFilters = pFilters.equal_range(lName.data(), lName.size());
+        if (lFilters.first == lFilters.second) {
+            continue;
+        }
+        const boost::string_ref lHeaderValue = pHeaders.value(i);
+        lValue.assign(lHeaderValue.data(), lHeaderValue.size());
+        if (const tFilter *lMatched = valueFilterMatch(lFilters, lValue, scope, fType, pRecordMatch)) {
+            return lMatched;
+        }
+    }
+    // No matching
+    return NULL;
+}
+
+const tFilter *
+RequestProcessor::keyFilterMatch(const tFiltersMap &pFilters, const std::string &pArgs, const tArgSpans &pParsedArgs,
+        ApplicationScope::eApplicationScope scope, tFilter::eFilterTypes fType,
+        bool pRecordMatch){
+
+    // Reused from an argument to the next
+    std::string lValue;
+    BOOST_FOREACH (const tArgSpan &lArg, pParsedArgs) {
+        const tFiltersMap::tRange lFilters = pFilters.equal_range(pArgs.data() + lArg.mKey, lArg.mKeySize);
+        if (lFilters.first == lFilters.second) {
+            continue;
+        }
+        lValue.clear();
+        mUrlCodec->decodeTo(pArgs.data() + lArg.mValue, lArg.mValueSize, lValue);
+        if (const tFilter *lMatched = valueFilterMatch(lFilters, lValue, scope, fType, pRecordMatch)) {
+            return lMatched;
+        }
+    }
     // No matching
     return NULL;
 }
@@ -250,62 +507,68 @@ RequestProcessor::matchesFilter(RequestInfo &pRequest, const Commands &pCommands
     applicationOnMap(pFilters, keyFilterOnQS, keyFilterOnHeader, keyFilterOnBody);
 
     // Prevent Filtering check on QUERY_STRING
-    if (keyFilterOnQS && keyFilterMatch(pFilters, pRequest.mParsedArgs, ApplicationScope::QUERY_STRING, tFilter::PREVENT_DUPLICATION)) {
-        Log::info(0, "[DUP] PREVENT Filter on QUERY_STRING match");
+    if (keyFilterOnQS && keyFilterMatch(pFilters, pRequest.mArgs, pRequest.mParsedArgs, ApplicationScope::QUERY_STRING, tFilter::PREVENT_DUPLICATION)) {
+        LOG_INFO_IF_ENABLED(0, "[DUP] PREVENT Filter on QUERY_STRING match");
         return NULL;
     }
     // Prevent Filtering check on HEADER
     if (keyFilterOnHeader && keyFilterMatch(pFilters, pRequest.mHeadersIn, ApplicationScope::HEADERS, tFilter::PREVENT_DUPLICATION)) {
-        Log::info(0, "[DUP] PREVENT Filter on HEADERS match");
+        LOG_INFO_IF_ENABLED(0, "[DUP] PREVENT Filter on HEADERS match");
         return NULL;
     }
     
-    tKeyValList lParsedArgs;
+    tArgSpans lParsedArgs;
 
     // Prevent Filtering check on BODY
     if (keyFilterOnBody){
         parseArgs(lParsedArgs, pRequest.mBody);
-        if ((matched = keyFilterMatch(pFilters, lParsedArgs, ApplicationScope::BODY, tFilter::PREVENT_DUPLICATION))) {
-            Log::info(0, "[DUP] PREVENT Filter on BODY match");
+        if ((matched = keyFilterMatch(pFilters, pRequest.mBody, lParsedArgs, ApplicationScope::BODY, tFilter::PREVENT_DUPLICATION))) {
+            LOG_INFO_IF_ENABLED(0, "[DUP] PREVENT Filter on BODY match");
             return NULL;
         }
     }
 
+    // Flattened once for all the raw filters on headers, the matches point into it
+    std::string lFlatHeaders;
+
     // Raw filters prevent analyse
     for (const tFilter &raw : pCommands.mRawFilters) {
         if (raw.mFilterType == tFilter::PREVENT_DUPLICATION) {
             // Http Method application
             if (raw.mScope & ApplicationScope::METHOD) {
-                if (boost::regex_search(pRequest.mMethod, raw.mRegex)) {
-                    Log::info(0, "[DUP] Prevent Raw filter (METHOD) matched: %s | %s", raw.mMatch.c_str(), raw.mRegex.str().c_str());
+                if (searchFilter(raw, pRequest.mMethod)) {
+                    LOG_INFO_IF_ENABLED(0, "[DUP] Prevent Raw filter (METHOD) matched: %s | %s", raw.mMatch.c_str(), raw.mRegex.str().c_str());
                     return NULL;
                 }
             }
             // Path application
             if (raw.mScope & ApplicationScope::PATH) {
-                if (boost::regex_search(pRequest.mPath, raw.mRegex)) {
-                    Log::info(0, "[DUP] Prevent Raw filter (PATH) matched: %s | %s", raw.mMatch.c_str(), raw.mRegex.str().c_str());
+                if (searchFilter(raw, pRequest.mPath)) {
+                    LOG_INFO_IF_ENABLED(0, "[DUP] Prevent Raw filter (PATH) matched: %s | %s", raw.mMatch.c_str(), raw.mRegex.str().c_str());
                     return NULL;
                 }
             }
             // Header applications
             if (raw.mScope & ApplicationScope::QUERY_STRING) {
-                if (boost::regex_search(pRequest.mArgs, raw.mRegex)) {
-                    Log::info(0, "[DUP] Prevent Raw filter (QUERY_STRING) matched: %s | %s", raw.mMatch.c_str(), raw.mRegex.str().c_str());
+                if (searchFilter(raw, pRequest.mArgs)) {
+                    LOG_INFO_IF_ENABLED(0, "[DUP] Prevent Raw filter (QUERY_STRING) matched: %s | %s", raw.mMatch.c_str(), raw.mRegex.str().c_str());
                     return NULL;
                 }
             }
             // Header applications
             if (raw.mScope & ApplicationScope::HEADERS) {
-                if (boost::regex_search(RequestInfo::flatten(pRequest.mHeadersIn), raw.mRegex)) {
-                    Log::info(0, "[DUP] Prevent Raw filter (HEADER) matched: %s | %s", raw.mMatch.c_str(), raw.mRegex.str().c_str());
+                if (lFlatHeaders.empty()) {
+                    lFlatHeaders = RequestInfo::flatten(pRequest.mHeadersIn);
+                }
+                if (searchFilter(raw, lFlatHeaders)) {
+                    LOG_INFO_IF_ENABLED(0, "[DUP] Prevent Raw filter (HEADER) matched: %s | %s", raw.mMatch.c_str(), raw.mRegex.str().c_str());
                     return NULL;
                 }
             }
             // Body application
             if (raw.mScope & ApplicationScope::BODY) {
-                if (boost::regex_search(pRequest.mBody, raw.mRegex)) {
-                    Log::info(0, "[DUP] Prevent Raw filter (BODY) matched: %s | %s", raw.mMatch.c_str(), raw.mRegex.str().c_str());
+                if (searchFilter(raw, pRequest.mBody)) {
+                    LOG_INFO_IF_ENABLED(0, "[DUP] Prevent Raw filter (BODY) matched: %s | %s", raw.mMatch.c_str(), raw.mRegex.str().c_str());
                     return NULL;
                 }
             }
@@ -313,196 +576,274 @@ RequestProcessor::matchesFilter(RequestInfo &pRequest, const Commands &pCommands
     }
 
     // Key filters on query string
-    if (keyFilterOnQS && (matched = keyFilterMatch(pFilters, pRequest.mParsedArgs, ApplicationScope::QUERY_STRING, tFilter::REGULAR))){
-        Log::info(0, "[DUP] Filter on QUERY_STRING match");
+    if (keyFilterOnQS && (matched = keyFilterMatch(pFilters, pRequest.mArgs, pRequest.mParsedArgs, ApplicationScope::QUERY_STRING, tFilter::REGULAR))){
+        LOG_INFO_IF_ENABLED(0, "[DUP] Filter on QUERY_STRING match");
         return matched;
     }
 
     // Key filters on header
     if (keyFilterOnHeader && (matched = keyFilterMatch(pFilters, pRequest.mHeadersIn, ApplicationScope::HEADERS, tFilter::REGULAR))){
-        Log::info(0, "[DUP] Filter on HEADERS match");
+        LOG_INFO_IF_ENABLED(0, "[DUP] Filter on HEADERS match");
         return matched;
     }
     
     // Key filters on body
     if (keyFilterOnBody){
-        if ((matched = keyFilterMatch(pFilters, lParsedArgs, ApplicationScope::BODY, tFilter::REGULAR))) {
-            Log::info(0, "[DUP] Filter on BODY match");
+        if ((matched = keyFilterMatch(pFilters, pRequest.mBody, lParsedArgs, ApplicationScope::BODY, tFilter::REGULAR))) {
+            LOG_INFO_IF_ENABLED(0, "[DUP] Filter on BODY match");
             return matched;
         }
     }
 
-    // Raw filters matching
-    for (const tFilter &raw : pCommands.mRawFilters) {
-        if (raw.mFilterType != tFilter::PREVENT_DUPLICATION) {
-            boost::smatch what;
-            // Http Method application
-            if (raw.mScope & ApplicationScope::METHOD) {
-                if (boost::regex_search(pRequest.mMethod, what, raw.mRegex)) {
-                    raw.mMatch = what[ 0 ];
-                    Log::info(0, "[DUP] Raw filter (PATH) matched: %s | %s", raw.mMatch.c_str(), raw.mRegex.str().c_str());
-                    return &raw;
-                }
-            }
-            // Path application
-            if (raw.mScope & ApplicationScope::PATH) {
-                if (boost::regex_search(pRequest.mPath, what, raw.mRegex)) {
-                    raw.mMatch = what[ 0 ];
-                    Log::info(0, "[DUP] Raw filter (PATH) matched: %s | %s", raw.mMatch.c_str(), raw.mRegex.str().c_str());
-                    return &raw;
-                }
-            }
-            // Header application
-            if (raw.mScope & ApplicationScope::QUERY_STRING) {
-                if (boost::regex_search(pRequest.mArgs, what, raw.mRegex)) {
-                    raw.mMatch = what[ 0 ];
-                    Log::info(0, "[DUP] Raw filter (QUERY_STRING) matched: %s | %s", raw.mMatch.c_str(), raw.mRegex.str().c_str());
-                    return &raw;
-                }
-            }
-            // Header application
-            if (raw.mScope & ApplicationScope::HEADERS) {
-                if (boost::regex_search(RequestInfo::flatten(pRequest.mHeadersIn), what, raw.mRegex)) {
-                    raw.mMatch = what[ 0 ];
-                    Log::info(0, "[DUP] Raw filter (HEADER) matched: %s | %s", raw.mMatch.c_str(), raw.mRegex.str().c_str());
-                    return &raw;
-                }
+    // Raw filters matching, in the order of their cost and selectivity with DupReorderFilters once computed by the manager of the pool
+    // The requests logging their duplication keep the configuration order, for the matched pattern to be predictable
+    boost::shared_ptr<const std::vector<const tFilter *> > lOrder;
+    if (pRequest.mConf && static_cast<const DupConf *>(pRequest.mConf)->reorderFilters && !pRequest.mValidationHeaderDup) {
+        lOrder = boost::atomic_load(&pCommands.mRawFilterOrder);
+    }
+    if (lOrder) {
+        for (const tFilter *raw : *lOrder) {
+            if (matchesRawFilter(*raw, pRequest, lFlatHeaders)) {
+                return raw;
             }
-            // Body application
-            if (raw.mScope & ApplicationScope::BODY) {
-                if (boost::regex_search(pRequest.mBody, what, raw.mRegex)) {
-                    raw.mMatch = what[ 0 ];
-                    Log::info(0, "[DUP] Raw filter (BODY) matched: %s | %s", raw.mMatch.c_str(), raw.mRegex.str().c_str());
-                    return &raw;
-                }
+        }
+    } else {
+        for (const tFilter &raw : pCommands.mRawFilters) {
+            if (raw.mFilterType != tFilter::PREVENT_DUPLICATION && matchesRawFilter(raw, pRequest, lFlatHeaders)) {
+                return &raw;
             }
         }
     }
-    Log::info(0, "No Filter matched for duplication -> no duplication for %s?%s", pRequest.mPath.c_str(), pRequest.mArgs.c_str());
+    LOG_INFO_IF_ENABLED(0, "No Filter matched for duplication -> no duplication for %s?%s", pRequest.mPath.c_str(), pRequest.mArgs.c_str());
     return NULL;
 }
 
 bool
-RequestProcessor::keySubstitute(tFieldSubstitutionMap &pSubs,
-        tKeyValList &pParsedArgs,
-        ApplicationScope::eApplicationScope scope,
-        std::string &result){
-    apr_pool_t *lPool = NULL;
-    apr_pool_create(&lPool, 0);
-
-    std::list<std::string> lNewArgs;
-    bool lDidSubstitute = false;
+RequestProcessor::matchesRawFilter(const tFilter &pFilter, const RequestInfo &pRequest, std::string &pFlatHeaders) {
+    boost::smatch what;
+    // Http Method application
+    if (pFilter.mScope & ApplicationScope::METHOD) {
+        if (searchFilter(pFilter, pRequest.mMethod, &what)) {
+            pFilter.mMatch = what[ 0 ];
+            LOG_INFO_IF_ENABLED(0, "[DUP] Raw filter (METHOD) matched: %s | %s", pFilter.mMatch.c_str(), pFilter.mRegex.str().c_str());
+            return true;
+        }
+    }
+    // Path application
+    if (pFilter.mScope & ApplicationScope::PATH) {
+        if (searchFilter(pFilter, pRequest.mPath, &what)) {
+            pFilter.mMatch = what[ 0 ];
+            LOG_INFO_IF_ENABLED(0, "[DUP] Raw filter (PATH) matched: %s | %s", pFilter.mMatch.c_str(), pFilter.mRegex.str().c_str());
+            return true;
+        }
+    }
+    // Header application
+    if (pFilter.mScope & ApplicationScope::QUERY_STRING) {
+        if (searchFilter(pFilter, pRequest.mArgs, &what)) {
+            pFilter.mMatch = what[ 0 ];
+            LOG_INFO_IF_ENABLED(0, "[DUP] Raw filter (QUERY_STRING) matched: %s | %s", pFilter.mMatch.c_str(), pFilter.mRegex.str().c_str());
+            return true;
+        }
+    }
+    // Header application
+    if (pFilter.mScope & ApplicationScope::HEADERS) {
+        if (pFlatHeaders.empty()) {
+            pFlatHeaders = RequestInfo::flatten(pRequest.mHeadersIn);
+        }
+        if (searchFilter(pFilter, pFlatHeaders, &what)) {
+            pFilter.mMatch = what[ 0 ];
+            LOG_INFO_IF_ENABLED(0, "[DUP] Raw filter (HEADER) matched: %s | %s", pFilter.mMatch.c_str(), pFilter.mRegex.str().c_str());
+            return true;
+        }
+    }
+    // Body application
+    if (pFilter.mScope & ApplicationScope::BODY) {
+        if (searchFilter(pFilter, pRequest.mBody, &what)) {
+            pFilter.mMatch = what[ 0 ];
+            LOG_INFO_IF_ENABLED(0, "[DUP] Raw filter (BODY) matched: %s | %s", pFilter.mMatch.c_str(), pFilter.mRegex.str().c_str());
+            return true;
+        }
+    }
+    return false;
+}
 
-    // Run through the keys
-    BOOST_FOREACH (const tKeyVal &lKeyVal, pParsedArgs) {
-        std::map<std::string, std::list<tSubstitute> >::iterator lSubstIter = pSubs.find(lKeyVal.first);
-        std::string lVal = lKeyVal.second;
+namespace {
 
-        // Key found in the subs?
-        if (lSubstIter != pSubs.end()) {
-            BOOST_FOREACH(const tSubstitute &lSubst, lSubstIter->second) {
-                Log::debug("[DUP] Key substitute: %d | lVal:%s | lSubst:%s | Rep:%s", (int) lSubst.mScope, lVal.c_str(),
-                        lSubst.mRegex.str().c_str(), lSubst.mReplacement.c_str());
-                if (!(scope & lSubst.mScope))
-                    continue;
+/** @brief A REGULAR raw filter with what orders it */
+struct tRankedFilter {
+    const tFilter *mFilter;
+    /** @brief The index of the run of consecutive filters of the same duplication type */
+    unsigned mRun;
+    /** @brief The expected cost of the filter per match, 0 if not evaluated */
+    double mScore;
 
-                lVal = boost::regex_replace(lVal, lSubst.mRegex, lSubst.mReplacement, boost::match_default | boost::format_all);
-                lDidSubstitute = true;
-                Log::debug("[DUP] Key substitute res: lVal:%s ", lVal.c_str());
+    bool operator<(const tRankedFilter &pOther) const {
+        return mRun < pOther.mRun || (mRun == pOther.mRun && mScore < pOther.mScore);
+    }
+};
 
-            }
+}
+
+boost::shared_ptr<const std::vector<const tFilter *> >
+RequestProcessor::computeRawFilterOrder(const Commands &pCommands) {
+    std::vector<tRankedFilter> lRanked;
+    for (const tFilter &raw : pCommands.mRawFilters) {
+        if (raw.mFilterType == tFilter::PREVENT_DUPLICATION) {
+            continue;
         }
-        if (lVal.empty()) {
-            lNewArgs.push_back(lKeyVal.first);
-        } else {
-            lNewArgs.push_back(lKeyVal.first + "=" + mUrlCodec->encode(lPool, lVal));
+        tRankedFilter lFilter = { &raw, 0, 0 };
+        if (!lRanked.empty()) {
+            lFilter.mRun = lRanked.back().mRun + (lRanked.back().mFilter->mDuplicationType != raw.mDuplicationType);
+        }
+        if (raw.mProfileIndex < mFilterRates.size()) {
+            const tDecayedFilterCounters &lCounters = mFilterRates[raw.mProfileIndex];
+            if (lCounters.mEvaluations > 0) {
+                // The filters are tried until one matches: the cheapest per match go first
+                // The match rate is smoothed so that the filters which never matched keep a finite score
+                const double lCost = lCounters.mNs / lCounters.mEvaluations;
+                const double lMatchRate = (lCounters.mMatches + 1.0) / (lCounters.mEvaluations + 2.0);
+                lFilter.mScore = lCost / lMatchRate;
+            }
         }
+        lRanked.push_back(lFilter);
     }
-    if (lDidSubstitute) {
-        result = boost::algorithm::join(lNewArgs, "&");
+    // Stable to keep the configuration order of the filters ranked the same
+    std::stable_sort(lRanked.begin(), lRanked.end());
+
+    boost::shared_ptr<std::vector<const tFilter *> > lOrder(new std::vector<const tFilter *>());
+    lOrder->reserve(lRanked.size());
+    BOOST_FOREACH(const tRankedFilter &lFilter, lRanked) {
+        lOrder->push_back(lFilter.mFilter);
     }
-    apr_pool_destroy(lPool);
-    return lDidSubstitute;
+    return lOrder;
 }
 
 bool
-RequestProcessor::headerSubstitute(tFieldSubstitutionMap &pSubs,
-        tKeyValList &pHeadersIn){
+RequestProcessor::mayMatchFilters(const RequestInfo &pRequest, bool pStatusKnown) {
 
-    bool lDidSubstitute = false;
+    const auto & it = mCommands.find(pRequest.mConf);
+    if (it == mCommands.end()) {
+        return false;
+    }
 
-    // Run through the keys
-    BOOST_FOREACH (tKeyVal &lKeyVal, pHeadersIn) {
-        std::map<std::string, std::list<tSubstitute> >::iterator lSubstIter = pSubs.find(lKeyVal.first);
-        // Key found in the subs?
-        if (lSubstIter != pSubs.end()) {
-            BOOST_FOREACH(const tSubstitute &lSubst, lSubstIter->second) {
-                Log::debug("Key substitute: %d | KeyVal:%s | lSubst:%s | Rep:%s", (int) lSubst.mScope, lKeyVal.second.c_str(),
-                        lSubst.mRegex.str().c_str(), lSubst.mReplacement.c_str());
-                if (!(ApplicationScope::HEADERS & lSubst.mScope))
-                    continue;
-
-                lKeyVal.second = boost::regex_replace(lKeyVal.second, lSubst.mRegex, lSubst.mReplacement, boost::match_default | boost::format_all);
-                lDidSubstitute = true;
+    tArgSpans lParsedArgs;
+    parseArgs(lParsedArgs, pRequest.mArgs);
+    std::string lFlatHeaders;
+
+    for ( const auto & itb : it->second ) {
+        const Commands &lCommands = itb.second;
+        bool lPrevented = false;
+
+        // A prevent filter matching on what is already known excludes this destination, whatever the body
+        if (keyFilterMatch(lCommands.mFilters, pRequest.mArgs, lParsedArgs, ApplicationScope::QUERY_STRING, tFilter::PREVENT_DUPLICATION, false) ||
+            keyFilterMatch(lCommands.mFilters, pRequest.mHeadersIn, ApplicationScope::HEADERS, tFilter::PREVENT_DUPLICATION, false)) {
+            continue;
+        }
+        for (const tFilter &raw : lCommands.mRawFilters) {
+            if (raw.mFilterType != tFilter::PREVENT_DUPLICATION) {
+                continue;
+            }
+            if (((raw.mScope & ApplicationScope::METHOD) && boost::regex_search(pRequest.mMethod, raw.mRegex)) ||
+                ((raw.mScope & ApplicationScope::PATH) && boost::regex_search(pRequest.mPath, raw.mRegex)) ||
+                ((raw.mScope & ApplicationScope::QUERY_STRING) && boost::regex_search(pRequest.mArgs, raw.mRegex))) {
+                lPrevented = true;
+                break;
+            }
+            if (raw.mScope & ApplicationScope::HEADERS) {
+                if (lFlatHeaders.empty()) {
+                    lFlatHeaders = RequestInfo::flatten(pRequest.mHeadersIn);
+                }
+                if (boost::regex_search(lFlatHeaders, raw.mRegex)) {
+                    lPrevented = true;
+                    break;
+                }
+            }
+        }
+        if (lPrevented) {
+            continue;
+        }
+
+        // Regular filters which cannot be decided yet
+        for (const auto & f : lCommands.mFilters) {
+            if (f.second.mFilterType == tFilter::REGULAR &&
+                ((f.second.mScope & ApplicationScope::BODY) ||
+                 (!pStatusKnown && (f.second.mScope & ApplicationScope::HEADERS) && f.first == "X_DUP_HTTP_STATUS"))) {
+                return true;
+            }
+        }
+        for (const tFilter &raw : lCommands.mRawFilters) {
+            if (raw.mFilterType == tFilter::REGULAR &&
+                ((raw.mScope & ApplicationScope::BODY) ||
+                 (!pStatusKnown && (raw.mScope & ApplicationScope::HEADERS)))) {
+                return true;
+            }
+        }
+
+        // Regular filters on what is already known
+        if (keyFilterMatch(lCommands.mFilters, pRequest.mArgs, lParsedArgs, ApplicationScope::QUERY_STRING, tFilter::REGULAR, false) ||
+            keyFilterMatch(lCommands.mFilters, pRequest.mHeadersIn, ApplicationScope::HEADERS, tFilter::REGULAR, false)) {
+            return true;
+        }
+        for (const tFilter &raw : lCommands.mRawFilters) {
+            if (raw.mFilterType != tFilter::REGULAR) {
+                continue;
+            }
+            if (((raw.mScope & ApplicationScope::METHOD) && boost::regex_search(pRequest.mMethod, raw.mRegex)) ||
+                ((raw.mScope & ApplicationScope::PATH) && boost::regex_search(pRequest.mPath, raw.mRegex)) ||
+                ((raw.mScope & ApplicationScope::QUERY_STRING) && boost::regex_search(pRequest.mArgs, raw.mRegex))) {
+                return true;
+            }
+            if (raw.mScope & ApplicationScope::HEADERS) {
+                if (lFlatHeaders.empty()) {
+                    lFlatHeaders = RequestInfo::flatten(pRequest.mHeadersIn);
+                }
+                if (boost::regex_search(lFlatHeaders, raw.mRegex)) {
+                    return true;
+                }
             }
-            Log::debug("[DUP] Header substitute %s : %s ", lKeyVal.first.c_str(), lKeyVal.second.c_str());
         }
     }
-    return lDidSubstitute;
+    LOG_DEBUG_IF_ENABLED("[DUP] No filter can match %s?%s, bodies not captured", pRequest.mPath.c_str(), pRequest.mArgs.c_str());
+    return false;
 }
 
 bool
 RequestProcessor::substituteRequest(RequestInfo &pRequest, Commands &pCommands) {
-    // Ideally we would use the pool from the apache request, but it's used in another thread
+    RequestOverlay lOverlay(pRequest);
+    bool lDidSubstitute = substituteRequest(lOverlay, pCommands);
+    lOverlay.apply(pRequest);
+    return lDidSubstitute;
+}
 
-    bool keySubOnBody, keySubOnHeader, keySubOnQs;
-    keySubOnBody = keySubOnHeader = keySubOnQs = false;
-    // Detect the presence of the different key filters
-    typedef std::pair<const std::string, std::list<tSubstitute> > value_type;
-    BOOST_FOREACH(value_type &f, pCommands.mSubstitutions) {
-        BOOST_FOREACH(tSubstitute &s, f.second) {
-            if (s.mScope & ApplicationScope::BODY)
-                keySubOnBody = true;
-            if (s.mScope & ApplicationScope::QUERY_STRING)
-                keySubOnQs = true;
-            if (s.mScope & ApplicationScope::HEADERS)
-                keySubOnHeader = true;
-        }
+bool
+RequestProcessor::substituteRequest(RequestOverlay &pRequest, Commands &pCommands) {
+    // The buffers and the pool of this thread, the apache pool of the request is used in another thread
+    if (!gSubstitutionScratch.get()) {
+        gSubstitutionScratch.reset(new tSubstitutionScratch());
     }
+    tSubstitutionScratch &lScratch = *gSubstitutionScratch;
 
+    // The original request is left untouched, the rewritten fields are set on the overlay
     bool lDidSubstitute = false;
-    // Perform the key substitutions
-    if (keySubOnQs) {
-        // On the header
-        lDidSubstitute = keySubstitute(pCommands.mSubstitutions,
-                pRequest.mParsedArgs,
-                ApplicationScope::QUERY_STRING,
-                pRequest.mArgs);
-    }
-    if (keySubOnHeader) {
-        lDidSubstitute |= headerSubstitute(pCommands.mSubstitutions,
-                                           pRequest.mHeadersIn);
-    }
-    if (keySubOnBody) {
-        // On the body
-        std::list<tKeyVal> lParsedArgs;
-        parseArgs(lParsedArgs, pRequest.mBody);
-        lDidSubstitute |= keySubstitute(pCommands.mSubstitutions,
-                lParsedArgs,
-                ApplicationScope::BODY,
-                pRequest.mBody);
+    if (!pCommands.mQueryStringSubstitutions.empty() &&
+        pCommands.mQueryStringSubstitutions.run(pRequest.args(), *mUrlCodec, lScratch)) {
+        pRequest.setArgs(lScratch.mOut);
+        lDidSubstitute = true;
     }
-    // Run the raw substitutions
-    BOOST_FOREACH(const tSubstitute &s, pCommands.mRawSubstitutions) {
-        if (s.mScope & ApplicationScope::URL) {
-            pRequest.mPath = boost::regex_replace(pRequest.mPath, s.mRegex, s.mReplacement, boost::match_default | boost::format_all);
-        }
-        if (s.mScope & ApplicationScope::BODY) {
-            pRequest.mBody = boost::regex_replace(pRequest.mBody, s.mRegex, s.mReplacement, boost::match_default | boost::format_all);
-        }
-        if (s.mScope & ApplicationScope::QUERY_STRING) {
-            pRequest.mArgs = boost::regex_replace(pRequest.mArgs, s.mRegex, s.mReplacement, boost::match_default | boost::format_all);
-        }
+    if (pCommands.mHeadersSubstitutions.matches(pRequest.headersIn())) {
+        tHeaders lHeadersIn(pRequest.headersIn());
+        pCommands.mHeadersSubstitutions.run(lHeadersIn, lScratch);
+        pRequest.setHeadersIn(lHeadersIn);
+        lDidSubstitute = true;
+    }
+    if (!pCommands.mBodySubstitutions.empty() &&
+        pCommands.mBodySubstitutions.run(pRequest.body(), *mUrlCodec, lScratch)) {
+        pRequest.setBody(lScratch.mOut);
+        lDidSubstitute = true;
+    }
+    if (!pCommands.mPathSubstitutions.empty() &&
+        pCommands.mPathSubstitutions.run(pRequest.path(), *mUrlCodec, lScratch)) {
+        pRequest.setPath(lScratch.mOut);
         lDidSubstitute = true;
     }
     return lDidSubstitute;
@@ -524,7 +865,7 @@ RequestProcessor::processRequest(RequestInfo &pRequest) {
     int filtersAttempted = 0;
     // For each duplication destination
     for ( const auto & itb : lCommands ) {
-        Log::debug("[DUP] Duplication tested for destination: %s", itb.first.c_str() );
+        LOG_DEBUG_IF_ENABLED("[DUP] Duplication tested for destination: %s", itb.first.c_str() );
         // Tests if at least one active filter matches on this duplication location
         const tFilter* matchedFilter = NULL;
         if ((matchedFilter = matchesFilter(pRequest, itb.second))) {
@@ -539,10 +880,305 @@ RequestProcessor::processRequest(RequestInfo &pRequest) {
 
 RequestProcessor::RequestProcessor() :
             mTimeout(0), mTimeoutCount(0),
-            mDuplicatedCount(0) {
+            mDuplicatedCount(0),
+            mRetryThread(NULL),
+            mMaxConcurrentSends(1),
+            mMaxConcurrentSendsPerDestination(1),
+            mBatchSize(1),
+            mErrorLogMaxBody(cDefaultErrorLogMaxBody),
+            mErrorLogSampling(1),
+            mLoadTicks(0),
+            mResolve(NULL) {
+    std::fill(mDropsByPriority, mDropsByPriority + QueuePriority::NB_PRIORITIES, 0);
+    std::fill(mDropsByReason, mDropsByReason + DropReason::NB_REASONS, 0);
     setUrlCodec();
 }
 
+RequestProcessor::~RequestProcessor() {
+    stopRetries();
+    clearResolve();
+}
+
+void
+RequestProcessor::setRetries(unsigned pMaxAttempts, unsigned pDeadline, unsigned pBaseDelay) {
+    mRetryQueue.setRetries(pMaxAttempts, pDeadline, pBaseDelay);
+}
+
+void
+RequestProcessor::setRetryShare(unsigned pPercentage) {
+    mRetryQueue.setShare(pPercentage);
+}
+
+void
+RequestProcessor::setConcurrentSends(unsigned pMaxSends, unsigned pMaxSendsPerDestination) {
+    mMaxConcurrentSends = pMaxSends;
+    mMaxConcurrentSendsPerDestination = pMaxSendsPerDestination;
+}
+
+void
+RequestProcessor::setBatchSize(unsigned pBatchSize) {
+    mBatchSize = pBatchSize;
+}
+
+void
+RequestProcessor::startRetries() {
+    if (mRetryQueue.isEnabled() && !mRetryThread) {
+        mRetryThread = new boost::thread(boost::bind(&RequestProcessor::runRetries, this));
+    }
+}
+
+void
+RequestProcessor::stopRetries() {
+    mRetryQueue.stop();
+    if (mRetryThread) {
+        mRetryThread->join();
+        delete mRetryThread;
+        mRetryThread = NULL;
+    }
+}
+
+const std::string
+RequestProcessor::getRetryCounts() {
+    unsigned lScheduled, lAbandoned;
+    mRetryQueue.getCounters(lScheduled, lAbandoned);
+    if (lAbandoned > 0) {
+        Log::warn(304, "[DUP] %u failed duplications were abandoned during last cycle!", lAbandoned);
+    }
+    return boost::lexical_cast<std::string>(lScheduled) + "/" + boost::lexical_cast<std::string>(lAbandoned);
+}
+
+QueuePriority::eQueuePriority
+RequestProcessor::queuePriority(const boost::shared_ptr<RequestInfo> &pRequest) {
+    if (pRequest->mValidationHeaderDup) {
+        return QueuePriority::PROTECTED;
+    }
+    if (!pRequest->mConf) {
+        return QueuePriority::NORMAL;
+    }
+    return static_cast<const DupConf *>(pRequest->mConf)->getPriority();
+}
+
+void
+RequestProcessor::dropped(const boost::shared_ptr<RequestInfo> &pRequest, DropReason::eDropReason pReason) {
+    __sync_fetch_and_add(&mDropsByPriority[queuePriority(pRequest)], 1);
+    __sync_fetch_and_add(&mDropsByReason[pReason], 1);
+    mScoreboard.count(ScoreboardCounter::DROPPED);
+    mScoreboard.countDrop(pReason == DropReason::EVICTED ? ScoreboardDrop::EVICTED : ScoreboardDrop::REFUSED);
+    // The filters are not run on dropped requests: counted once for their location, not for a destination
+    const DupConf *lConf = static_cast<const DupConf *>(pRequest->mConf);
+    if (!lConf || !lConf->dirName) {
+        return;
+    }
+    boost::lock_guard<boost::mutex> lLock(mDropsMutex);
+    ++mDropsByLocation[lConf->dirName];
+}
+
+size_t
+RequestProcessor::queuedSize(const boost::shared_ptr<RequestInfo> &pRequest) {
+    size_t lSize = sizeof(RequestInfo) + pRequest->mPath.size() + pRequest->mArgs.size() + pRequest->mBody.size() +
+        pRequest->mResponseBody.size();
+    return lSize + pRequest->mHeadersIn.bytes() + pRequest->mHeadersOut.bytes();
+}
+
+std::vector<std::string>
+RequestProcessor::getDestinations() const {
+    std::set<std::string> lDestinations;
+    BOOST_FOREACH(const tCommandsByConfPathAndDestination::value_type &lConf, mCommands) {
+        BOOST_FOREACH(const tCommandsByDestination::value_type &lDestination, lConf.second) {
+            lDestinations.insert(lDestination.first);
+        }
+    }
+    return std::vector<std::string>(lDestinations.begin(), lDestinations.end());
+}
+
+const std::string
+RequestProcessor::getLatencies() {
+    return mLatencies.getSummary();
+}
+
+const std::string
+RequestProcessor::getFilterStats() {
+    return mFilterProfiler.getSummary();
+}
+
+/** @brief The number of manage intervals between two refreshes of the filter totals and orders */
+static const unsigned int cFilterRefreshTicks = 10;
+
+/** @brief The share of the decayed filter counters kept at each refresh, for the order of the raw filters to follow the recent requests */
+static const double cFilterDecay = 0.8;
+
+void
+RequestProcessor::onLoad(size_t pQueued, size_t pQueuedBytes, size_t pThreads) {
+    mScoreboard.setLoad(pQueued, pQueuedBytes, pThreads);
+    if (mLoadTicks++ % cFilterRefreshTicks == 0) {
+        refreshFilters();
+    }
+}
+
+void
+RequestProcessor::refreshFilters() {
+    std::vector<std::pair<std::string, tFilterCounters> > lTotals;
+    mFilterProfiler.getTotals(lTotals);
+    mScoreboard.setFilters(lTotals);
+
+    // Decayed with what was counted since the previous refresh
+    mFilterTotals.resize(lTotals.size());
+    mFilterRates.resize(lTotals.size());
+    for (unsigned int i = 0; i < lTotals.size(); ++i) {
+        const tFilterCounters &lTotal = lTotals[i].second;
+        tFilterCounters lDelta;
+        lDelta.mEvaluations = lTotal.mEvaluations - mFilterTotals[i].mEvaluations;
+        lDelta.mMatches = lTotal.mMatches - mFilterTotals[i].mMatches;
+        lDelta.mNs = lTotal.mNs - mFilterTotals[i].mNs;
+        mFilterRates[i].update(lDelta, cFilterDecay);
+        mFilterTotals[i] = lTotal;
+    }
+
+    BOOST_FOREACH(const tCommandsByConfPathAndDestination::value_type &lConf, mCommands) {
+        if (!static_cast<const DupConf *>(lConf.first)->reorderFilters) {
+            continue;
+        }
+        BOOST_FOREACH(const tCommandsByDestination::value_type &lDestination, lConf.second) {
+            // Swapped as a whole: the request threads keep using the previous order meanwhile
+            boost::atomic_store(&lDestination.second.mRawFilterOrder, computeRawFilterOrder(lDestination.second));
+        }
+    }
+}
+
+bool
+RequestProcessor::searchFilter(const tFilter &pFilter, const std::string &pField, boost::smatch *pWhat) {
+    const uint64_t lStart = monotonicNs();
+    const bool lMatched = pWhat ? boost::regex_search(pField, *pWhat, pFilter.mRegex) : boost::regex_search(pField, pFilter.mRegex);
+    mFilterProfiler.record(pFilter.mProfileIndex, pFilter.mFilterType == tFilter::PREVENT_DUPLICATION, lMatched, monotonicNs() - lStart);
+    return lMatched;
+}
+
+void
+RequestProcessor::recordLatency(Latency::eLatency pLatency, const std::string &pDestination, uint64_t pValue) {
+    mLatencies.record(pLatency, pDestination, pValue);
+    mScoreboard.record(pLatency, pDestination, pValue);
+}
+
+const std::string
+RequestProcessor::getDropCounts() {
+    std::string lCounts = boost::lexical_cast<std::string>(__sync_fetch_and_and(&mDropsByPriority[QueuePriority::LOW], 0)) + "/" +
+        boost::lexical_cast<std::string>(__sync_fetch_and_and(&mDropsByPriority[QueuePriority::NORMAL], 0)) + "/" +
+        boost::lexical_cast<std::string>(__sync_fetch_and_and(&mDropsByPriority[QueuePriority::HIGH], 0)) + " " +
+        boost::lexical_cast<std::string>(__sync_fetch_and_and(&mDropsByReason[DropReason::REFUSED], 0)) + "/" +
+        boost::lexical_cast<std::string>(__sync_fetch_and_and(&mDropsByReason[DropReason::EVICTED], 0));
+    boost::lock_guard<boost::mutex> lLock(mDropsMutex);
+    typedef std::map<std::string, unsigned int>::value_type tLocationDrops;
+    BOOST_FOREACH(tLocationDrops &lLocation, mDropsByLocation) {
+        if (lLocation.second) {
+            lCounts += " " + lLocation.first + ":" + boost::lexical_cast<std::string>(lLocation.second);
+            lLocation.second = 0;
+        }
+    }
+    return lCounts;
+}
+
+void
+RequestProcessor::setErrorLog(unsigned pMaxBody, unsigned pSampling) {
+    mErrorLogMaxBody = pMaxBody;
+    mErrorLogSampling = std::max(1u, pSampling);
+}
+
+void
+RequestProcessor::addResolve(const std::string &pHost, unsigned pPort, const std::string &pAddress) {
+    const std::string lEntry = pHost + ":" + boost::lexical_cast<std::string>(pPort) + ":" + pAddress;
+    mResolve = curl_slist_append(mResolve, lEntry.c_str());
+}
+
+void
+RequestProcessor::clearResolve() {
+    curl_slist_free_all(mResolve);
+    mResolve = NULL;
+}
+
+void
+RequestProcessor::logFailure(const tFilter &pFilter, const std::string &pUri, const std::string &pBody, int pCurlCode, long pHttpCode) {
+    {
+        boost::lock_guard<boost::mutex> lLock(mErrorLogMutex);
+        // The first failure is logged, then one out of mErrorLogSampling
+        if (mFailuresByDestination[pFilter.mDestination]++ % mErrorLogSampling) {
+            const std::string lError = pCurlCode ? "curl" + boost::lexical_cast<std::string>(pCurlCode) :
+                "http" + boost::lexical_cast<std::string>(pHttpCode);
+            ++mErrorLogSkips[lError + "@" + pFilter.mDestination];
+            return;
+        }
+    }
+
+    if (pBody.empty()) {
+        Log::error(403, "[DUP] Sending request failed with curl code: %d, http: %ld, request uri: %s, empty body",
+                   pCurlCode, pHttpCode, pUri.c_str());
+        return;
+    }
+    // The match of the filter if any, the whole body otherwise
+    size_t lStart = 0;
+    size_t lSize = pBody.size();
+    const char *lWhat = "body";
+    boost::smatch lMatch;
+    if (!pFilter.mErrorLogBodyMatch.empty() && boost::regex_search(pBody, lMatch, pFilter.mErrorLogBodyMatch)) {
+        lStart = lMatch.position(static_cast<boost::smatch::size_type>(0));
+        lSize = lMatch.length(0);
+        lWhat = "matched body";
+    }
+    const size_t lLength = std::min<size_t>(lSize, mErrorLogMaxBody);
+    Log::error(403, "[DUP] Sending request failed with curl code: %d, http: %ld, request uri: %s, %s%s (%zu bytes): %.*s",
+               pCurlCode, pHttpCode, pUri.c_str(), lLength < lSize ? "truncated " : "", lWhat,
+               lSize, static_cast<int>(lLength), pBody.data() + lStart);
+}
+
+const std::string
+RequestProcessor::getErrorLogSkips() {
+    std::string lSkips;
+    boost::lock_guard<boost::mutex> lLock(mErrorLogMutex);
+    typedef std::map<std::string, unsigned int>::value_type tErrorSkips;
+    BOOST_FOREACH(tErrorSkips &lError, mErrorLogSkips) {
+        if (lError.second) {
+            if (!lSkips.empty()) {
+                lSkips += " ";
+            }
+            lSkips += lError.first + "=" + boost::lexical_cast<std::string>(lError.second);
+        }
+    }
+    mErrorLogSkips.clear();
+    return lSkips.empty() ? "-" : lSkips;
+}
+
+void
+RequestProcessor::retryLater(const tFilter &pFilter, const RequestOverlay &pRequest) {
+    tRetryItem lItem;
+    lItem.mRequest.reset(new RequestOverlay(pRequest));
+    lItem.mFilter = &pFilter;
+    if (!mRetryQueue.schedule(lItem)) {
+        mScoreboard.countDrop(ScoreboardDrop::ABANDONED);
+    }
+}
+
+void
+RequestProcessor::runRetries() {
+    Log::debug("[DUP] Retry thread started");
+
+    CURL * lCurl = initCurl();
+    if (!lCurl) {
+        return;
+    }
+
+    tRetryItem lItem;
+    while (mRetryQueue.pop(lItem)) {
+        LOG_DEBUG_IF_ENABLED("[DUP] Retrying duplication to %s, attempt %u", lItem.mFilter->mDestination.c_str(), lItem.mAttempts);
+        // Nobody waits for the outcome of a retry, it must not be written to the shared request
+        RequestInfo lOutcome;
+        lOutcome.mValidationHeaderDup = lItem.mRequest->base().mValidationHeaderDup;
+        if (performCurlCall(lCurl, *lItem.mFilter, *lItem.mRequest, lOutcome) && !mRetryQueue.schedule(lItem)) {
+            mScoreboard.countDrop(ScoreboardDrop::ABANDONED);
+        }
+        lItem = tRetryItem();
+    }
+    curl_easy_cleanup(lCurl);
+}
+
 void
 RequestProcessor::setUrlCodec(const std::string &pUrlCodec)
 {
@@ -552,125 +1188,91 @@ RequestProcessor::setUrlCodec(const std::string &pUrlCodec)
 /// @brief send a POST with a body
 /// @param toSend must be kept until the request is performed
 void
-RequestProcessor::sendInBody(CURL *curl, const RequestInfo &rInfo, curl_slist *&slist, const std::string &toSend) const {
-    std::string contentLen = std::string("Content-Length: ") +
-            boost::lexical_cast<std::string>(toSend.size());
-    slist = curl_slist_append(slist, contentLen.c_str());
-
+RequestProcessor::sendInBody(CURL *curl, const RequestOverlay &rInfo, tCurlHeaders &pHeaders, const std::string &toSend) const {
+    pHeaders.add(HeaderName::CONTENT_LENGTH, boost::lexical_cast<std::string>(toSend.size()));
 
     curl_easy_setopt(curl, CURLOPT_POST, 1);
-    addOrigHeaders(rInfo, slist);
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, slist);
+    addOrigHeaders(rInfo, pHeaders);
     curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, toSend.size());
     // the string is not copied by curl, so must be kept until request is performed
     curl_easy_setopt(curl, CURLOPT_POSTFIELDS, toSend.c_str());
 }
 
 std::string *
-RequestProcessor::sendDupFormat(CURL *curl, const RequestInfo &rInfo, curl_slist *&slist) const {
+RequestProcessor::sendDupFormat(CURL *curl, const RequestOverlay &rInfo, tCurlHeaders &pHeaders) const {
 
     // set the content type to application/x-dup-serialized if we pass the REQUEST_WITH_ANSWER
-    slist = curl_slist_append(slist, "Content-Type: application/x-dup-serialized");
+    pHeaders.add(HeaderName::CONTENT_TYPE, "application/x-dup-serialized");
     // Adding HTTP HEADER to indicate that the request is duplicated with it's answer
-    slist = curl_slist_append(slist, "Duplication-Type: Response");
+    pHeaders.add(HeaderName::DUPLICATION_TYPE, "Response");
 
-    for( const std::pair<std::string, std::string> &hdrOut : rInfo.mHeadersOut ) {
-        if( hdrOut.first == "X-MATCHED-PATTERN") {
-            const std::string temp  = hdrOut.first + ": " + hdrOut.second;
-           curl_slist_append(slist, temp.c_str() );
+    for( const tHeaders::tHeader &hdrOut : rInfo.base().mHeadersOut ) {
+        if( hdrOut.mId == HeaderName::X_MATCHED_PATTERN) {
+            pHeaders.add(hdrOut.mName, hdrOut.mId, hdrOut.mValue);
         }
     }
 
     //Computing dup format string
     std::stringstream ss;
     //Request body
-    RequestInfo::Serialize(rInfo.mBody, ss);
+    RequestInfo::Serialize(rInfo.body(), ss);
 
     // Answer headers, Copy requestInfo out headers
     std::string answerHeaders;
-    BOOST_FOREACH(const tKeyValList::value_type &v, rInfo.mHeadersOut) {
-        answerHeaders.append(v.first + std::string(": ") + v.second + "\n");
+    answerHeaders.reserve(rInfo.base().mHeadersOut.bytes() + 3 * rInfo.base().mHeadersOut.size());
+    for( const tHeaders::tHeader &v : rInfo.base().mHeadersOut ) {
+        answerHeaders.append(v.mName.data(), v.mName.size()).append(": ").append(v.mValue.data(), v.mValue.size()).append("\n");
     }
     RequestInfo::Serialize(answerHeaders, ss);
 
     // Answer Body
-    RequestInfo::Serialize(rInfo.mAnswer, ss);
+    RequestInfo::Serialize(rInfo.base().mAnswer, ss);
     std::string *content = new std::string(ss.str());
-    sendInBody(curl, rInfo, slist, *content);
+    sendInBody(curl, rInfo, pHeaders, *content);
     return content;
 }
 
 /// @brief add the original input headers making sure we have no duplicates
 /// duplicates are merged into csv by apache
 /// @param rInfo
-/// @param slist
-void RequestProcessor::addOrigHeaders(const RequestInfo &rInfo, struct curl_slist *&slist) {
-    // Copy the request input headers
-
-    // Create a set of headers already added
-    std::set<std::string> headers;
-
-    curl_slist * curlist = slist;
-    while ( curlist ) {
-      if ( curlist->data ) {
-      char *pos = strchr(curlist->data, ':');
-      if ( pos ) {
-          std::string header;
-          header.assign(curlist->data, pos - curlist->data);
-          headers.insert(header);
-      }
-      }
-      curlist = curlist->next;
-    }
-
+/// @param pHeaders
+void RequestProcessor::addOrigHeaders(const RequestOverlay &rInfo, tCurlHeaders &pHeaders) {
     /* The headers potentially added by dup or others and not to be added twice are currently the following:
       ELAPSED_TIME_BY_DUP,X_DUP_HTTP_STATUS,X_DUP_METHOD,X_DUP_CONTENT_TYPE,
       Duplication-Type,Content-Length,Host,Expect,Transfer-Encoding,Content-Type
     */
 
-    // Now append only if not in the set of headers already added
+    // Now append only if not among the headers already added
     // or apache will at some point concatenate values in a csv list
     // but also never add Transfer-Encoding chunked or a Content-Length, or Duplication-Type
     // because we may not be adding it but a previous duplication might have put it there
-    BOOST_FOREACH(const tKeyValList::value_type &v, rInfo.mHeadersIn) {
-        if ( (headers.find(v.first) == headers.end()) && (v.first != std::string("Host")) &&
-      (v.first != std::string("Transfer-Encoding")) &&
-      (v.first != std::string("Content-Length")) && (v.first != std::string("Duplication-Type")) ) {
-            headers.insert(v.first);
-            slist = curl_slist_append(slist, std::string(v.first + std::string(": ") + v.second).c_str());
-            // Log::error(11, "Adding header %s: %s", v.first.c_str(), v.second.c_str());
-      } else {
-            // Log::error(11, "Skipping copy of header %s", v.first.c_str());
+    for( const tHeaders::tHeader &v : rInfo.headersIn() ) {
+        if ( v.mId == HeaderName::HOST || v.mId == HeaderName::TRANSFER_ENCODING ||
+             v.mId == HeaderName::CONTENT_LENGTH || v.mId == HeaderName::DUPLICATION_TYPE ) {
+            continue;
         }
+        pHeaders.addOnce(v.mName, v.mId, v.mValue);
     }
 }
 
 /// @brief add http headers common to all dup types
-/// @param slist slist ref on which to add
-void RequestProcessor::addCommonHeaders(const RequestInfo &rInfo, struct curl_slist *&slist) {
+/// Expect, X-DUPLICATED-REQUEST and User-RealAgent are always sent, they are not added per request
+/// @param pHeaders the headers on which to add
+void RequestProcessor::addCommonHeaders(const RequestInfo &rInfo, tCurlHeaders &pHeaders) {
     // Add the elapsed time header
-    std::string elapsed = std::string("ELAPSED_TIME_BY_DUP: ") + boost::lexical_cast<std::string>(rInfo.getElapsedTimeMS());
-    slist = curl_slist_append(slist, elapsed.c_str());
-
-    // This avoids the Expect: 100 continue
-    // Which is generated by curl when it's a POST and the body is long
-    slist = curl_slist_append(slist, "Expect:");
-    // Setting X-DUPLICATED-REQUEST to 1 in the header
-    slist = curl_slist_append(slist, "X-DUPLICATED-REQUEST: 1");
-    // Setting mod-dup as the real agent for tracability
-    slist = curl_slist_append(slist, "User-RealAgent: mod-dup");
+    pHeaders.add(HeaderName::ELAPSED_TIME_BY_DUP, boost::lexical_cast<std::string>(rInfo.getElapsedTimeMS()));
 }
 
 /// @brief add http headers to the request sent to compare for validation
 /// @param rInfo
 /// @param matchedFilter
-/// @param slist slist ref on which to add
-void RequestProcessor::addValidationHeadersCompare(RequestInfo &rInfo, const tFilter &matchedFilter, struct curl_slist *&slist) {
+/// @param pHeaders the headers on which to add
+void RequestProcessor::addValidationHeadersCompare(RequestInfo &rInfo, const tFilter &matchedFilter, tCurlHeaders &pHeaders) {
     // Set Compare log header
     if (matchedFilter.mDuplicationType == DuplicationType::REQUEST_WITH_ANSWER) {
         if (rInfo.mValidationHeaderDup) {
             rInfo.mValidationHeaderComp = true;
-            slist = curl_slist_append(slist, "X_COMP_LOG: ON");
+            pHeaders.add(HeaderName::X_COMP_LOG, "ON");
         }
     }
 }
@@ -686,92 +1288,116 @@ void RequestProcessor::addValidationHeadersDup(RequestInfo &rInfo, const std::li
         std::string separator;
         for ( const auto & matchedFilter : matchedFilters) {
             xDupLog << separator << ApplicationScope::enumToString(matchedFilter->mScope) << " filter: \"" << matchedFilter->mRegex << "\" matched: \"" << matchedFilter->mMatch << "\" Destination: " << matchedFilter->mDestination;
-            std::cout<<"----------------------"<<xDupLog.str();
-            rInfo.mHeadersOut.push_back(std::pair<std::string, std::string>("X-MATCHED-PATTERN", matchedFilter->mMatch));
+            rInfo.mHeadersOut.push_back(HeaderName::toString(HeaderName::X_MATCHED_PATTERN), matchedFilter->mMatch);
             separator = " AND ";
         }
     } else {
         xDupLog << "The request is not duplicated, having found " << numDestinations << " DupDestination(s) and attempted to match " << numFiltersAttempted << " DupFilter or DupRawFilter";
     }
-    Log::debug("[DUP] %s", xDupLog.str().c_str());
-    rInfo.mHeadersOut.push_back(std::pair<std::string, std::string>("X_DUP_LOG", xDupLog.str()));
+    LOG_DEBUG_IF_ENABLED("[DUP] %s", xDupLog.str().c_str());
+    rInfo.mHeadersOut.push_back(HeaderName::toString(HeaderName::X_DUP_LOG), xDupLog.str());
 }
 
-void
+bool
 RequestProcessor::performCurlCall(CURL *curl, const tFilter &matchedFilter, RequestInfo &rInfo) {
+    return performCurlCall(curl, matchedFilter, RequestOverlay(rInfo), rInfo);
+}
+
+bool
+RequestProcessor::performCurlCall(CURL *curl, const tFilter &matchedFilter, const RequestOverlay &pRequest, RequestInfo &pOutcome) {
+    tCurlTransfer lTransfer;
+    startCurlCall(curl, matchedFilter, pRequest, pOutcome, lTransfer);
+    pOutcome.mCurlCompResponseStatus = curl_easy_perform(curl);
+    return endCurlCall(curl, matchedFilter, pRequest, pOutcome, lTransfer);
+}
+
+void
+RequestProcessor::startCurlCall(CURL *curl, const tFilter &matchedFilter, const RequestOverlay &pRequest, RequestInfo &pOutcome, tCurlTransfer &pTransfer) {
+    const RequestInfo &rInfo = pRequest.base();
+    const std::string &lBody = pRequest.body();
     // Setting URI
-    std::string uri = matchedFilter.mDestination + rInfo.mPath + "?" + rInfo.mArgs;
-    curl_easy_setopt(curl, CURLOPT_URL, uri.c_str());
+    pTransfer.mCurl = curl;
+    pTransfer.mUri = matchedFilter.mDestination + pRequest.path() + "?" + pRequest.args();
+    curl_easy_setopt(curl, CURLOPT_URL, pTransfer.mUri.c_str());
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &my_dummy_write); // this avoids curl printing the answer to stdout
 
-    std::string *content = NULL;
-    struct curl_slist *slist = NULL;
+    // The headers of the request and the few added, in one buffer
+    tCurlHeaders &lHeaders = pTransfer.mHeaders;
+    lHeaders.clear();
+    lHeaders.reserve(pRequest.headersIn().size() + cAddedHeaders, pRequest.headersIn().bytes() + cAddedHeadersBytes);
 
-    addCommonHeaders(rInfo, slist);
-    addValidationHeadersCompare(rInfo, matchedFilter, slist);
+    addCommonHeaders(rInfo, lHeaders);
+    addValidationHeadersCompare(pOutcome, matchedFilter, lHeaders);
 
     //Add callback function to getacess to the header returned by the curl call
     curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, getCurlResponseHeaderCallback);
-    curl_easy_setopt(curl, CURLOPT_HEADERDATA,(void *)&rInfo.mCurlCompResponseHeader);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA,(void *)&pOutcome.mCurlCompResponseHeader);
 
     // Sending body in plain or dup format according to the duplication need
     if (matchedFilter.mDuplicationType == DuplicationType::REQUEST_WITH_ANSWER) {
         // POST with dup serialized original request body AND response
-        content = sendDupFormat(curl, rInfo, slist);
-    } else if ((matchedFilter.mDuplicationType == DuplicationType::COMPLETE_REQUEST) && rInfo.hasBody()) {
+        pTransfer.mContent = sendDupFormat(curl, pRequest, lHeaders);
+    } else if ((matchedFilter.mDuplicationType == DuplicationType::COMPLETE_REQUEST) && !lBody.empty()) {
         // POST with original body
-        sendInBody(curl, rInfo, slist, rInfo.mBody);
+        sendInBody(curl, pRequest, lHeaders, lBody);
     } else {
         // Regular GET case
         curl_easy_setopt(curl, CURLOPT_HTTPGET, 1);
-        addOrigHeaders(rInfo, slist);
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, slist);
+        addOrigHeaders(pRequest, lHeaders);
     }
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, lHeaders.list());
 
-    Log::debug("[DUP] >> Duplicating: %s", uri.c_str());
-
-    rInfo.mCurlCompResponseStatus = curl_easy_perform(curl);
-    if (slist)
-        curl_slist_free_all(slist);
+    LOG_DEBUG_IF_ENABLED("[DUP] >> Duplicating: %s", pTransfer.mUri.c_str());
+    mScoreboard.addInFlight(matchedFilter.mDestination, 1);
+}
 
-    if (rInfo.mCurlCompResponseStatus == CURLE_OPERATION_TIMEDOUT) {
+bool
+RequestProcessor::endCurlCall(CURL *curl, const tFilter &matchedFilter, const RequestOverlay &pRequest, RequestInfo &pOutcome, tCurlTransfer &pTransfer) {
+    const std::string &lBody = pRequest.body();
+    const std::string &uri = pTransfer.mUri;
+    pTransfer.mHeaders.clear();
+
+    mScoreboard.addInFlight(matchedFilter.mDestination, -1);
+    mScoreboard.count(ScoreboardCounter::DUPLICATED);
+    mScoreboard.countDestination(ScoreboardCounter::DUPLICATED, matchedFilter.mDestination);
+    if (pOutcome.mCurlCompResponseStatus == CURLE_OPERATION_TIMEDOUT) {
         __sync_fetch_and_add(&mTimeoutCount, 1);
+        mScoreboard.count(ScoreboardCounter::TIMEOUT);
+        mScoreboard.countDestination(ScoreboardCounter::TIMEOUT, matchedFilter.mDestination);
     }
     long httpCode = 0;
     curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &httpCode);
+
+    double lSendTime = 0;
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &lSendTime);
+    if (lSendTime > 0) {
+        recordLatency(Latency::SEND, matchedFilter.mDestination, static_cast<uint64_t>(lSendTime * 1000000));
+    }
+    const boost::posix_time::time_duration lEndToEnd = boost::posix_time::microsec_clock::universal_time() - pRequest.base().getStartTime();
+    if (!lEndToEnd.is_negative()) {
+        recordLatency(Latency::END_TO_END, matchedFilter.mDestination, lEndToEnd.total_microseconds());
+    }
     
-    if (rInfo.mCurlCompResponseStatus || (httpCode != 200)) {
-        boost::regex lRegex(matchedFilter.mErrorLogBodyMatch);
-        Log::debug("[DUP] matching body %s", matchedFilter.mErrorLogBodyMatch.str().c_str());
-        boost::smatch what;
-        if ( rInfo.mBody.empty() ) {
-            Log::error(403, "[DUP] Sending request failed with curl code: %d, http: %ld, request uri: %s, empty body", 
-                       rInfo.mCurlCompResponseStatus, httpCode, uri.c_str());
-        } else if ( (!matchedFilter.mErrorLogBodyMatch.empty()) && boost::regex_search(rInfo.mBody, what, lRegex) ) {
-            std::string matchedBody = what[0];
-            Log::error(403, "[DUP] Sending request failed with curl code: %d, http: %ld, request uri: %s, matched body: %s", 
-                       rInfo.mCurlCompResponseStatus, httpCode, uri.c_str(), matchedBody.c_str());
-        } else {
-            Log::error(403, "[DUP] Sending request failed with curl code: %d, http: %ld, request uri: %s, truncated body: %s", 
-                       rInfo.mCurlCompResponseStatus, httpCode, uri.c_str(), rInfo.mBody.c_str());
-        }
+    if (pOutcome.mCurlCompResponseStatus || (httpCode != 200)) {
+        logFailure(matchedFilter, uri, lBody, pOutcome.mCurlCompResponseStatus, httpCode);
     }
-    delete content;
+    delete pTransfer.mContent;
+    pTransfer.mContent = NULL;
+    pTransfer.mDone = true;
+    // The destination did not process the request, sending it again is safe
+    return (pOutcome.mCurlCompResponseStatus == CURLE_COULDNT_CONNECT) || (httpCode == 503);
 }
 
-/**
- * @brief perform curl(s) for one request if it matches
- * One request per filter matched
- * @param reqInfo the RequestInfo instance for this request
- * @param pCurl a preinitialized curl handle
- * @param stillRunning ref to see if queue is still running
- */
-void
-RequestProcessor::runOne(RequestInfo &reqInfo, CURL * pCurl,const bool & stillRunning) {
+std::list<tDuplication>
+RequestProcessor::planDuplications(const boost::shared_ptr<RequestInfo> &pRequest) {
+    RequestInfo &reqInfo = *pRequest;
     // Parse query string args
     parseArgs(reqInfo.mParsedArgs, reqInfo.mArgs);
 
+    std::list<tDuplication> lDuplications;
+    const uint64_t lFilterStart = monotonicNs();
     std::list<const tFilter *> matchedFilters = processRequest(reqInfo);
+    recordLatency(Latency::FILTER, "", (monotonicNs() - lFilterStart) / 1000);
     for (const auto & it : matchedFilters) {
             // First get a hand the commands structure that matches the destination duplication
             tCommandsByDestination &cbd = mCommands.at(reqInfo.mConf);
@@ -780,29 +1406,181 @@ RequestProcessor::runOne(RequestInfo &reqInfo, CURL * pCurl,const bool & stillRu
             // How many times do we duplicate this request? (0-10 i.e. 0-10000% in conf)
             unsigned int numDups = c.toDuplicateInt();
             if (numDups == 0) {
-                Log::debug("dup dropped for DupDestination %s", it->mDestination.c_str());
+                LOG_DEBUG_IF_ENABLED("dup dropped for DupDestination %s", it->mDestination.c_str());
                 continue;
             } else if ( numDups > 1 ) {
-                Log::debug("Amplifying traffic, duplicated %u times", numDups);
+                LOG_DEBUG_IF_ENABLED("Amplifying traffic, duplicated %u times", numDups);
+            }
+
+            RequestOverlay lOverlay(pRequest);
+            if (c.hasSubstitutions()) {
+                // perform substitutions specific to this location, once for all the amplified duplications
+                const uint64_t lSubstitutionStart = monotonicNs();
+                substituteRequest(lOverlay, c);
+                recordLatency(Latency::SUBSTITUTION, it->mDestination, (monotonicNs() - lSubstitutionStart) / 1000);
             }
-            
             for (unsigned int i = 0; i < numDups; i++ ) {
-                // Exit faster than poison pill, just finish the running curl
-                if ( ! stillRunning ) {
+                lDuplications.push_back(tDuplication(*it, lOverlay));
+            }
+    }
+    return lDuplications;
+}
+
+/**
+ * @brief perform curl(s) for one request if it matches
+ * One request per filter matched
+ * The request is not copied: each destination with substitutions gets an overlay holding the rewritten fields,
+ * shared by its amplified duplications and its retries
+ * @param pRequest the RequestInfo instance for this request
+ * @param pCurl a preinitialized curl handle
+ * @param stillRunning ref to see if queue is still running
+ */
+void
+RequestProcessor::runOne(const boost::shared_ptr<RequestInfo> &pRequest, CURL * pCurl,const bool & stillRunning) {
+    const std::list<tDuplication> lDuplications = planDuplications(pRequest);
+    BOOST_FOREACH(const tDuplication &lDuplication, lDuplications) {
+        // Exit faster than poison pill, just finish the running curl
+        if ( ! stillRunning ) {
+            break;
+        }
+        if (mRetryQueue.isEnabled()) {
+            mRetryQueue.earn();
+        }
+        if (performCurlCall(pCurl, *lDuplication.mFilter, lDuplication.mRequest, *pRequest) && mRetryQueue.isEnabled()) {
+            retryLater(*lDuplication.mFilter, lDuplication.mRequest);
+        }
+        __sync_fetch_and_add(&mDuplicatedCount, 1);
+    }
+}
+
+void
+RequestProcessor::runSync(const boost::shared_ptr<RequestInfo> &pRequest, tMultiCurl &pSync) {
+    namespace pt = boost::posix_time;
+    // All the duplications start at once, without a deadline when the outgoing requests have no timeout
+    const bool lStillRunning = true;
+    const pt::ptime lDeadline = mTimeout ? pt::microsec_clock::universal_time() + pt::milliseconds(mTimeout)
+                                         : pt::ptime(pt::not_a_date_time);
+    runConcurrently(std::vector<boost::shared_ptr<RequestInfo> >(1, pRequest), pSync,
+                    std::numeric_limits<size_t>::max(), std::numeric_limits<size_t>::max(),
+                    lDeadline, lStillRunning);
+}
+
+void
+RequestProcessor::runConcurrently(const std::vector<boost::shared_ptr<RequestInfo> > &pRequests, tMultiCurl &pMulti,
+                                  size_t pMaxSends, size_t pMaxSendsPerDestination,
+                                  const boost::posix_time::ptime &pDeadline, const bool &stillRunning) {
+    namespace pt = boost::posix_time;
+    std::list<tDuplication> lDuplications;
+    std::vector<RequestInfo *> lOutcomes;
+    BOOST_FOREACH(const boost::shared_ptr<RequestInfo> &lRequest, pRequests) {
+        std::list<tDuplication> lPlanned = planDuplications(lRequest);
+        lOutcomes.insert(lOutcomes.end(), lPlanned.size(), lRequest.get());
+        lDuplications.splice(lDuplications.end(), lPlanned);
+    }
+    if (lDuplications.empty()) {
+        return;
+    }
+
+    // Never resized: the transfers are referenced by their easy handles
+    std::vector<tCurlTransfer> lTransfers(lDuplications.size());
+    size_t i = 0;
+    BOOST_FOREACH(const tDuplication &lDuplication, lDuplications) {
+        lTransfers[i].mDuplication = &lDuplication;
+        lTransfers[i].mOutcome = lOutcomes[i];
+        ++i;
+    }
+    unsigned int lDuplicatedCount = 0;
+    std::vector<CURL *> lFreeHandles(pMulti.mHandles.rbegin(), pMulti.mHandles.rend());
+    std::map<std::string, size_t> lInFlightByDestination;
+    size_t lInFlight = 0;
+    size_t lFirstPending = 0;
+
+    for (;;) {
+        // Start the duplications allowed by the caps, in order
+        for (i = lFirstPending; stillRunning && (i < lTransfers.size()) && (lInFlight < pMaxSends); ++i) {
+            tCurlTransfer &lTransfer = lTransfers[i];
+            if (lTransfer.mStarted) {
+                continue;
+            }
+            size_t &lToDestination = lInFlightByDestination[lTransfer.mDuplication->mFilter->mDestination];
+            if (lToDestination >= pMaxSendsPerDestination) {
+                continue;
+            }
+            if (lFreeHandles.empty()) {
+                CURL *lCurl = initCurl();
+                if (!lCurl) {
                     break;
                 }
-                if (!c.mSubstitutions.empty() || !c.mRawSubstitutions.empty()) {
-                    // perform substitutions specific to this location
-                    RequestInfo ri(reqInfo);
-                    substituteRequest(ri, c);
-                    performCurlCall(pCurl, *it, ri);
-
-                } else {
-                    performCurlCall(pCurl, *it, reqInfo);
-                }
-                __sync_fetch_and_add(&mDuplicatedCount, 1);
+                pMulti.mHandles.push_back(lCurl);
+                lFreeHandles.push_back(lCurl);
+            }
+            if (mRetryQueue.isEnabled()) {
+                mRetryQueue.earn();
             }
+            startCurlCall(lFreeHandles.back(), *lTransfer.mDuplication->mFilter, lTransfer.mDuplication->mRequest, *lTransfer.mOutcome, lTransfer);
+            lFreeHandles.pop_back();
+            lTransfer.mStarted = true;
+            curl_easy_setopt(lTransfer.mCurl, CURLOPT_PRIVATE, &lTransfer);
+            curl_multi_add_handle(pMulti.mMulti, lTransfer.mCurl);
+            ++lToDestination;
+            ++lInFlight;
+        }
+        while ((lFirstPending < lTransfers.size()) && lTransfers[lFirstPending].mStarted) {
+            ++lFirstPending;
+        }
+        if (!lInFlight) {
+            break;
+        }
+
+        int lRunning = 0;
+        curl_multi_perform(pMulti.mMulti, &lRunning);
+        bool lFinished = false;
+        CURLMsg *lMsg;
+        int lQueued;
+        while ((lMsg = curl_multi_info_read(pMulti.mMulti, &lQueued))) {
+            if (lMsg->msg != CURLMSG_DONE) {
+                continue;
+            }
+            char *lPrivate = NULL;
+            curl_easy_getinfo(lMsg->easy_handle, CURLINFO_PRIVATE, &lPrivate);
+            tCurlTransfer &lTransfer = *reinterpret_cast<tCurlTransfer *>(lPrivate);
+            curl_multi_remove_handle(pMulti.mMulti, lTransfer.mCurl);
+            lTransfer.mOutcome->mCurlCompResponseStatus = lMsg->data.result;
+            if (endCurlCall(lTransfer.mCurl, *lTransfer.mDuplication->mFilter, lTransfer.mDuplication->mRequest, *lTransfer.mOutcome, lTransfer) &&
+                mRetryQueue.isEnabled()) {
+                retryLater(*lTransfer.mDuplication->mFilter, lTransfer.mDuplication->mRequest);
+            }
+            ++lDuplicatedCount;
+            lFreeHandles.push_back(lTransfer.mCurl);
+            --lInFlightByDestination[lTransfer.mDuplication->mFilter->mDestination];
+            --lInFlight;
+            lFinished = true;
+        }
+        if (lFinished) {
+            // Room for the next duplications
+            continue;
+        }
+        long lWait = 1000;
+        if (!pDeadline.is_not_a_date_time()) {
+            const long lRemaining = (pDeadline - pt::microsec_clock::universal_time()).total_milliseconds();
+            if (lRemaining <= 0) {
+                break;
+            }
+            lWait = std::min(lWait, lRemaining);
+        }
+        curl_multi_wait(pMulti.mMulti, NULL, 0, lWait, NULL);
+    }
+
+    // Deadline reached, the duplications still running are abandoned with the results already in
+    BOOST_FOREACH(tCurlTransfer &lTransfer, lTransfers) {
+        if (lTransfer.mStarted && !lTransfer.mDone) {
+            curl_multi_remove_handle(pMulti.mMulti, lTransfer.mCurl);
+            lTransfer.mOutcome->mCurlCompResponseStatus = CURLE_OPERATION_TIMEDOUT;
+            endCurlCall(lTransfer.mCurl, *lTransfer.mDuplication->mFilter, lTransfer.mDuplication->mRequest, *lTransfer.mOutcome, lTransfer);
+            ++lDuplicatedCount;
+        }
     }
+    __sync_fetch_and_add(&mDuplicatedCount, lDuplicatedCount);
 }
 
 CURL * RequestProcessor::initCurl()
@@ -816,10 +1594,82 @@ CURL * RequestProcessor::initCurl()
     // Activer l'option provoque des timeouts sur des requests avec un fort payload
     curl_easy_setopt(lCurl, CURLOPT_TIMEOUT_MS, mTimeout);
     curl_easy_setopt(lCurl, CURLOPT_NOSIGNAL, 1);
+    // After curl_easy_init, which initializes curl if it was not
+    if (CURLSH *lShare = mCurlShare.get()) {
+        curl_easy_setopt(lCurl, CURLOPT_SHARE, lShare);
+    }
+    if (mResolve) {
+        curl_easy_setopt(lCurl, CURLOPT_RESOLVE, mResolve);
+    }
 
     return lCurl;
 }
 
+tCurlShare::tCurlShare()
+    : mShare(NULL),
+      mInitialized(false) {
+}
+
+CURLSH *
+tCurlShare::get() {
+    boost::lock_guard<boost::mutex> lLock(mInitMutex);
+    if (mInitialized) {
+        return mShare;
+    }
+    mInitialized = true;
+    mShare = curl_share_init();
+    if (!mShare) {
+        Log::error(402, "[DUP] Could not init curl share object, the handles keep their own caches.");
+        return NULL;
+    }
+    curl_share_setopt(mShare, CURLSHOPT_LOCKFUNC, &tCurlShare::lock);
+    curl_share_setopt(mShare, CURLSHOPT_UNLOCKFUNC, &tCurlShare::unlock);
+    curl_share_setopt(mShare, CURLSHOPT_USERDATA, this);
+    curl_share_setopt(mShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    // Without TLS support in curl the sessions are simply not shared
+    curl_share_setopt(mShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    return mShare;
+}
+
+tCurlShare::~tCurlShare() {
+    // Fails if a handle still uses it, it is then left to the end of the process
+    if (mShare) {
+        curl_share_cleanup(mShare);
+    }
+}
+
+void
+tCurlShare::lock(CURL *pHandle, curl_lock_data pData, curl_lock_access pAccess, void *pShare) {
+    reinterpret_cast<tCurlShare *>(pShare)->mMutexes[pData].lock();
+}
+
+void
+tCurlShare::unlock(CURL *pHandle, curl_lock_data pData, void *pShare) {
+    reinterpret_cast<tCurlShare *>(pShare)->mMutexes[pData].unlock();
+}
+
+tMultiCurl::~tMultiCurl()
+{
+    BOOST_FOREACH(CURL *lCurl, mHandles) {
+        curl_easy_cleanup(lCurl);
+    }
+    if (mMulti) {
+        curl_multi_cleanup(mMulti);
+    }
+}
+
+tMultiCurl * RequestProcessor::initMultiCurl()
+{
+    CURLM * lMulti = curl_multi_init();
+    if (!lMulti) {
+        Log::error(402, "[DUP] Could not init curl multi object.");
+        return NULL;
+    }
+    tMultiCurl *lSync = new tMultiCurl();
+    lSync->mMulti = lMulti;
+    return lSync;
+}
+
 /**
  * @brief Run the infinite loop which pops new requests of the given queue, processes them and sends the over to the configured destination
  * @param pQueue the queue which gets filled with incoming requests
@@ -833,18 +1683,45 @@ RequestProcessor::run(MultiThreadQueue<boost::shared_ptr<RequestInfo> > &pQueue)
     if (!lCurl) {
         return;
     }
+    // Handles to send the duplications of a request concurrently
+    boost::scoped_ptr<tMultiCurl> lMulti;
+    if (mMaxConcurrentSends > 1) {
+        lMulti.reset(initMultiCurl());
+    }
 
-    for (;;) {
-        boost::shared_ptr<RequestInfo> lQueueItemShared = pQueue.pop();
-        RequestInfo *lQueueItem = lQueueItemShared.get();
+    std::vector<boost::shared_ptr<RequestInfo> > lBatch;
+    lBatch.reserve(mBatchSize);
+    bool lPoisoned = false;
+    while (!lPoisoned) {
+        lBatch.clear();
+        pQueue.popBatch(lBatch, mBatchSize, 0);
+
+        // Several poison pills in one batch: only one is for us
+        std::vector<boost::shared_ptr<RequestInfo> >::iterator lIt = lBatch.begin();
+        while (lIt != lBatch.end()) {
+            if ((*lIt)->isPoison()) {
+                if (lPoisoned) {
+                    pQueue.push_front(*lIt);
+                }
+                lPoisoned = true;
+                lIt = lBatch.erase(lIt);
+            } else {
+                ++lIt;
+            }
+        }
 
-        if (lQueueItem->isPoison()) {
-            // Master tells us to stop
-            Log::debug("[DUP] Received poison pill. Exiting.");
-            break;
+        // The items popped with the poison pill are sent before exiting
+        if (lMulti) {
+            runConcurrently(lBatch, *lMulti, mMaxConcurrentSends, mMaxConcurrentSendsPerDestination,
+                            boost::posix_time::ptime(), pQueue.isRunning());
+        } else {
+            BOOST_FOREACH(const boost::shared_ptr<RequestInfo> &lRequest, lBatch) {
+                runOne(lRequest, lCurl, pQueue.isRunning());
+            }
         }
-        runOne(*lQueueItem, lCurl, pQueue.isRunning());
     }
+    // Master tells us to stop
+    Log::debug("[DUP] Received poison pill. Exiting.");
     curl_easy_cleanup(lCurl);
 }
 
@@ -873,7 +1750,8 @@ tFilter::tFilter(const std::string &regex, ApplicationScope::eApplicationScope s
 , mDestination(currentDupDestination)
 , mErrorLogBodyMatch(errorLogBodyMatch)
 , mDuplicationType(dupType)
-, mFilterType(fType) {
+, mFilterType(fType)
+, mProfileIndex(FilterProfiler::cNotProfiled) {
     // Log::debug("[DUP] errorLogBodyMatch: %s", mErrorLogBodyMatch.str().c_str());
     
 }
@@ -23,12 +23,19 @@
 #include <curl/curl.h>
 #include <string>
 #include <map>
+#include <vector>
 #include <apr_pools.h>
 
+#include "CurlHeaders.hh"
+#include "FilterProfiler.hh"
+#include "Histogram.hh"
+#include "KeyIndex.hh"
 #include "MultiThreadQueue.hh"
 #include "RequestInfo.hh"
 #include "UrlCodec.hh"
 #include "RequestCommon.hh"
+#include "RetryQueue.hh"
+#include "Scoreboard.hh"
 
 
 typedef void CURL;
@@ -91,6 +98,9 @@ public:
     eFilterTypes mFilterType;
 
     mutable std::string mMatch;
+
+    /** The index of the filter in the profiler of the processor, FilterProfiler::cNotProfiled if not profiled */
+    unsigned mProfileIndex;
 };
 
 /**
@@ -107,30 +117,82 @@ public:
     std::string mReplacement; /** The replacement value regex */
 };
 
-/** @brief Maps a path to a substitution. Not a multimap because order matters. */
-typedef std::map<std::string, std::list<tSubstitute> > tFieldSubstitutionMap;
+/**
+ * @brief Buffers reused by all the substitutions run by a thread
+ */
+struct tSubstitutionScratch {
+    /** @brief Receives the rewritten field */
+    std::string mOut;
+    /** @brief Holds the decoded value of a key with rules */
+    std::string mDecoded;
+    /** @brief Holds the value being rewritten by the rules of a key */
+    std::string mValue;
+    /** @brief Alternates with the value being rewritten, so that a rule never allocates a new string */
+    std::string mBuffer;
+};
 
-struct ci_less
-{
-    // case-independent (ci) compare_less binary function
-    struct nocase_compare
-    {
-        bool operator() (const unsigned char& c1, const unsigned char& c2) const {
-            return tolower (c1) < tolower (c2); 
-        }
-    };
-    bool operator() (const std::string & s1, const std::string & s2) const {
-        return std::lexicographical_compare 
-        (s1.begin (), s1.end (),   // source range
-         s2.begin (), s2.end (),   // dest range
-         nocase_compare ());  // comparison
-    }
+/**
+ * @brief The substitutions of a destination compiled for one field of the request
+ * Key rules are indexed by the key they apply to and only hold the rules whose scope contains the field,
+ * raw rules are kept in declaration order. A field is rewritten in one walk through its keys followed by its raw rules.
+ */
+class tSubstitutionProgram {
+public:
+
+    void addKeyRule(const std::string &pKey, const tSubstitute &pRule);
+
+    void addRawRule(const tSubstitute &pRule);
+
+    bool empty() const { return mKeyRules.empty() && mRawRules.empty(); }
+
+    /**
+     * @brief Rewrites a field in the query string format (key1=value1&key2=value2)
+     * Keys are upper cased. Only the values changed by a rule are decoded and encoded again, the others are copied as they are
+     * @param pIn the field to rewrite
+     * @param pCodec the codec of the query string values
+     * @param pScratch the buffers of the calling thread, the result is in its mOut member
+     * @return true if a rule was run, false if the field is left untouched
+     */
+    bool run(const std::string &pIn, const IUrlCodec &pCodec, tSubstitutionScratch &pScratch) const;
+
+    /**
+     * @brief Rewrites the values of the headers which have rules
+     * @return true if a rule was run
+     */
+    bool run(tHeaders &pHeaders, tSubstitutionScratch &pScratch) const;
+
+    /**
+     * @brief Returns true if one of the headers has rules
+     */
+    bool matches(const tHeaders &pHeaders) const;
+
+private:
+
+    /**
+     * @brief Runs a rule on a value, in place
+     */
+    static void apply(const tSubstitute &pRule, std::string &pValue, std::string &pBuffer);
+
+    /**
+     * @brief Runs a list of rules on a value, in place
+     */
+    static void apply(const std::vector<tSubstitute> &pRules, std::string &pValue, std::string &pBuffer);
+
+    static void apply(const tKeyIndex<tSubstitute>::tRange &pRules, std::string &pValue, std::string &pBuffer);
+
+    bool runKeyRules(const std::string &pIn, const IUrlCodec &pCodec, tSubstitutionScratch &pScratch) const;
+
+    /** @brief The rules of each key, in declaration order, the key being case insensitive */
+    tKeyIndex<tSubstitute> mKeyRules;
+
+    /** @brief The rules applying to the whole field */
+    std::vector<tSubstitute> mRawRules;
 };
 
-/** @brief maps the key on which they apply to the filter for the value
+/** @brief Indexes the filters by the key on which they apply
  * search for the key is case insensitive
  */
-typedef std::multimap<std::string, tFilter, ci_less> tFiltersMap;
+typedef tKeyIndex<tFilter> tFiltersMap;
 
 /** @brief A container for the operations */
 class Commands {
@@ -150,15 +212,26 @@ public:
     /** @brief The Raw filter list */
     std::list<tFilter> mRawFilters;
 
-    /** @brief The substition maps */
-    tFieldSubstitutionMap mSubstitutions;
+    /** @brief The substitutions of the query string */
+    tSubstitutionProgram mQueryStringSubstitutions;
+
+    /** @brief The substitutions of the headers, they have no raw rules */
+    tSubstitutionProgram mHeadersSubstitutions;
 
-    /** @brief The Raw Substitution list */
-    std::list<tSubstitute> mRawSubstitutions;
+    /** @brief The substitutions of the body */
+    tSubstitutionProgram mBodySubstitutions;
+
+    /** @brief The substitutions of the path, they only have raw rules */
+    tSubstitutionProgram mPathSubstitutions;
 
     /** The percentage of matching requests to duplicate */
     unsigned int mDuplicationPercentage;
 
+    /** @brief The REGULAR raw filters in the order they are evaluated with DupReorderFilters, NULL until first computed
+     * Replaced as a whole by the manager of the pool and read without locking through boost::atomic_load
+     */
+    mutable boost::shared_ptr<const std::vector<const tFilter *> > mRawFilterOrder;
+
     /**
      * @brief Returns true if the request must be duplicated
      * Uses the remaining 1-99 percent of duplication to determine randomly if the request must be
@@ -172,8 +245,91 @@ public:
      * duplicated or not
      */
     unsigned int toDuplicateInt();
+
+    /**
+     * @brief Returns true if the requests sent to this destination have to be rewritten
+     */
+    bool hasSubstitutions() const;
     
-    
+};
+
+/**
+ * @brief One duplication to send: the filter that matched and the request as rewritten for its destination
+ */
+struct tDuplication {
+
+    tDuplication(const tFilter &pFilter, const RequestOverlay &pRequest)
+        : mFilter(&pFilter), mRequest(pRequest) {}
+
+    const tFilter *mFilter;
+    RequestOverlay mRequest;
+};
+
+/**
+ * @brief What must be kept alive until the transfer of a duplication is done
+ */
+struct tCurlTransfer {
+
+    tCurlTransfer() : mCurl(NULL), mContent(NULL), mDuplication(NULL), mOutcome(NULL), mStarted(false), mDone(false) {}
+
+    CURL *mCurl;
+    tCurlHeaders mHeaders;
+    /** @brief The serialized body sent with the REQUEST_WITH_ANSWER duplication type */
+    std::string *mContent;
+    std::string mUri;
+    const tDuplication *mDuplication;
+    /** @brief The request receiving the outcome of the duplication */
+    RequestInfo *mOutcome;
+    bool mStarted;
+    bool mDone;
+};
+
+/**
+ * @brief The curl handles of a thread sending the duplications of a request concurrently
+ * Easy handles are kept between requests to reuse their connections
+ */
+struct tMultiCurl {
+
+    tMultiCurl() : mMulti(NULL) {}
+
+    ~tMultiCurl();
+
+    CURLM *mMulti;
+    std::vector<CURL *> mHandles;
+};
+
+/**
+ * @brief The caches of the curl handles of the process: resolved names and TLS sessions
+ * The handles are created with the threads and die with them, the caches live as long as the processor,
+ * so that a thread spawned again neither resolves its destinations nor negotiates their sessions anew.
+ * The connections are not shared: libcurl does not support a connection cache used by several multi handles at once.
+ */
+class tCurlShare {
+public:
+    tCurlShare();
+
+    ~tCurlShare();
+
+    /**
+     * @brief The share object, created on first use: curl is only initialized in the children
+     * @return NULL if it could not be created
+     */
+    CURLSH *get();
+
+private:
+    tCurlShare(const tCurlShare &);
+    tCurlShare &operator=(const tCurlShare &);
+
+    static void lock(CURL *pHandle, curl_lock_data pData, curl_lock_access pAccess, void *pShare);
+
+    static void unlock(CURL *pHandle, curl_lock_data pData, void *pShare);
+
+    CURLSH *mShare;
+    /** @brief Set once the creation of the share object was attempted */
+    bool mInitialized;
+    boost::mutex mInitMutex;
+    /** @brief One per kind of data shared */
+    boost::mutex mMutexes[CURL_LOCK_DATA_LAST];
 };
 
 /**
@@ -204,16 +360,82 @@ private:
     /** @brief The codec to use when encoding the url*/
     boost::scoped_ptr<const IUrlCodec>              mUrlCodec;
 
-    static void addOrigHeaders(const RequestInfo &rInfo, curl_slist *&slist);
-    static void addCommonHeaders(const RequestInfo &rInfo, curl_slist *&slist);
-    static void addValidationHeadersCompare(RequestInfo &rInfo, const tFilter &matchedFilter, curl_slist *&slist);
+    /** @brief The failed duplications waiting to be retried */
+    RetryQueue                                      mRetryQueue;
+
+    /** @brief The thread sending the retries, apart from the workers */
+    boost::thread                                   *mRetryThread;
+
+    /** @brief The maximum number of duplications of a request a worker sends at once, 1 sends them sequentially */
+    unsigned int                                    mMaxConcurrentSends;
+
+    /** @brief The maximum number of duplications of a request sent at once to one destination, caps amplification bursts */
+    unsigned int                                    mMaxConcurrentSendsPerDestination;
+
+    /** @brief The maximum number of requests a worker takes off the queue at once */
+    unsigned int                                    mBatchSize;
+
+    /** @brief The number of requests dropped by the queue per priority since the last call to getDropCounts */
+    unsigned int                                    mDropsByPriority[QueuePriority::NB_PRIORITIES];
+
+    /** @brief The number of requests dropped by the queue per reason since the last call to getDropCounts */
+    unsigned int                                    mDropsByReason[DropReason::NB_REASONS];
+
+    /** @brief The number of dropped requests per location since the last call to getDropCounts */
+    std::map<std::string, unsigned int>             mDropsByLocation;
+
+    /** @brief Protects mDropsByLocation */
+    boost::mutex                                    mDropsMutex;
+
+    /** @brief The maximum number of bytes of the body logged for a failed duplication */
+    unsigned int                                    mErrorLogMaxBody;
+
+    /** @brief One failed duplication out of mErrorLogSampling is logged per destination */
+    unsigned int                                    mErrorLogSampling;
+
+    /** @brief The number of failed duplications per destination */
+    std::map<std::string, unsigned int>             mFailuresByDestination;
+
+    /** @brief The number of failed duplications not logged per error and destination since the last call to getErrorLogSkips */
+    std::map<std::string, unsigned int>             mErrorLogSkips;
+
+    /** @brief Protects mFailuresByDestination and mErrorLogSkips */
+    boost::mutex                                    mErrorLogMutex;
+
+    /** @brief The durations of the filters, substitutions and sends, per destination */
+    LatencyRecorder                                 mLatencies;
+
+    /** @brief The counters and durations of all the children, this one writing into its own slot */
+    Scoreboard                                      mScoreboard;
+
+    /** @brief The evaluations, matches and cost of each filter */
+    FilterProfiler                                  mFilterProfiler;
+
+    /** @brief The number of calls to onLoad, only made by the manager of the pool */
+    unsigned int                                    mLoadTicks;
+
+    /** @brief The totals of the filters at the previous refresh, indexed like the profiler, only used by the manager of the pool */
+    std::vector<tFilterCounters>                    mFilterTotals;
+
+    /** @brief The counters of the filters decayed at each refresh, which order the raw filters */
+    std::vector<tDecayedFilterCounters>             mFilterRates;
+
+    /** @brief The caches shared by all the curl handles */
+    tCurlShare                                      mCurlShare;
+
+    /** @brief The addresses the destination names are pinned to, as "host:port:address" */
+    curl_slist                                      *mResolve;
+
+    static void addOrigHeaders(const RequestOverlay &rInfo, tCurlHeaders &pHeaders);
+    static void addCommonHeaders(const RequestInfo &rInfo, tCurlHeaders &pHeaders);
+    static void addValidationHeadersCompare(RequestInfo &rInfo, const tFilter &matchedFilter, tCurlHeaders &pHeaders);
     static void addValidationHeadersDup(RequestInfo &rInfo, const std::list<const tFilter *> & matchedFilters, int numDestinations, int numFiltersAttempted);
 
     void
-    sendInBody(CURL *curl, const RequestInfo &rInfo, curl_slist *&slist, const std::string &toSend) const;
+    sendInBody(CURL *curl, const RequestOverlay &rInfo, tCurlHeaders &pHeaders, const std::string &toSend) const;
 
     std::string *
-    sendDupFormat(CURL *curl, const RequestInfo &rInfo, curl_slist *&slist) const;
+    sendDupFormat(CURL *curl, const RequestOverlay &rInfo, tCurlHeaders &pHeaders) const;
 
 public:
     /**
@@ -221,6 +443,11 @@ public:
      */
     RequestProcessor();
 
+    /**
+     * @brief Stops the retries
+     */
+    ~RequestProcessor();
+
     /**
      * @brief Set the timeout
      * @param pTimeout the timeout in ms
@@ -242,6 +469,156 @@ public:
     const unsigned int
     getDuplicatedCount();
 
+    /**
+     * @brief Configures the retry of the duplications which failed with a connection error or a 503
+     * @param pMaxAttempts the maximum number of retries of a duplication, 0 disables the retries
+     * @param pDeadline the time in ms after the first failure past which a duplication is abandoned
+     * @param pBaseDelay the delay in ms before the first retry, doubled at each attempt
+     */
+    void
+    setRetries(unsigned pMaxAttempts, unsigned pDeadline, unsigned pBaseDelay);
+
+    /**
+     * @brief Sets the maximum number of retries per 100 fresh duplications
+     * @param pPercentage the share of the fresh traffic that the retries may use
+     */
+    void
+    setRetryShare(unsigned pPercentage);
+
+    /**
+     * @brief Lets the workers send the duplications of a request concurrently
+     * @param pMaxSends the maximum number of duplications of a request in flight, 1 sends them sequentially
+     * @param pMaxSendsPerDestination the maximum number of them in flight to one destination
+     */
+    void
+    setConcurrentSends(unsigned pMaxSends, unsigned pMaxSendsPerDestination);
+
+    /**
+     * @brief Sets the maximum number of requests a worker takes off the queue at once
+     * @param pBatchSize the maximum number of requests of a batch, 1 takes them one by one
+     */
+    void
+    setBatchSize(unsigned pBatchSize);
+
+    /**
+     * @brief Bounds the logs of the failed duplications
+     * @param pMaxBody the maximum number of bytes of the body logged
+     * @param pSampling one failure out of pSampling is logged per destination, 1 logs them all
+     */
+    void
+    setErrorLog(unsigned pMaxBody, unsigned pSampling);
+
+    /**
+     * @brief Pins a destination name to an address instead of resolving it
+     * @param pHost the name of the destination
+     * @param pPort the port of the destination
+     * @param pAddress the address, or addresses separated by commas, IPv6 ones between brackets
+     */
+    void
+    addResolve(const std::string &pHost, unsigned pPort, const std::string &pAddress);
+
+    /**
+     * @brief Forgets the destination names pinned, before the configuration is read again
+     */
+    void
+    clearResolve();
+
+    /**
+     * @brief Start the retry thread if retries are configured
+     */
+    void
+    startRetries();
+
+    /**
+     * @brief Stop the retry thread, pending retries are abandoned
+     */
+    void
+    stopRetries();
+
+    /**
+     * @brief Get the number of retries scheduled and of abandoned duplications since last call to this method
+     * @return The counts in the "scheduled/abandoned" format
+     */
+    const std::string
+    getRetryCounts();
+
+    /**
+     * @brief Gives the priority of a request in the queue: PROTECTED for the X_DUP_LOG requests, that of their location otherwise
+     * @param pRequest the queued request
+     * @return the priority
+     */
+    QueuePriority::eQueuePriority
+    queuePriority(const boost::shared_ptr<RequestInfo> &pRequest);
+
+    /**
+     * @brief Accounts for a request dropped by the queue, for its priority, the reason and its location
+     * The filters did not run: the destination it would have gone to is not known.
+     * @param pRequest the dropped request
+     * @param pReason why the queue dropped it
+     */
+    void
+    dropped(const boost::shared_ptr<RequestInfo> &pRequest, DropReason::eDropReason pReason);
+
+    /**
+     * @brief Gives the memory held by a request in the queue, its strings included
+     * @param pRequest the queued request
+     * @return the size in bytes
+     */
+    static size_t
+    queuedSize(const boost::shared_ptr<RequestInfo> &pRequest);
+
+    /**
+     * @brief Get the destinations of all the locations, once the configuration is read
+     * @return the destinations, sorted
+     */
+    std::vector<std::string>
+    getDestinations() const;
+
+    /**
+     * @brief Get the number of requests dropped since last call to this method
+     * @return The counts per priority in the "low/normal/high" format, per reason in the "refused/evicted" format,
+     * followed by the counts per location as "<location>:<count>"
+     */
+    const std::string
+    getDropCounts();
+
+    /**
+     * @brief Get the number of failed duplications not logged because of the sampling since last call to this method
+     * @return The counts per error and destination in the "<http|curl><code>@<destination>=<count>" format, "-" if none
+     */
+    const std::string
+    getErrorLogSkips();
+
+    /**
+     * @brief Get the percentiles of the durations measured since last call to this method
+     * @return the p50/p90/p99/max in micro sec of the filters, and of the substitutions, sends and end to end durations per destination
+     */
+    const std::string
+    getLatencies();
+
+    /**
+     * @brief Get the evaluations, matches, prevents and cost of the filters since the start of the child
+     * @return "label=evaluations/matches/prevents/us ..." the most expensive filters first
+     */
+    const std::string
+    getFilterStats();
+
+    /**
+     * @brief Told the load of the pool by its manager after each manage interval, off the request path
+     * Publishes it in the scoreboard, and refreshes the filters every cFilterRefreshTicks calls.
+     * @param pQueued the number of queued requests
+     * @param pQueuedBytes the memory they hold
+     * @param pThreads the number of duplication threads
+     */
+    void
+    onLoad(size_t pQueued, size_t pQueuedBytes, size_t pThreads);
+
+    /**
+     * @brief Get the scoreboard shared by the children, to create it in the parent and take a slot in the children
+     */
+    Scoreboard &
+    getScoreboard() { return mScoreboard; }
+
     /**
      * @brief Set the url codec
      * @param pUrlCodec the codec to use
@@ -318,12 +695,23 @@ public:
     matchesFilter(RequestInfo &pRequest, const Commands &pCommands);
 
     /**
-     * @brief Parses arguments into key valye pairs. Also url-decodes values and converts keys to upper case.
-     * @param pParsedArgs the list which should be filled with the key value pairs
-     * @param pArgs the parameters part of the query
+     * @brief Early filter evaluation, done before the request and answer bodies are buffered
+     * Only the filters on the method, path, query string and headers are evaluated,
+     * filters which need the body or the final http status are considered as possibly matching
+     * @param pRequest the incoming request with its method, path, args, headers and conf set
+     * @param pStatusKnown true if the X_DUP_HTTP_STATUS header of pRequest holds the final status
+     * @return false if no filter of any destination can match this request, true otherwise
      */
-    void
-    parseArgs(tKeyValList &pParsedArgs, const std::string &pArgs);
+    bool
+    mayMatchFilters(const RequestInfo &pRequest, bool pStatusKnown);
+
+    /**
+     * @brief Locates the key value pairs of arguments, without copying nor decoding them
+     * @param pParsedArgs cleared then filled with the pairs, in order, its capacity is reused
+     * @param pArgs the parameters part of the query, or an urlencoded body
+     */
+    static void
+    parseArgs(tArgSpans &pParsedArgs, const std::string &pArgs);
 
     /**
      * @brief Process a field. This includes filtering and executing substitutions
@@ -342,42 +730,183 @@ public:
 
     /**
      * @brief initialize curl handle and common curl options
+     * The handle shares the caches of the processor and resolves the names pinned
      * @return a curl handle
      */
     CURL * initCurl();
 
-    void
+    /**
+     * @brief initialize the multi handle of a thread running synchronous duplications
+     * @return the handles of the thread, NULL on failure
+     */
+    tMultiCurl * initMultiCurl();
+
+    /**
+     * @brief send one duplication
+     * @return true if the duplication failed with an error that makes a retry safe: connection failure or 503
+     */
+    bool
     performCurlCall(CURL *curl, const tFilter &matchedFilter, RequestInfo &rInfo);
 
+    /**
+     * @brief send one duplication of a request as rewritten for its destination
+     * @param pOutcome receives the response headers and status of the duplication
+     * @return true if the duplication failed with an error that makes a retry safe: connection failure or 503
+     */
+    bool
+    performCurlCall(CURL *curl, const tFilter &matchedFilter, const RequestOverlay &pRequest, RequestInfo &pOutcome);
+
     /**
      * @brief perform one or more curl(s) for one request if it matches
      * if running more than one curl because of multiple destinations
      * or destination >100%, the curls are done sequentially by the same thread/handle/connection
      * so it prevents load balancing and may create spikes on destination servers
      * however, this is preferable than a parallel spike.
-     * @param reqInfo the RequestInfo instance for this request
+     * @param pRequest the RequestInfo instance for this request, shared with the retries
      * @param pCurl a preinitialized curl handle
      * @param stillRunning ref to see if queue is still running
      */
-    void runOne(RequestInfo &reqInfo, CURL * pCurl, const bool & stillRunning);
+    void runOne(const boost::shared_ptr<RequestInfo> &pRequest, CURL * pCurl, const bool & stillRunning);
+
+    /**
+     * @brief perform the curl(s) for one request concurrently, used by the synchronous duplication
+     * All the duplications share one deadline, the timeout of outgoing requests: the caller waits for the slowest
+     * destination instead of the sum of all of them. The duplications still running at the deadline are abandoned.
+     * Without a timeout there is no deadline.
+     * @param pRequest the RequestInfo instance for this request, receives the outcome of the duplications
+     * @param pSync the curl handles of the calling thread
+     */
+    void runSync(const boost::shared_ptr<RequestInfo> &pRequest, tMultiCurl &pSync);
+
+    /**
+     * @brief perform the curl(s) for a batch of requests, up to a number of them at once
+     * A duplication starts as soon as the caps allow it, so the requests hold the worker for about
+     * the latency of their slowest destination instead of the sum of them.
+     * The caps are shared by the whole batch: the duplications of its requests to one destination reuse the same connections.
+     * @param pRequests the RequestInfo instances of the requests, receive the outcome of their duplications
+     * @param pMulti the curl handles of the calling thread
+     * @param pMaxSends the maximum number of duplications in flight
+     * @param pMaxSendsPerDestination the maximum number of duplications in flight to one destination
+     * @param pDeadline the duplications still running at this time are abandoned, not_a_date_time for none
+     * @param stillRunning no more duplication is started once false
+     */
+    void runConcurrently(const std::vector<boost::shared_ptr<RequestInfo> > &pRequests, tMultiCurl &pMulti,
+                         size_t pMaxSends, size_t pMaxSendsPerDestination,
+                         const boost::posix_time::ptime &pDeadline, const bool &stillRunning);
 
 private:
 
+    /**
+     * @brief Lists the duplications of a request: one per matching destination and amplification,
+     * the substitutions of a destination are run once and shared by its duplications
+     */
+    std::list<tDuplication>
+    planDuplications(const boost::shared_ptr<RequestInfo> &pRequest);
+
+    /**
+     * @brief Sets up a curl handle to send one duplication
+     * @param pTransfer receives what must be kept until the transfer is done
+     */
+    void
+    startCurlCall(CURL *curl, const tFilter &matchedFilter, const RequestOverlay &pRequest, RequestInfo &pOutcome, tCurlTransfer &pTransfer);
+
+    /**
+     * @brief Releases the resources of a transfer and logs its failure, pOutcome.mCurlCompResponseStatus must be set
+     * @return true if the duplication failed with an error that makes a retry safe: connection failure or 503
+     */
     bool
-    substituteRequest(RequestInfo &pRequest, Commands &pCommands);
+    endCurlCall(CURL *curl, const tFilter &matchedFilter, const RequestOverlay &pRequest, RequestInfo &pOutcome, tCurlTransfer &pTransfer);
 
-    const tFilter *
-    keyFilterMatch(const tFiltersMap &pFilters, const tKeyValList &pParsedArgs,
-            ApplicationScope::eApplicationScope scope, tFilter::eFilterTypes eType);
+    /**
+     * @brief Schedule the retry of a failed duplication, the request is shared and not copied
+     */
+    void
+    retryLater(const tFilter &pFilter, const RequestOverlay &pRequest);
+
+    /**
+     * @brief Run the loop which sends the retries when they are due
+     */
+    void
+    runRetries();
+
+    /**
+     * @brief Logs a failed duplication with its body, or the match of DupErrorLogBodyMatch, bounded, if selected by the sampling of its destination
+     */
+    void
+    logFailure(const tFilter &pFilter, const std::string &pUri, const std::string &pBody, int pCurlCode, long pHttpCode);
+
+    /**
+     * @brief Records a duration in the histograms of the thread and in the slot of the child in the scoreboard
+     */
+    void
+    recordLatency(Latency::eLatency pLatency, const std::string &pDestination, uint64_t pValue);
 
+    /**
+     * @brief Runs the regex of a filter on a field, counting the evaluation and its cost in the filter profiler
+     * @param pFilter the filter
+     * @param pField the field to search
+     * @param pWhat receives the match if not NULL
+     * @return true if the regex matched
+     */
     bool
-    keySubstitute(tFieldSubstitutionMap &pSubs,
-            tKeyValList &pParsedArgs,
-            ApplicationScope::eApplicationScope scope,
-            std::string &result);
+    searchFilter(const tFilter &pFilter, const std::string &pField, boost::smatch *pWhat = NULL);
+
+    /**
+     * @brief Runs a REGULAR raw filter on the fields of its scope, recording what it matched
+     * @param pFlatHeaders the flattened headers of the request, set on the first use
+     * @return true if the filter matched
+     */
+    bool
+    matchesRawFilter(const tFilter &pFilter, const RequestInfo &pRequest, std::string &pFlatHeaders);
+
+    /**
+     * @brief Merges the counters of the filters, publishes them in the scoreboard and decays them into mFilterRates,
+     * then computes the order of the raw filters of the locations with DupReorderFilters
+     * Run by the manager of the pool, the request threads only load the orders.
+     */
+    void
+    refreshFilters();
+
+    /**
+     * @brief Sorts the REGULAR raw filters of a destination by their cost divided by their match rate, from their decayed counters,
+     * the filters which were not evaluated first
+     * Only the consecutive filters of the same duplication type are swapped, the filter matching a request keeps its type.
+     */
+    boost::shared_ptr<const std::vector<const tFilter *> >
+    computeRawFilterOrder(const Commands &pCommands);
+
     bool
-    headerSubstitute(tFieldSubstitutionMap &pSubs,
-                     tKeyValList &pHeadersIn);
+    substituteRequest(RequestInfo &pRequest, Commands &pCommands);
+
+    /**
+     * @brief Rewrites a request for a destination, only the substituted fields are stored in the overlay
+     * @return true if a substitution was run
+     */
+    bool
+    substituteRequest(RequestOverlay &pRequest, Commands &pCommands);
+
+    const tFilter *
+    keyFilterMatch(const tFiltersMap &pFilters, const tHeaders &pHeaders,
+            ApplicationScope::eApplicationScope scope, tFilter::eFilterTypes eType,
+            bool pRecordMatch = true);
+
+    /**
+     * @brief Same as above on parsed arguments, whose values are only decoded if filters apply to their key
+     * @param pArgs the arguments pParsedArgs point into
+     */
+    const tFilter *
+    keyFilterMatch(const tFiltersMap &pFilters, const std::string &pArgs, const tArgSpans &pParsedArgs,
+            ApplicationScope::eApplicationScope scope, tFilter::eFilterTypes eType,
+            bool pRecordMatch = true);
+
+    /**
+     * @brief The first of the filters of a key with this scope and type which matches its value
+     */
+    const tFilter *
+    valueFilterMatch(const tFiltersMap::tRange &pFilters, const std::string &pValue,
+            ApplicationScope::eApplicationScope scope, tFilter::eFilterTypes eType,
+            bool pRecordMatch);
+
 
     friend class ::TestRequestProcessor;
     friend class ::TestModDup;
@@ -0,0 +1,140 @@
+/*
+* mod_dup - duplicates apache requests
+*
+* Copyright (C) 2017 Orange
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "RetryQueue.hh"
+#include "Log.hh"
+
+#include <cstdlib>
+#include <unistd.h>
+
+using namespace boost::posix_time;
+
+namespace DupModule {
+
+RetryQueue::RetryQueue() :
+    mMaxAttempts(0), mDeadline(0), mBaseDelay(0),
+    mShare(10),
+    mTokens(0),
+    mSeed(getpid()),
+    mScheduledCount(0), mAbandonedCount(0),
+    mRunning(true)
+{
+}
+
+void RetryQueue::setRetries(unsigned pMaxAttempts, unsigned pDeadline, unsigned pBaseDelay)
+{
+    mMaxAttempts = pMaxAttempts;
+    mDeadline = pDeadline;
+    mBaseDelay = pBaseDelay;
+}
+
+void RetryQueue::setShare(unsigned pPercentage)
+{
+    mShare = pPercentage;
+}
+
+void RetryQueue::earn()
+{
+    // Approximate capping is fine, the budget only has to be bounded
+    if (mTokens < mMaxTokens) {
+        __sync_fetch_and_add(&mTokens, mShare);
+    }
+}
+
+bool RetryQueue::spend()
+{
+    unsigned lTokens = mTokens;
+    while (lTokens >= 100) {
+        if (__sync_bool_compare_and_swap(&mTokens, lTokens, lTokens - 100)) {
+            return true;
+        }
+        lTokens = mTokens;
+    }
+    return false;
+}
+
+bool RetryQueue::schedule(tRetryItem pItem)
+{
+    ptime lNow = microsec_clock::universal_time();
+    if (pItem.mDeadline.is_not_a_date_time()) {
+        pItem.mDeadline = lNow + milliseconds(mDeadline);
+    }
+    {
+        boost::lock_guard<boost::mutex> lLock(mMutex);
+        // Exponential backoff with jitter on the upper half, so that retries of a burst of failures spread out
+        unsigned lDelay = mBaseDelay << std::min(pItem.mAttempts, 16u);
+        lDelay = lDelay / 2 + rand_r(&mSeed) % (lDelay / 2 + 1);
+        ptime lDue = lNow + milliseconds(lDelay);
+        if (!mRunning || pItem.mAttempts >= mMaxAttempts || lDue > pItem.mDeadline ||
+            mQueue.size() >= mMaxQueued || !spend()) {
+            __sync_fetch_and_add(&mAbandonedCount, 1);
+            return false;
+        }
+        pItem.mAttempts++;
+        mQueue.insert(std::make_pair(lDue, pItem));
+    }
+    __sync_fetch_and_add(&mScheduledCount, 1);
+    mCondition.notify_one();
+    return true;
+}
+
+bool RetryQueue::pop(tRetryItem &pItem)
+{
+    boost::unique_lock<boost::mutex> lLock(mMutex);
+    while (mRunning) {
+        if (mQueue.empty()) {
+            mCondition.wait(lLock);
+            continue;
+        }
+        tTimerQueue::iterator lFirst = mQueue.begin();
+        if (lFirst->first > microsec_clock::universal_time()) {
+            // Woken up earlier if a retry due sooner gets scheduled
+            mCondition.timed_wait(lLock, lFirst->first);
+            continue;
+        }
+        pItem = lFirst->second;
+        mQueue.erase(lFirst);
+        return true;
+    }
+    return false;
+}
+
+void RetryQueue::stop()
+{
+    {
+        boost::lock_guard<boost::mutex> lLock(mMutex);
+        mRunning = false;
+        mQueue.clear();
+    }
+    mCondition.notify_all();
+}
+
+size_t RetryQueue::size()
+{
+    boost::lock_guard<boost::mutex> lLock(mMutex);
+    return mQueue.size();
+}
+
+void RetryQueue::getCounters(unsigned &pScheduledCount, unsigned &pAbandonedCount)
+{
+    // Atomic read + reset
+    pScheduledCount = __sync_fetch_and_and(&mScheduledCount, 0);
+    pAbandonedCount = __sync_fetch_and_and(&mAbandonedCount, 0);
+}
+
+}
@@ -0,0 +1,155 @@
+/*
+* mod_dup - duplicates apache requests
+*
+* Copyright (C) 2017 Orange
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <map>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include "RequestInfo.hh"
+
+namespace DupModule {
+
+class tFilter;
+
+/**
+ * @brief A duplication which failed and waits to be sent again
+ */
+struct tRetryItem {
+
+    tRetryItem() : mFilter(NULL), mAttempts(0) {}
+
+    /** @brief The request as rewritten for the destination, it keeps the shared original request alive */
+    boost::shared_ptr<RequestOverlay> mRequest;
+    /** @brief The filter that matched, holds the destination and the duplication type */
+    const tFilter *mFilter;
+    /** @brief The number of retries already scheduled for this duplication */
+    unsigned mAttempts;
+    /** @brief Past this time the duplication is abandoned, set on the first failure */
+    boost::posix_time::ptime mDeadline;
+};
+
+/**
+ * @brief A thread safe queue of failed duplications ordered by the time at which they must be retried.
+ * Retries are delayed with a jittered exponential backoff and abandoned after a maximum number of attempts or a deadline.
+ * They are also limited by a retry budget: each fresh duplication earns a share of a retry and each retry spends one,
+ * so that retries never compete with the fresh traffic beyond the configured share.
+ */
+class RetryQueue
+{
+public:
+    /**
+     * @brief Constructs a disabled RetryQueue
+     */
+    RetryQueue();
+
+    /**
+     * @brief Configures the retries
+     * @param pMaxAttempts the maximum number of retries of a duplication, 0 disables the retries
+     * @param pDeadline the time in ms after the first failure past which a duplication is abandoned
+     * @param pBaseDelay the delay in ms before the first retry, doubled at each attempt
+     */
+    void setRetries(unsigned pMaxAttempts, unsigned pDeadline, unsigned pBaseDelay);
+
+    /**
+     * @brief Sets the share of the fresh traffic that the retries may use
+     * @param pPercentage the maximum number of retries per 100 fresh duplications
+     */
+    void setShare(unsigned pPercentage);
+
+    /**
+     * @brief Returns true if retries are configured
+     */
+    bool isEnabled() const { return mMaxAttempts > 0; }
+
+    /**
+     * @brief Adds the share of one fresh duplication to the retry budget
+     */
+    void earn();
+
+    /**
+     * @brief Schedules the retry of a failed duplication
+     * It is abandoned if it was retried too many times, if the next try would miss its deadline,
+     * if the retry budget is exhausted or if the queue is full
+     * @param pItem the failed duplication
+     * @return true if the retry is scheduled
+     */
+    bool schedule(tRetryItem pItem);
+
+    /**
+     * @brief Removes the first item due. Blocks until an item is due or the queue is stopped
+     * @param pItem filled with the item due
+     * @return false if the queue was stopped
+     */
+    bool pop(tRetryItem &pItem);
+
+    /// @brief Wakes up and releases the poppers, pending retries are abandoned
+    void stop();
+
+    /**
+     * @brief Returns the number of retries waiting
+     */
+    size_t size();
+
+    /**
+     * @brief Gets the counters then resets them
+     * @param pScheduledCount the number of retries scheduled since last call
+     * @param pAbandonedCount the number of failed duplications abandoned since last call
+     */
+    void getCounters(unsigned &pScheduledCount, unsigned &pAbandonedCount);
+
+private:
+    /** @brief Takes one retry from the budget, returns false if exhausted */
+    bool spend();
+
+    typedef std::multimap<boost::posix_time::ptime, tRetryItem> tTimerQueue;
+
+    /** @brief The retries ordered by due time */
+    tTimerQueue mQueue;
+    /** @brief The mutex used to ensure thread safety */
+    boost::mutex mMutex;
+    /** @brief Signaled when an item is scheduled or the queue stopped */
+    boost::condition_variable mCondition;
+    /** @brief The maximum number of retries of a duplication */
+    unsigned mMaxAttempts;
+    /** @brief The deadline in ms after the first failure */
+    unsigned mDeadline;
+    /** @brief The delay in ms before the first retry */
+    unsigned mBaseDelay;
+    /** @brief The number of retries per 100 fresh duplications */
+    unsigned mShare;
+    /** @brief The retry budget, in hundredths of retry */
+    volatile unsigned mTokens;
+    /** @brief Seed for the backoff jitter */
+    unsigned mSeed;
+    /** @brief Number of retries scheduled since last call to getCounters */
+    volatile unsigned mScheduledCount;
+    /** @brief Number of duplications abandoned since last call to getCounters */
+    volatile unsigned mAbandonedCount;
+    /** @brief false once stopped */
+    bool mRunning;
+
+    /** @brief The maximum number of retries waiting */
+    static const size_t mMaxQueued = 10000;
+    /** @brief The maximum retry budget, bounds the burst of retries after a long stable period */
+    static const unsigned mMaxTokens = 100 * 100;
+};
+
+}
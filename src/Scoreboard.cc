@@ -0,0 +1,675 @@
+/*
+* mod_dup - duplicates apache requests
+*
+* Copyright (C) 2017 Orange
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "Scoreboard.hh"
+#include "Log.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <new>
+#include <signal.h>
+#include <sstream>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <boost/lexical_cast.hpp>
+
+namespace DupModule {
+
+namespace ScoreboardCounter {
+
+const char *enumToString(eCounter pCounter)
+{
+    switch (pCounter) {
+    case DUPLICATED:
+        return "dup";
+    case TIMEOUT:
+        return "tmout";
+    case DROPPED:
+        return "drop";
+    default:
+        return "?";
+    }
+}
+
+const char *enumToMetric(eCounter pCounter)
+{
+    switch (pCounter) {
+    case DUPLICATED:
+        return "duplications";
+    case TIMEOUT:
+        return "timeouts";
+    case DROPPED:
+        return "drops";
+    default:
+        return "unknown";
+    }
+}
+
+}
+
+namespace ScoreboardDrop {
+
+const char *enumToString(eDrop pDrop)
+{
+    switch (pDrop) {
+    case REFUSED:
+        return "refused";
+    case EVICTED:
+        return "evicted";
+    case ABANDONED:
+        return "abandoned";
+    default:
+        return "unknown";
+    }
+}
+
+}
+
+namespace ScoreboardGauge {
+
+const char *enumToString(eGauge pGauge)
+{
+    switch (pGauge) {
+    case QUEUED:
+        return "queued";
+    case QUEUED_BYTES:
+        return "queued_bytes";
+    case THREADS:
+        return "threads";
+    case IN_FLIGHT:
+        return "in_flight";
+    default:
+        return "unknown";
+    }
+}
+
+}
+
+/** @brief Changed whenever the layout of the shared memory changes */
+static const uint32_t cMagic = 0xd0b5c004;
+
+/**
+ * @brief Whether a process which owned a slot is still running
+ */
+static bool isAlive(pid_t pPid)
+{
+    return pPid && (kill(pPid, 0) == 0 || errno != ESRCH);
+}
+
+tScoreboardTotals::tScoreboardTotals()
+    : mChildren(0)
+{
+    std::fill(mCounters, mCounters + ScoreboardCounter::NB_COUNTERS, 0);
+    std::fill(mDrops, mDrops + ScoreboardDrop::NB_DROPS, 0);
+    std::fill(mGauges, mGauges + ScoreboardGauge::NB_GAUGES, 0);
+}
+
+Scoreboard::Scoreboard()
+    : mHeader(NULL)
+    , mSlots(NULL)
+    , mSlot(NULL)
+    , mNbSlots(0)
+{
+}
+
+Scoreboard::~Scoreboard()
+{
+    if (mHeader) {
+        munmap(mHeader, sizeFor(mNbSlots));
+    }
+}
+
+size_t Scoreboard::sizeFor(unsigned pSlots)
+{
+    return sizeof(tHeader) + pSlots * sizeof(tScoreboardSlot);
+}
+
+bool Scoreboard::matches(unsigned pSlots, const std::vector<std::string> &pDestinations) const
+{
+    if (mHeader->mMagic != cMagic || mHeader->mSlots != pSlots || mHeader->mNbDestinations != pDestinations.size()) {
+        return false;
+    }
+    for (unsigned i = 0; i < pDestinations.size(); ++i) {
+        if (pDestinations[i] != mHeader->mDestinations[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Scoreboard::create(const std::string &pName, unsigned pSlots, const std::vector<std::string> &pDestinations)
+{
+    std::vector<std::string> lDestinations;
+    for (std::vector<std::string>::const_iterator lIt = pDestinations.begin(); lIt != pDestinations.end(); ++lIt) {
+        if (lDestinations.size() == cScoreboardDestinations) {
+            Log::warn(305, "[DUP] Only the first %u destinations are counted separately in the scoreboard", cScoreboardDestinations);
+            break;
+        }
+        if (lIt->size() < sizeof(mHeader->mDestinations[0])) {
+            lDestinations.push_back(*lIt);
+        }
+    }
+
+    if (mHeader) {
+        // postConfig runs twice on start
+        if (mName == pName && matches(pSlots, lDestinations)) {
+            return true;
+        }
+        munmap(mHeader, sizeFor(mNbSlots));
+        mHeader = NULL;
+        mSlots = mSlot = NULL;
+        mDestinationIndexes.clear();
+    }
+
+    const size_t lSize = sizeFor(pSlots);
+    int lFd = shm_open(pName.c_str(), O_RDWR | O_CREAT, 0600);
+    if (lFd < 0) {
+        Log::error(406, "[DUP] Cannot open the scoreboard named: %s. What: %s", pName.c_str(), strerror(errno));
+        return false;
+    }
+    struct stat lStat;
+    const bool lResized = fstat(lFd, &lStat) || lStat.st_size != static_cast<off_t>(lSize);
+    if (lResized && ftruncate(lFd, lSize)) {
+        Log::error(406, "[DUP] Failed to truncate the scoreboard named: %s. What: %s", pName.c_str(), strerror(errno));
+        close(lFd);
+        return false;
+    }
+    void *lAddr = mmap(NULL, lSize, PROT_READ | PROT_WRITE, MAP_SHARED, lFd, 0);
+    close(lFd);
+    if (lAddr == MAP_FAILED) {
+        Log::error(406, "[DUP] Cannot map the scoreboard named: %s. What: %s", pName.c_str(), strerror(errno));
+        return false;
+    }
+
+    mName = pName;
+    mHeader = static_cast<tHeader *>(lAddr);
+    mSlots = reinterpret_cast<tScoreboardSlot *>(mHeader + 1);
+    mNbSlots = pSlots;
+    if (lResized || !matches(pSlots, lDestinations)) {
+        // The destinations are part of the layout of the slots
+        mHeader->mMagic = 0;
+        for (unsigned i = 0; i < pSlots; ++i) {
+            new (&mSlots[i]) tScoreboardSlot();
+        }
+        mHeader->mSlots = pSlots;
+        mHeader->mNbDestinations = lDestinations.size();
+        for (unsigned i = 0; i < lDestinations.size(); ++i) {
+            strncpy(mHeader->mDestinations[i], lDestinations[i].c_str(), sizeof(mHeader->mDestinations[i]));
+        }
+        mHeader->mMagic = cMagic;
+        Log::debug("[DUP] Scoreboard %s initialized with %u slots", pName.c_str(), pSlots);
+    }
+    for (unsigned i = 0; i < lDestinations.size(); ++i) {
+        mDestinationIndexes[lDestinations[i]] = i;
+    }
+    return true;
+}
+
+void Scoreboard::destroy()
+{
+    if (mHeader) {
+        munmap(mHeader, sizeFor(mNbSlots));
+        mHeader = NULL;
+        mSlots = mSlot = NULL;
+        mDestinationIndexes.clear();
+        shm_unlink(mName.c_str());
+    }
+}
+
+bool Scoreboard::claimSlot()
+{
+    if (!mHeader) {
+        return false;
+    }
+    const pid_t lPid = getpid();
+    if (mSlot && mSlot->mPid == lPid) {
+        return true;
+    }
+    for (unsigned i = 0; i < mNbSlots; ++i) {
+        const pid_t lOwner = mSlots[i].mPid;
+        if (lOwner != lPid && isAlive(lOwner)) {
+            continue;
+        }
+        // Another child may take it first
+        if (__sync_bool_compare_and_swap(&mSlots[i].mPid, lOwner, lPid)) {
+            mSlot = &mSlots[i];
+            return true;
+        }
+    }
+    mSlot = &mSlots[lPid % mNbSlots];
+    Log::warn(305, "[DUP] No free slot in the scoreboard %s for child %d, sharing one", mName.c_str(), lPid);
+    return true;
+}
+
+void Scoreboard::count(ScoreboardCounter::eCounter pCounter, uint64_t pCount)
+{
+    if (mSlot) {
+        __sync_fetch_and_add(&mSlot->mCounters[pCounter], pCount);
+    }
+}
+
+int Scoreboard::destinationIndex(const std::string &pDestination) const
+{
+    std::map<std::string, unsigned>::const_iterator lIt = mDestinationIndexes.find(pDestination);
+    return lIt == mDestinationIndexes.end() ? -1 : lIt->second;
+}
+
+void Scoreboard::countDestination(ScoreboardCounter::eCounter pCounter, const std::string &pDestination, uint64_t pCount)
+{
+    const int lIndex = destinationIndex(pDestination);
+    if (mSlot && lIndex >= 0) {
+        __sync_fetch_and_add(&mSlot->mDestinations[lIndex].mCounters[pCounter], pCount);
+    }
+}
+
+void Scoreboard::countDrop(ScoreboardDrop::eDrop pDrop)
+{
+    if (mSlot) {
+        __sync_fetch_and_add(&mSlot->mDrops[pDrop], 1);
+    }
+}
+
+void Scoreboard::setLoad(size_t pQueued, size_t pQueuedBytes, size_t pThreads)
+{
+    if (mSlot) {
+        mSlot->mGauges[ScoreboardGauge::QUEUED] = pQueued;
+        mSlot->mGauges[ScoreboardGauge::QUEUED_BYTES] = pQueuedBytes;
+        mSlot->mGauges[ScoreboardGauge::THREADS] = pThreads;
+    }
+}
+
+void Scoreboard::addInFlight(const std::string &pDestination, int pDelta)
+{
+    if (!mSlot) {
+        return;
+    }
+    __sync_fetch_and_add(&mSlot->mGauges[ScoreboardGauge::IN_FLIGHT], pDelta);
+    const int lIndex = destinationIndex(pDestination);
+    if (lIndex >= 0) {
+        __sync_fetch_and_add(&mSlot->mDestinations[lIndex].mInFlight, pDelta);
+    }
+}
+
+void Scoreboard::record(Latency::eLatency pLatency, const std::string &pDestination, uint64_t pValue)
+{
+    if (!mSlot) {
+        return;
+    }
+    mSlot->mLatencies[pLatency].record(pValue);
+    const int lIndex = destinationIndex(pDestination);
+    if (lIndex >= 0) {
+        mSlot->mDestinations[lIndex].mLatencies[pLatency].record(pValue);
+    }
+}
+
+/**
+ * @brief Orders the filters the most expensive first
+ */
+static bool moreExpensive(const std::pair<std::string, tFilterCounters> &pFirst, const std::pair<std::string, tFilterCounters> &pSecond)
+{
+    return pFirst.second.mNs > pSecond.second.mNs;
+}
+
+void Scoreboard::setFilters(const std::vector<std::pair<std::string, tFilterCounters> > &pTotals)
+{
+    if (!mSlot) {
+        return;
+    }
+    std::vector<std::pair<std::string, tFilterCounters> > lFilters;
+    for (std::vector<std::pair<std::string, tFilterCounters> >::const_iterator lIt = pTotals.begin(); lIt != pTotals.end(); ++lIt) {
+        if (lIt->second.mEvaluations) {
+            lFilters.push_back(*lIt);
+        }
+    }
+    std::stable_sort(lFilters.begin(), lFilters.end(), moreExpensive);
+    lFilters.resize(std::min<size_t>(lFilters.size(), cScoreboardFilters));
+
+    // Full barriers: the readers see the version odd, or even and unchanged around a consistent copy
+    __sync_fetch_and_add(&mSlot->mFiltersVersion, 1);
+    for (unsigned i = 0; i < lFilters.size(); ++i) {
+        tScoreboardFilter &lFilter = mSlot->mFilters[i];
+        strncpy(lFilter.mLabel, lFilters[i].first.c_str(), sizeof(lFilter.mLabel) - 1);
+        lFilter.mLabel[sizeof(lFilter.mLabel) - 1] = 0;
+        lFilter.mCounters = lFilters[i].second;
+    }
+    mSlot->mNbFilters = lFilters.size();
+    __sync_fetch_and_add(&mSlot->mFiltersVersion, 1);
+}
+
+void Scoreboard::addFilters(const tScoreboardSlot &pSlot, std::map<std::string, tFilterCounters> &pTotals)
+{
+    const uint32_t lVersion = pSlot.mFiltersVersion;
+    __sync_synchronize();
+    tScoreboardFilter lFilters[cScoreboardFilters];
+    const unsigned lNbFilters = std::min<unsigned>(pSlot.mNbFilters, cScoreboardFilters);
+    std::copy(pSlot.mFilters, pSlot.mFilters + lNbFilters, lFilters);
+    __sync_synchronize();
+    if ((lVersion & 1) || pSlot.mFiltersVersion != lVersion) {
+        // Published again in a manage interval
+        return;
+    }
+    for (unsigned i = 0; i < lNbFilters; ++i) {
+        tFilterCounters &lTotal = pTotals[std::string(lFilters[i].mLabel, strnlen(lFilters[i].mLabel, sizeof(lFilters[i].mLabel)))];
+        lTotal.mEvaluations += lFilters[i].mCounters.mEvaluations;
+        lTotal.mMatches += lFilters[i].mCounters.mMatches;
+        lTotal.mPrevents += lFilters[i].mCounters.mPrevents;
+        lTotal.mNs += lFilters[i].mCounters.mNs;
+    }
+}
+
+void Scoreboard::aggregate(tScoreboardTotals &pTotals) const
+{
+    if (!mHeader) {
+        return;
+    }
+    pTotals.mDestinations.resize(mHeader->mNbDestinations);
+    for (unsigned i = 0; i < mHeader->mNbDestinations; ++i) {
+        pTotals.mDestinations[i].first = mHeader->mDestinations[i];
+        pTotals.mDestinations[i].second = tScoreboardDestination();
+    }
+    std::map<std::string, tFilterCounters> lFilters;
+    for (unsigned i = 0; i < mNbSlots; ++i) {
+        const tScoreboardSlot &lSlot = mSlots[i];
+        if (!lSlot.mPid) {
+            continue;
+        }
+        const bool lAlive = isAlive(lSlot.mPid);
+        if (lAlive) {
+            ++pTotals.mChildren;
+            for (unsigned j = 0; j < ScoreboardGauge::NB_GAUGES; ++j) {
+                pTotals.mGauges[j] += lSlot.mGauges[j];
+            }
+            // Counted since the child started
+            addFilters(lSlot, lFilters);
+        }
+        for (unsigned j = 0; j < ScoreboardCounter::NB_COUNTERS; ++j) {
+            pTotals.mCounters[j] += lSlot.mCounters[j];
+        }
+        for (unsigned j = 0; j < ScoreboardDrop::NB_DROPS; ++j) {
+            pTotals.mDrops[j] += lSlot.mDrops[j];
+        }
+        for (unsigned j = 0; j < mHeader->mNbDestinations; ++j) {
+            tScoreboardDestination &lTotal = pTotals.mDestinations[j].second;
+            for (unsigned k = 0; k < ScoreboardCounter::NB_COUNTERS; ++k) {
+                lTotal.mCounters[k] += lSlot.mDestinations[j].mCounters[k];
+            }
+            if (lAlive) {
+                lTotal.mInFlight += lSlot.mDestinations[j].mInFlight;
+            }
+            for (unsigned k = 0; k < Latency::NB_LATENCIES; ++k) {
+                lSlot.mDestinations[j].mLatencies[k].addTo(lTotal.mLatencies[k]);
+            }
+        }
+        for (unsigned j = 0; j < Latency::NB_LATENCIES; ++j) {
+            lSlot.mLatencies[j].addTo(pTotals.mLatencies[j]);
+        }
+    }
+    pTotals.mFilters.assign(lFilters.begin(), lFilters.end());
+    std::stable_sort(pTotals.mFilters.begin(), pTotals.mFilters.end(), moreExpensive);
+}
+
+const std::string Scoreboard::getSummary() const
+{
+    if (!mHeader) {
+        return "-";
+    }
+    tScoreboardTotals lTotals;
+    aggregate(lTotals);
+    std::string lSummary = "children=" + boost::lexical_cast<std::string>(lTotals.mChildren);
+    for (unsigned i = 0; i < ScoreboardCounter::NB_COUNTERS; ++i) {
+        lSummary += std::string(" ") + ScoreboardCounter::enumToString(static_cast<ScoreboardCounter::eCounter>(i)) +
+            "=" + boost::lexical_cast<std::string>(lTotals.mCounters[i]);
+    }
+    for (unsigned i = 0; i < Latency::NB_LATENCIES; ++i) {
+        if (lTotals.mLatencies[i].count()) {
+            lSummary += std::string(" ") + Latency::enumToString(static_cast<Latency::eLatency>(i)) +
+                "=" + lTotals.mLatencies[i].summary();
+        }
+    }
+    return lSummary;
+}
+
+/** @brief The percentiles of the latencies in the status */
+static const double cPercentiles[] = {50, 90, 99};
+
+/**
+ * @brief Escapes a destination or a filter for a JSON string or a Prometheus label value, which share the same rules
+ * but for the control characters, only allowed as is in the label values
+ */
+static std::string escape(const std::string &pValue, bool pJson = false)
+{
+    std::string lEscaped;
+    for (std::string::const_iterator lIt = pValue.begin(); lIt != pValue.end(); ++lIt) {
+        if (*lIt == '"' || *lIt == '\\') {
+            lEscaped += '\\';
+        } else if (*lIt == '\n') {
+            lEscaped += "\\n";
+            continue;
+        } else if (pJson && static_cast<unsigned char>(*lIt) < 0x20) {
+            char lCode[7];
+            snprintf(lCode, sizeof(lCode), "\\u%04x", static_cast<unsigned char>(*lIt));
+            lEscaped += lCode;
+            continue;
+        }
+        lEscaped += *lIt;
+    }
+    return lEscaped;
+}
+
+static void formatText(const tScoreboardTotals &pTotals, std::ostringstream &pOut)
+{
+    pOut << "children: " << pTotals.mChildren << "\n";
+    for (unsigned i = 0; i < ScoreboardCounter::NB_COUNTERS; ++i) {
+        pOut << ScoreboardCounter::enumToMetric(static_cast<ScoreboardCounter::eCounter>(i)) << ": " << pTotals.mCounters[i] << "\n";
+    }
+    for (unsigned i = 0; i < ScoreboardDrop::NB_DROPS; ++i) {
+        pOut << "drops " << ScoreboardDrop::enumToString(static_cast<ScoreboardDrop::eDrop>(i)) << ": " << pTotals.mDrops[i] << "\n";
+    }
+    for (unsigned i = 0; i < ScoreboardGauge::NB_GAUGES; ++i) {
+        pOut << ScoreboardGauge::enumToString(static_cast<ScoreboardGauge::eGauge>(i)) << ": " << pTotals.mGauges[i] << "\n";
+    }
+    for (unsigned i = 0; i < Latency::NB_LATENCIES; ++i) {
+        pOut << "latency_us " << Latency::enumToString(static_cast<Latency::eLatency>(i)) << ": " << pTotals.mLatencies[i].summary() << "\n";
+    }
+    for (unsigned i = 0; i < pTotals.mDestinations.size(); ++i) {
+        const tScoreboardDestination &lDestination = pTotals.mDestinations[i].second;
+        pOut << "destination " << pTotals.mDestinations[i].first << ":";
+        for (unsigned j = 0; j < ScoreboardCounter::NB_COUNTERS; ++j) {
+            pOut << " " << ScoreboardCounter::enumToMetric(static_cast<ScoreboardCounter::eCounter>(j)) << "=" << lDestination.mCounters[j];
+        }
+        pOut << " in_flight=" << lDestination.mInFlight << "\n";
+        for (unsigned j = 0; j < Latency::NB_LATENCIES; ++j) {
+            if (lDestination.mLatencies[j].count()) {
+                pOut << "latency_us " << Latency::enumToString(static_cast<Latency::eLatency>(j)) << "@" << pTotals.mDestinations[i].first
+                     << ": " << lDestination.mLatencies[j].summary() << "\n";
+            }
+        }
+    }
+    for (unsigned i = 0; i < pTotals.mFilters.size(); ++i) {
+        const tFilterCounters &lFilter = pTotals.mFilters[i].second;
+        pOut << "filter " << pTotals.mFilters[i].first << ": evaluations=" << lFilter.mEvaluations << " matches=" << lFilter.mMatches
+             << " prevents=" << lFilter.mPrevents << " us=" << lFilter.mNs / 1000 << "\n";
+    }
+}
+
+/**
+ * @brief Formats the count, percentiles, maximum and sum of a histogram as a JSON object
+ */
+template <typename HistogramT>
+static void formatJsonLatency(const HistogramT &pHistogram, std::ostringstream &pOut)
+{
+    pOut << "{\"count\":" << pHistogram.count();
+    for (unsigned i = 0; i < sizeof(cPercentiles) / sizeof(cPercentiles[0]); ++i) {
+        pOut << ",\"p" << cPercentiles[i] << "\":" << pHistogram.percentile(cPercentiles[i]);
+    }
+    pOut << ",\"max\":" << pHistogram.max() << ",\"sum\":" << pHistogram.sum() << "}";
+}
+
+static void formatJson(const tScoreboardTotals &pTotals, std::ostringstream &pOut)
+{
+    pOut << "{\"children\":" << pTotals.mChildren;
+    for (unsigned i = 0; i < ScoreboardCounter::NB_COUNTERS; ++i) {
+        pOut << ",\"" << ScoreboardCounter::enumToMetric(static_cast<ScoreboardCounter::eCounter>(i)) << "\":" << pTotals.mCounters[i];
+    }
+    pOut << ",\"drops_by_reason\":{";
+    for (unsigned i = 0; i < ScoreboardDrop::NB_DROPS; ++i) {
+        pOut << (i ? "," : "") << "\"" << ScoreboardDrop::enumToString(static_cast<ScoreboardDrop::eDrop>(i)) << "\":" << pTotals.mDrops[i];
+    }
+    pOut << "}";
+    for (unsigned i = 0; i < ScoreboardGauge::NB_GAUGES; ++i) {
+        pOut << ",\"" << ScoreboardGauge::enumToString(static_cast<ScoreboardGauge::eGauge>(i)) << "\":" << pTotals.mGauges[i];
+    }
+    pOut << ",\"latencies_us\":{";
+    for (unsigned i = 0; i < Latency::NB_LATENCIES; ++i) {
+        pOut << (i ? "," : "") << "\"" << Latency::enumToString(static_cast<Latency::eLatency>(i)) << "\":";
+        formatJsonLatency(pTotals.mLatencies[i], pOut);
+    }
+    pOut << "},\"destinations\":{";
+    for (unsigned i = 0; i < pTotals.mDestinations.size(); ++i) {
+        const tScoreboardDestination &lDestination = pTotals.mDestinations[i].second;
+        pOut << (i ? "," : "") << "\"" << escape(pTotals.mDestinations[i].first, true) << "\":{";
+        for (unsigned j = 0; j < ScoreboardCounter::NB_COUNTERS; ++j) {
+            pOut << "\"" << ScoreboardCounter::enumToMetric(static_cast<ScoreboardCounter::eCounter>(j)) << "\":" << lDestination.mCounters[j] << ",";
+        }
+        pOut << "\"in_flight\":" << lDestination.mInFlight << ",\"latencies_us\":{";
+        // Only the durations measured per destination
+        bool lFirst = true;
+        for (unsigned j = 0; j < Latency::NB_LATENCIES; ++j) {
+            if (lDestination.mLatencies[j].count()) {
+                pOut << (lFirst ? "" : ",") << "\"" << Latency::enumToString(static_cast<Latency::eLatency>(j)) << "\":";
+                formatJsonLatency(lDestination.mLatencies[j], pOut);
+                lFirst = false;
+            }
+        }
+        pOut << "}}";
+    }
+    pOut << "},\"filters\":{";
+    for (unsigned i = 0; i < pTotals.mFilters.size(); ++i) {
+        const tFilterCounters &lFilter = pTotals.mFilters[i].second;
+        pOut << (i ? "," : "") << "\"" << escape(pTotals.mFilters[i].first, true) << "\":{\"evaluations\":" << lFilter.mEvaluations
+             << ",\"matches\":" << lFilter.mMatches << ",\"prevents\":" << lFilter.mPrevents << ",\"us\":" << lFilter.mNs / 1000 << "}";
+    }
+    pOut << "}}\n";
+}
+
+/**
+ * @brief Formats a histogram as the quantiles, sum and count of a Prometheus summary
+ * @param pName the name of the summary
+ * @param pLabels the labels of its samples but the quantile
+ */
+template <typename HistogramT>
+static void formatPrometheusLatency(const char *pName, const std::string &pLabels, const HistogramT &pHistogram, std::ostringstream &pOut)
+{
+    for (unsigned i = 0; i < sizeof(cPercentiles) / sizeof(cPercentiles[0]); ++i) {
+        pOut << pName << "{" << pLabels << ",quantile=\"" << cPercentiles[i] / 100 << "\"} " << pHistogram.percentile(cPercentiles[i]) << "\n";
+    }
+    pOut << pName << "_sum{" << pLabels << "} " << pHistogram.sum() << "\n";
+    pOut << pName << "_count{" << pLabels << "} " << pHistogram.count() << "\n";
+}
+
+static void formatPrometheusFilters(const tScoreboardTotals &pTotals, std::ostringstream &pOut)
+{
+    if (pTotals.mFilters.empty()) {
+        return;
+    }
+    static const char *cNames[] = { "evaluations", "matches", "prevents", "time_us" };
+    for (unsigned i = 0; i < sizeof(cNames) / sizeof(cNames[0]); ++i) {
+        const std::string lName = std::string("mod_dup_filter_") + cNames[i] + "_total";
+        pOut << "# TYPE " << lName << " counter\n";
+        for (unsigned j = 0; j < pTotals.mFilters.size(); ++j) {
+            const tFilterCounters &lFilter = pTotals.mFilters[j].second;
+            const uint64_t lValues[] = { lFilter.mEvaluations, lFilter.mMatches, lFilter.mPrevents, lFilter.mNs / 1000 };
+            pOut << lName << "{filter=\"" << escape(pTotals.mFilters[j].first) << "\"} " << lValues[i] << "\n";
+        }
+    }
+}
+
+static void formatPrometheus(const tScoreboardTotals &pTotals, std::ostringstream &pOut)
+{
+    pOut << "# TYPE mod_dup_children gauge\nmod_dup_children " << pTotals.mChildren << "\n";
+    for (unsigned i = 0; i < ScoreboardCounter::NB_COUNTERS; ++i) {
+        const std::string lName = std::string("mod_dup_") + ScoreboardCounter::enumToMetric(static_cast<ScoreboardCounter::eCounter>(i)) + "_total";
+        pOut << "# TYPE " << lName << " counter\n" << lName << " " << pTotals.mCounters[i] << "\n";
+    }
+    pOut << "# TYPE mod_dup_drops_by_reason_total counter\n";
+    for (unsigned i = 0; i < ScoreboardDrop::NB_DROPS; ++i) {
+        pOut << "mod_dup_drops_by_reason_total{reason=\"" << ScoreboardDrop::enumToString(static_cast<ScoreboardDrop::eDrop>(i)) << "\"} "
+             << pTotals.mDrops[i] << "\n";
+    }
+    for (unsigned i = 0; i < ScoreboardGauge::NB_GAUGES; ++i) {
+        const std::string lName = std::string("mod_dup_") + ScoreboardGauge::enumToString(static_cast<ScoreboardGauge::eGauge>(i));
+        pOut << "# TYPE " << lName << " gauge\n" << lName << " " << pTotals.mGauges[i] << "\n";
+    }
+    pOut << "# TYPE mod_dup_latency_us summary\n";
+    for (unsigned i = 0; i < Latency::NB_LATENCIES; ++i) {
+        formatPrometheusLatency("mod_dup_latency_us", std::string("step=\"") + Latency::enumToString(static_cast<Latency::eLatency>(i)) + "\"",
+                                pTotals.mLatencies[i], pOut);
+    }
+    formatPrometheusFilters(pTotals, pOut);
+    if (pTotals.mDestinations.empty()) {
+        return;
+    }
+    for (unsigned i = 0; i < ScoreboardCounter::NB_COUNTERS; ++i) {
+        const std::string lName = std::string("mod_dup_destination_") + ScoreboardCounter::enumToMetric(static_cast<ScoreboardCounter::eCounter>(i)) + "_total";
+        pOut << "# TYPE " << lName << " counter\n";
+        for (unsigned j = 0; j < pTotals.mDestinations.size(); ++j) {
+            pOut << lName << "{destination=\"" << escape(pTotals.mDestinations[j].first) << "\"} " << pTotals.mDestinations[j].second.mCounters[i] << "\n";
+        }
+    }
+    pOut << "# TYPE mod_dup_destination_in_flight gauge\n";
+    for (unsigned j = 0; j < pTotals.mDestinations.size(); ++j) {
+        pOut << "mod_dup_destination_in_flight{destination=\"" << escape(pTotals.mDestinations[j].first) << "\"} " << pTotals.mDestinations[j].second.mInFlight << "\n";
+    }
+    pOut << "# TYPE mod_dup_destination_latency_us summary\n";
+    for (unsigned j = 0; j < pTotals.mDestinations.size(); ++j) {
+        const tScoreboardDestination &lDestination = pTotals.mDestinations[j].second;
+        for (unsigned i = 0; i < Latency::NB_LATENCIES; ++i) {
+            if (lDestination.mLatencies[i].count()) {
+                formatPrometheusLatency("mod_dup_destination_latency_us",
+                                        "destination=\"" + escape(pTotals.mDestinations[j].first) + "\",step=\"" +
+                                        Latency::enumToString(static_cast<Latency::eLatency>(i)) + "\"",
+                                        lDestination.mLatencies[i], pOut);
+            }
+        }
+    }
+}
+
+const std::string Scoreboard::getStatus(StatusFormat::eStatusFormat pFormat) const
+{
+    tScoreboardTotals lTotals;
+    aggregate(lTotals);
+    std::ostringstream lOut;
+    switch (pFormat) {
+    case StatusFormat::JSON:
+        formatJson(lTotals, lOut);
+        break;
+    case StatusFormat::PROMETHEUS:
+        formatPrometheus(lTotals, lOut);
+        break;
+    default:
+        formatText(lTotals, lOut);
+        break;
+    }
+    return lOut.str();
+}
+
+}
@@ -0,0 +1,326 @@
+/*
+* mod_dup - duplicates apache requests
+*
+* Copyright (C) 2017 Orange
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "FilterProfiler.hh"
+#include "Histogram.hh"
+
+namespace DupModule {
+
+/*
+ * The events counted in the scoreboard
+ */
+namespace ScoreboardCounter {
+
+enum eCounter {
+    DUPLICATED              = 0,    // Duplications sent, retries included
+    TIMEOUT                 = 1,    // Duplications which timed out
+    DROPPED                 = 2,    // Requests dropped by a full queue
+    NB_COUNTERS             = 3,
+};
+
+/*
+ * The name of a counter in the stats
+ */
+const char *enumToString(eCounter pCounter);
+
+/*
+ * The name of a counter in the exported metrics
+ */
+const char *enumToMetric(eCounter pCounter);
+
+};
+
+/*
+ * Why the requests were not duplicated, in the scoreboard
+ */
+namespace ScoreboardDrop {
+
+enum eDrop {
+    REFUSED                 = 0,    // The full queue refused a new request
+    EVICTED                 = 1,    // The full queue evicted a queued request for a new one, with the drop policy
+    ABANDONED               = 2,    // A failed duplication whose retry was abandoned
+    NB_DROPS                = 3,
+};
+
+/*
+ * The name of a reason in the stats and the exported metrics
+ */
+const char *enumToString(eDrop pDrop);
+
+};
+
+/*
+ * The current values written by each child into the scoreboard
+ */
+namespace ScoreboardGauge {
+
+enum eGauge {
+    QUEUED                  = 0,    // Requests waiting for a thread
+    QUEUED_BYTES            = 1,    // Memory held by the queued requests
+    THREADS                 = 2,    // Duplication threads
+    IN_FLIGHT               = 3,    // Duplications being sent
+    NB_GAUGES               = 4,
+};
+
+/*
+ * The name of a gauge in the stats and the exported metrics
+ */
+const char *enumToString(eGauge pGauge);
+
+};
+
+/*
+ * The formats of the status
+ */
+namespace StatusFormat {
+
+enum eStatusFormat {
+    TEXT                    = 0,    // One "name: value" line per metric
+    JSON                    = 1,
+    PROMETHEUS              = 2,    // The Prometheus text exposition format
+};
+
+};
+
+/** @brief The maximum number of destinations counted separately in the scoreboard */
+static const unsigned cScoreboardDestinations = 32;
+
+/** @brief What one child counts for one destination */
+struct tScoreboardDestination {
+    uint64_t mCounters[ScoreboardCounter::NB_COUNTERS];
+    /** @brief The duplications being sent to the destination */
+    int64_t mInFlight;
+    /** @brief The durations recorded for the destination, coarser than those of all the destinations together */
+    CoarseLatencyHistogram mLatencies[Latency::NB_LATENCIES];
+};
+
+/** @brief The maximum number of filters published by each child in the scoreboard, the most expensive ones */
+static const unsigned cScoreboardFilters = 16;
+
+/** @brief The totals of one filter published by a child */
+struct tScoreboardFilter {
+    /** @brief The label of the filter, truncated */
+    char mLabel[128];
+    tFilterCounters mCounters;
+};
+
+/**
+ * @brief What one child records in the scoreboard
+ * Aligned on cache lines so that the children do not write to the same ones.
+ */
+struct tScoreboardSlot {
+    /** @brief The child which owns the slot, 0 if none ever did */
+    volatile pid_t mPid;
+    /** @brief The events counted since the scoreboard was created */
+    uint64_t mCounters[ScoreboardCounter::NB_COUNTERS];
+    /** @brief The requests not duplicated per reason since the scoreboard was created */
+    uint64_t mDrops[ScoreboardDrop::NB_DROPS];
+    /** @brief The current values, only meaningful while the child is alive */
+    int64_t mGauges[ScoreboardGauge::NB_GAUGES];
+    /** @brief The events per destination, in the order of the destinations of the scoreboard */
+    tScoreboardDestination mDestinations[cScoreboardDestinations];
+    /** @brief The durations recorded since the scoreboard was created, all destinations together */
+    LatencyHistogram mLatencies[Latency::NB_LATENCIES];
+    /** @brief Odd while the child rewrites the filters, so that the readers skip a torn copy */
+    volatile uint32_t mFiltersVersion;
+    /** @brief The number of filters published */
+    uint32_t mNbFilters;
+    /** @brief The totals of the filters since the child started, the most expensive first */
+    tScoreboardFilter mFilters[cScoreboardFilters];
+} __attribute__((aligned(64)));
+
+/**
+ * @brief The sum of the slots of all the children
+ */
+struct tScoreboardTotals {
+    tScoreboardTotals();
+
+    /** @brief The number of children alive */
+    unsigned mChildren;
+    uint64_t mCounters[ScoreboardCounter::NB_COUNTERS];
+    uint64_t mDrops[ScoreboardDrop::NB_DROPS];
+    /** @brief The sums over the children alive */
+    int64_t mGauges[ScoreboardGauge::NB_GAUGES];
+    LatencyHistogram mLatencies[Latency::NB_LATENCIES];
+    /** @brief The names of the destinations and their sums, in the order of the scoreboard */
+    std::vector<std::pair<std::string, tScoreboardDestination> > mDestinations;
+    /** @brief The filters published by the children alive and their sums per label, the most expensive first */
+    std::vector<std::pair<std::string, tFilterCounters> > mFilters;
+};
+
+/**
+ * @brief Counters and histograms in shared memory, where each apache child writes into its own slot without locking
+ * Created by the parent in postConfig, so that the children inherit the mapping when forked,
+ * then read by any child to get the metrics of the whole server.
+ * The memory is named and kept on restarts: the counters only grow for the life of the host, as expected by the
+ * monitoring computing rates from them.
+ */
+class Scoreboard {
+public:
+    Scoreboard();
+
+    ~Scoreboard();
+
+    /**
+     * @brief Maps the named shared memory, creating it if it does not exist or was not created for the same slots and destinations
+     * @param pName the name of the shared memory
+     * @param pSlots the maximum number of children
+     * @param pDestinations the destinations counted separately, the first cScoreboardDestinations ones
+     * @return true if successful, false when it fails
+     */
+    bool create(const std::string &pName, unsigned pSlots, const std::vector<std::string> &pDestinations = std::vector<std::string>());
+
+    /**
+     * @brief Unmaps and unlinks the shared memory
+     * Not used in apache to keep the counters on restarts
+     */
+    void destroy();
+
+    /**
+     * @brief Takes the first slot which is free or whose child exited, keeping what it counted
+     * Shares a slot with another child if there is none, the writes being atomic.
+     * @return true if a slot was taken, false if the scoreboard is not created
+     */
+    bool claimSlot();
+
+    /**
+     * @brief Whether the calling process writes into the scoreboard
+     */
+    bool isClaimed() const { return mSlot; }
+
+    /**
+     * @brief Counts events in the slot of the calling child, no-op if it has none
+     * @param pCounter the event
+     * @param pCount the number of events
+     */
+    void count(ScoreboardCounter::eCounter pCounter, uint64_t pCount = 1);
+
+    /**
+     * @brief Counts events for a destination in the slot of the calling child, no-op if it has none or the destination is unknown
+     * @param pCounter the event
+     * @param pDestination the destination
+     * @param pCount the number of events
+     */
+    void countDestination(ScoreboardCounter::eCounter pCounter, const std::string &pDestination, uint64_t pCount = 1);
+
+    /**
+     * @brief Counts a request not duplicated in the slot of the calling child, no-op if it has none
+     * @param pDrop why it was not
+     */
+    void countDrop(ScoreboardDrop::eDrop pDrop);
+
+    /**
+     * @brief Sets the load of the calling child
+     * @param pQueued the number of queued requests
+     * @param pQueuedBytes the memory they hold
+     * @param pThreads the number of duplication threads
+     */
+    void setLoad(size_t pQueued, size_t pQueuedBytes, size_t pThreads);
+
+    /**
+     * @brief Accounts for a duplication starting or ending to be sent by the calling child
+     * @param pDestination the destination of the duplication
+     * @param pDelta 1 when it starts, -1 when it ends
+     */
+    void addInFlight(const std::string &pDestination, int pDelta);
+
+    /**
+     * @brief Records a duration in the slot of the calling child, no-op if it has none
+     * @param pLatency what was measured
+     * @param pDestination the destination it was measured for, only recorded all destinations together if empty or unknown
+     * @param pValue the duration in micro sec
+     */
+    void record(Latency::eLatency pLatency, const std::string &pDestination, uint64_t pValue);
+
+    /**
+     * @brief Publishes the totals of the most expensive filters of the calling child, no-op if it has none
+     * @param pTotals the label and totals of each filter of the child since it started
+     */
+    void setFilters(const std::vector<std::pair<std::string, tFilterCounters> > &pTotals);
+
+    /**
+     * @brief Sums the slots of all the children
+     * @param pTotals receives the sums
+     */
+    void aggregate(tScoreboardTotals &pTotals) const;
+
+    /**
+     * @brief Formats the sums of the slots of all the children
+     * @return "children=<n> <counter>=<n> ... <latency>=p50/p90/p99/max ..." or "-" if the scoreboard is not created
+     */
+    const std::string getSummary() const;
+
+    /**
+     * @brief Formats the sums of the slots of all the children with all their details, per destination included
+     * @param pFormat the format
+     * @return the formatted status, empty metrics if the scoreboard is not created
+     */
+    const std::string getStatus(StatusFormat::eStatusFormat pFormat) const;
+
+private:
+    /** @brief At the start of the shared memory, to check it was initialized for this layout */
+    struct tHeader {
+        uint32_t mMagic;
+        uint32_t mSlots;
+        uint32_t mNbDestinations;
+        char mDestinations[cScoreboardDestinations][128];
+    } __attribute__((aligned(64)));
+
+    /**
+     * @brief Whether the mapped memory was initialized for these slots and destinations
+     */
+    bool matches(unsigned pSlots, const std::vector<std::string> &pDestinations) const;
+
+    /**
+     * @brief Adds the filters published in a slot to the totals, skipped if the child is rewriting them
+     */
+    static void addFilters(const tScoreboardSlot &pSlot, std::map<std::string, tFilterCounters> &pTotals);
+
+    /**
+     * @brief The index of a destination in the slots, -1 if it is not counted separately
+     */
+    int destinationIndex(const std::string &pDestination) const;
+
+    /**
+     * @brief The size of the shared memory for a number of slots
+     */
+    static size_t sizeFor(unsigned pSlots);
+
+    /** @brief The name of the shared memory */
+    std::string mName;
+    /** @brief The start of the mapped memory, NULL if not created */
+    tHeader *mHeader;
+    /** @brief The slots of all the children, right after the header */
+    tScoreboardSlot *mSlots;
+    /** @brief The slot of the calling child, NULL if none */
+    tScoreboardSlot *mSlot;
+    /** @brief The number of slots mapped, the header may be rewritten by another process */
+    unsigned mNbSlots;
+    /** @brief The index of the destinations counted separately, built before the children fork */
+    std::map<std::string, unsigned> mDestinationIndexes;
+};
+
+}
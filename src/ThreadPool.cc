@@ -18,12 +18,16 @@
 
 #include "ThreadPool.hh"
 #include <boost/date_time/posix_time/posix_time_types.hpp>
+#include <algorithm>
+#include <cmath>
 #include "RequestInfo.hh"
 #include "Log.hh"
 
 using namespace boost::posix_time;
 
 namespace DupModule {
+template <typename QueueT> const unsigned ThreadPool<QueueT>::mManageInterval;
+
 template <typename QueueT> ThreadPool<QueueT>::ThreadPool(tQueueWorker pWorker, const QueueT &pPoisonItem) :
     mManagerThread(NULL),
     mMinThreads(1), mMaxThreads(10),
@@ -33,7 +37,9 @@ template <typename QueueT> ThreadPool<QueueT>::ThreadPool(tQueueWorker pWorker,
     mWorker(pWorker),
     mPoisonItem(pPoisonItem),
     mRunning(false),
-    mProgramName("ModDup")
+    mProgramName("ModDup"),
+    mAliveThreads(0),
+    mWakeUpRequested(false)
 {
 }
 
@@ -72,25 +78,69 @@ template <typename QueueT> void ThreadPool<QueueT>::collectKilled()
     }
 }
 
-template <typename QueueT> void ThreadPool<QueueT>::run()
+template <typename QueueT> void ThreadPool<QueueT>::manage(uint64_t pElapsedUs)
 {
-    unsigned pid = getpid();
-    unsigned iterationsSinceStats = 0;
+    tQueueTimings lTimings;
+    mQueue.getTimings(lTimings);
+    const size_t lQueued = mQueue.size();
+    const size_t lAlive = mThreads.size() - mBeingKilled;
 
-    while (mRunning) {
-        size_t lQueued = mQueue.size();
-        float lQueuedPerThread = static_cast<float>(mQueue.size()) / mThreads.size();
+    boost::lock_guard<boost::mutex> lLock(mManageMutex);
+    mStats.mArrivalRate = pElapsedUs ? lTimings.mPushed * 1000000.0 / pElapsedUs : 0;
+    mStats.mMeanWaitUs = lTimings.mPopped ? static_cast<double>(lTimings.mWaitUs) / lTimings.mPopped : 0;
+    if (lTimings.mServed) {
+        const double lServiceUs = static_cast<double>(lTimings.mServiceUs) / lTimings.mServed;
+        mStats.mMeanServiceUs = mStats.mMeanServiceUs ? 0.7 * mStats.mMeanServiceUs + 0.3 * lServiceUs : lServiceUs;
+    }
 
-        collectKilled();
+    // The queue length rule is the floor, and all there is until a handling time was measured
+    // DupQueue accepts a max of 0, read as one queued request per thread
+    const size_t lMaxQueued = std::max<size_t>(1, mMaxQueued);
+    size_t lTarget = (lQueued + lMaxQueued - 1) / lMaxQueued;
+    if (mStats.mMeanServiceUs) {
+        // Little's law with a 25% headroom, plus the threads draining the backlog within one interval
+        const double lBusy = mStats.mArrivalRate * mStats.mMeanServiceUs / 1000000.0;
+        const double lBacklog = lQueued * mStats.mMeanServiceUs / mManageInterval;
+        lTarget = std::max(lTarget, static_cast<size_t>(std::ceil(lBusy * 1.25 + lBacklog)));
+    }
+    lTarget = std::min(std::max(lTarget, mMinThreads), mMaxThreads);
+    mStats.mTargetThreads = lTarget;
 
-        if ((lQueuedPerThread > mMaxQueued) && (mThreads.size() < mMaxThreads)) {
+    if (lTarget > lAlive) {
+        Log::debug("Starting %zu threads, %zu queued", lTarget - lAlive, lQueued);
+        for (size_t i = lAlive; i < lTarget; ++i) {
             newThread();
         }
-        else if ((lQueuedPerThread < mMinQueued) && ((mThreads.size() - mBeingKilled) > mMinThreads)) {
+        mStats.mThreadsStarted += lTarget - lAlive;
+    }
+    else if ((lTarget < lAlive) && (static_cast<float>(lQueued) / lAlive < mMinQueued)) {
+        // Half the extra threads at a time, not to stop the ones the next burst needs
+        const size_t lToStop = std::max<size_t>(1, (lAlive - lTarget) / 2);
+        for (size_t i = 0; i < lToStop; ++i) {
             poisonThread();
         }
+        mStats.mThreadsStopped += lToStop;
+    }
+    mAliveThreads = mThreads.size() - mBeingKilled;
+}
+
+template <typename QueueT> void ThreadPool<QueueT>::run()
+{
+    unsigned pid = getpid();
+    ptime lLastManage = microsec_clock::universal_time();
+    ptime lLastStats = lLastManage;
+
+    while (mRunning) {
+        const ptime lNow = microsec_clock::universal_time();
+        collectKilled();
+        manage(std::max<long>(0, (lNow - lLastManage).total_microseconds()));
+        lLastManage = lNow;
+        if (mOnLoad) {
+            mOnLoad(mQueue.size(), mQueue.bytes(), mAliveThreads);
+        }
 
-        if (++iterationsSinceStats * mManageInterval >= mStatsInterval) {
+        if ((lNow - lLastStats).total_microseconds() >= mStatsInterval) {
+            size_t lQueued = mQueue.size();
             unsigned lInCount, lOutCount, lDropCount;
             mQueue.getCounters(lInCount, lOutCount, lDropCount);
 
@@ -100,15 +150,33 @@ template <typename QueueT> void ThreadPool<QueueT>::run()
             lStatsIter = mAdditionalStats.find("#DupReq");
             const std::string lDuplicateCount = lStatsIter == mAdditionalStats.end() ? "??" : lStatsIter->second();
 
-            Log::notice(201, "%s - %u - %zu - %zu - %u - %u - %u - %s - %s",
+            // The other stats are appended with their names
+            std::string lOtherStats;
+            for (lStatsIter = mAdditionalStats.begin(); lStatsIter != mAdditionalStats.end(); ++lStatsIter) {
+                if (lStatsIter->first != "#TmOut" && lStatsIter->first != "#DupReq") {
+                    lOtherStats += " - " + lStatsIter->first + " " + lStatsIter->second();
+                }
+            }
+
+            const tPoolStats lStats = getStats();
+            LatencyHistogram lWait;
+            mQueue.getWaitHistogram(lWait);
+            Log::notice(201, "%s - %u - %zu - %zu - %u - %u - %u - %s - %s%s - Target %zu - #ThStart %u - #ThStop %u - #Spikes %u - Wait %s - SvcUs %.0f",
                         mProgramName.c_str(), pid, lQueued, mThreads.size(), lInCount, lOutCount,
-                        lDropCount, lTimeoutCount.c_str(), lDuplicateCount.c_str());
+                        lDropCount, lTimeoutCount.c_str(), lDuplicateCount.c_str(), lOtherStats.c_str(),
+                        lStats.mTargetThreads, lStats.mThreadsStarted, lStats.mThreadsStopped, lStats.mSpikes,
+                        lWait.summary().c_str(), lStats.mMeanServiceUs);
             if (lDropCount > 0) {
                 Log::warn(301, "Pool %u dropped %d requests during last cycle!", pid, lDropCount);
             }
-            iterationsSinceStats = 0;
+            lLastStats = lNow;
         }
-        usleep(mManageInterval);
+
+        boost::unique_lock<boost::mutex> lLock(mManageMutex);
+        if (!mWakeUpRequested && mRunning) {
+            mManageCondition.timed_wait(lLock, microseconds(mManageInterval));
+        }
+        mWakeUpRequested = false;
     }
 
     // Poison all threads, not an issue if some were already exiting
@@ -145,6 +213,22 @@ template <typename QueueT> void ThreadPool<QueueT>::setQueue(const size_t pMinQu
     mMaxQueued = pMaxQueued;
 }
 
+template <typename QueueT> void ThreadPool<QueueT>::setDropPolicy(DropPolicy::eDropPolicy pDropPolicy,
+                                                                 typename MultiThreadQueue<QueueT>::tPriorityFunction pPriority,
+                                                                 typename MultiThreadQueue<QueueT>::tDropHandler pOnDrop)
+{
+    mQueue.setDropPolicy(pDropPolicy);
+    mQueue.setPriority(pPriority);
+    mQueue.setDropHandler(pOnDrop);
+}
+
+template <typename QueueT> void ThreadPool<QueueT>::setLoadHandler(typename MultiThreadQueue<QueueT>::tSizeFunction pSize,
+                                                                  tLoadHandler pOnLoad)
+{
+    mQueue.setSizeFunction(pSize);
+    mOnLoad = pOnLoad;
+}
+
 template <typename QueueT> void ThreadPool<QueueT>::start()
 {
     mRunning = true;
@@ -154,6 +238,7 @@ template <typename QueueT> void ThreadPool<QueueT>::start()
     for (unsigned i = 0; i < mMinThreads; ++i) {
         newThread();
     }
+    mAliveThreads = mThreads.size();
 
     mManagerThread = new boost::thread(boost::bind(&ThreadPool::run, this));
 }
@@ -162,6 +247,11 @@ template <typename QueueT> void ThreadPool<QueueT>::stop()
 {
     mRunning = false;
     mQueue.stop();
+    {
+        boost::lock_guard<boost::mutex> lLock(mManageMutex);
+        mWakeUpRequested = true;
+    }
+    mManageCondition.notify_one();
     if (mManagerThread) {
         // TODO improve this part.
         // The process can be stuck here if curl calls do not terminate
@@ -174,6 +264,19 @@ template <typename QueueT> void ThreadPool<QueueT>::stop()
 template <typename QueueT> void ThreadPool<QueueT>::push(const QueueT &pItem)
 {
     mQueue.push(pItem);
+    // A burst must not wait for the next interval to get its threads
+    const size_t lAlive = mAliveThreads;
+    if (mRunning && (mQueue.size() > mMaxQueued * lAlive) && (lAlive < mMaxThreads)) {
+        {
+            boost::lock_guard<boost::mutex> lLock(mManageMutex);
+            if (mWakeUpRequested) {
+                return;
+            }
+            mWakeUpRequested = true;
+            mStats.mSpikes++;
+        }
+        mManageCondition.notify_one();
+    }
 }
 
 template <typename QueueT> size_t ThreadPool<QueueT>::getThreadCount()
@@ -181,6 +284,12 @@ template <typename QueueT> size_t ThreadPool<QueueT>::getThreadCount()
     return mThreads.size();
 }
 
+template <typename QueueT> tPoolStats ThreadPool<QueueT>::getStats()
+{
+    boost::lock_guard<boost::mutex> lLock(mManageMutex);
+    return mStats;
+}
+
 // Explicitly instantiate the ones we use
 template class ThreadPool<boost::shared_ptr<RequestInfo>>;
 template class ThreadPool<int>;
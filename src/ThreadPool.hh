@@ -19,14 +19,42 @@
 #pragma once
 
 #include <boost/function.hpp>
+#include <boost/thread.hpp>
 #include "MultiThreadQueue.hh"
 
 
 namespace DupModule {
 
 /**
- * @brief Manages a pool of threads depending on the size of its queue.
- * As its queue grows, it spawns new worker threads. If the queue shrinks again, it hands poison pills to a worker which should then exit.
+ * @brief The last decisions of a thread pool manager and what they were based on
+ */
+struct tPoolStats {
+
+    tPoolStats() : mArrivalRate(0), mMeanWaitUs(0), mMeanServiceUs(0), mTargetThreads(0),
+                   mThreadsStarted(0), mThreadsStopped(0), mSpikes(0) {}
+
+    /** @brief The number of items queued per second during the last interval */
+    double mArrivalRate;
+    /** @brief The mean time in micro sec the items popped during the last interval spent in the queue */
+    double mMeanWaitUs;
+    /** @brief The smoothed mean time in micro sec a worker takes to handle an item */
+    double mMeanServiceUs;
+    /** @brief The number of threads the manager last aimed at */
+    size_t mTargetThreads;
+    /** @brief The number of threads started by the manager since the pool started */
+    unsigned mThreadsStarted;
+    /** @brief The number of threads the manager asked to exit since the pool started */
+    unsigned mThreadsStopped;
+    /** @brief The number of times a push woke the manager up because the queue grew too long */
+    unsigned mSpikes;
+};
+
+/**
+ * @brief Manages a pool of threads depending on the load of its queue.
+ * The number of threads needed follows Little's law: the arrival rate times the time a worker takes to handle an item,
+ * plus what it takes to drain the queued items within one manage interval. The manager starts or stops as many threads as needed
+ * at once, and a push which makes the queue too long wakes it up without waiting for the next interval.
+ * As its queue grows, it spawns new worker threads. If the queue shrinks again, it hands poison pills to workers which should then exit.
  * The class gets the queue item type as its template argument. This makes it independent of any business needs and therefore more easily reusable.
  */
 template <typename QueueT>
@@ -38,6 +66,9 @@ public:
     /** @brief The type of the function object which returns a stat */
     typedef boost::function0<const std::string> tStatProvider;
 
+    /** @brief The type of the function object told the load of the pool: the queued items, the bytes they hold and the threads */
+    typedef boost::function3<void, size_t, size_t, size_t> tLoadHandler;
+
 public:
     /**
      * @brief Constructs a ThreadPool object
@@ -82,6 +113,23 @@ public:
      */
     void setQueue(const size_t pMinQueued, const size_t pMaxQueued);
 
+    /**
+     * @brief Set what the queue drops once full
+     * @param pDropPolicy the drop policy
+     * @param pPriority the function giving the priority of the queued items
+     * @param pOnDrop the function called with the dropped items
+     */
+    void setDropPolicy(DropPolicy::eDropPolicy pDropPolicy,
+                       typename MultiThreadQueue<QueueT>::tPriorityFunction pPriority,
+                       typename MultiThreadQueue<QueueT>::tDropHandler pOnDrop);
+
+    /**
+     * @brief Set the function the manager tells the load of the pool to, after each manage interval
+     * @param pSize the function giving the memory held by a queued item
+     * @param pOnLoad the function told the load
+     */
+    void setLoadHandler(typename MultiThreadQueue<QueueT>::tSizeFunction pSize, tLoadHandler pOnLoad);
+
     /// @brief Start the manager thread and the minimum number of worker threads
     void start();
 
@@ -99,6 +147,12 @@ public:
      * @return The number of threads currently running.
      */
     size_t getThreadCount();
+
+    /**
+     * @brief Get the last decisions of the manager
+     * @return a copy of the manager stats
+     */
+    tPoolStats getStats();
        
 private:
     /// @brief Spawn a new worker thread
@@ -115,6 +169,12 @@ private:
      * depending on the amount of queued items
      */
     void run(); 
+
+    /**
+     * @brief Start or stop threads to match the load of the queue
+     * @param pElapsedUs the time in micro sec since the last call
+     */
+    void manage(uint64_t pElapsedUs);
     
 private:
     /** @brief The time in micro sec for which we wait before controlling the number of threads in the pool */
@@ -148,6 +208,18 @@ private:
     std::string mProgramName;
     /** @brief Map containing additional stats providers */
     std::map<std::string, tStatProvider> mAdditionalStats;
+    /** @brief Told the load of the pool after each manage interval */
+    tLoadHandler mOnLoad;
+    /** @brief The number of threads alive and not poisoned, readable without locking by the pushing threads */
+    volatile size_t mAliveThreads;
+    /** @brief true when a push asked the manager to run before the end of its interval */
+    bool mWakeUpRequested;
+    /** @brief Protects mWakeUpRequested and mStats */
+    boost::mutex mManageMutex;
+    /** @brief Wakes the manager up on a queue spike or on stop */
+    boost::condition_variable mManageCondition;
+    /** @brief The last decisions of the manager */
+    tPoolStats mStats;
     
 };
 
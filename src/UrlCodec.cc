@@ -16,47 +16,238 @@
 * limitations under the License.
 */
 
-#include <httpd.h>
-// Work-around boost::chrono 1.53 conflict on CR typedef vs define in apache
-#undef CR
-#include <boost/algorithm/string/replace.hpp>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "Log.hh"
 #include "UrlCodec.hh"
 
 namespace DupModule {
 
+namespace {
+
+const char cHexDigits[] = "0123456789abcdef";
+
+/**
+ * @brief The characters ap_escape_path_segment leaves as they are: RFC 1808 pchar
+ */
+struct tPathSegmentChars {
+	tPathSegmentChars() {
+		memset(mSafe, 0, sizeof(mSafe));
+		for (const char *c = "$-_.+!*'(),:@&=~"; *c; ++c) {
+			mSafe[static_cast<unsigned char>(*c)] = true;
+		}
+		for (int c = 0; c < 256; ++c) {
+			if ((c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z')) {
+				mSafe[c] = true;
+			}
+		}
+	}
+
+	bool mSafe[256];
+};
+
+const tPathSegmentChars gPathSegmentChars;
+
+inline int
+hexValue(char c) {
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	c |= 0x20;
+	if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+	return -1;
+}
+
+#ifdef __SSE2__
+/**
+ * @brief Flags the bytes of a chunk between pLow and pHigh
+ * Shifted so that pLow becomes the smallest signed byte, the range is then checked with a single signed comparison.
+ */
+inline __m128i
+inRange(__m128i pChunk, unsigned char pLow, unsigned char pHigh) {
+	const __m128i lShifted = _mm_add_epi8(pChunk, _mm_set1_epi8(static_cast<char>(0x80 - pLow)));
+	return _mm_cmplt_epi8(lShifted, _mm_set1_epi8(static_cast<char>(-0x80 + pHigh - pLow + 1)));
+}
+#endif
+
+/**
+ * @brief The position of the first '%', '\0', or '+' if it decodes to a space, 16 bytes at a time with SSE2
+ * @return pSize if there is none
+ */
+size_t
+findToDecode(const char *pIn, size_t pSize, bool pPlusIsSpace) {
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i lPercent = _mm_set1_epi8('%');
+	const __m128i lPlus = _mm_set1_epi8(pPlusIsSpace ? '+' : '%');
+	const __m128i lZero = _mm_setzero_si128();
+	for (; i + 16 <= pSize; i += 16) {
+		const __m128i lChunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pIn + i));
+		const int lFound = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(lChunk, lPercent),
+		                                                               _mm_cmpeq_epi8(lChunk, lPlus)),
+		                                                  _mm_cmpeq_epi8(lChunk, lZero)));
+		if (lFound) {
+			return i + __builtin_ctz(lFound);
+		}
+	}
+#endif
+	for (; i < pSize; ++i) {
+		if (pIn[i] == '%' || pIn[i] == '\0' || (pPlusIsSpace && pIn[i] == '+')) {
+			return i;
+		}
+	}
+	return pSize;
+}
+
+/**
+ * @brief The position of the first character to escape in a path segment, 16 bytes at a time with SSE2
+ * @return pSize if there is none
+ */
+size_t
+findToEncode(const char *pIn, size_t pSize, bool pEscapePlus) {
+	size_t i = 0;
+#ifdef __SSE2__
+	const __m128i lPlus = _mm_set1_epi8('+');
+	for (; i + 16 <= pSize; i += 16) {
+		const __m128i lChunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pIn + i));
+		// Same set as tPathSegmentChars: &'()*+,-. 0-9: @A-Z a-z ! $ = _ ~
+		__m128i lSafe = _mm_or_si128(_mm_or_si128(inRange(lChunk, '&', '.'), inRange(lChunk, '0', ':')),
+		                             _mm_or_si128(inRange(lChunk, '@', 'Z'), inRange(lChunk, 'a', 'z')));
+		lSafe = _mm_or_si128(lSafe, _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(lChunk, _mm_set1_epi8('!')),
+		                                                      _mm_cmpeq_epi8(lChunk, _mm_set1_epi8('$'))),
+		                                         _mm_or_si128(_mm_cmpeq_epi8(lChunk, _mm_set1_epi8('=')),
+		                                                      _mm_cmpeq_epi8(lChunk, _mm_set1_epi8('_')))));
+		lSafe = _mm_or_si128(lSafe, _mm_cmpeq_epi8(lChunk, _mm_set1_epi8('~')));
+		if (pEscapePlus) {
+			lSafe = _mm_andnot_si128(_mm_cmpeq_epi8(lChunk, lPlus), lSafe);
+		}
+		const int lToEncode = ~_mm_movemask_epi8(lSafe) & 0xffff;
+		if (lToEncode) {
+			return i + __builtin_ctz(lToEncode);
+		}
+	}
+#endif
+	for (; i < pSize; ++i) {
+		const unsigned char c = pIn[i];
+		if (!gPathSegmentChars.mSafe[c] || (pEscapePlus && c == '+')) {
+			return i;
+		}
+	}
+	return pSize;
+}
+
+/**
+ * @brief Same decoding as ap_unescape_url, without copying the runs which have nothing to decode one by one
+ */
+bool
+unescape(const char *pIn, size_t pSize, std::string &pOut, bool pPlusIsSpace) {
+	size_t lPos = findToDecode(pIn, pSize, pPlusIsSpace);
+	if (lPos == pSize) {
+		pOut.append(pIn, pSize);
+		return false;
+	}
+	const size_t lOutStart = pOut.size();
+	pOut.reserve(lOutStart + pSize);
+	bool lBadEscape = false;
+	size_t lStart = 0;
+	while (lPos < pSize) {
+		pOut.append(pIn + lStart, lPos - lStart);
+		if (pIn[lPos] == '\0') {
+			// Where the C string ap_unescape_url works on ends
+			lStart = pSize;
+			break;
+		} else if (pIn[lPos] == '+') {
+			pOut.push_back(' ');
+			lStart = lPos + 1;
+		} else if (lPos + 2 < pSize && hexValue(pIn[lPos + 1]) >= 0 && hexValue(pIn[lPos + 2]) >= 0) {
+			const char lDecoded = static_cast<char>(hexValue(pIn[lPos + 1]) << 4 | hexValue(pIn[lPos + 2]));
+			if (!lDecoded) {
+				lStart = pSize;
+				break;
+			}
+			pOut.push_back(lDecoded);
+			lStart = lPos + 3;
+		} else {
+			lBadEscape = true;
+			pOut.push_back('%');
+			lStart = lPos + 1;
+		}
+		lPos = lStart + findToDecode(pIn + lStart, pSize - lStart, pPlusIsSpace);
+	}
+	pOut.append(pIn + lStart, pSize - lStart);
+	if (lBadEscape) {
+		Log::warn(302, "Bad escape values in request: %.*s", static_cast<int>(pOut.size() - lOutStart), pOut.data() + lOutStart);
+	}
+	return true;
+}
+
+/**
+ * @brief Same encoding as ap_escape_path_segment, without copying the runs which have nothing to encode one by one
+ */
+bool
+escapePathSegment(const char *pIn, size_t pSize, std::string &pOut, bool pEscapePlus) {
+	size_t lPos = findToEncode(pIn, pSize, pEscapePlus);
+	if (lPos == pSize) {
+		pOut.append(pIn, pSize);
+		return false;
+	}
+	pOut.reserve(pOut.size() + lPos + 3 * (pSize - lPos));
+	size_t lStart = 0;
+	while (lPos < pSize) {
+		pOut.append(pIn + lStart, lPos - lStart);
+		const unsigned char c = pIn[lPos];
+		if (!c) {
+			// Where the C string ap_escape_path_segment works on ends
+			return true;
+		}
+		pOut.push_back('%');
+		pOut.push_back(cHexDigits[c >> 4]);
+		pOut.push_back(cHexDigits[c & 0xf]);
+		lStart = lPos + 1;
+		lPos = lStart + findToEncode(pIn + lStart, pSize - lStart, pEscapePlus);
+	}
+	pOut.append(pIn + lStart, pSize - lStart);
+	return true;
+}
+
+}
+
+const std::string
+IUrlCodec::decode(const std::string &pIn) const {
+	std::string lOut;
+	decodeTo(pIn.data(), pIn.size(), lOut);
+	return lOut;
+}
+
+const std::string
+IUrlCodec::encode(const std::string &pIn) const {
+	std::string lOut;
+	encodeTo(pIn.data(), pIn.size(), lOut);
+	return lOut;
+}
+
 class ApacheUrlCodec : public IUrlCodec
 {
 public:
 	/**
-	 * @brief Helper function to decode queries
-	 * @param pIn string to be decoded
-	 * @return decoded string
+	 * @brief Decodes queries like ap_unescape_url
 	 */
-	const std::string
-	decode(const std::string &pIn) const {
-		char *lBuffer = new char[pIn.size()+1];
-		strncpy(lBuffer, pIn.c_str(), pIn.size()+1);
-		if (ap_unescape_url(lBuffer) == HTTP_BAD_REQUEST) {
-			Log::warn(302, "Bad escape values in request: %s", lBuffer);
-		}
-		std::string lOut(lBuffer);
-		delete[] lBuffer;
-
-		return lOut;
+	bool
+	decodeTo(const char *pIn, size_t pSize, std::string &pOut) const {
+		return unescape(pIn, pSize, pOut, false);
 	}
 
 	/**
-	 * @brief Helper function to encode queries
-	 * @param pIn string to be encoded
-	 * @return encoded string
+	 * @brief Encodes queries like ap_escape_path_segment
 	 */
-	const std::string
-	encode(apr_pool_t *pPool, const std::string &pIn) const {
-		// ap_escape_path_segment returns a char * which is allocated in the apache pool
-		// No need to free it, as apache will destroy the whole pool
-		return std::string(ap_escape_path_segment(pPool, pIn.c_str()));
+	bool
+	encodeTo(const char *pIn, size_t pSize, std::string &pOut) const {
+		return escapePathSegment(pIn, pSize, pOut, false);
 	}
 };
 
@@ -64,35 +255,19 @@ class DefaultUrlCodec : public IUrlCodec
 {
 public:
 	/**
-	 * @brief Helper function to decode queries
-	 * @param pIn string to be decoded
-	 * @return decoded string
+	 * @brief Decodes queries like ap_unescape_url, '+' being a space
 	 */
-	const std::string
-	decode(const std::string &pIn) const {
-		std::string preDecoded = boost::replace_all_copy(pIn, "+", " ");
-		char *lBuffer = new char[preDecoded.size()+1];
-		strncpy(lBuffer, preDecoded.c_str(), preDecoded.size()+1);
-		if (ap_unescape_url(lBuffer) == HTTP_BAD_REQUEST) {
-			Log::warn(302, "Bad escape values in request: %s", lBuffer);
-		}
-		std::string lOut(lBuffer);
-		delete[] lBuffer;
-
-		return lOut;
+	bool
+	decodeTo(const char *pIn, size_t pSize, std::string &pOut) const {
+		return unescape(pIn, pSize, pOut, true);
 	}
 
 	/**
-	 * @brief Helper function to encode queries
-	 * @param pIn string to be encoded
-	 * @return encoded string
+	 * @brief Encodes queries like ap_escape_path_segment, '+' included
 	 */
-	const std::string
-	encode(apr_pool_t *pPool, const std::string &pIn) const {
-		// ap_escape_path_segment returns a char * which is allocated in the apache pool
-		// No need to free it, as apache will destroy the whole pool
-		std::string encoded(ap_escape_path_segment(pPool, pIn.c_str()));
-		return boost::replace_all_copy(encoded, "+", "%2b");
+	bool
+	encodeTo(const char *pIn, size_t pSize, std::string &pOut) const {
+		return escapePathSegment(pIn, pSize, pOut, true);
 	}
 };
 
@@ -19,7 +19,7 @@
 #pragma once
 
 #include <string>
-#include <apr_pools.h>
+#include <stddef.h>
 
 
 namespace DupModule {
@@ -27,8 +27,30 @@ namespace DupModule {
 class IUrlCodec
 {
 public:
-	virtual const std::string decode(const std::string &pIn) const = 0;
-	virtual const std::string encode(apr_pool_t *pPool, const std::string &pIn) const = 0;
+	virtual ~IUrlCodec() {}
+
+	/**
+	 * @brief Decodes a value, appending it to a buffer of the caller so that it is not allocated again and again
+	 * Like ap_unescape_url, the value ends at the first decoded %00.
+	 * @param pIn the value to decode
+	 * @param pSize its size
+	 * @param pOut receives the decoded value after what it holds
+	 * @return false if the value had nothing to decode, it was then appended as is
+	 */
+	virtual bool decodeTo(const char *pIn, size_t pSize, std::string &pOut) const = 0;
+
+	/**
+	 * @brief Encodes a value as a path segment, appending it to a buffer of the caller
+	 * @param pIn the value to encode
+	 * @param pSize its size
+	 * @param pOut receives the encoded value after what it holds
+	 * @return false if the value had nothing to encode, it was then appended as is
+	 */
+	virtual bool encodeTo(const char *pIn, size_t pSize, std::string &pOut) const = 0;
+
+	const std::string decode(const std::string &pIn) const;
+
+	const std::string encode(const std::string &pIn) const;
 };
 
 const IUrlCodec *
@@ -88,7 +88,7 @@ extractBrigadeContent(apr_bucket_brigade *bb, ap_filter_t *pF, std::string &cont
       }
       if (len) {
           content.append(data, len);
-          Log::debug("[DEBUG][COMPARE] extracted %zd bytes from brigade", len);
+          LOG_DEBUG_IF_ENABLED("[DEBUG][COMPARE] extracted %zd bytes from brigade", len);
       }
     }
     return false;
@@ -98,7 +98,7 @@ std::string getOrSetUniqueID(request_rec *pRequest) {
     // If there is no UNIQUE_ID in the request header copy thr Request ID generated in both headers
     const char* lID = apr_table_get(pRequest->headers_in, CommonModule::c_UNIQUE_ID);
     unsigned int lReqID;
-    Log::debug("[DUPCOMPMIG] getOrSetUniqueID %s %p", lID, pRequest);
+    LOG_DEBUG_IF_ENABLED("[DUPCOMPMIG] getOrSetUniqueID %s %p", lID, pRequest);
     if( lID == NULL){
         // Not defined in a header
         lReqID = CommonModule::getNextReqId();
@@ -52,9 +52,9 @@ void
 printRequest(request_rec *pRequest, std::string pBody)
 {
     const char *reqId = apr_table_get(pRequest->headers_in, CommonModule::c_UNIQUE_ID);
-    Log::debug("[COMPARE] Filtering a request with ID: %s, body size:%ld", reqId, pBody.size());
-    Log::debug("[COMPARE] Uri:%s", pRequest->uri);
-    Log::debug("[COMPARE] Request args: %s", pRequest->args);
+    LOG_DEBUG_IF_ENABLED("[COMPARE] Filtering a request with ID: %s, body size:%ld", reqId, pBody.size());
+    LOG_DEBUG_IF_ENABLED("[COMPARE] Uri:%s", pRequest->uri);
+    LOG_DEBUG_IF_ENABLED("[COMPARE] Request args: %s", pRequest->args);
 }
 
 void
@@ -99,6 +99,18 @@ int iterateOverHeadersCallBack(void *d, const char *key, const char *value) {
     return 1;
 }
 
+/*
+ * Callback to iterate over the headers tables
+ * Appends a copy of key => value to the headers of the request
+ */
+int iterateOverRequestHeadersCallBack(void *d, const char *key, const char *value) {
+    DupModule::tHeaders *lHeader = reinterpret_cast<DupModule::tHeaders *>(d);
+
+    lHeader->push_back(key, value);
+
+    return 1;
+}
+
 /** @brief initializes the RequestInfo and input headers
  * Called in translateHook or inputFilter, which ever is called first
  * It is used to remove the DUP headers and change the request method
@@ -128,19 +140,19 @@ boost::shared_ptr<DupModule::RequestInfo>* initRequest(request_rec *pRequest)
     }
     
     // Copy headers in our object
-    apr_table_do(&iterateOverHeadersCallBack, &(info->mReqHeader), pRequest->headers_in, NULL);
+    apr_table_do(&iterateOverRequestHeadersCallBack, &(info->mReqHeader), pRequest->headers_in, NULL);
     
     // We retrieve the original request HTTP status from X_DUP_HTTP_STATUS header
     // if it does not exist, we set it to -1
-    std::map<std::string,std::string>::const_iterator it = info->mReqHeader.find("X_DUP_HTTP_STATUS");
+    const size_t it = info->mReqHeader.find(DupModule::HeaderName::X_DUP_HTTP_STATUS);
     try {
-        info->mReqHttpStatus = it != info->mReqHeader.end() ? boost::lexical_cast<int>(it->second) : -1;
+        info->mReqHttpStatus = it != DupModule::tHeaders::npos ? boost::lexical_cast<int>(info->mReqHeader.value(it).to_string()) : -1;
     } catch (boost::bad_lexical_cast& e) {
         info->mReqHttpStatus = -1;
         Log::warn(1, "Invalid X_DUP_HTTP_STATUS header value (not a number?)");
     }
     
-    Log::debug("[DEBUG][COMPARE] REMAINING: %ld", pRequest->remaining);
+    LOG_DEBUG_IF_ENABLED("[DEBUG][COMPARE] REMAINING: %ld", pRequest->remaining);
     apr_table_unset(pRequest->headers_in, "ELAPSED_TIME_BY_DUP");
     apr_table_unset(pRequest->headers_in, "X_DUP_HTTP_STATUS");
     
@@ -164,7 +176,7 @@ int translateHook(request_rec *pRequest) {
         Log::error(42, "No connection pool associated to the request");
         return DECLINED;
     }
-    Log::debug("[DEBUG][COMPARE] Inside translateHook");
+    LOG_DEBUG_IF_ENABLED("[DEBUG][COMPARE] Inside translateHook");
     
     initRequest(pRequest);
 
@@ -179,52 +191,52 @@ int translateHook(request_rec *pRequest) {
  */
 apr_status_t inputFilterHandler(ap_filter_t *pF, apr_bucket_brigade *pB, ap_input_mode_t pMode, apr_read_type_e pBlock, apr_off_t pReadbytes)
 {
-    Log::debug("[DEBUG][COMPARE] Inside inputFilterHandler");
+    LOG_DEBUG_IF_ENABLED("[DEBUG][COMPARE] Inside inputFilterHandler");
 
     apr_status_t lStatus;
     request_rec *pRequest = pF->r;
     if (!pRequest) {
-        Log::debug("[DEBUG][COMPARE] inputFilterHandler request_rec null");
+        LOG_DEBUG_IF_ENABLED("[DEBUG][COMPARE] inputFilterHandler request_rec null");
         return ap_get_brigade(pF->next, pB, pMode, pBlock, pReadbytes);
     }
     
     const char *lDupType = apr_table_get(pRequest->headers_in, "Duplication-Type");
     if (( lDupType == NULL ) || ( strcmp("Response", lDupType) != 0) ) {
-        Log::debug("[DEBUG][COMPARE] inputFilterHandler not a duplicated request on path %s, nothing to compare", pRequest->uri);
+        LOG_DEBUG_IF_ENABLED("[DEBUG][COMPARE] inputFilterHandler not a duplicated request on path %s, nothing to compare", pRequest->uri);
         return ap_get_brigade(pF->next, pB, pMode, pBlock, pReadbytes);
     }
 
     if(pRequest->per_dir_config == NULL){
-        Log::debug("[DEBUG][COMPARE] inputFilterHandler per_dir_config is null");
+        LOG_DEBUG_IF_ENABLED("[DEBUG][COMPARE] inputFilterHandler per_dir_config is null");
         return ap_get_brigade(pF->next, pB, pMode, pBlock, pReadbytes);
     }
     struct CompareConf *tConf = reinterpret_cast<CompareConf *>(ap_get_module_config(pRequest->per_dir_config, &compare_module));
     if (!tConf) {
-        Log::debug("[DEBUG][COMPARE] inputFilterHandler per_dir_config is null");
+        LOG_DEBUG_IF_ENABLED("[DEBUG][COMPARE] inputFilterHandler per_dir_config is null");
         return ap_get_brigade(pF->next, pB, pMode, pBlock, pReadbytes); // SHOULD NOT HAPPEN
     }
 
     // No context? new request or request called with an alias, translateHook was not called
     if (!pF->ctx) {
-        Log::debug("[DEBUG][COMPARE] inputFilterHandler Assigning filter ctx");
+        LOG_DEBUG_IF_ENABLED("[DEBUG][COMPARE] inputFilterHandler Assigning filter ctx");
         boost::shared_ptr<DupModule::RequestInfo> *shPtr = reinterpret_cast<boost::shared_ptr<DupModule::RequestInfo> *>(ap_get_module_config(pRequest->request_config, &compare_module));
         if ( ! shPtr ) {
             shPtr = initRequest(pRequest);
-            Log::debug("[DEBUG][COMPARE] Translate hook was not called, request created directly in the input filter");
+            LOG_DEBUG_IF_ENABLED("[DEBUG][COMPARE] Translate hook was not called, request created directly in the input filter");
         }
         assert(shPtr->get());
         // Backup of info struct in the request context
         pF->ctx = shPtr->get();
 
         DupModule::RequestInfo *lRI = static_cast<DupModule::RequestInfo *>(pF->ctx);
-        Log::debug("[DEBUG][COMPARE] inputFilterHandler Starting extractBrigadeContent");
+        LOG_DEBUG_IF_ENABLED("[DEBUG][COMPARE] inputFilterHandler Starting extractBrigadeContent");
         while (!CommonModule::extractBrigadeContent(pB, pF->next, lRI->mBody)){
             apr_brigade_cleanup(pB);
         }
         pF->ctx = (void *)1;
         apr_brigade_cleanup(pB);
         lRI->offset = 0;
-        Log::debug("[DEBUG][COMPARE] inputFilterHandler Starting deserializeBody");
+        LOG_DEBUG_IF_ENABLED("[DEBUG][COMPARE] inputFilterHandler Starting deserializeBody");
         lStatus =  deserializeBody(*lRI);
 
         // reset timer to not take deserializing computation time into account
@@ -266,7 +278,7 @@ apr_status_t inputFilterHandler(ap_filter_t *pF, apr_bucket_brigade *pB, ap_inpu
 /// @brief first output filter, stores the response in RequestInfo
 apr_status_t
 outputFilterHandler(ap_filter_t *pFilter, apr_bucket_brigade *pBrigade) {
-    Log::debug("[DEBUG][COMPARE] Inside outputFilterHandler");
+    LOG_DEBUG_IF_ENABLED("[DEBUG][COMPARE] Inside outputFilterHandler");
 
     request_rec *pRequest = pFilter->r;
     apr_status_t lStatus;
@@ -329,7 +341,7 @@ outputFilterHandler(ap_filter_t *pFilter, apr_bucket_brigade *pBrigade) {
         apr_size_t len;
 
         if (APR_BUCKET_IS_EOS(currentBucket)) {
-            Log::debug("[DEBUG][COMPARE] in outputFilterHandler eos_seen");
+            LOG_DEBUG_IF_ENABLED("[DEBUG][COMPARE] in outputFilterHandler eos_seen");
             req->eos_seen(true);
             continue;
         }
@@ -342,7 +354,7 @@ outputFilterHandler(ap_filter_t *pFilter, apr_bucket_brigade *pBrigade) {
     }
 
     if (apr_table_get(pRequest->headers_in, "X_COMP_LOG") != NULL) {
-        Log::debug("[DEBUG][COMPARE] all the body is received,X_COMP_LOG is set, responses will be compared");
+        LOG_DEBUG_IF_ENABLED("[DEBUG][COMPARE] all the body is received,X_COMP_LOG is set, responses will be compared");
         std::string out = "COMPARED - with conf from ";
         out += tConf->mDirName;
         out += " logged in ";
@@ -365,11 +377,11 @@ outputFilterHandler(ap_filter_t *pFilter, apr_bucket_brigade *pBrigade) {
 /// @brief second output filter, performs the actual comparison
 apr_status_t
 outputFilterHandler2(ap_filter_t *pFilter, apr_bucket_brigade *pBrigade) {
-    Log::debug("[DEBUG][COMPARE] Inside outputFilterHandler2");
+    LOG_DEBUG_IF_ENABLED("[DEBUG][COMPARE] Inside outputFilterHandler2");
 
     apr_status_t lStatus;
     if (pFilter->ctx == (void *)-1){
-        Log::debug("[DEBUG][COMPARE] Inside outputFilterHandler2 pass because ctx -1");
+        LOG_DEBUG_IF_ENABLED("[DEBUG][COMPARE] Inside outputFilterHandler2 pass because ctx -1");
         lStatus =  ap_pass_brigade(pFilter->next, pBrigade);
         apr_brigade_cleanup(pBrigade);
         return lStatus;
@@ -379,7 +391,7 @@ outputFilterHandler2(ap_filter_t *pFilter, apr_bucket_brigade *pBrigade) {
 
     struct CompareConf *tConf = reinterpret_cast<CompareConf *>(ap_get_module_config(pRequest->per_dir_config, &compare_module));
     if( tConf == NULL ){
-        Log::debug("[DEBUG][COMPARE] Inside outputFilterHandler2 pass because no per dir conf");
+        LOG_DEBUG_IF_ENABLED("[DEBUG][COMPARE] Inside outputFilterHandler2 pass because no per dir conf");
         lStatus =  ap_pass_brigade(pFilter->next, pBrigade);
         apr_brigade_cleanup(pBrigade);
         return lStatus;
@@ -388,7 +400,7 @@ outputFilterHandler2(ap_filter_t *pFilter, apr_bucket_brigade *pBrigade) {
     boost::shared_ptr<DupModule::RequestInfo> *shPtr(reinterpret_cast<boost::shared_ptr<DupModule::RequestInfo> *>(ap_get_module_config(pRequest->request_config, &compare_module)));
 
     if ( !shPtr || !shPtr->get()) {
-        Log::debug("[DEBUG][COMPARE] Inside outputFilterHandler2 pass because no request info");
+        LOG_DEBUG_IF_ENABLED("[DEBUG][COMPARE] Inside outputFilterHandler2 pass because no request info");
         lStatus =  ap_pass_brigade(pFilter->next, pBrigade);
         apr_brigade_cleanup(pBrigade);
         return lStatus;
@@ -396,7 +408,7 @@ outputFilterHandler2(ap_filter_t *pFilter, apr_bucket_brigade *pBrigade) {
 
     DupModule::RequestInfo *req = shPtr->get();
     if (!req->eos_seen()) {
-        Log::debug("[DEBUG][COMPARE] Inside outputFilterHandler2 pass because not eos");
+        LOG_DEBUG_IF_ENABLED("[DEBUG][COMPARE] Inside outputFilterHandler2 pass because not eos");
         lStatus =  ap_pass_brigade(pFilter->next, pBrigade);
         apr_brigade_cleanup(pBrigade);
          return lStatus;
@@ -410,18 +422,18 @@ outputFilterHandler2(ap_filter_t *pFilter, apr_bucket_brigade *pBrigade) {
     boost::scoped_ptr<LibWsDiff::diffPrinter> printer(LibWsDiff::diffPrinter::createDiffPrinter(req->mId,tConf->mLogType));
 
     if (tConf->mCompareDisabled) {
-        Log::debug("[DEBUG][COMPARE] comparison disabled: write serialized request to file");
+        LOG_DEBUG_IF_ENABLED("[DEBUG][COMPARE] comparison disabled: write serialized request to file");
         writeSerializedRequest(*req);
     } else {
         req->mDupResponseHttpStatus = pRequest->status;
         boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
-        Log::debug("[DEBUG][COMPARE] retrieve differences if any");
+        LOG_DEBUG_IF_ENABLED("[DEBUG][COMPARE] retrieve differences if any");
         bool headerDiff = tConf->mCompHeader.retrieveDiff(req->mResponseHeader,req->mDupResponseHeader,*printer);
         bool bodyDiff = tConf->mCompBody.retrieveDiff(req->mResponseBody,req->mDupResponseBody,*printer);
         if ( headerDiff || bodyDiff) {
-            Log::debug("[DEBUG][COMPARE] header or body differences found");
+            LOG_DEBUG_IF_ENABLED("[DEBUG][COMPARE] header or body differences found");
             if(printer->isDiff() || checkCassandraDiff(req->mId) || (req->mReqHttpStatus!=-1 && (req->mReqHttpStatus != req->mDupResponseHttpStatus)) ){
-                Log::debug("[DEBUG][COMPARE] write differences to file or syslog");
+                LOG_DEBUG_IF_ENABLED("[DEBUG][COMPARE] write differences to file or syslog");
                 writeDifferences(*req,*printer,boost::posix_time::microsec_clock::universal_time()-start);
             }
         }
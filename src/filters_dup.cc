@@ -27,12 +27,12 @@ namespace DupModule {
 
 /*
  * Callback to iterate over the headers tables
- * Pushes a copy of key => value in a list passed without typing as the first argument
+ * Appends a copy of key => value to the headers passed without typing as the first argument
  */
 static int iterateOverHeadersCallBack(void *d, const char *key, const char *value)
 {
-    tKeyValList *headers = reinterpret_cast<tKeyValList *>(d);
-    headers->push_back(std::pair<std::string, std::string>(key, value));
+    tHeaders *headers = reinterpret_cast<tHeaders *>(d);
+    headers->push_back(key, value);
     return 1;
 }
 
@@ -42,12 +42,12 @@ static int checkAdditionalHeaders(const RequestInfo &r, request_rec *pRequest)
         return 0;
     }
 
-    for (tKeyValList::value_type header : r.mHeadersOut) {
-        if (header.first == std::string("X_DUP_LOG")) {
-            apr_table_set(pRequest->headers_out,"X_DUP_LOG", header.second.c_str());
+    for (const tHeaders::tHeader &header : r.mHeadersOut) {
+        if (header.mId == HeaderName::X_DUP_LOG) {
+            apr_table_set(pRequest->headers_out,"X_DUP_LOG", header.mValue.to_string().c_str());
         }
-        else if (header.first == std::string("X_COMP_LOG")) {
-            apr_table_set(pRequest->headers_out,"X_COMP_LOG", header.second.c_str());
+        else if (header.mId == HeaderName::X_COMP_LOG) {
+            apr_table_set(pRequest->headers_out,"X_COMP_LOG", header.mValue.to_string().c_str());
         }
     }
 
@@ -60,49 +60,37 @@ static int checkCurlResponseCompareStatus(const RequestInfo &ri, request_rec *pR
     {
         return 0;
     }
-    if (ri.mCurlCompResponseHeader.count("X-COMP-STATUS")) {
-        Log::debug("[DUP] header contains the X-COMP-STATUS");
-        apr_table_set( pRequest->headers_out,"X-COMP-STATUS", ri.mCurlCompResponseHeader.at("X-COMP-STATUS").c_str());
+    const size_t compStatus = ri.mCurlCompResponseHeader.find(HeaderName::X_COMP_STATUS);
+    if (compStatus != tHeaders::npos) {
+        LOG_DEBUG_IF_ENABLED("[DUP] header contains the X-COMP-STATUS");
+        apr_table_set( pRequest->headers_out,"X-COMP-STATUS", ri.mCurlCompResponseHeader.value(compStatus).to_string().c_str());
         return 0;
     } 
     else if (ri.mCurlCompResponseStatus == -1){
-        Log::debug("[DUP] Curl uninitialized, no duplication, so no comparison.");
+        LOG_DEBUG_IF_ENABLED("[DUP] Curl uninitialized, no duplication, so no comparison.");
         apr_table_set( pRequest->headers_out,"X-COMPARE-STATUS", "No Duplication, No Comparison");
         return 0;
     }
     else if (ri.mCurlCompResponseStatus != CURLE_OK){
-        Log::debug("[DUP] Curl error happened the destination is not reached");
+        LOG_DEBUG_IF_ENABLED("[DUP] Curl error happened the destination is not reached");
         std::string out("NOT REACHED - curl status ");
         out += curl_easy_strerror(static_cast<CURLcode>(ri.mCurlCompResponseStatus));
         apr_table_set( pRequest->headers_out,"X-COMPARE-STATUS", out.c_str());
         return 0;
     }
 
-    Log::debug("[DUP] Curl returned OK but there was no comparison.");
+    LOG_DEBUG_IF_ENABLED("[DUP] Curl returned OK but there was no comparison.");
     apr_table_set( pRequest->headers_out,"X-COMPARE-STATUS", "Reached Destination - No Comparison");
     return 0;
 }
 
-static bool prepareRequestInfo(DupConf *tConf, request_rec *pRequest, RequestInfo &r)
+/*
+ * Fills the headers in with the mod_dup pseudo headers followed by the request headers
+ * The X_DUP_HTTP_STATUS pseudo header is only added when withStatus is true
+ * Returns false if the request has already been duplicated too many times
+ */
+static bool prepareHeadersIn(request_rec *pRequest, tHeaders &headersIn, bool withStatus)
 {
-    Log::debug("[DUP] Prepare request info");
-    // Add the HTTP Status Code Header
-    r.mHeadersIn.push_front(std::make_pair("X_DUP_HTTP_STATUS", boost::lexical_cast<std::string>(pRequest->status)));
-    // Add the HTTP Request Method
-    const char* inOverride = apr_table_get(pRequest->headers_in, "X-HTTP-METHOD-OVERRIDE");
-    if(inOverride) {
-        //take the X-HTTP-METHOD-OVERRIDE for input request over the basic method
-        r.mHeadersIn.push_front(std::make_pair("X_DUP_METHOD", inOverride));
-        r.mHeadersIn.push_front(std::make_pair("X-HTTP-METHOD-OVERRIDE", inOverride));
-    }
-    else {
-        r.mHeadersIn.push_front(std::make_pair("X_DUP_METHOD", pRequest->method));
-        r.mHeadersIn.push_front(std::make_pair("X-HTTP-METHOD-OVERRIDE", pRequest->method));
-    }
-    // Add the HTTP Content Type
-    const char* contentType = apr_table_get(pRequest->headers_in,"Content-Type");
-    if (contentType) r.mHeadersIn.push_front(std::make_pair("X_DUP_CONTENT_TYPE", contentType));
-
     // Increment the dup count and make sure we didn't duplicate more than 4 times
     // avoids an infinite loop of duplication when destination is localhost or a loop in the network
     const char* dupCount = apr_table_get(pRequest->headers_in,"X-DUP-COUNT");
@@ -114,10 +102,35 @@ static bool prepareRequestInfo(DupConf *tConf, request_rec *pRequest, RequestInf
         }
     }
     count++;
-    r.mHeadersIn.push_front(std::make_pair("X-DUP-COUNT", std::to_string(count).c_str()));
-    
+    headersIn.push_back(HeaderName::toString(HeaderName::X_DUP_COUNT), std::to_string(count));
+
+    // Add the HTTP Content Type
+    const char* contentType = apr_table_get(pRequest->headers_in,"Content-Type");
+    if (contentType) headersIn.push_back(HeaderName::toString(HeaderName::X_DUP_CONTENT_TYPE), contentType);
+
+    // Add the HTTP Request Method
+    const char* inOverride = apr_table_get(pRequest->headers_in, "X-HTTP-METHOD-OVERRIDE");
+    //take the X-HTTP-METHOD-OVERRIDE for input request over the basic method
+    const char* method = inOverride ? inOverride : pRequest->method;
+    headersIn.push_back(HeaderName::toString(HeaderName::X_HTTP_METHOD_OVERRIDE), method);
+    headersIn.push_back(HeaderName::toString(HeaderName::X_DUP_METHOD), method);
+
+    // Add the HTTP Status Code Header
+    if (withStatus) {
+        headersIn.push_back(HeaderName::toString(HeaderName::X_DUP_HTTP_STATUS), boost::lexical_cast<std::string>(pRequest->status));
+    }
+
     // Copy headers in, we might have duplicate headers in case of double dup but we'll deal with it later
-    apr_table_do(&iterateOverHeadersCallBack, &r.mHeadersIn, pRequest->headers_in, NULL);
+    apr_table_do(&iterateOverHeadersCallBack, &headersIn, pRequest->headers_in, NULL);
+    return true;
+}
+
+static bool prepareRequestInfo(DupConf *tConf, request_rec *pRequest, RequestInfo &r)
+{
+    LOG_DEBUG_IF_ENABLED("[DUP] Prepare request info");
+    if ( ! prepareHeadersIn(pRequest, r.mHeadersIn, true) ) {
+        return false;
+    }
 
     // Check if X_DUP_LOG header is present
     if (apr_table_get(pRequest->headers_in, "X_DUP_LOG")) r.mValidationHeaderDup = true;
@@ -131,12 +144,45 @@ static bool prepareRequestInfo(DupConf *tConf, request_rec *pRequest, RequestInf
     return true;
 }
 
+/**
+ * @brief Evaluates the filters which do not depend on the bodies before buffering them
+ * @param statusKnown true if the http status of the answer is final
+ * @return false if no filter can match this request, so its bodies must not be captured
+ */
+static bool bodyCaptureNeeded(DupConf *tConf, request_rec *pRequest, bool statusKnown)
+{
+    if (!pRequest->method || !pRequest->uri) {
+        // Not enough information to decide yet
+        return true;
+    }
+    RequestInfo early;
+    if ( ! prepareHeadersIn(pRequest, early.mHeadersIn, statusKnown) ) {
+        return false;
+    }
+    early.mConf = tConf;
+    early.mMethod = pRequest->method;
+    early.mPath = pRequest->uri;
+    early.mArgs = pRequest->args ? pRequest->args : "";
+    return gProcessor->mayMatchFilters(early, statusKnown);
+}
+
+/*
+ * Stops the capture of the bodies of a request that can never be duplicated
+ * and frees what has already been buffered
+ */
+static void stopBodyCapture(RequestInfo &ri)
+{
+    ri.mCaptureBodies = false;
+    std::string().swap(ri.mBody);
+    std::string().swap(ri.mAnswer);
+}
+
 static void printRequest(request_rec *pRequest, RequestInfo *pBH, DupConf *tConf)
 {
     const char *reqId = apr_table_get(pRequest->headers_in, CommonModule::c_UNIQUE_ID);
-    Log::debug("[DUP] Pushing a request with ID: %s, body size:%ld", reqId, pBH->mBody.size());
-    Log::debug("[DUP] Uri:%s, dir name:%s", pRequest->uri, tConf->dirName);
-    Log::debug("[DUP] Request args: %s", pRequest->args);
+    LOG_DEBUG_IF_ENABLED("[DUP] Pushing a request with ID: %s, body size:%ld", reqId, pBH->mBody.size());
+    LOG_DEBUG_IF_ENABLED("[DUP] Uri:%s, dir name:%s", pRequest->uri, tConf->dirName);
+    LOG_DEBUG_IF_ENABLED("[DUP] Request args: %s", pRequest->args);
 }
 
 /**
@@ -152,13 +198,14 @@ static void initiateDuplication(DupConf *tConf, request_rec *pRequest, boost::sh
 
     // Force synchronous mode when X_DUP_LOG to retrieve X_DUP_LOG header
     if (tConf->synchronous || apr_table_get(pRequest->headers_in, "X_DUP_LOG")) {
-        static __thread CURL * lCurl = NULL;
-        if (!lCurl) {
-            lCurl = gProcessor->initCurl();
+        static __thread tMultiCurl * lSyncCurl = NULL;
+        if (!lSyncCurl) {
+            lSyncCurl = gProcessor->initMultiCurl();
+        }
+        // Run synchronously without pushing to the queue, all the destinations at once
+        if (lSyncCurl) {
+            gProcessor->runSync(*reqInfo, *lSyncCurl);
         }
-        // Run synchronously without pushing to the queue
-        bool stillRunning = true;
-        gProcessor->runOne(*ri, lCurl, stillRunning);
     } else {
         // will be popped by RequestProcessor::Run
         gThreadPool->push(*reqInfo);
@@ -170,7 +217,7 @@ static void initiateDuplication(DupConf *tConf, request_rec *pRequest, boost::sh
 
 apr_status_t inputFilterHandler(ap_filter_t *pFilter, apr_bucket_brigade *pB, ap_input_mode_t pMode, apr_read_type_e pBlock, apr_off_t pReadbytes)
 {
-    Log::debug("[DUP] Input filter handler");
+    LOG_DEBUG_IF_ENABLED("[DUP] Input filter handler");
     request_rec *pRequest = pFilter->r;
     if (!pRequest || !pRequest->per_dir_config) {
         return ap_get_brigade(pFilter->next, pB, pMode, pBlock, pReadbytes);
@@ -191,6 +238,10 @@ apr_status_t inputFilterHandler(ap_filter_t *pFilter, apr_bucket_brigade *pB, ap
             info->mArgs = pRequest->args ? pRequest->args : "";
         }
         pFilter->ctx = reqInfo->get();
+        // Do not buffer a body that no filter will ever look at
+        if (reqInfo->get()->mCaptureBodies && !bodyCaptureNeeded(conf, pRequest, false)) {
+            stopBodyCapture(*reqInfo->get());
+        }
     }
     if (pFilter->ctx != (void *) -1) {
         // Request not completely read yet
@@ -216,7 +267,7 @@ apr_status_t inputFilterHandler(ap_filter_t *pFilter, apr_bucket_brigade *pB, ap
                 Log::error(42, "[DUP] Bucket read failed, skipping the rest of the body");
                 return rv;
             }
-            if (len) {
+            if (len && info->mCaptureBodies) {
                 info->mBody.append(data, len);
             }
         }
@@ -232,7 +283,7 @@ apr_status_t inputFilterHandler(ap_filter_t *pFilter, apr_bucket_brigade *pB, ap
  */
 apr_status_t outputBodyFilterHandler(ap_filter_t *pFilter, apr_bucket_brigade *pBrigade)
 {
-    Log::debug("[DUP] Output body filter handler");
+    LOG_DEBUG_IF_ENABLED("[DUP] Output body filter handler");
 
     request_rec *pRequest = pFilter->r;
     apr_status_t rv;
@@ -250,6 +301,7 @@ apr_status_t outputBodyFilterHandler(ap_filter_t *pFilter, apr_bucket_brigade *p
     }
 
     RequestInfo * ri = NULL;
+    bool firstCall = false;
     boost::shared_ptr<RequestInfo> * reqInfo(reinterpret_cast<boost::shared_ptr<RequestInfo> *>(ap_get_module_config(pFilter->r->request_config, &dup_module)));
     if (!reqInfo || !reqInfo->get()) {
         if (!pFilter->ctx) {
@@ -261,6 +313,7 @@ apr_status_t outputBodyFilterHandler(ap_filter_t *pFilter, apr_bucket_brigade *p
             reqInfo = CommonModule::makeRequestInfo<DupModule::RequestInfo,&dup_module>(pRequest);
 			ri = reqInfo->get();
             pFilter->ctx = ri;
+            firstCall = true;
 
             ri->mConf = tConf;
             ri->mArgs = pRequest->args ? pRequest->args : "";
@@ -273,6 +326,17 @@ apr_status_t outputBodyFilterHandler(ap_filter_t *pFilter, apr_bucket_brigade *p
         }
     } else {
         ri = reqInfo->get();
+        if (!pFilter->ctx) {
+            pFilter->ctx = ri;
+            firstCall = true;
+        }
+    }
+
+    // The status is final now, last chance to avoid buffering an answer that will never be duplicated
+    if (firstCall && ri->mCaptureBodies &&
+        (tConf->getHighestDuplicationType() == DuplicationType::REQUEST_WITH_ANSWER) &&
+        !bodyCaptureNeeded(tConf, pRequest, true)) {
+        stopBodyCapture(*ri);
     }
 
     // Write the response body to the RequestInfo if found
@@ -295,7 +359,7 @@ apr_status_t outputBodyFilterHandler(ap_filter_t *pFilter, apr_bucket_brigade *p
             continue;
 
         // We need to get the highest one as we haven't matched which rule it is yet
-        if (tConf->getHighestDuplicationType() == DuplicationType::REQUEST_WITH_ANSWER) {
+        if (ri->mCaptureBodies && (tConf->getHighestDuplicationType() == DuplicationType::REQUEST_WITH_ANSWER)) {
 
             const char *data;
             apr_size_t len;
@@ -320,7 +384,7 @@ apr_status_t outputBodyFilterHandler(ap_filter_t *pFilter, apr_bucket_brigade *p
  */
 apr_status_t outputHeadersFilterHandler(ap_filter_t *pFilter, apr_bucket_brigade *pBrigade)
 {
-    Log::debug("[DUP] Output headers filter handler");
+    LOG_DEBUG_IF_ENABLED("[DUP] Output headers filter handler");
 
     apr_status_t rv;
     if (pFilter->ctx == (void *) -1) {
@@ -346,6 +410,15 @@ apr_status_t outputHeadersFilterHandler(ap_filter_t *pFilter, apr_bucket_brigade
         return rv;
     }
 
+    // Nothing to do on the response path, logTransactionHook takes over
+    // X_DUP_LOG requests still need the headers added to the answer by a synchronous duplication
+    if (tConf->afterResponse && !apr_table_get(pRequest->headers_in, "X_DUP_LOG")) {
+        pFilter->ctx = (void *) -1;
+        rv = ap_pass_brigade(pFilter->next, pBrigade);
+        apr_brigade_cleanup(pBrigade);
+        return rv;
+    }
+
     RequestInfo * ri = NULL;
     boost::shared_ptr<RequestInfo> * reqInfo(reinterpret_cast<boost::shared_ptr<RequestInfo> *>(ap_get_module_config(pFilter->r->request_config, &dup_module)));
 
@@ -392,4 +465,27 @@ apr_status_t outputHeadersFilterHandler(ap_filter_t *pFilter, apr_bucket_brigade
     return rv;
 }
 
+int logTransactionHook(request_rec *pRequest)
+{
+    if (!pRequest->per_dir_config || apr_table_get(pRequest->headers_in, "X_DUP_LOG")) {
+        return DECLINED;
+    }
+    struct DupConf *tConf = reinterpret_cast<DupConf *>(ap_get_module_config(pRequest->per_dir_config, &dup_module));
+    if ((!tConf) || (!tConf->dirName) || (!tConf->afterResponse) ||
+        (tConf->getHighestDuplicationType() == DuplicationType::NONE)) {
+        return DECLINED;
+    }
+    boost::shared_ptr<RequestInfo> * reqInfo(reinterpret_cast<boost::shared_ptr<RequestInfo> *>(ap_get_module_config(pRequest->request_config, &dup_module)));
+    // The output filters did not see the end of the answer, the request was aborted
+    if (!reqInfo || !reqInfo->get() || !reqInfo->get()->eos_seen()) {
+        return DECLINED;
+    }
+    LOG_DEBUG_IF_ENABLED("[DUP] Log transaction hook");
+    // The request pool still holds its reference until the end of the transaction,
+    // handing the shared pointer to the workers neither copies nor frees the captured bodies
+    apr_table_do(&iterateOverHeadersCallBack, &reqInfo->get()->mHeadersOut, pRequest->headers_out, NULL);
+    initiateDuplication(tConf, pRequest, reqInfo);
+    return OK;
+}
+
 }
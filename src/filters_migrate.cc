@@ -39,7 +39,7 @@ namespace MigrateModule {
 /// set apache env var
 static bool setEnvVar(request_rec *pRequest, const MigrateConf::MigrateEnv &ctx, const std::string& toSet, int& count) {
     if (!toSet.empty()) {
-        Log::debug("CE: URL match: Value to set: %s, varName: %s", toSet.c_str(), ctx.mVarName.c_str());
+        LOG_DEBUG_IF_ENABLED("CE: URL match: Value to set: %s, varName: %s", toSet.c_str(), ctx.mVarName.c_str());
 #ifndef UNIT_TESTING
         apr_table_set(pRequest->subprocess_env, ctx.mVarName.c_str(), toSet.c_str());
 #endif
@@ -159,7 +159,7 @@ int translateHook(request_rec *pRequest) {
  */
 apr_status_t inputFilterBody2Brigade(ap_filter_t *pF, apr_bucket_brigade *pB, ap_input_mode_t pMode, apr_read_type_e pBlock, apr_off_t pReadbytes)
 {
-    Log::debug("[MIGRATE] inputFilterBody2Brigade");
+    LOG_DEBUG_IF_ENABLED("[MIGRATE] inputFilterBody2Brigade");
     request_rec *pRequest = pF->r;
     if (!pRequest || !pRequest->per_dir_config) {
         return ap_get_brigade(pF->next, pB, pMode, pBlock, pReadbytes);
@@ -183,6 +183,8 @@ void map2string(const std::map< std::string, std::string> &pMap, std::string &pS
 
 int iterateOverHeadersCallBack(void *d, const char *key, const char *value);
 
+int iterateOverRequestHeadersCallBack(void *d, const char *key, const char *value);
+
 apr_status_t closeLogFile(void *);
 
 apr_status_t openLogFile(const char* filepath,std::ios_base::openmode mode=std::ios_base::out);
@@ -21,9 +21,11 @@
 #include <http_request.h>
 #include <http_protocol.h>
 #include <http_connection.h>
+#include <http_main.h>
 // Work-around boost::chrono 1.53 conflict on CR typedef vs define in apache
 #undef CR
 
+#include <ap_mpm.h>
 #include <apr_pools.h>
 #include <apr_hooks.h>
 #include "apr_strings.h"
@@ -53,6 +55,17 @@ const char *gNameOutBody = "DupOutBody";
 const char *gNameOutHeaders = "DupOutHeaders";
 
 const char *c_COMPONENT_VERSION = "Dup/1.0";
+const char *c_SCOREBOARD_PREFIX = "mod_dup_scoreboard.";
+const char *c_STATUS_HANDLER = "dup-status";
+
+/** @brief The number of messages buffered per thread by the DupLogBackend writer by default */
+static const unsigned int cDefaultLogCapacity = 64;
+
+/** @brief The number of messages logged per second and per code by the DupLogBackend writer by default */
+static const unsigned int cDefaultLogRatePerCode = 10;
+
+/** @brief The number of slots of the scoreboard when the mpm does not tell its maximum number of children */
+static const int cDefaultScoreboardSlots = 256;
 
 namespace DuplicationType {
     extern const char* c_ERROR_ON_STRING_VALUE;
@@ -63,6 +76,9 @@ DupConf::DupConf()
     , dirName(NULL)
     , currentDupDestination()
     , synchronous(false)
+    , afterResponse(false)
+    , reorderFilters(false)
+    , mPriority(-1)
     , mCurrentDuplicationType(DuplicationType::NONE)
     , mHighestDuplicationType(DuplicationType::NONE) {
     srand(time(NULL));
@@ -96,6 +112,20 @@ DupConf::getHighestDuplicationType() const {
     return mHighestDuplicationType;
 }
 
+void
+DupConf::setPriority(QueuePriority::eQueuePriority pPriority) {
+    mPriority = pPriority;
+}
+
+QueuePriority::eQueuePriority
+DupConf::getPriority() const {
+    if (mPriority >= 0) {
+        return static_cast<QueuePriority::eQueuePriority>(mPriority);
+    }
+    // A comparison campaign misses the requests whose answers got lost
+    return mHighestDuplicationType == DuplicationType::REQUEST_WITH_ANSWER ? QueuePriority::HIGH : QueuePriority::NORMAL;
+}
+
 void *
 createDirConfig(apr_pool_t *pPool, char *pDirName)
 {
@@ -118,12 +148,88 @@ init() {
                                                boost::bind(&RequestProcessor::getTimeoutCount, gProcessor)));
     gThreadPool->addStat("#DupReq", boost::bind(boost::lexical_cast<std::string, unsigned int>,
                                                 boost::bind(&RequestProcessor::getDuplicatedCount, gProcessor)));
+    gThreadPool->setDropPolicy(DropPolicy::NEWEST,
+                               boost::bind(&RequestProcessor::queuePriority, gProcessor, _1),
+                               boost::bind(&RequestProcessor::dropped, gProcessor, _1, _2));
+    gThreadPool->addStat("#Drop", boost::bind(&RequestProcessor::getDropCounts, gProcessor));
+    gThreadPool->addStat("#Latency", boost::bind(&RequestProcessor::getLatencies, gProcessor));
+    gThreadPool->addStat("#Filters", boost::bind(&RequestProcessor::getFilterStats, gProcessor));
+    gThreadPool->setLoadHandler(&RequestProcessor::queuedSize,
+                                boost::bind(&RequestProcessor::onLoad, gProcessor, _1, _2, _3));
+}
+
+std::string
+scoreboardName(const char *pServerRoot, const char *pConfName) {
+    // FNV-1a, the paths may be longer than a shared memory name
+    uint64_t lHash = 14695981039346656037ULL;
+    const char *lParts[] = { pServerRoot ? pServerRoot : "", "\n", pConfName ? pConfName : "" };
+    for (size_t i = 0; i < sizeof(lParts) / sizeof(lParts[0]); ++i) {
+        for (const char *c = lParts[i]; *c; ++c) {
+            lHash = (lHash ^ static_cast<unsigned char>(*c)) * 1099511628211ULL;
+        }
+    }
+    char lHex[17];
+    snprintf(lHex, sizeof(lHex), "%016llx", static_cast<unsigned long long>(lHash));
+    return std::string(c_SCOREBOARD_PREFIX) + lHex;
+}
+
+int
+preConfig(apr_pool_t * pPool, apr_pool_t * pLog, apr_pool_t * pTemp) {
+    // The processor and the logs outlive a graceful restart: what the directives set starts again from the defaults
+    Log::setLevel(LOG_DEBUG);
+    Log::resetAsync();
+    if ( gProcessor ) {
+        gProcessor->clearResolve();
+    }
+    return OK;
 }
 
 int
 postConfig(apr_pool_t * pPool, apr_pool_t * pLog, apr_pool_t * pTemp, server_rec * pServer) {
     Log::init();
     ap_add_version_component(pPool, c_COMPONENT_VERSION) ;
+    if ( gProcessor ) {
+        int lSlots = 0;
+        if ( ap_mpm_query(AP_MPMQ_HARD_LIMIT_DAEMONS, &lSlots) != APR_SUCCESS || lSlots <= 0 ) {
+            lSlots = cDefaultScoreboardSlots;
+        }
+        // Mapped before the children are forked so that they all share it, one per instance of httpd on the host
+        if ( gProcessor->getScoreboard().create(scoreboardName(ap_server_root, ap_server_confname), lSlots,
+                                                gProcessor->getDestinations()) ) {
+            gThreadPool->addStat("#Server", boost::bind(&Scoreboard::getSummary, &gProcessor->getScoreboard()));
+        }
+    }
+    return OK;
+}
+
+int
+statusHandler(request_rec *pRequest) {
+    if ( ! pRequest->handler || strcmp(pRequest->handler, c_STATUS_HANDLER) ) {
+        return DECLINED;
+    }
+    if ( pRequest->method_number != M_GET ) {
+        return HTTP_METHOD_NOT_ALLOWED;
+    }
+    if ( ! gProcessor ) {
+        // Nothing to report without any Dup directive
+        return HTTP_NOT_FOUND;
+    }
+    StatusFormat::eStatusFormat lFormat = StatusFormat::TEXT;
+    if ( pRequest->args && ! strcasecmp(pRequest->args, "json") ) {
+        lFormat = StatusFormat::JSON;
+        ap_set_content_type(pRequest, "application/json");
+    } else if ( pRequest->args && ! strcasecmp(pRequest->args, "prometheus") ) {
+        lFormat = StatusFormat::PROMETHEUS;
+        ap_set_content_type(pRequest, "text/plain; version=0.0.4");
+    } else {
+        ap_set_content_type(pRequest, "text/plain");
+    }
+    if ( pRequest->header_only ) {
+        return OK;
+    }
+    // Read from the shared memory without locking
+    const std::string lStatus = gProcessor->getScoreboard().getStatus(lFormat);
+    ap_rwrite(lStatus.data(), lStatus.size(), pRequest);
     return OK;
 }
 
@@ -249,6 +355,126 @@ setTimeout(cmd_parms* pParams, void* pCfg, const char* pTimeout) {
     return NULL;
 }
 
+const char*
+setRetry(cmd_parms* pParams, void* pCfg, const char* pMaxAttempts, const char* pDeadline, const char* pBaseDelay) {
+    unsigned int lMaxAttempts, lDeadline, lBaseDelay = 100;
+    try {
+        lMaxAttempts = boost::lexical_cast<unsigned int>(pMaxAttempts);
+        lDeadline = boost::lexical_cast<unsigned int>(pDeadline);
+        if (pBaseDelay) {
+            lBaseDelay = boost::lexical_cast<unsigned int>(pBaseDelay);
+        }
+    } catch (boost::bad_lexical_cast&) {
+        return "Invalid value(s) for retries: <max retries> <deadline ms> [<base delay ms>]";
+    }
+
+    if ( ! gProcessor ) init();
+    gProcessor->setRetries(lMaxAttempts, lDeadline, lBaseDelay);
+    if ( lMaxAttempts ) {
+        gThreadPool->addStat("#Retry", boost::bind(&RequestProcessor::getRetryCounts, gProcessor));
+    }
+    return NULL;
+}
+
+const char*
+setRetryShare(cmd_parms* pParams, void* pCfg, const char* pPercentage) {
+    unsigned int lPercentage;
+    try {
+        lPercentage = boost::lexical_cast<unsigned int>(pPercentage);
+    } catch (boost::bad_lexical_cast&) {
+        return "Invalid value for the retry share, must be a percentage of the duplicated requests";
+    }
+    if (lPercentage > 100) {
+        return "Invalid value for the retry share, must be a percentage of the duplicated requests";
+    }
+
+    if ( ! gProcessor ) init();
+    gProcessor->setRetryShare(lPercentage);
+    return NULL;
+}
+
+const char*
+setConcurrentSends(cmd_parms* pParams, void* pCfg, const char* pMaxSends, const char* pMaxSendsPerDestination) {
+    unsigned int lMaxSends, lMaxSendsPerDestination;
+    try {
+        lMaxSends = boost::lexical_cast<unsigned int>(pMaxSends);
+        lMaxSendsPerDestination = pMaxSendsPerDestination ? boost::lexical_cast<unsigned int>(pMaxSendsPerDestination) : lMaxSends;
+    } catch (boost::bad_lexical_cast&) {
+        return "Invalid value(s) for the maximum number of concurrent sends.";
+    }
+    if (!lMaxSends || !lMaxSendsPerDestination) {
+        return "Invalid value(s) for the maximum number of concurrent sends, must be at least 1.";
+    }
+
+    if ( ! gProcessor ) init();
+    gProcessor->setConcurrentSends(lMaxSends, lMaxSendsPerDestination);
+    return NULL;
+}
+
+const char*
+setBatchSize(cmd_parms* pParams, void* pCfg, const char* pBatchSize) {
+    unsigned int lBatchSize;
+    try {
+        lBatchSize = boost::lexical_cast<unsigned int>(pBatchSize);
+    } catch (boost::bad_lexical_cast&) {
+        return "Invalid value for the batch size, must be a number of requests.";
+    }
+    if (!lBatchSize) {
+        return "Invalid value for the batch size, must be at least 1.";
+    }
+
+    if ( ! gProcessor ) init();
+    gProcessor->setBatchSize(lBatchSize);
+    return NULL;
+}
+
+const char*
+setErrorLog(cmd_parms* pParams, void* pCfg, const char* pMaxBody, const char* pSampling) {
+    unsigned int lMaxBody, lSampling = 1;
+    try {
+        lMaxBody = boost::lexical_cast<unsigned int>(pMaxBody);
+        if (pSampling) {
+            lSampling = boost::lexical_cast<unsigned int>(pSampling);
+        }
+    } catch (boost::bad_lexical_cast&) {
+        return "Invalid value(s) for the error logs: <max body bytes> [<one failure logged out of>]";
+    }
+    if (!lSampling) {
+        return "Invalid value for the error logs sampling, must be at least 1.";
+    }
+
+    if ( ! gProcessor ) init();
+    gProcessor->setErrorLog(lMaxBody, lSampling);
+    if ( lSampling > 1 ) {
+        gThreadPool->addStat("#ErrLogSkip", boost::bind(&RequestProcessor::getErrorLogSkips, gProcessor));
+    }
+    return NULL;
+}
+
+const char*
+setResolve(cmd_parms* pParams, void* pCfg, const char* pEntry) {
+    // The address goes last: an IPv6 one holds colons
+    const std::string lEntry(pEntry);
+    const size_t lHostEnd = lEntry.find(':');
+    const size_t lPortEnd = lHostEnd == std::string::npos ? std::string::npos : lEntry.find(':', lHostEnd + 1);
+    if (lHostEnd == 0 || lPortEnd == std::string::npos || lPortEnd + 1 == lEntry.size()) {
+        return "Invalid pinned address, format: <host>:<port>:<address>";
+    }
+    unsigned int lPort;
+    try {
+        lPort = boost::lexical_cast<unsigned int>(lEntry.substr(lHostEnd + 1, lPortEnd - lHostEnd - 1));
+    } catch (boost::bad_lexical_cast&) {
+        return "Invalid port for the pinned address, format: <host>:<port>:<address>";
+    }
+    if (!lPort || lPort > 65535) {
+        return "Invalid port for the pinned address, must be between 1 and 65535.";
+    }
+
+    if ( ! gProcessor ) init();
+    gProcessor->addResolve(lEntry.substr(0, lHostEnd), lPort, lEntry.substr(lPortEnd + 1));
+    return NULL;
+}
+
 const char*
 setQueue(cmd_parms* pParams, void* pCfg, const char* pMin, const char* pMax) {
     size_t lMin, lMax;
@@ -317,12 +543,115 @@ setSynchronous(cmd_parms* pParams, void* pCfg) {
     if (!lConf) {
         return "No per_dir conf defined. This should never happen!";
     }
+    if (lConf->afterResponse) {
+        return "DupSync cannot be used with DupAfterResponse, which duplicates once the client was answered.";
+    }
 
     lConf->synchronous = true;
 
     return NULL;
 }
 
+const char*
+setAfterResponse(cmd_parms* pParams, void* pCfg) {
+    struct DupConf *lConf = reinterpret_cast<DupConf *>(pCfg);
+    if (!lConf) {
+        return "No per_dir conf defined. This should never happen!";
+    }
+    // A synchronous duplication would hold the worker and the connection of the client until the timeout
+    if (lConf->synchronous) {
+        return "DupAfterResponse cannot be used with DupSync, the duplications are queued once the client was answered.";
+    }
+
+    lConf->afterResponse = true;
+
+    return NULL;
+}
+
+const char*
+setReorderFilters(cmd_parms* pParams, void* pCfg) {
+    struct DupConf *lConf = reinterpret_cast<DupConf *>(pCfg);
+    if (!lConf) {
+        return "No per_dir conf defined. This should never happen!";
+    }
+
+    lConf->reorderFilters = true;
+
+    return NULL;
+}
+
+const char*
+setPriority(cmd_parms* pParams, void* pCfg, const char* pPriority) {
+    struct DupConf *lConf = reinterpret_cast<DupConf *>(pCfg);
+    if (!lConf) {
+        return "No per_dir conf defined. This should never happen!";
+    }
+
+    if (!strcasecmp(pPriority, "low")) {
+        lConf->setPriority(QueuePriority::LOW);
+    } else if (!strcasecmp(pPriority, "normal")) {
+        lConf->setPriority(QueuePriority::NORMAL);
+    } else if (!strcasecmp(pPriority, "high")) {
+        lConf->setPriority(QueuePriority::HIGH);
+    } else {
+        return "Invalid priority, must be one of low, normal or high";
+    }
+    return NULL;
+}
+
+const char*
+setDropPolicy(cmd_parms* pParams, void* pCfg, const char* pPolicy) {
+    DropPolicy::eDropPolicy lPolicy;
+    if (!strcasecmp(pPolicy, "newest")) {
+        lPolicy = DropPolicy::NEWEST;
+    } else if (!strcasecmp(pPolicy, "oldest")) {
+        lPolicy = DropPolicy::OLDEST;
+    } else if (!strcasecmp(pPolicy, "priority")) {
+        lPolicy = DropPolicy::LOWEST_PRIORITY;
+    } else {
+        return "Invalid drop policy, must be one of newest, oldest or priority";
+    }
+
+    if ( ! gProcessor ) init();
+    gThreadPool->setDropPolicy(lPolicy,
+                               boost::bind(&RequestProcessor::queuePriority, gProcessor, _1),
+                               boost::bind(&RequestProcessor::dropped, gProcessor, _1, _2));
+    return NULL;
+}
+
+const char*
+setLogLevel(cmd_parms* pParams, void* pCfg, const char* pLevel) {
+    const int lLevel = Log::levelOf(pLevel);
+    if (lLevel < 0) {
+        return "Invalid log level, must be one of debug, info, notice, warn, error or crit";
+    }
+    Log::setLevel(lLevel);
+    return NULL;
+}
+
+const char*
+setLogBackend(cmd_parms* pParams, void* pCfg, const char* pTarget, const char* pCapacity, const char* pRatePerCode) {
+    unsigned int lCapacity = cDefaultLogCapacity, lRatePerCode = cDefaultLogRatePerCode;
+    try {
+        if (pCapacity) {
+            lCapacity = boost::lexical_cast<unsigned int>(pCapacity);
+        }
+        if (pRatePerCode) {
+            lRatePerCode = boost::lexical_cast<unsigned int>(pRatePerCode);
+        }
+    } catch (boost::bad_lexical_cast&) {
+        return "Invalid value(s) for the log backend: <target> [<buffered messages per thread>] [<messages per second per code>]";
+    }
+    const std::string lError = Log::setAsync(pTarget, lCapacity, lRatePerCode);
+    if (!lError.empty()) {
+        return apr_pstrdup(pParams->pool, lError.c_str());
+    }
+
+    if ( ! gProcessor ) init();
+    gThreadPool->addStat("#LogDrop", &Log::getAsyncDrops);
+    return NULL;
+}
+
 const char*
 setDuplicationType(cmd_parms* pParams, void* pCfg, const char* pDupType) {
     const char *lErrorMsg = setActive(pParams, pCfg);
@@ -426,15 +755,21 @@ cleanUp(void *) {
         delete gProcessor;
         gProcessor = NULL;
     }
+    Log::stopAsync();
     return APR_SUCCESS;
 }
 
 void
 childInit(apr_pool_t *pPool, server_rec *pServer) {
     curl_global_init(CURL_GLOBAL_ALL);
+    Log::startAsync();
     if ( gThreadPool ) {
         gThreadPool->start();
     }
+    if ( gProcessor ) {
+        gProcessor->startRetries();
+        gProcessor->getScoreboard().claimSlot();
+    }
     apr_pool_cleanup_register(pPool, NULL, cleanUp, cleanUp);
 }
 
@@ -471,6 +806,40 @@ command_rec gCmds[] = {
                   0,
                   RSRC_CONF,
                   "Set the minimum and maximum queue size for each thread pool."),
+    AP_INIT_TAKE23("DupRetry",
+                  reinterpret_cast<const char *(*)()>(&setRetry),
+                  0,
+                  RSRC_CONF,
+                  "Retry the duplications failing with a connection error or a 503. "
+                  "Format: <max retries> <deadline in ms> [<delay before the first retry in ms>]"),
+    AP_INIT_TAKE1("DupRetryShare",
+                  reinterpret_cast<const char *(*)()>(&setRetryShare),
+                  0,
+                  RSRC_CONF,
+                  "Set the maximum number of retries per 100 duplicated requests (default 10)."),
+    AP_INIT_TAKE12("DupConcurrentSends",
+                  reinterpret_cast<const char *(*)()>(&setConcurrentSends),
+                  0,
+                  RSRC_CONF,
+                  "Set the maximum number of duplications of a request sent at once (default 1, sequential). "
+                  "Format: <max sends> [<max sends per destination>]"),
+    AP_INIT_TAKE1("DupBatchSize",
+                  reinterpret_cast<const char *(*)()>(&setBatchSize),
+                  0,
+                  RSRC_CONF,
+                  "Set the maximum number of requests a thread takes off the queue at once (default 1)."),
+    AP_INIT_TAKE12("DupErrorLog",
+                  reinterpret_cast<const char *(*)()>(&setErrorLog),
+                  0,
+                  RSRC_CONF,
+                  "Bound the logs of the failed duplications. "
+                  "Format: <max body bytes> [<one failure logged out of, per destination>]"),
+    AP_INIT_TAKE1("DupResolve",
+                  reinterpret_cast<const char *(*)()>(&setResolve),
+                  0,
+                  RSRC_CONF,
+                  "Pins the names of destinations to addresses instead of resolving them. "
+                  "Format: <host>:<port>:<address>[,<address>...], repeatable"),
     AP_INIT_TAKE1("DupDuplicationType",
                   reinterpret_cast<const char *(*)()>(&setDuplicationType),
                   0,
@@ -526,13 +895,46 @@ command_rec gCmds[] = {
                   0,
                   ACCESS_CONF,
                   "In case of duplication error, "
-                  "log the body starting from this matched regex"),
+                  "log the part of the body matched by this regex"),
     AP_INIT_NO_ARGS("DupSync",
                     reinterpret_cast<const char *(*)()>(&setSynchronous),
                     0,
                     ACCESS_CONF,
                     "Duplicating Synchronously. "
                     "This is only needed if no filter or substitution is defined."),
+    AP_INIT_TAKE1("DupPriority",
+                  reinterpret_cast<const char *(*)()>(&setPriority),
+                  0,
+                  ACCESS_CONF,
+                  "Priority of the requests of the location when the queue is full: low, normal or high."),
+    AP_INIT_TAKE1("DupDropPolicy",
+                  reinterpret_cast<const char *(*)()>(&setDropPolicy),
+                  0,
+                  RSRC_CONF,
+                  "What the queue drops once full: newest (default), oldest or priority."),
+    AP_INIT_TAKE1("DupLogLevel",
+                  reinterpret_cast<const char *(*)()>(&setLogLevel),
+                  0,
+                  RSRC_CONF,
+                  "The most verbose level logged: debug (default), info, notice, warn, error or crit."),
+    AP_INIT_TAKE123("DupLogBackend",
+                  reinterpret_cast<const char *(*)()>(&setLogBackend),
+                  0,
+                  RSRC_CONF,
+                  "Writing the logs from a thread of each child to syslog, file:<path> or udp:<host>:<port>, "
+                  "with the number of messages buffered per thread and logged per second for each code."),
+    AP_INIT_NO_ARGS("DupAfterResponse",
+                    reinterpret_cast<const char *(*)()>(&setAfterResponse),
+                    0,
+                    ACCESS_CONF,
+                    "Duplicating from the log transaction phase, "
+                    "once the client received the whole answer."),
+    AP_INIT_NO_ARGS("DupReorderFilters",
+                    reinterpret_cast<const char *(*)()>(&setReorderFilters),
+                    0,
+                    ACCESS_CONF,
+                    "Evaluating the raw filters of the location in the order "
+                    "of their measured cost and selectivity."),
     AP_INIT_NO_ARGS("Dup",
                     reinterpret_cast<const char *(*)()>(&setActive),
                     0,
@@ -577,6 +979,7 @@ static void insertOutputHeadersFilter(request_rec *pRequest) {
 void
 registerHooks(apr_pool_t *pPool) {
 #ifndef UNIT_TESTING
+    ap_hook_pre_config(preConfig, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_post_config(postConfig, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_child_init(&childInit, NULL, NULL, APR_HOOK_MIDDLE);
 
@@ -592,6 +995,11 @@ registerHooks(apr_pool_t *pPool) {
     ap_hook_insert_filter(&insertOutputBodyFilter, NULL, NULL, APR_HOOK_LAST);
     ap_hook_insert_filter(&insertOutputHeadersFilter, NULL, NULL, APR_HOOK_LAST);
 
+    // The client has received the whole answer when the transaction is logged
+    ap_hook_log_transaction(&logTransactionHook, NULL, NULL, APR_HOOK_MIDDLE);
+
+    ap_hook_handler(&statusHandler, NULL, NULL, APR_HOOK_MIDDLE);
+
 #endif
 }
 
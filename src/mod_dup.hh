@@ -70,6 +70,16 @@ public:
     std::string                                 currentDupDestination;
 
     bool                                        synchronous;
+
+    /** @brief true if the requests are handed to the duplication threads from the log transaction hook,
+     *  once the client received the whole answer, set by the DupAfterResponse directive
+     */
+    bool                                        afterResponse;
+
+    /** @brief true if the REGULAR raw filters are evaluated in the order of their measured cost and selectivity
+     *  instead of the configuration order, set by the DupReorderFilters directive
+     */
+    bool                                        reorderFilters;
     
     /** @brief start logging body at regex match in case of dup error
      *  if empty (default) or not matched, log the whole body
@@ -83,8 +93,20 @@ public:
     DuplicationType::eDuplicationType getCurrentDuplicationType() const;
     DuplicationType::eDuplicationType getHighestDuplicationType() const;
 
+    /** @brief Sets the priority of the requests of the location in the queue, set by the DupPriority directive */
+    void setPriority(QueuePriority::eQueuePriority pPriority);
+
+    /**
+     * @brief The priority of the requests of the location in the queue
+     * @return the priority set, by default HIGH for the locations duplicating the answers for a comparison, NORMAL otherwise
+     */
+    QueuePriority::eQueuePriority getPriority() const;
+
 private:
 
+    /** @brief the priority set by the DupPriority directive, -1 if none */
+    int                                        mPriority;
+
     /** @brief the current duplication type*/
     DuplicationType::eDuplicationType          mCurrentDuplicationType;
 
@@ -109,7 +131,24 @@ void *
 createDirConfig(apr_pool_t *pPool, char *pDirName);
 
 /**
- * @brief Initialize logging post-config
+ * @brief The name of the shared memory of the scoreboard of an instance of httpd
+ * @param pServerRoot the ServerRoot of the instance
+ * @param pConfName the configuration file of the instance
+ * @return the prefix mod_dup_scoreboard. followed by a hash of both
+ */
+std::string
+scoreboardName(const char *pServerRoot, const char *pConfName);
+
+/**
+ * @brief Reset the settings accumulated over the directives before the configuration is read again
+ * @param pPool the apache pool
+ * @return Always OK
+ */
+int
+preConfig(apr_pool_t * pPool, apr_pool_t * pLog, apr_pool_t * pTemp);
+
+/**
+ * @brief Initialize logging and the scoreboard shared by the children post-config
  * @param pPool the apache pool
  * @param pServer the corresponding server record
  * @return Always OK
@@ -149,6 +188,70 @@ setThreads(cmd_parms* pParams, void* pCfg, const char* pMin, const char* pMax);
 const char*
 setTimeout(cmd_parms* pParams, void* pCfg, const char* pTimeout);
 
+/**
+ * @brief Enable the retry of the duplications failing with a connection error or a 503
+ * @param pParams miscellaneous data
+ * @param pCfg user data for the directory/location
+ * @param pMaxAttempts the maximum number of retries of a duplication
+ * @param pDeadline the time in ms after the first failure past which a duplication is abandoned
+ * @param pBaseDelay the delay in ms before the first retry, doubled at each attempt, optional
+ * @return NULL if parameters are valid, otherwise a string describing the error
+ */
+const char*
+setRetry(cmd_parms* pParams, void* pCfg, const char* pMaxAttempts, const char* pDeadline, const char* pBaseDelay);
+
+/**
+ * @brief Set the maximum number of retries per 100 duplicated requests
+ * @param pParams miscellaneous data
+ * @param pCfg user data for the directory/location
+ * @param pPercentage the share of the duplicated traffic that retries may use
+ * @return NULL if parameters are valid, otherwise a string describing the error
+ */
+const char*
+setRetryShare(cmd_parms* pParams, void* pCfg, const char* pPercentage);
+
+/**
+ * @brief Set the maximum number of duplications of a request the workers send at once
+ * @param pParams miscellaneous data
+ * @param pCfg user data for the directory/location
+ * @param pMaxSends the maximum number of duplications of a request in flight
+ * @param pMaxSendsPerDestination the maximum number of them in flight to one destination, optional
+ * @return NULL if parameters are valid, otherwise a string describing the error
+ */
+const char*
+setConcurrentSends(cmd_parms* pParams, void* pCfg, const char* pMaxSends, const char* pMaxSendsPerDestination);
+
+/**
+ * @brief Set the maximum number of requests the workers take off the queue at once
+ * @param pParams miscellaneous data
+ * @param pCfg user data for the directory/location
+ * @param pBatchSize the maximum number of requests of a batch
+ * @return NULL if parameters are valid, otherwise a string describing the error
+ */
+const char*
+setBatchSize(cmd_parms* pParams, void* pCfg, const char* pBatchSize);
+
+/**
+ * @brief Bound the logs of the failed duplications
+ * @param pParams miscellaneous data
+ * @param pCfg user data for the directory/location
+ * @param pMaxBody the maximum number of bytes of the body logged
+ * @param pSampling one failure out of this number is logged per destination, optional
+ * @return NULL if parameters are valid, otherwise a string describing the error
+ */
+const char*
+setErrorLog(cmd_parms* pParams, void* pCfg, const char* pMaxBody, const char* pSampling);
+
+/**
+ * @brief Pin the name of a destination to an address instead of resolving it
+ * @param pParams miscellaneous data
+ * @param pCfg user data for the directory/location
+ * @param pEntry the name, port and address(es) as host:port:address[,address]
+ * @return NULL if parameters are valid, otherwise a string describing the error
+ */
+const char*
+setResolve(cmd_parms* pParams, void* pCfg, const char* pEntry);
+
 /**
  * @brief Set the minimum and maximum queue size
  * @param pParams miscellaneous data
@@ -206,6 +309,75 @@ setFilter(cmd_parms* pParams, void* pCfg, const char *pField, const char* pFilte
 const char*
 setRawFilter(cmd_parms* pParams, void* pCfg, const char* pFilter);
 
+/**
+ * @brief Duplicate the requests of the location synchronously, incompatible with DupAfterResponse
+ * @param pParams miscellaneous data
+ * @param pCfg user data for the directory/location
+ * @return NULL if parameters are valid, otherwise a string describing the error
+ */
+const char*
+setSynchronous(cmd_parms* pParams, void* pCfg);
+
+/**
+ * @brief Hand the requests to the duplication threads once the client received the whole answer, incompatible with DupSync
+ * @param pParams miscellaneous data
+ * @param pCfg user data for the directory/location
+ * @return NULL if parameters are valid, otherwise a string describing the error
+ */
+const char*
+setAfterResponse(cmd_parms* pParams, void* pCfg);
+
+/**
+ * @brief Evaluates the raw filters of the location in the order of their measured cost and selectivity
+ * @param pParams miscellaneous data
+ * @param pCfg user data for the directory/location
+ * @return NULL if parameters are valid, otherwise a string describing the error
+ */
+const char*
+setReorderFilters(cmd_parms* pParams, void* pCfg);
+
+/**
+ * @brief Set the priority of the requests of the location when the queue is full
+ * @param pParams miscellaneous data
+ * @param pCfg user data for the directory/location
+ * @param pPriority the priority: low, normal or high
+ * @return NULL if parameters are valid, otherwise a string describing the error
+ */
+const char*
+setPriority(cmd_parms* pParams, void* pCfg, const char* pPriority);
+
+/**
+ * @brief Set what the queue drops once full
+ * @param pParams miscellaneous data
+ * @param pCfg user data for the directory/location
+ * @param pPolicy the drop policy: newest, oldest or priority
+ * @return NULL if parameters are valid, otherwise a string describing the error
+ */
+const char*
+setDropPolicy(cmd_parms* pParams, void* pCfg, const char* pPolicy);
+
+/**
+ * @brief Set the most verbose level logged
+ * @param pParams miscellaneous data
+ * @param pCfg user data for the directory/location
+ * @param pLevel the level: debug, info, notice, warn, error or crit
+ * @return NULL if parameters are valid, otherwise a string describing the error
+ */
+const char*
+setLogLevel(cmd_parms* pParams, void* pCfg, const char* pLevel);
+
+/**
+ * @brief Write the logs from a thread of each child instead of the threads logging
+ * @param pParams miscellaneous data
+ * @param pCfg user data for the directory/location
+ * @param pTarget syslog, file:<path> or udp:<host>:<port>
+ * @param pCapacity the number of messages buffered per thread, optional
+ * @param pRatePerCode the number of messages logged per second and per code, optional
+ * @return NULL if parameters are valid, otherwise a string describing the error
+ */
+const char*
+setLogBackend(cmd_parms* pParams, void* pCfg, const char* pTarget, const char* pCapacity, const char* pRatePerCode);
+
 /**
  * @brief Activate duplication
  * @param pParams miscellaneous data
@@ -271,6 +443,22 @@ setDuplicationType(cmd_parms* pParams, void* pCfg, const char* pDupType);
 int
 translateHook(request_rec *r);
 
+/**
+ * @brief Initiates the duplication of the requests of the DupAfterResponse locations
+ * Runs once the last byte of the answer was sent, so the duplication adds no latency to the client
+ * @return OK if the request was handed to the duplication, DECLINED otherwise
+ */
+int
+logTransactionHook(request_rec *pRequest);
+
+/**
+ * @brief Serves the live metrics of all the children, read from the scoreboard, on the locations with SetHandler dup-status
+ * The format is picked with the query string: "json", "prometheus", plain text otherwise
+ * @return OK if the request was served, DECLINED if it is not for this handler
+ */
+int
+statusHandler(request_rec *pRequest);
+
 /**
  * @brief the source input filter callback
  * This filter is placed first in the chain and serves the body stored in a RequestInfo object in the request context
@@ -58,15 +58,15 @@ void writeDifferences(const DupModule::RequestInfo &pReqInfo,
     	printer.addInfo("ElapsedTime",t);
     }
 
-    std::map< std::string, std::string >::const_iterator it = pReqInfo.mReqHeader.find("ELAPSED_TIME_BY_DUP");
-    std::string diffTime;
+    const size_t it = pReqInfo.mReqHeader.find(DupModule::HeaderName::ELAPSED_TIME_BY_DUP);
+    const std::string dupTime = it != DupModule::tHeaders::npos ? pReqInfo.mReqHeader.value(it).to_string() : std::string();
     try {
-    	if(it!=pReqInfo.mReqHeader.end()){
-    		t=boost::lexical_cast<int>(it->second)-boost::lexical_cast<int>(pReqInfo.getElapsedTimeMS());
+    	if(it!=DupModule::tHeaders::npos){
+    		t=boost::lexical_cast<int>(dupTime)-boost::lexical_cast<int>(pReqInfo.getElapsedTimeMS());
     		printer.addRuntime("DIFF",t);
     	}
     } catch ( boost::bad_lexical_cast &e ) {
-        Log::error(12, "[COMPARE] Failed to cast ELAPSED_TIME_BY_DUP: %s to an int", it->second.c_str());
+        Log::error(12, "[COMPARE] Failed to cast ELAPSED_TIME_BY_DUP: %s to an int", dupTime.c_str());
     }
 
 #ifdef UNIT_TESTING
@@ -76,8 +76,8 @@ void writeDifferences(const DupModule::RequestInfo &pReqInfo,
 	printer.addInfo("Date",boost::posix_time::to_iso_extended_string(today));
 #endif
 
-    if(it!=pReqInfo.mReqHeader.end()){
-    	printer.addRuntime("DUP",boost::lexical_cast<int>(it->second));
+    if(it!=DupModule::tHeaders::npos){
+    	printer.addRuntime("DUP",boost::lexical_cast<int>(dupTime));
     }
   	printer.addRuntime("COMP",pReqInfo.getElapsedTimeMS());
 
@@ -90,8 +90,11 @@ void writeDifferences(const DupModule::RequestInfo &pReqInfo,
     	}
 	}
 
+    // Printed sorted by name
+    DupModule::RequestInfo::mapStr lReqHeader;
+    pReqInfo.mReqHeader.toMap(lReqHeader);
     std::map< std::string, std::string>::const_iterator lIter;
-	for ( lIter = pReqInfo.mReqHeader.begin(); lIter != pReqInfo.mReqHeader.end(); ++lIter )
+	for ( lIter = lReqHeader.begin(); lIter != lReqHeader.end(); ++lIter )
 	{
 		printer.addRequestHeader(lIter->first,lIter->second);
 	}
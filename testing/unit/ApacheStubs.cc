@@ -33,6 +33,7 @@
 #include <apr_pools.h>
 #include <apr_hooks.h>
 #include <unixd.h>
+#include <ap_mpm.h>
 
 #include <http_log.h>
 #include "testBodies.hh"
@@ -195,6 +196,20 @@ apr_status_t 	ap_filter_flush (apr_bucket_brigade *bb, void *ctx) {
     return APR_SUCCESS;
 }
 
+AP_DECLARE(int)
+ap_rwrite(const void *buf, int nbyte, request_rec *r)
+{
+    // Appended to the filename, like ap_rprintf
+    return ap_rprintf(r, "%.*s", nbyte, static_cast<const char *>(buf));
+}
+
+AP_DECLARE(apr_status_t)
+ap_mpm_query(int query_code, int *result)
+{
+    *result = query_code == AP_MPMQ_HARD_LIMIT_DAEMONS ? 16 : 0;
+    return APR_SUCCESS;
+}
+
 AP_DECLARE(void)
 ap_set_content_type(request_rec *r, const char *ct)
 {
@@ -101,8 +101,8 @@ struct MyComp {
            : key(k), value(v) {
        }
 
-       bool operator()(const std::pair<std::string, std::string > &elt) {
-           return (elt.first == key && elt.second == value);
+       bool operator()(const tHeaders::tHeader &elt) {
+           return (elt.mName == boost::string_ref(key) && elt.mValue == boost::string_ref(value));
        }
 
        const char *key;
@@ -287,6 +287,84 @@ void TestFilters::outputFilterHandlerTest() {
  }
 
 
+{
+    // DUPLICATION TYPE == REQUEST_WITH_ANSWER but no filter can match
+    // the answer must not be buffered
+    request_rec *req = prep_request_rec();
+    req->method = "GET";
+    req->uri = strdup("/spp/main/test.cgi");
+    req->args = strdup("INFO=other");
+    ap_filter_t *filter = new ap_filter_t;
+    memSet(filter);
+    apr_pool_t *pool = NULL;
+    apr_pool_create(&pool, 0);
+    filter->r = req;
+    filter->c = (conn_rec *)apr_pcalloc(pool, sizeof(*(filter->c)));
+    filter->c->bucket_alloc = apr_bucket_alloc_create(pool);
+
+    DupConf *conf = new DupConf();
+    conf->dirName = strdup("/spp/main");
+    conf->currentApplicationScope = ApplicationScope::QUERY_STRING;
+    conf->setCurrentDuplicationType(DuplicationType::REQUEST_WITH_ANSWER);
+    ap_set_module_config(req->per_dir_config, &dup_module, conf);
+    gProcessor->addFilter("INFO", "myinfo", *conf, tFilter::eFilterTypes::REGULAR);
+
+    RequestInfo *info = new RequestInfo(std::string("42"), 1000000 * time(NULL));
+    boost::shared_ptr<RequestInfo> shPtr(info);
+    ap_set_module_config(req->request_config, &dup_module, (void *)&shPtr);
+
+    apr_bucket_brigade *bb = apr_brigade_create(req->connection->pool, req->connection->bucket_alloc);
+    CPPUNIT_ASSERT_EQUAL(APR_SUCCESS, apr_brigade_write(bb, NULL, NULL, testBody42, std::string(testBody42).size()));
+    CPPUNIT_ASSERT_EQUAL(APR_SUCCESS, outputBodyFilterHandler(filter, bb));
+
+    CPPUNIT_ASSERT(!info->mCaptureBodies);
+    CPPUNIT_ASSERT(info->mAnswer.empty());
+ }
+
+
+}
+
+void TestFilters::logTransactionHookTest() {
+    DummyThreadPool<boost::shared_ptr<RequestInfo> > *pool = static_cast<DummyThreadPool<boost::shared_ptr<RequestInfo> > *>(gThreadPool);
+    pool->mDummyQueued.clear();
+
+    request_rec *req = prep_request_rec();
+    req->uri = strdup("/spp/main/test.cgi");
+    req->method = strdup("GET");
+    DupConf *conf = new DupConf();
+    conf->dirName = strdup("/spp/main");
+    conf->setCurrentDuplicationType(DuplicationType::HEADER_ONLY);
+    ap_set_module_config(req->per_dir_config, &dup_module, conf);
+
+    RequestInfo *info = new RequestInfo(std::string("42"), 1000000 * time(NULL));
+    boost::shared_ptr<RequestInfo> shPtr(info);
+    ap_set_module_config(req->request_config, &dup_module, (void *)&shPtr);
+    info->eos_seen(true);
+    apr_table_set(req->headers_out, "KeyOut1", "value1");
+
+    // Duplicated by the output filters
+    CPPUNIT_ASSERT_EQUAL(DECLINED, logTransactionHook(req));
+    CPPUNIT_ASSERT(pool->mDummyQueued.empty());
+
+    conf->afterResponse = true;
+    // The answer was not fully sent
+    info->eos_seen(false);
+    CPPUNIT_ASSERT_EQUAL(DECLINED, logTransactionHook(req));
+    CPPUNIT_ASSERT(pool->mDummyQueued.empty());
+
+    // Handed to the workers without a copy
+    info->eos_seen(true);
+    CPPUNIT_ASSERT_EQUAL(OK, logTransactionHook(req));
+    CPPUNIT_ASSERT_EQUAL(size_t(1), pool->mDummyQueued.size());
+    CPPUNIT_ASSERT(pool->mDummyQueued.front().get() == info);
+    CPPUNIT_ASSERT_EQUAL(std::string("/spp/main/test.cgi"), info->mPath);
+    CPPUNIT_ASSERT(std::find_if(info->mHeadersOut.begin(), info->mHeadersOut.end(), MyComp("KeyOut1", "value1")) != info->mHeadersOut.end());
+
+    // X_DUP_LOG requests are duplicated synchronously by the output filters
+    apr_table_set(req->headers_in, "X_DUP_LOG", "ON");
+    CPPUNIT_ASSERT_EQUAL(DECLINED, logTransactionHook(req));
+    CPPUNIT_ASSERT_EQUAL(size_t(1), pool->mDummyQueued.size());
+    pool->mDummyQueued.clear();
 }
 
 #ifdef UNIT_TESTING
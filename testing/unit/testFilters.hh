@@ -38,12 +38,15 @@ class TestFilters :
 
     CPPUNIT_TEST_SUITE(TestFilters);
     CPPUNIT_TEST(outputFilterHandlerTest);
+    CPPUNIT_TEST(logTransactionHookTest);
     CPPUNIT_TEST_SUITE_END();
 
 public:
 
     void outputFilterHandlerTest();
 
+    void logTransactionHookTest();
+
 
     virtual void setUp();
     virtual void tearDown();
@@ -0,0 +1,231 @@
+/*
+* mod_dup - duplicates apache requests
+* 
+* Copyright (C) 2013 Orange
+* 
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "Histogram.hh"
+#include "Scoreboard.hh"
+#include "testHistogram.hh"
+
+// cppunit
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/ui/text/TestRunner.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+CPPUNIT_TEST_SUITE_REGISTRATION( TestHistogram );
+
+using namespace DupModule;
+
+void TestHistogram::testPercentiles()
+{
+    LatencyHistogram histogram;
+    CPPUNIT_ASSERT_EQUAL(std::string("-"), histogram.summary());
+
+    // Exact below 16
+    for (uint64_t i = 1; i <= 10; ++i) {
+        histogram.record(i);
+    }
+    CPPUNIT_ASSERT_EQUAL((uint64_t)10, histogram.count());
+    CPPUNIT_ASSERT_EQUAL((uint64_t)5, histogram.percentile(50));
+    CPPUNIT_ASSERT_EQUAL((uint64_t)10, histogram.percentile(100));
+    CPPUNIT_ASSERT_EQUAL((uint64_t)55, histogram.sum());
+
+    // Within 1/16 of the recorded values above
+    LatencyHistogram large;
+    for (uint64_t i = 1; i <= 1000; ++i) {
+        large.record(i * 1000);
+    }
+    const uint64_t p50 = large.percentile(50);
+    const uint64_t p99 = large.percentile(99);
+    CPPUNIT_ASSERT(p50 >= 500000 && p50 <= 500000 + 500000 / 16);
+    CPPUNIT_ASSERT(p99 >= 990000 && p99 <= 990000 + 990000 / 16);
+    CPPUNIT_ASSERT_EQUAL((uint64_t)1000000, large.max());
+    // Never above the maximum
+    CPPUNIT_ASSERT_EQUAL((uint64_t)1000000, large.percentile(100));
+
+    // Beyond the last magnitude
+    large.record(1ULL << 50);
+    CPPUNIT_ASSERT_EQUAL((uint64_t)1 << 50, large.percentile(100));
+
+    // Draining moves the values
+    LatencyHistogram total;
+    large.drainInto(total);
+    histogram.drainInto(total);
+    CPPUNIT_ASSERT_EQUAL((uint64_t)0, large.count());
+    CPPUNIT_ASSERT_EQUAL((uint64_t)0, large.max());
+    CPPUNIT_ASSERT_EQUAL((uint64_t)1011, total.count());
+    CPPUNIT_ASSERT_EQUAL((uint64_t)1 << 50, total.max());
+    CPPUNIT_ASSERT_EQUAL((uint64_t)500500000 + (1ULL << 50) + 55, total.sum());
+    CPPUNIT_ASSERT_EQUAL((uint64_t)0, large.sum());
+
+    // Within 1/4 with the coarse histogram
+    CoarseLatencyHistogram coarse;
+    for (uint64_t i = 1; i <= 1000; ++i) {
+        coarse.record(i * 1000);
+    }
+    const uint64_t coarseP50 = coarse.percentile(50);
+    CPPUNIT_ASSERT(coarseP50 >= 500000 && coarseP50 <= 500000 + 500000 / 4);
+    CPPUNIT_ASSERT_EQUAL((uint64_t)1000000, coarse.percentile(100));
+    CPPUNIT_ASSERT_EQUAL((uint64_t)500500000, coarse.sum());
+}
+
+static void recordSends(LatencyRecorder *recorder, uint64_t value)
+{
+    for (int i = 0; i < 100; ++i) {
+        recorder->record(Latency::SEND, "Honolulu:8080", value);
+    }
+}
+
+void TestHistogram::testRecorder()
+{
+    LatencyRecorder recorder;
+    CPPUNIT_ASSERT_EQUAL(std::string("-"), recorder.getSummary());
+
+    recorder.record(Latency::FILTER, "", 12);
+    boost::thread first(recordSends, &recorder, 10);
+    boost::thread second(recordSends, &recorder, 14);
+    first.join();
+    second.join();
+    CPPUNIT_ASSERT_EQUAL(std::string("filter=12/12/12/12 send@Honolulu:8080=10/14/14/14"), recorder.getSummary());
+
+    // Reset by the call, and the threads which exited are forgotten
+    CPPUNIT_ASSERT_EQUAL(std::string("-"), recorder.getSummary());
+    recorder.record(Latency::END_TO_END, "Papeete:8080", 3);
+    CPPUNIT_ASSERT_EQUAL(std::string("e2e@Papeete:8080=3/3/3/3"), recorder.getSummary());
+}
+
+void TestHistogram::testScoreboard()
+{
+    Scoreboard scoreboard;
+    CPPUNIT_ASSERT(!scoreboard.claimSlot());
+    CPPUNIT_ASSERT_EQUAL(std::string("-"), scoreboard.getSummary());
+    // Counted nowhere
+    scoreboard.count(ScoreboardCounter::DUPLICATED);
+
+    std::vector<std::string> destinations;
+    destinations.push_back("Honolulu:8080");
+    destinations.push_back("Papeete:8080");
+    CPPUNIT_ASSERT(scoreboard.create("mod_dup_test_scoreboard", 4, destinations));
+    CPPUNIT_ASSERT_EQUAL(std::string("children=0 dup=0 tmout=0 drop=0"), scoreboard.getSummary());
+
+    // Each child writes into its own slot
+    for (unsigned i = 1; i <= 2; ++i) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            scoreboard.claimSlot();
+            scoreboard.count(ScoreboardCounter::DUPLICATED, i);
+            scoreboard.count(ScoreboardCounter::TIMEOUT);
+            scoreboard.countDestination(ScoreboardCounter::DUPLICATED, "Honolulu:8080", i);
+            scoreboard.countDestination(ScoreboardCounter::DUPLICATED, "Unknown:8080");
+            scoreboard.record(Latency::SEND, "Honolulu:8080", i * 10);
+            // Not summed once the child exited
+            scoreboard.setLoad(100, 100, 100);
+            _exit(0);
+        }
+        CPPUNIT_ASSERT(pid > 0);
+        waitpid(pid, NULL, 0);
+    }
+    CPPUNIT_ASSERT_EQUAL(std::string("children=0 dup=3 tmout=2 drop=0 send=10/20/20/20"), scoreboard.getSummary());
+
+    // A slot of an exited child is taken back, with what it counted
+    CPPUNIT_ASSERT(scoreboard.claimSlot());
+    CPPUNIT_ASSERT(scoreboard.isClaimed());
+    scoreboard.count(ScoreboardCounter::DROPPED);
+    scoreboard.countDrop(ScoreboardDrop::EVICTED);
+    tScoreboardTotals totals;
+    scoreboard.aggregate(totals);
+    CPPUNIT_ASSERT_EQUAL(1u, totals.mChildren);
+    CPPUNIT_ASSERT_EQUAL((uint64_t)3, totals.mCounters[ScoreboardCounter::DUPLICATED]);
+    CPPUNIT_ASSERT_EQUAL((uint64_t)1, totals.mCounters[ScoreboardCounter::DROPPED]);
+    CPPUNIT_ASSERT_EQUAL((uint64_t)2, totals.mLatencies[Latency::SEND].count());
+    CPPUNIT_ASSERT_EQUAL((uint64_t)1, totals.mDrops[ScoreboardDrop::EVICTED]);
+    CPPUNIT_ASSERT_EQUAL((uint64_t)2, totals.mDestinations[0].second.mLatencies[Latency::SEND].count());
+    CPPUNIT_ASSERT_EQUAL((uint64_t)0, totals.mDestinations[1].second.mLatencies[Latency::SEND].count());
+
+    scoreboard.setLoad(3, 1024, 2);
+    scoreboard.addInFlight("Papeete:8080", 1);
+    // The filters which were evaluated, the most expensive first
+    std::vector<std::pair<std::string, tFilterCounters> > filters(3);
+    filters[0].first = "*~^/cheap@Honolulu:8080";
+    filters[0].second.mEvaluations = 10;
+    filters[0].second.mMatches = 4;
+    filters[0].second.mNs = 2000;
+    filters[1].first = "*~never@Honolulu:8080";
+    filters[2].first = "!NO~\"dup\"\t@Papeete:8080";
+    filters[2].second.mEvaluations = 3;
+    filters[2].second.mPrevents = 1;
+    filters[2].second.mNs = 9000;
+    scoreboard.setFilters(filters);
+    CPPUNIT_ASSERT_EQUAL(std::string("children: 1\n"
+                                     "duplications: 3\n"
+                                     "timeouts: 2\n"
+                                     "drops: 1\n"
+                                     "drops refused: 0\n"
+                                     "drops evicted: 1\n"
+                                     "drops abandoned: 0\n"
+                                     "queued: 3\n"
+                                     "queued_bytes: 1024\n"
+                                     "threads: 2\n"
+                                     "in_flight: 1\n"
+                                     "latency_us filter: -\n"
+                                     "latency_us subst: -\n"
+                                     "latency_us send: 10/20/20/20\n"
+                                     "latency_us e2e: -\n"
+                                     "destination Honolulu:8080: duplications=3 timeouts=0 drops=0 in_flight=0\n"
+                                     "latency_us send@Honolulu:8080: 11/20/20/20\n"
+                                     "destination Papeete:8080: duplications=0 timeouts=0 drops=0 in_flight=1\n"
+                                     "filter !NO~\"dup\"\t@Papeete:8080: evaluations=3 matches=0 prevents=1 us=9\n"
+                                     "filter *~^/cheap@Honolulu:8080: evaluations=10 matches=4 prevents=0 us=2\n"),
+                         scoreboard.getStatus(StatusFormat::TEXT));
+    const std::string json = scoreboard.getStatus(StatusFormat::JSON);
+    CPPUNIT_ASSERT(json.find("{\"children\":1,\"duplications\":3,\"timeouts\":2,\"drops\":1,"
+                             "\"drops_by_reason\":{\"refused\":0,\"evicted\":1,\"abandoned\":0},\"queued\":3,") == 0);
+    CPPUNIT_ASSERT(json.find("\"send\":{\"count\":2,\"p50\":10,\"p90\":20,\"p99\":20,\"max\":20,\"sum\":30}") != std::string::npos);
+    CPPUNIT_ASSERT(json.find("\"Honolulu:8080\":{\"duplications\":3,\"timeouts\":0,\"drops\":0,\"in_flight\":0,"
+                             "\"latencies_us\":{\"send\":{\"count\":2,\"p50\":11,\"p90\":20,\"p99\":20,\"max\":20,\"sum\":30}}}") != std::string::npos);
+    CPPUNIT_ASSERT(json.find("\"Papeete:8080\":{\"duplications\":0,\"timeouts\":0,\"drops\":0,\"in_flight\":1,\"latencies_us\":{}}},") != std::string::npos);
+    CPPUNIT_ASSERT(json.find("\"filters\":{\"!NO~\\\"dup\\\"\\u0009@Papeete:8080\":{\"evaluations\":3,\"matches\":0,\"prevents\":1,\"us\":9},"
+                             "\"*~^/cheap@Honolulu:8080\":{\"evaluations\":10,\"matches\":4,\"prevents\":0,\"us\":2}}}\n") != std::string::npos);
+    const std::string prometheus = scoreboard.getStatus(StatusFormat::PROMETHEUS);
+    CPPUNIT_ASSERT(prometheus.find("# TYPE mod_dup_duplications_total counter\nmod_dup_duplications_total 3\n") != std::string::npos);
+    CPPUNIT_ASSERT(prometheus.find("mod_dup_latency_us{step=\"send\",quantile=\"0.9\"} 20\n") != std::string::npos);
+    CPPUNIT_ASSERT(prometheus.find("mod_dup_latency_us_sum{step=\"send\"} 30\nmod_dup_latency_us_count{step=\"send\"} 2\n") != std::string::npos);
+    CPPUNIT_ASSERT(prometheus.find("mod_dup_drops_by_reason_total{reason=\"evicted\"} 1\n") != std::string::npos);
+    CPPUNIT_ASSERT(prometheus.find("mod_dup_destination_latency_us{destination=\"Honolulu:8080\",step=\"send\",quantile=\"0.5\"} 11\n") != std::string::npos);
+    CPPUNIT_ASSERT(prometheus.find("mod_dup_destination_duplications_total{destination=\"Honolulu:8080\"} 3\n") != std::string::npos);
+    CPPUNIT_ASSERT(prometheus.find("mod_dup_destination_in_flight{destination=\"Papeete:8080\"} 1\n") != std::string::npos);
+    CPPUNIT_ASSERT(prometheus.find("mod_dup_filter_matches_total{filter=\"*~^/cheap@Honolulu:8080\"} 4\n") != std::string::npos);
+    CPPUNIT_ASSERT(prometheus.find("mod_dup_filter_time_us_total{filter=\"!NO~\\\"dup\\\"\t@Papeete:8080\"} 9\n") != std::string::npos);
+    scoreboard.addInFlight("Papeete:8080", -1);
+
+    {
+        // Kept on restart
+        Scoreboard restarted;
+        CPPUNIT_ASSERT(restarted.create("mod_dup_test_scoreboard", 4, destinations));
+        CPPUNIT_ASSERT_EQUAL(std::string("children=1 dup=3 tmout=2 drop=1 send=10/20/20/20"), restarted.getSummary());
+
+        // Reset when the destinations or the number of slots change
+        CPPUNIT_ASSERT(restarted.create("mod_dup_test_scoreboard", 4));
+        CPPUNIT_ASSERT_EQUAL(std::string("children=0 dup=0 tmout=0 drop=0"), restarted.getSummary());
+        CPPUNIT_ASSERT(restarted.create("mod_dup_test_scoreboard", 8));
+        CPPUNIT_ASSERT_EQUAL(std::string("children=0 dup=0 tmout=0 drop=0"), restarted.getSummary());
+    }
+    scoreboard.destroy();
+    CPPUNIT_ASSERT(!scoreboard.isClaimed());
+}
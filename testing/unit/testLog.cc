@@ -19,6 +19,9 @@
 #include "testLog.hh"
 #include "Log.hh"
 #include <string>
+#include <cstdlib>
+#include <fstream>
+#include <unistd.h>
 
 // cppunit
 #include <cppunit/extensions/TestFactoryRegistry.h>
@@ -45,3 +48,98 @@ void TestLog::Log()
     Log::close();
     Log::init();
 }
+
+static int gEvaluations = 0;
+
+static const char *evaluated()
+{
+    ++gEvaluations;
+    return "argument";
+}
+
+void TestLog::levels()
+{
+    Log::init();
+    CPPUNIT_ASSERT_EQUAL(LOG_DEBUG, Log::levelOf("debug"));
+    CPPUNIT_ASSERT_EQUAL(LOG_WARNING, Log::levelOf("WARN"));
+    CPPUNIT_ASSERT_EQUAL(-1, Log::levelOf("verbose"));
+
+    CPPUNIT_ASSERT(Log::isEnabled(LOG_DEBUG));
+    LOG_DEBUG_IF_ENABLED("Test Message %s", evaluated());
+    LOG_INFO_IF_ENABLED(2, "Test Message %s", evaluated());
+    CPPUNIT_ASSERT_EQUAL(2, gEvaluations);
+
+    Log::setLevel(LOG_NOTICE);
+    CPPUNIT_ASSERT(!Log::isEnabled(LOG_INFO));
+    CPPUNIT_ASSERT(Log::isEnabled(LOG_ERR));
+    LOG_DEBUG_IF_ENABLED("Test Message %s", evaluated());
+    LOG_INFO_IF_ENABLED(2, "Test Message %s", evaluated());
+    CPPUNIT_ASSERT_EQUAL(2, gEvaluations);
+    // Not printed
+    Log::info(2, "Test Message %s", "argument");
+
+    Log::setLevel(LOG_DEBUG);
+}
+
+void TestLog::async()
+{
+    Log::init();
+    CPPUNIT_ASSERT(!Log::setAsync("tcp:localhost:514", 8, 2).empty());
+    CPPUNIT_ASSERT(!Log::setAsync("udp:localhost", 8, 2).empty());
+    CPPUNIT_ASSERT(!Log::setAsync("syslog", 0, 2).empty());
+
+    const std::string path = "/tmp/mod_dup_test_async.log";
+    unlink(path.c_str());
+    CPPUNIT_ASSERT_EQUAL(std::string(), Log::setAsync("file:" + path, 8, 2));
+    Log::startAsync();
+    // Above the rate of the code
+    for (int i = 0; i < 5; ++i) {
+        Log::error(7, "Rate limited %d", i);
+    }
+    // Above the capacity of the buffer of the thread, unless the writer empties it meanwhile
+    for (int i = 0; i < 100; ++i) {
+        Log::info(0, "Buffered %d", i);
+    }
+    Log::stopAsync();
+    // Written synchronously once stopped
+    Log::info(0, "Not in the file");
+
+    std::ifstream file(path.c_str());
+    std::string line;
+    int rateLimited = 0, buffered = 0;
+    while (std::getline(file, line)) {
+        CPPUNIT_ASSERT(line.find("Not in the file") == std::string::npos);
+        if (line.find("[error] code:7 - Rate limited") != std::string::npos) {
+            ++rateLimited;
+        } else if (line.find("[info] code:0 - Buffered") != std::string::npos) {
+            ++buffered;
+        }
+    }
+    const std::string drops = Log::getAsyncDrops();
+    const int dropped = atoi(drops.c_str());
+    // 2 per second, the loop may cross a second
+    CPPUNIT_ASSERT(rateLimited >= 2 && rateLimited <= 4);
+    CPPUNIT_ASSERT_EQUAL(5 - rateLimited, atoi(drops.substr(drops.find('/') + 1).c_str()));
+    CPPUNIT_ASSERT(buffered >= 8 - rateLimited);
+    CPPUNIT_ASSERT_EQUAL(100, buffered + dropped);
+    CPPUNIT_ASSERT_EQUAL(std::string("0/0"), Log::getAsyncDrops());
+    unlink(path.c_str());
+
+    // A message beyond the size of a record is marked as cut
+    Log::startAsync();
+    Log::error(8, "Long %s", std::string(4096, 'x').c_str());
+    Log::stopAsync();
+    std::ifstream longFile(path.c_str());
+    CPPUNIT_ASSERT(std::getline(longFile, line));
+    CPPUNIT_ASSERT(line.find("code:8 - Long xxx") != std::string::npos);
+    CPPUNIT_ASSERT_EQUAL(line.size() - 12, line.rfind(" [truncated]"));
+    CPPUNIT_ASSERT(line.size() < 2048 + 128);
+    unlink(path.c_str());
+
+    // Forgotten before the configuration is read again: written synchronously even once started
+    Log::resetAsync();
+    Log::startAsync();
+    Log::error(9, "Not in the file either");
+    Log::stopAsync();
+    CPPUNIT_ASSERT(access(path.c_str(), F_OK) != 0);
+}
@@ -30,8 +30,20 @@ class TestLog :
 
     CPPUNIT_TEST_SUITE( TestLog );
     CPPUNIT_TEST( Log );
+    CPPUNIT_TEST( levels );
+    CPPUNIT_TEST( async );
     CPPUNIT_TEST_SUITE_END();
 
 public:
     void Log();
+
+    /**
+     * @brief Tests that the arguments of the disabled levels are not evaluated
+     */
+    void levels();
+
+    /**
+     * @brief Tests the messages written by the writer thread, rate limited and dropped
+     */
+    void async();
 };
@@ -296,9 +296,9 @@ void TestModCompare::testWriteDifferences()
     gFile.open(lPath.c_str());
 
     DupModule::RequestInfo lReqInfo;
-    lReqInfo.mReqHeader["content-type"]= "plain/text";  //size = 11
-    lReqInfo.mReqHeader["agent-type"]= "myAgent";  //size = 11
-    lReqInfo.mReqHeader["date"]= "TODAY";  //size = 11
+    lReqInfo.mReqHeader.push_back("content-type", "plain/text");  //size = 11
+    lReqInfo.mReqHeader.push_back("agent-type", "myAgent");  //size = 11
+    lReqInfo.mReqHeader.push_back("date", "TODAY");  //size = 11
     lReqInfo.mReqBody="MyClientRequest";
     lReqInfo.mId=std::string("123");
     lReqInfo.mReqHttpStatus = -1;
@@ -366,10 +366,10 @@ void TestModCompare::testNoDifferences()
     gFile.open(lPath.c_str());
 
     DupModule::RequestInfo lReqInfo;
-    lReqInfo.mReqHeader["content-type"]= "plain/text";  //size = 11
-    lReqInfo.mReqHeader["agent-type"]= "myAgent";  //size = 11
-    lReqInfo.mReqHeader["date"]= "TODAY";  //size = 11
-    lReqInfo.mReqHeader["ELAPSED_TIME_BY_DUP"]= "432";  // test diff time dup/comp requests
+    lReqInfo.mReqHeader.push_back("content-type", "plain/text");  //size = 11
+    lReqInfo.mReqHeader.push_back("agent-type", "myAgent");  //size = 11
+    lReqInfo.mReqHeader.push_back("date", "TODAY");  //size = 11
+    lReqInfo.mReqHeader.push_back("ELAPSED_TIME_BY_DUP", "432");  // test diff time dup/comp requests
     lReqInfo.mReqBody="MyClientRequest";
     lReqInfo.mId=std::string("123");
     lReqInfo.mReqHttpStatus = -1; // default value for non existant X_DUP_HTTP_STATUS header
@@ -412,10 +412,10 @@ void TestModCompare::testWriteDifferencesWithStatusDiff()
     gFile.open(lPath.c_str());
 
     DupModule::RequestInfo lReqInfo;
-    lReqInfo.mReqHeader["content-type"]= "plain/text";  //size = 11
-    lReqInfo.mReqHeader["agent-type"]= "myAgent";  //size = 11
-    lReqInfo.mReqHeader["date"]= "TODAY";  //size = 11
-    lReqInfo.mReqHeader["ELAPSED_TIME_BY_DUP"]= "432";  // test diff time dup/comp requests
+    lReqInfo.mReqHeader.push_back("content-type", "plain/text");  //size = 11
+    lReqInfo.mReqHeader.push_back("agent-type", "myAgent");  //size = 11
+    lReqInfo.mReqHeader.push_back("date", "TODAY");  //size = 11
+    lReqInfo.mReqHeader.push_back("ELAPSED_TIME_BY_DUP", "432");  // test diff time dup/comp requests
     lReqInfo.mReqBody="MyClientRequest";
     lReqInfo.mId=std::string("123");
     lReqInfo.mReqHttpStatus = 456;
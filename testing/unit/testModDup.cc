@@ -33,6 +33,7 @@
 #include <cppunit/extensions/TestFactoryRegistry.h>
 #include <cppunit/ui/text/TestRunner.h>
 #include <cppunit/extensions/HelperMacros.h>
+#include <jsoncpp/json/json.h>
 
 CPPUNIT_TEST_SUITE_REGISTRATION( TestModDup );
 
@@ -91,6 +92,13 @@ void TestModDup::testInitAndCleanUp()
     CPPUNIT_ASSERT(!gProcessor);
     CPPUNIT_ASSERT(!gThreadPool);
 
+    // One scoreboard per instance of httpd
+    const std::string lName = scoreboardName("/etc/httpd", "conf/httpd.conf");
+    CPPUNIT_ASSERT_EQUAL(std::string("mod_dup_scoreboard."), lName.substr(0, 19));
+    CPPUNIT_ASSERT_EQUAL(lName, scoreboardName("/etc/httpd", "conf/httpd.conf"));
+    CPPUNIT_ASSERT(lName != scoreboardName("/etc/httpd2", "conf/httpd.conf"));
+    CPPUNIT_ASSERT(lName != scoreboardName("/etc/httpd", "conf/other.conf"));
+
     // Cleaner test
     int test;
     Dummy d(test);
@@ -117,6 +125,61 @@ void TestModDup::testConfig()
     CPPUNIT_ASSERT(!setQueue(NULL, NULL, "0", "0"));
     CPPUNIT_ASSERT(setQueue(NULL, NULL, "-1", "2"));
 
+    CPPUNIT_ASSERT(setRetry(NULL, NULL, "", "1000", NULL));
+    CPPUNIT_ASSERT(setRetry(NULL, NULL, "3", "x", NULL));
+    CPPUNIT_ASSERT(setRetry(NULL, NULL, "3", "1000", "-"));
+    CPPUNIT_ASSERT(!setRetry(NULL, NULL, "3", "1000", NULL));
+    CPPUNIT_ASSERT(!setRetry(NULL, NULL, "3", "1000", "50"));
+    CPPUNIT_ASSERT(!setRetry(NULL, NULL, "0", "0", NULL));
+
+    CPPUNIT_ASSERT(setRetryShare(NULL, NULL, "x"));
+    CPPUNIT_ASSERT(setRetryShare(NULL, NULL, "101"));
+    CPPUNIT_ASSERT(!setRetryShare(NULL, NULL, "20"));
+
+    CPPUNIT_ASSERT(setConcurrentSends(NULL, NULL, "x", NULL));
+    CPPUNIT_ASSERT(setConcurrentSends(NULL, NULL, "0", NULL));
+    CPPUNIT_ASSERT(setConcurrentSends(NULL, NULL, "4", "0"));
+    CPPUNIT_ASSERT(!setConcurrentSends(NULL, NULL, "4", "2"));
+    CPPUNIT_ASSERT(!setConcurrentSends(NULL, NULL, "1", NULL));
+
+    {
+        // Synchronous duplications after the response would still hold the client
+        DupConf sync, afterResponse;
+        CPPUNIT_ASSERT(!setSynchronous(NULL, &sync));
+        CPPUNIT_ASSERT(setAfterResponse(NULL, &sync));
+        CPPUNIT_ASSERT(!sync.afterResponse);
+        CPPUNIT_ASSERT(!setAfterResponse(NULL, &afterResponse));
+        CPPUNIT_ASSERT(setSynchronous(NULL, &afterResponse));
+        CPPUNIT_ASSERT(!afterResponse.synchronous);
+    }
+
+    CPPUNIT_ASSERT(setResolve(NULL, NULL, "dest.example"));
+    CPPUNIT_ASSERT(setResolve(NULL, NULL, ":80:127.0.0.1"));
+    CPPUNIT_ASSERT(setResolve(NULL, NULL, "dest.example:x:127.0.0.1"));
+    CPPUNIT_ASSERT(setResolve(NULL, NULL, "dest.example:0:127.0.0.1"));
+    CPPUNIT_ASSERT(setResolve(NULL, NULL, "dest.example:80:"));
+    CPPUNIT_ASSERT(!setResolve(NULL, NULL, "dest.example:80:127.0.0.1"));
+    CPPUNIT_ASSERT(!setResolve(NULL, NULL, "dest.example:443:[::1],127.0.0.1"));
+    CPPUNIT_ASSERT(gProcessor->mResolve);
+    // Read again from scratch on a graceful restart
+    CPPUNIT_ASSERT(!setLogLevel(NULL, NULL, "error"));
+    CPPUNIT_ASSERT(!Log::isEnabled(LOG_INFO));
+    CPPUNIT_ASSERT_EQUAL(OK, preConfig(NULL, NULL, NULL));
+    CPPUNIT_ASSERT(Log::isEnabled(LOG_DEBUG));
+    CPPUNIT_ASSERT(!gProcessor->mResolve);
+    CPPUNIT_ASSERT(!setResolve(NULL, NULL, "dest.example:80:127.0.0.1"));
+    CPPUNIT_ASSERT(gProcessor->mResolve && !gProcessor->mResolve->next);
+
+    CPPUNIT_ASSERT(setBatchSize(NULL, NULL, "x"));
+    CPPUNIT_ASSERT(setBatchSize(NULL, NULL, "0"));
+    CPPUNIT_ASSERT(!setBatchSize(NULL, NULL, "16"));
+    CPPUNIT_ASSERT(!setBatchSize(NULL, NULL, "1"));
+
+    CPPUNIT_ASSERT(setDropPolicy(NULL, NULL, "random"));
+    CPPUNIT_ASSERT(!setDropPolicy(NULL, NULL, "oldest"));
+    CPPUNIT_ASSERT(!setDropPolicy(NULL, NULL, "Priority"));
+    CPPUNIT_ASSERT(!setDropPolicy(NULL, NULL, "newest"));
+
     cmd_parms * lParms = getParms();
     lParms->path = new char[10];
     strcpy(lParms->path, "/spp/main");
@@ -246,6 +309,14 @@ void TestModDup::testHighestDuplicationType()
     // Should NOT go back to HEADER_ONLY
     CPPUNIT_ASSERT(!setDuplicationType(lParms, (void *)conf, "HEADER_ONLY"));
     CPPUNIT_ASSERT_EQUAL(DuplicationType::COMPLETE_REQUEST, conf->getHighestDuplicationType());
+
+    // The queue priority follows the highest duplication type unless set
+    CPPUNIT_ASSERT_EQUAL(QueuePriority::NORMAL, conf->getPriority());
+    CPPUNIT_ASSERT(!setDuplicationType(lParms, (void *)conf, "REQUEST_WITH_ANSWER"));
+    CPPUNIT_ASSERT_EQUAL(QueuePriority::HIGH, conf->getPriority());
+    CPPUNIT_ASSERT(setPriority(lParms, (void *)conf, "urgent"));
+    CPPUNIT_ASSERT(!setPriority(lParms, (void *)conf, "low"));
+    CPPUNIT_ASSERT_EQUAL(QueuePriority::LOW, conf->getPriority());
 }
 
 void TestModDup::testDuplicationPercentage() {
@@ -329,6 +400,79 @@ void TestModDup::testDuplicationPercentage() {
 
 }
 
+void TestModDup::testStatusHandler()
+{
+    request_rec lRequest;
+    memset(&lRequest, 0, sizeof(request_rec));
+    CPPUNIT_ASSERT_EQUAL(DECLINED, statusHandler(&lRequest));
+    lRequest.handler = "other-handler";
+    CPPUNIT_ASSERT_EQUAL(DECLINED, statusHandler(&lRequest));
+
+    lRequest.handler = "dup-status";
+    lRequest.method_number = M_POST;
+    CPPUNIT_ASSERT_EQUAL(HTTP_METHOD_NOT_ALLOWED, statusHandler(&lRequest));
+
+    lRequest.method_number = M_GET;
+    if ( ! gProcessor ) {
+        init();
+    }
+    std::vector<std::string> lDestinations;
+    lDestinations.push_back("Honolulu:8080");
+    Scoreboard &lScoreboard = gProcessor->getScoreboard();
+    CPPUNIT_ASSERT(lScoreboard.create("mod_dup_test_status", 2, lDestinations));
+    CPPUNIT_ASSERT(lScoreboard.claimSlot());
+    lScoreboard.count(ScoreboardCounter::DUPLICATED, 2);
+    lScoreboard.countDestination(ScoreboardCounter::DUPLICATED, "Honolulu:8080", 2);
+    lScoreboard.record(Latency::SEND, "Honolulu:8080", 10);
+    lScoreboard.record(Latency::SEND, "Honolulu:8080", 20);
+    lScoreboard.countDrop(ScoreboardDrop::ABANDONED);
+
+    // What the handler writes is captured in the filename by the stubs
+    CPPUNIT_ASSERT_EQUAL(OK, statusHandler(&lRequest));
+    CPPUNIT_ASSERT_EQUAL(std::string("text/plain"), std::string(lRequest.content_type));
+    std::string lText(lRequest.filename);
+    CPPUNIT_ASSERT(lText.find("duplications: 2\n") != std::string::npos);
+    CPPUNIT_ASSERT(lText.find("drops abandoned: 1\n") != std::string::npos);
+    CPPUNIT_ASSERT(lText.find("destination Honolulu:8080: duplications=2 ") != std::string::npos);
+    CPPUNIT_ASSERT(lText.find("latency_us send@Honolulu:8080: 11/20/20/20\n") != std::string::npos);
+    free(lRequest.filename);
+    lRequest.filename = NULL;
+
+    lRequest.args = (char *)"json";
+    CPPUNIT_ASSERT_EQUAL(OK, statusHandler(&lRequest));
+    CPPUNIT_ASSERT_EQUAL(std::string("application/json"), std::string(lRequest.content_type));
+    Json::Value lJson;
+    Json::Reader lReader;
+    CPPUNIT_ASSERT(lReader.parse(std::string(lRequest.filename), lJson));
+    CPPUNIT_ASSERT_EQUAL(2u, lJson["duplications"].asUInt());
+    CPPUNIT_ASSERT_EQUAL(1u, lJson["drops_by_reason"]["abandoned"].asUInt());
+    CPPUNIT_ASSERT_EQUAL(30u, lJson["latencies_us"]["send"]["sum"].asUInt());
+    const Json::Value &lDestination = lJson["destinations"]["Honolulu:8080"];
+    CPPUNIT_ASSERT_EQUAL(2u, lDestination["duplications"].asUInt());
+    CPPUNIT_ASSERT_EQUAL(2u, lDestination["latencies_us"]["send"]["count"].asUInt());
+    CPPUNIT_ASSERT_EQUAL(20u, lDestination["latencies_us"]["send"]["p99"].asUInt());
+    CPPUNIT_ASSERT(lJson["filters"].isObject());
+    free(lRequest.filename);
+    lRequest.filename = NULL;
+
+    lRequest.args = (char *)"prometheus";
+    CPPUNIT_ASSERT_EQUAL(OK, statusHandler(&lRequest));
+    CPPUNIT_ASSERT_EQUAL(std::string("text/plain; version=0.0.4"), std::string(lRequest.content_type));
+    std::string lPrometheus(lRequest.filename);
+    CPPUNIT_ASSERT(lPrometheus.find("mod_dup_latency_us_sum{step=\"send\"} 30\n") != std::string::npos);
+    CPPUNIT_ASSERT(lPrometheus.find("mod_dup_drops_by_reason_total{reason=\"abandoned\"} 1\n") != std::string::npos);
+    CPPUNIT_ASSERT(lPrometheus.find("mod_dup_destination_duplications_total{destination=\"Honolulu:8080\"} 2\n") != std::string::npos);
+    CPPUNIT_ASSERT(lPrometheus.find("mod_dup_destination_latency_us_count{destination=\"Honolulu:8080\",step=\"send\"} 2\n") != std::string::npos);
+    free(lRequest.filename);
+    lRequest.filename = NULL;
+
+    // Nothing written for a HEAD
+    lRequest.header_only = 1;
+    CPPUNIT_ASSERT_EQUAL(OK, statusHandler(&lRequest));
+    CPPUNIT_ASSERT(!lRequest.filename);
+    lScoreboard.destroy();
+}
+
 #ifdef UNIT_TESTING
 //--------------------------------------
 // the main method
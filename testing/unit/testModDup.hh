@@ -49,6 +49,7 @@ class TestModDup :
     CPPUNIT_TEST(testHighestDuplicationType);
     CPPUNIT_TEST(testInitAndCleanUp);
     CPPUNIT_TEST(testDuplicationPercentage);
+    CPPUNIT_TEST(testStatusHandler);
     CPPUNIT_TEST_SUITE_END();
 
 public:
@@ -61,6 +62,8 @@ public:
     void testHighestDuplicationType();
 
     void testDuplicationPercentage();
+
+    void testStatusHandler();
 };
 
 
@@ -30,6 +30,27 @@ CPPUNIT_TEST_SUITE_REGISTRATION( TestMultiThreadQueue );
 
 using namespace DupModule;
 
+// The tens give the priority of the items in the drop policies tests
+static QueuePriority::eQueuePriority priority(const int &item)
+{
+	return static_cast<QueuePriority::eQueuePriority>(item / 10);
+}
+
+static std::vector<int> dropped;
+static std::vector<DropReason::eDropReason> dropReasons;
+
+static void onDrop(const int &item, DropReason::eDropReason reason)
+{
+	dropped.push_back(item);
+	dropReasons.push_back(reason);
+}
+
+// The items weigh their value in bytes
+static size_t itemSize(const int &item)
+{
+	return item;
+}
+
 void TestMultiThreadQueue::run()
 {
 	unsigned lInCount, lOutCount, lDropCount;
@@ -91,6 +112,30 @@ void TestMultiThreadQueue::run()
 	CPPUNIT_ASSERT_EQUAL_UINT(1, queue.size());
 	CPPUNIT_ASSERT_EQUAL(1234, queue.pop());
 
+	// Batches take what is available, up to their maximum size
+	queue.setDropSize(0);
+	tQueueTimings timings;
+	queue.getTimings(timings);
+	for (int i = 0; i < 5; ++i)
+		queue.push(i);
+	std::vector<int> batch;
+	CPPUNIT_ASSERT_EQUAL_UINT(3, queue.popBatch(batch, 3, 0));
+	CPPUNIT_ASSERT_EQUAL_UINT(2, queue.popBatch(batch, 3, 0));
+	CPPUNIT_ASSERT_EQUAL_UINT(5, batch.size());
+	for (int i = 0; i < 5; ++i)
+		CPPUNIT_ASSERT_EQUAL(i, batch[i]);
+	queue.getCounters(lInCount, lOutCount, lDropCount);
+	CPPUNIT_ASSERT_EQUAL_UINT(5, lInCount);
+	CPPUNIT_ASSERT_EQUAL_UINT(6, lOutCount);
+	// An empty queue gives up after the timeout
+	CPPUNIT_ASSERT_EQUAL_UINT(0, queue.popBatch(batch, 3, 10000));
+	CPPUNIT_ASSERT_EQUAL_UINT(5, batch.size());
+	queue.getTimings(timings);
+	CPPUNIT_ASSERT_EQUAL_UINT(5, timings.mPushed);
+	CPPUNIT_ASSERT_EQUAL_UINT(5, timings.mPopped);
+	// The last single pop and the two batches were handled, the timed out pop had nothing to handle
+	CPPUNIT_ASSERT_EQUAL_UINT(6, timings.mServed);
+
 
 	// This works also with more complex types
 	typedef std::pair<std::string, std::string> complexType;
@@ -104,3 +149,75 @@ void TestMultiThreadQueue::run()
 	CPPUNIT_ASSERT_EQUAL_UINT(0, lDropCount);
 	CPPUNIT_ASSERT_EQUAL_UINT(0, queue.size());
 }
+
+void TestMultiThreadQueue::dropPolicies()
+{
+	unsigned lInCount, lOutCount, lDropCount;
+	MultiThreadQueue<int> queue;
+	queue.setDropSize(3);
+	queue.setPriority(&priority);
+	queue.setDropHandler(&onDrop);
+	queue.setSizeFunction(&itemSize);
+
+	// Newest: the incoming item is dropped
+	dropped.clear();
+	dropReasons.clear();
+	queue.push(11);
+	queue.push(12);
+	queue.push(13);
+	queue.push(14);
+	CPPUNIT_ASSERT_EQUAL_UINT(1, dropped.size());
+	CPPUNIT_ASSERT_EQUAL(14, dropped[0]);
+	CPPUNIT_ASSERT_EQUAL(DropReason::REFUSED, dropReasons[0]);
+	CPPUNIT_ASSERT_EQUAL_UINT(11 + 12 + 13, queue.bytes());
+
+	// Oldest: the item queued for the longest time is dropped, whatever its priority
+	queue.setDropPolicy(DropPolicy::OLDEST);
+	queue.push(1);
+	CPPUNIT_ASSERT_EQUAL_UINT(2, dropped.size());
+	CPPUNIT_ASSERT_EQUAL(11, dropped[1]);
+	CPPUNIT_ASSERT_EQUAL(DropReason::EVICTED, dropReasons[1]);
+	CPPUNIT_ASSERT_EQUAL_UINT(3, queue.size());
+	// Items still come out in the order they were pushed
+	CPPUNIT_ASSERT_EQUAL(12, queue.pop());
+	CPPUNIT_ASSERT_EQUAL(13, queue.pop());
+	CPPUNIT_ASSERT_EQUAL(1, queue.pop());
+
+	// Lowest priority: the oldest of the lowest priority, unless the incoming item is lower
+	queue.setDropPolicy(DropPolicy::LOWEST_PRIORITY);
+	queue.push(21);
+	queue.push(2);
+	queue.push(3);
+	queue.push(22);
+	CPPUNIT_ASSERT_EQUAL(2, dropped[2]);
+	queue.push(4);
+	CPPUNIT_ASSERT_EQUAL(3, dropped[3]);
+	queue.push(5);
+	CPPUNIT_ASSERT_EQUAL(4, dropped[4]);
+	CPPUNIT_ASSERT_EQUAL(DropReason::EVICTED, dropReasons[4]);
+	queue.push(23);
+	CPPUNIT_ASSERT_EQUAL(5, dropped[5]);
+	queue.push(24);
+	CPPUNIT_ASSERT_EQUAL(21, dropped[6]);
+
+	// Protected items are never dropped, they go beyond the maximum size once nothing else can be
+	queue.push(31);
+	CPPUNIT_ASSERT_EQUAL(22, dropped[7]);
+	queue.push(32);
+	queue.push(33);
+	CPPUNIT_ASSERT_EQUAL_UINT(10, dropped.size());
+	queue.push(34);
+	CPPUNIT_ASSERT_EQUAL_UINT(10, dropped.size());
+	CPPUNIT_ASSERT_EQUAL_UINT(4, queue.size());
+
+	// So are the items pushed to the front, which come out first
+	queue.push_front(42);
+	CPPUNIT_ASSERT_EQUAL_UINT(5, queue.size());
+	CPPUNIT_ASSERT_EQUAL(42, queue.pop());
+	CPPUNIT_ASSERT_EQUAL(31, queue.pop());
+	// The dropped and popped items no longer count
+	CPPUNIT_ASSERT_EQUAL_UINT(32 + 33 + 34, queue.bytes());
+
+	queue.getCounters(lInCount, lOutCount, lDropCount);
+	CPPUNIT_ASSERT_EQUAL_UINT(10, lDropCount);
+}
@@ -31,8 +31,14 @@ class TestMultiThreadQueue :
 
     CPPUNIT_TEST_SUITE(TestMultiThreadQueue);
     CPPUNIT_TEST(run);
+    CPPUNIT_TEST(dropPolicies);
     CPPUNIT_TEST_SUITE_END();
 
 public:
     void run();
+
+    /**
+     * @brief Tests what a full queue drops with each drop policy
+     */
+    void dropPolicies();
 };
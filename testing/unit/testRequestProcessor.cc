@@ -29,6 +29,9 @@
 #include <cppunit/extensions/HelperMacros.h>
 #include <boost/shared_ptr.hpp>
 #include <curl/curl.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
 
 CPPUNIT_TEST_SUITE_REGISTRATION( TestRequestProcessor );
 
@@ -145,6 +148,21 @@ void TestRequestProcessor::testRun()
     queue.stop();
     proc.run(queue);
     CPPUNIT_ASSERT_EQUAL(val,proc.mDuplicatedCount);
+
+    // Batches sent concurrently: the requests popped with the poison pill are sent,
+    // the second pill is left for another worker
+    MultiThreadQueue<boost::shared_ptr<RequestInfo> > batchQueue;
+    proc.setBatchSize(8);
+    proc.setConcurrentSends(4, 2);
+    batchQueue.push(ri);
+    batchQueue.push(ri);
+    batchQueue.push(POISON_REQUEST);
+    batchQueue.push(POISON_REQUEST);
+    proc.run(batchQueue);
+    val = 15U;
+    CPPUNIT_ASSERT_EQUAL(val,proc.mDuplicatedCount);
+    CPPUNIT_ASSERT_EQUAL((size_t)1, batchQueue.size());
+    CPPUNIT_ASSERT(batchQueue.pop()->isPoison());
     // We could hack a web server with nc to test the rest of this method,
     // but this might be overkill for a unit test
 }
@@ -190,18 +208,16 @@ void TestRequestProcessor::testSubstitution()
         query = "titi=tatae&tutu";
         ri = RequestInfo("42","/toto", "GET", "/toto", query);
         ri.mConf = &conf;
-        ri.mHeadersIn.push_back(tKeyVal(std::string("H1"), std::string("tAta1,2#")));
-        ri.mHeadersIn.push_back(tKeyVal(std::string("H2"), std::string(""))); ;
+        ri.mHeadersIn.push_back("H1", "tAta1,2#");
+        ri.mHeadersIn.push_back("H2", "");
         proc.parseArgs(ri.mParsedArgs, ri.mArgs);
         RequestProcessor::tCommandsByDestination &cbd = proc.mCommands.at(&conf);
         Commands &c = cbd.at(conf.currentDupDestination);
         proc.substituteRequest(ri, c);
-        CPPUNIT_ASSERT_EQUAL(ri.mHeadersIn.front().first, std::string("H1"));
-        CPPUNIT_ASSERT_EQUAL(ri.mHeadersIn.front().second, std::string("t*t*1,2#"));
-        ri.mHeadersIn.pop_front();
-        CPPUNIT_ASSERT_EQUAL(ri.mHeadersIn.front().first, std::string("H2"));
-        CPPUNIT_ASSERT_EQUAL(ri.mHeadersIn.front().second, std::string(""));
-        ri.mHeadersIn.pop_front();
+        CPPUNIT_ASSERT_EQUAL(ri.mHeadersIn.name(0).to_string(), std::string("H1"));
+        CPPUNIT_ASSERT_EQUAL(ri.mHeadersIn.value(0).to_string(), std::string("t*t*1,2#"));
+        CPPUNIT_ASSERT_EQUAL(ri.mHeadersIn.name(1).to_string(), std::string("H2"));
+        CPPUNIT_ASSERT_EQUAL(ri.mHeadersIn.value(1).to_string(), std::string(""));
         CPPUNIT_ASSERT_EQUAL(std::string("TITI=t-t--&TUTU"), ri.mArgs);
     }
 
@@ -314,7 +330,7 @@ void TestRequestProcessor::testFilterBasic()
         RequestProcessor proc;
         proc.addFilter( "INFO", "[my]+", conf, tFilter::eFilterTypes::REGULAR);
         RequestInfo ri = RequestInfo("42","/toto", "GET", "/toto/pws/titi/", "doesnot=match");
-        ri.mHeadersIn.push_back(std::make_pair("InFo","myinfo"));
+        ri.mHeadersIn.push_back("InFo","myinfo");
         ri.mConf = &conf;
         proc.parseArgs(ri.mParsedArgs, ri.mArgs);
         CPPUNIT_ASSERT(!proc.processRequest(ri).empty());
@@ -611,17 +627,38 @@ void TestRequestProcessor::testParseArgs()
 {
     RequestProcessor proc;
     std::string query;
-    std::list<std::pair<std::string, std::string> > lParsedArgs;
+    tArgSpans lParsedArgs;
 
-    query = "titi=tAta1,2#&tutu";
+    // Keys are kept as they are and values are not decoded
+    query = "titi=tAta1%2C2#&&tutu&=x&v=";
+    proc.parseArgs(lParsedArgs, query);
+    CPPUNIT_ASSERT_EQUAL(size_t(4), lParsedArgs.size());
+    CPPUNIT_ASSERT_EQUAL(std::string("titi"), lParsedArgs[0].key(query).to_string());
+    CPPUNIT_ASSERT_EQUAL(std::string("tAta1%2C2#"), lParsedArgs[0].value(query).to_string());
+    CPPUNIT_ASSERT_EQUAL(std::string("tutu"), lParsedArgs[1].key(query).to_string());
+    CPPUNIT_ASSERT_EQUAL(std::string(""), lParsedArgs[1].value(query).to_string());
+    CPPUNIT_ASSERT_EQUAL(std::string(""), lParsedArgs[2].key(query).to_string());
+    CPPUNIT_ASSERT_EQUAL(std::string("x"), lParsedArgs[2].value(query).to_string());
+    CPPUNIT_ASSERT_EQUAL(std::string("v"), lParsedArgs[3].key(query).to_string());
+    CPPUNIT_ASSERT_EQUAL(std::string(""), lParsedArgs[3].value(query).to_string());
+
+    // Reused
+    query = "a=b";
     proc.parseArgs(lParsedArgs, query);
-    CPPUNIT_ASSERT_EQUAL(lParsedArgs.front().first, std::string("TITI"));
-    CPPUNIT_ASSERT_EQUAL(lParsedArgs.front().second, std::string("tAta1,2#"));
-    lParsedArgs.pop_front();
+    CPPUNIT_ASSERT_EQUAL(size_t(1), lParsedArgs.size());
+    proc.parseArgs(lParsedArgs, "");
+    CPPUNIT_ASSERT(lParsedArgs.empty());
 
-    CPPUNIT_ASSERT_EQUAL(lParsedArgs.front().first, std::string("TUTU"));
-    CPPUNIT_ASSERT_EQUAL(lParsedArgs.front().second, std::string(""));
-    lParsedArgs.pop_front();
+    // Matched case insensitively on the decoded value
+    DupConf conf;
+    conf.currentDupDestination = "Honolulu:8080";
+    conf.currentApplicationScope = ApplicationScope::QUERY_STRING;
+    proc.addFilter("TITI", "^tAta1,2#$", conf, tFilter::eFilterTypes::REGULAR);
+    query = "tutu=1&TiTi=tAta1%2C2#";
+    proc.parseArgs(lParsedArgs, query);
+    const tFiltersMap &filters = proc.mCommands[&conf]["Honolulu:8080"].mFilters;
+    CPPUNIT_ASSERT(proc.keyFilterMatch(filters, query, lParsedArgs, ApplicationScope::QUERY_STRING, tFilter::REGULAR));
+    CPPUNIT_ASSERT(!proc.keyFilterMatch(filters, query, lParsedArgs, ApplicationScope::BODY, tFilter::REGULAR));
 }
 
 
@@ -635,17 +672,18 @@ void TestRequestProcessor::testAddValidationHeaders()
         matchedFilter.mDuplicationType = DuplicationType::COMPLETE_REQUEST;
         matchedFilter.mMatch = "papalino";
         matchedFilter.mScope = ApplicationScope::ALL;
-        lInfo.mHeadersIn.push_back(tKeyVal(std::string("X_DUP_LOG"), std::string("ON")));
+        lInfo.mHeadersIn.push_back("X_DUP_LOG", "ON");
         std::list<const tFilter *> matchedFilters;
         matchedFilters.push_back(&matchedFilter);
         proc.addValidationHeadersDup(lInfo, matchedFilters,0,0);
-        CPPUNIT_ASSERT_EQUAL(std::string("X-MATCHED-PATTERN"), lInfo.mHeadersOut.front().first);
-        CPPUNIT_ASSERT_EQUAL(std::string("papalino"), lInfo.mHeadersOut.front().second);
-        lInfo.mHeadersOut.pop_front();
-        CPPUNIT_ASSERT_EQUAL(std::string("The request is duplicated, ALL filter: \"papalino\" matched: \"papalino\" Destination: Alger"), lInfo.mHeadersOut.front().second);
+        CPPUNIT_ASSERT_EQUAL(std::string("X-MATCHED-PATTERN"), lInfo.mHeadersOut.name(0).to_string());
+        CPPUNIT_ASSERT_EQUAL(HeaderName::X_MATCHED_PATTERN, lInfo.mHeadersOut.id(0));
+        CPPUNIT_ASSERT_EQUAL(std::string("papalino"), lInfo.mHeadersOut.value(0).to_string());
+        CPPUNIT_ASSERT_EQUAL(HeaderName::X_DUP_LOG, lInfo.mHeadersOut.id(1));
+        CPPUNIT_ASSERT_EQUAL(std::string("The request is duplicated, ALL filter: \"papalino\" matched: \"papalino\" Destination: Alger"), lInfo.mHeadersOut.value(1).to_string());
     }
     
-    lInfo.mHeadersOut.pop_front();
+    lInfo.mHeadersOut.clear();
     {
         tFilter matchedFilter(".*", ApplicationScope::ALL, "Alger", DuplicationType::COMPLETE_REQUEST, boost::regex("nomatch"));
         matchedFilter.mMatch = "papalino";
@@ -662,25 +700,23 @@ void TestRequestProcessor::testAddValidationHeaders()
         matchedFilters.push_back(&matchedFilter2);
         proc.addValidationHeadersDup(lInfo, matchedFilters,0,0);
 
-        CPPUNIT_ASSERT_EQUAL(std::string("X-MATCHED-PATTERN"), lInfo.mHeadersOut.front().first);
-        CPPUNIT_ASSERT_EQUAL(std::string("papalino"), lInfo.mHeadersOut.front().second);
+        CPPUNIT_ASSERT_EQUAL(std::string("X-MATCHED-PATTERN"), lInfo.mHeadersOut.name(0).to_string());
+        CPPUNIT_ASSERT_EQUAL(std::string("papalino"), lInfo.mHeadersOut.value(0).to_string());
 
-        lInfo.mHeadersOut.pop_front();
-        CPPUNIT_ASSERT_EQUAL(std::string("X-MATCHED-PATTERN"), lInfo.mHeadersOut.front().first);
-        CPPUNIT_ASSERT_EQUAL(std::string("pikolinos"), lInfo.mHeadersOut.front().second);
-        
-        lInfo.mHeadersOut.pop_front();
+        CPPUNIT_ASSERT_EQUAL(std::string("X-MATCHED-PATTERN"), lInfo.mHeadersOut.name(1).to_string());
+        CPPUNIT_ASSERT_EQUAL(std::string("pikolinos"), lInfo.mHeadersOut.value(1).to_string());
         
-        CPPUNIT_ASSERT_EQUAL(std::string("The request is duplicated, HEADERS filter: \".*\" matched: \"papalino\" Destination: Napoli AND URL_AND_HEADERS filter: \".*\" matched: \"pikolinos\" Destination: Torino"), lInfo.mHeadersOut.front().second);
-        lInfo.mHeadersOut.pop_front();
+        CPPUNIT_ASSERT_EQUAL(std::string("The request is duplicated, HEADERS filter: \".*\" matched: \"papalino\" Destination: Napoli AND URL_AND_HEADERS filter: \".*\" matched: \"pikolinos\" Destination: Torino"), lInfo.mHeadersOut.value(2).to_string());
+        lInfo.mHeadersOut.clear();
         matchedFilters.clear();
         proc.addValidationHeadersDup(lInfo, matchedFilters,1,2);
-        CPPUNIT_ASSERT_EQUAL(std::string("The request is not duplicated, having found 1 DupDestination(s) and attempted to match 2 DupFilter or DupRawFilter"), lInfo.mHeadersOut.front().second);
+        CPPUNIT_ASSERT_EQUAL(std::string("The request is not duplicated, having found 1 DupDestination(s) and attempted to match 2 DupFilter or DupRawFilter"), lInfo.mHeadersOut.value(0).to_string());
         
-        struct curl_slist *slist = NULL;
+        tCurlHeaders headers;
         lInfo.mValidationHeaderDup = true;
-        proc.addValidationHeadersCompare(lInfo, matchedFilter, slist);
+        proc.addValidationHeadersCompare(lInfo, matchedFilter, headers);
         CPPUNIT_ASSERT_EQUAL(true, lInfo.mValidationHeaderComp);
+        CPPUNIT_ASSERT_EQUAL(std::string("X_COMP_LOG: ON"), std::string(headers.list()->data));
     }
 
 }
@@ -806,23 +842,23 @@ void TestRequestProcessor::testDupFormat() {
     std::string body = "mybody1test";
     RequestInfo ri = RequestInfo("42", "/mypath", "GET", "/mypath/wb", query, &body);
     CURL * curl = curl_easy_init();
-    struct curl_slist *slist = NULL;
+    tCurlHeaders headers;
 
     // Just the request body, no answer header or answer body
-    std::string *df = proc.sendDupFormat(curl, ri, slist);
+    std::string *df = proc.sendDupFormat(curl, ri, headers);
     CPPUNIT_ASSERT_EQUAL(std::string("00000011mybody1test0000000000000000"),
                          *df);
     delete df;
 
     // Request body, + answer header
-    ri.mHeadersOut.push_back(std::make_pair(std::string("key"), std::string("val")));
-    df = proc.sendDupFormat(curl, ri, slist);
+    ri.mHeadersOut.push_back("key", "val");
+    df = proc.sendDupFormat(curl, ri, headers);
     CPPUNIT_ASSERT_EQUAL(std::string("00000011mybody1test00000009key: val\n00000000"),
                          *df);
 
     // Request body, + answer header + answer body
     ri.mAnswer = "TheAnswerBody";
-    df = proc.sendDupFormat(curl, ri, slist);
+    df = proc.sendDupFormat(curl, ri, headers);
     CPPUNIT_ASSERT_EQUAL(std::string("00000011mybody1test00000009key: val\n00000013TheAnswerBody"),
                          *df);
 
@@ -879,7 +915,8 @@ void TestRequestProcessor::testKeySubstitutionOnBody()
     proc.substituteRequest(ri, c);
 
     CPPUNIT_ASSERT_EQUAL(std::string("titi=value&tutu=tatae"), ri.mArgs);
-    CPPUNIT_ASSERT_EQUAL(std::string("KEY1=what%3f%3f&TITI=replacedValue"), ri.mBody);
+    // Only the substituted value is encoded again, the others are copied as they are
+    CPPUNIT_ASSERT_EQUAL(std::string("KEY1=what??&TITI=replacedValue"), ri.mBody);
 }
 
 void TestRequestProcessor::testMultiDestination() {
@@ -950,6 +987,72 @@ void TestRequestProcessor::testMultiDestination() {
 
 }
 
+void TestRequestProcessor::testMayMatchFilters() {
+
+    DupConf conf;
+    conf.currentDupDestination = "Honolulu:8080";
+    {
+        // No filter at all
+        RequestProcessor proc;
+        MAKE_REQ_INFO("42","/match", "/match/pws/titi/", "INFO=myinfo", conf, proc);
+        CPPUNIT_ASSERT(!proc.mayMatchFilters(ri, false));
+    }
+    {
+        // Query string filters are decided early
+        RequestProcessor proc;
+        conf.currentApplicationScope = ApplicationScope::QUERY_STRING;
+        proc.addFilter("INFO", "myinfo", conf, tFilter::eFilterTypes::REGULAR);
+        {
+            MAKE_REQ_INFO("42","/match", "/match/pws/titi/", "INFO=myinfo", conf, proc);
+            CPPUNIT_ASSERT(proc.mayMatchFilters(ri, false));
+        }
+        {
+            MAKE_REQ_INFO("42","/match", "/match/pws/titi/", "INFO=other", conf, proc);
+            CPPUNIT_ASSERT(!proc.mayMatchFilters(ri, false));
+        }
+        // A matching prevent filter excludes the destination
+        proc.addFilter("NO", "dup", conf, tFilter::eFilterTypes::PREVENT_DUPLICATION);
+        {
+            MAKE_REQ_INFO("42","/match", "/match/pws/titi/", "INFO=myinfo&NO=dup", conf, proc);
+            CPPUNIT_ASSERT(!proc.mayMatchFilters(ri, false));
+        }
+        // A body filter cannot be decided before the body is read
+        conf.currentApplicationScope = ApplicationScope::BODY;
+        proc.addFilter("INFO", "myinfo", conf, tFilter::eFilterTypes::REGULAR);
+        {
+            MAKE_REQ_INFO("42","/match", "/match/pws/titi/", "INFO=other", conf, proc);
+            CPPUNIT_ASSERT(proc.mayMatchFilters(ri, false));
+        }
+        // But a prevent filter still excludes the destination
+        {
+            MAKE_REQ_INFO("42","/match", "/match/pws/titi/", "NO=dup", conf, proc);
+            CPPUNIT_ASSERT(!proc.mayMatchFilters(ri, false));
+        }
+    }
+    {
+        // Raw filters on the path and on the headers
+        RequestProcessor proc;
+        conf.currentApplicationScope = ApplicationScope::PATH;
+        proc.addRawFilter("^/match/pws", conf, tFilter::eFilterTypes::REGULAR);
+        conf.currentApplicationScope = ApplicationScope::HEADERS;
+        conf.currentDupDestination = "Hikkaduwa:8090";
+        proc.addRawFilter("X_DUP_HTTP_STATUS: 5", conf, tFilter::eFilterTypes::REGULAR);
+        {
+            MAKE_REQ_INFO("42","/match", "/match/pws/titi/", "", conf, proc);
+            CPPUNIT_ASSERT(proc.mayMatchFilters(ri, false));
+        }
+        {
+            // Header filters might match once the status is known
+            MAKE_REQ_INFO("42","/match", "/other/pws/titi/", "", conf, proc);
+            CPPUNIT_ASSERT(proc.mayMatchFilters(ri, false));
+            ri.mHeadersIn.push_back("X_DUP_HTTP_STATUS", "200");
+            CPPUNIT_ASSERT(!proc.mayMatchFilters(ri, true));
+            ri.mHeadersIn.setValue(ri.mHeadersIn.size() - 1, "503");
+            CPPUNIT_ASSERT(proc.mayMatchFilters(ri, true));
+        }
+    }
+}
+
 void TestRequestProcessor::testPerformCurlCall() {
 
     DupConf lConf;
@@ -1050,6 +1153,689 @@ void TestRequestProcessor::testPerformCurlCall() {
 //--------------------------------------
 // the main method
 //--------------------------------------
+void TestRequestProcessor::testSubstitutionOverlay() {
+    RequestProcessor proc;
+    DupConf conf;
+    conf.currentDupDestination = "Honolulu:8080";
+    proc.addRawFilter(".*", conf, tFilter::eFilterTypes::REGULAR);
+    conf.currentApplicationScope = ApplicationScope::QUERY_STRING;
+    proc.addSubstitution("titi", "[ae]", "-", conf);
+    conf.currentApplicationScope = ApplicationScope::URL;
+    proc.addRawSubstitution("toto", "tata", conf);
+
+    std::string body = "mybody";
+    boost::shared_ptr<RequestInfo> ri(new RequestInfo("42", "/toto", "GET", "/toto/path", "titi=tatae", &body));
+    ri->mConf = &conf;
+    ri->mHeadersIn.push_back("H1", "tAta");
+    proc.parseArgs(ri->mParsedArgs, ri->mArgs);
+    Commands &c = proc.mCommands.at(&conf).at(conf.currentDupDestination);
+
+    RequestOverlay overlay(ri);
+    CPPUNIT_ASSERT(proc.substituteRequest(overlay, c));
+    CPPUNIT_ASSERT_EQUAL(std::string("TITI=t-t--"), overlay.args());
+    CPPUNIT_ASSERT_EQUAL(std::string("/tata/path"), overlay.path());
+    // The original request is untouched
+    CPPUNIT_ASSERT_EQUAL(std::string("titi=tatae"), ri->mArgs);
+    CPPUNIT_ASSERT_EQUAL(std::string("/toto/path"), ri->mPath);
+    // The fields which are not substituted are not copied
+    CPPUNIT_ASSERT(&overlay.body() == &ri->mBody);
+    CPPUNIT_ASSERT(&overlay.headersIn() == &ri->mHeadersIn);
+
+    // Copies of the overlay share the substituted buffers
+    RequestOverlay copy(overlay);
+    CPPUNIT_ASSERT(&copy.args() == &overlay.args());
+
+    // The overlay keeps the original request alive
+    ri.reset();
+    CPPUNIT_ASSERT_EQUAL(std::string("mybody"), copy.body());
+    CPPUNIT_ASSERT_EQUAL(std::string("42"), copy.base().mId);
+}
+
+void TestRequestProcessor::testSubstitutionProgram() {
+    RequestProcessor proc;
+    tSubstitutionScratch scratch;
+    tSubstitutionProgram program;
+    CPPUNIT_ASSERT(program.empty());
+    CPPUNIT_ASSERT(!program.run("a=b", *proc.mUrlCodec, scratch));
+
+    // Rules of a key are chained in declaration order
+    program.addKeyRule("TITI", tSubstitute("a", "b", ApplicationScope::QUERY_STRING));
+    program.addKeyRule("TITI", tSubstitute("b", "c d", ApplicationScope::QUERY_STRING));
+    CPPUNIT_ASSERT(program.run("titi=tata&&tutu=%3f&empty=", *proc.mUrlCodec, scratch));
+    CPPUNIT_ASSERT_EQUAL(std::string("TITI=tc%20dtc%20d&TUTU=%3f&EMPTY"), scratch.mOut);
+
+    // A value left unchanged by its rules is not encoded again
+    CPPUNIT_ASSERT(program.run("titi=%7e", *proc.mUrlCodec, scratch));
+    CPPUNIT_ASSERT_EQUAL(std::string("TITI=%7e"), scratch.mOut);
+
+    // Raw rules run on the result of the key rules
+    program.addRawRule(tSubstitute("TITI", "TOTO", ApplicationScope::QUERY_STRING));
+    CPPUNIT_ASSERT(program.run("titi=a", *proc.mUrlCodec, scratch));
+    CPPUNIT_ASSERT_EQUAL(std::string("TOTO=c%20d"), scratch.mOut);
+
+    // Headers
+    tSubstitutionProgram headers;
+    headers.addKeyRule("H1", tSubstitute("[Aa]", "*", ApplicationScope::HEADERS));
+    tHeaders list;
+    list.push_back("H2", "tAta");
+    CPPUNIT_ASSERT(!headers.matches(list));
+    list.push_back("H1", "tAta");
+    CPPUNIT_ASSERT(headers.matches(list));
+    CPPUNIT_ASSERT(headers.run(list, scratch));
+    CPPUNIT_ASSERT_EQUAL(std::string("tAta"), list.value(0).to_string());
+    CPPUNIT_ASSERT_EQUAL(std::string("t*t*"), list.value(1).to_string());
+}
+
+void TestRequestProcessor::testRunSync() {
+    // A destination which accepts connections but never answers
+    int lSocket = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in lAddr;
+    memset(&lAddr, 0, sizeof(lAddr));
+    lAddr.sin_family = AF_INET;
+    lAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    CPPUNIT_ASSERT_EQUAL(0, bind(lSocket, (struct sockaddr *)&lAddr, sizeof(lAddr)));
+    CPPUNIT_ASSERT_EQUAL(0, listen(lSocket, 16));
+    socklen_t lLen = sizeof(lAddr);
+    getsockname(lSocket, (struct sockaddr *)&lAddr, &lLen);
+
+    RequestProcessor proc;
+    proc.setTimeout(300);
+    DupConf conf;
+    conf.currentApplicationScope = ApplicationScope::ALL;
+    conf.currentDupDestination = "127.0.0.1:" + boost::lexical_cast<std::string>(ntohs(lAddr.sin_port));
+    proc.addFilter("SID", "mySid", conf, tFilter::eFilterTypes::REGULAR);
+    proc.setDestinationDuplicationPercentage(conf, conf.currentDupDestination, 300);
+
+    boost::shared_ptr<RequestInfo> ri(new RequestInfo("42", "/spp/main", "GET", "/spp/main", "SID=mySid"));
+    ri->mConf = &conf;
+    tMultiCurl *sync = proc.initMultiCurl();
+    CPPUNIT_ASSERT(sync);
+
+    boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+    proc.runSync(ri, *sync);
+    long elapsed = (boost::posix_time::microsec_clock::universal_time() - start).total_milliseconds();
+
+    // The 3 duplications shared one deadline instead of waiting 300ms each
+    CPPUNIT_ASSERT(elapsed >= 250);
+    CPPUNIT_ASSERT(elapsed < 700);
+    CPPUNIT_ASSERT_EQUAL((unsigned int)3, proc.getDuplicatedCount());
+    CPPUNIT_ASSERT_EQUAL((unsigned int)3, proc.getTimeoutCount());
+    CPPUNIT_ASSERT_EQUAL((int)CURLE_OPERATION_TIMEDOUT, ri->mCurlCompResponseStatus);
+    CPPUNIT_ASSERT_EQUAL((size_t)3, sync->mHandles.size());
+    close(lSocket);
+}
+
+/*
+ * Answers each connection accepted after a delay, until pCount were answered
+ */
+static void
+answerLater(int pSocket, int pCount, int pDelayMs) {
+    static const char c_ANSWER[] = "HTTP/1.1 200 OK\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    for (int i = 0; i < pCount; ++i) {
+        int lConnection = accept(pSocket, NULL, NULL);
+        if (lConnection < 0) {
+            return;
+        }
+        char lRequest[4096];
+        ssize_t lRead = recv(lConnection, lRequest, sizeof(lRequest), 0);
+        (void)lRead;
+        usleep(pDelayMs * 1000);
+        ssize_t lWritten = send(lConnection, c_ANSWER, sizeof(c_ANSWER) - 1, 0);
+        (void)lWritten;
+        close(lConnection);
+    }
+}
+
+void TestRequestProcessor::testRunSyncNoTimeout() {
+    // A destination which answers, but not right away
+    int lSocket = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in lAddr;
+    memset(&lAddr, 0, sizeof(lAddr));
+    lAddr.sin_family = AF_INET;
+    lAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    CPPUNIT_ASSERT_EQUAL(0, bind(lSocket, (struct sockaddr *)&lAddr, sizeof(lAddr)));
+    CPPUNIT_ASSERT_EQUAL(0, listen(lSocket, 16));
+    socklen_t lLen = sizeof(lAddr);
+    getsockname(lSocket, (struct sockaddr *)&lAddr, &lLen);
+    boost::thread lServer(boost::bind(&answerLater, lSocket, 1, 50));
+
+    // No DupTimeout
+    RequestProcessor proc;
+    DupConf conf;
+    conf.currentApplicationScope = ApplicationScope::ALL;
+    conf.currentDupDestination = "127.0.0.1:" + boost::lexical_cast<std::string>(ntohs(lAddr.sin_port));
+    proc.addFilter("SID", "mySid", conf, tFilter::eFilterTypes::REGULAR);
+
+    boost::shared_ptr<RequestInfo> ri(new RequestInfo("42", "/spp/main", "GET", "/spp/main", "SID=mySid"));
+    ri->mConf = &conf;
+    tMultiCurl *sync = proc.initMultiCurl();
+    CPPUNIT_ASSERT(sync);
+    proc.runSync(ri, *sync);
+
+    CPPUNIT_ASSERT_EQUAL((int)CURLE_OK, ri->mCurlCompResponseStatus);
+    CPPUNIT_ASSERT_EQUAL((unsigned int)1, proc.getDuplicatedCount());
+    CPPUNIT_ASSERT_EQUAL((unsigned int)0, proc.getTimeoutCount());
+    lServer.join();
+    delete sync;
+    close(lSocket);
+}
+
+void TestRequestProcessor::testResolve() {
+    // A destination which accepts connections but never answers, known only by a name which does not resolve
+    int lSocket = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in lAddr;
+    memset(&lAddr, 0, sizeof(lAddr));
+    lAddr.sin_family = AF_INET;
+    lAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    CPPUNIT_ASSERT_EQUAL(0, bind(lSocket, (struct sockaddr *)&lAddr, sizeof(lAddr)));
+    CPPUNIT_ASSERT_EQUAL(0, listen(lSocket, 16));
+    socklen_t lLen = sizeof(lAddr);
+    getsockname(lSocket, (struct sockaddr *)&lAddr, &lLen);
+    const unsigned lPort = ntohs(lAddr.sin_port);
+
+    RequestProcessor proc;
+    proc.setTimeout(200);
+    DupConf conf;
+    conf.currentApplicationScope = ApplicationScope::ALL;
+    conf.currentDupDestination = "dest.invalid:" + boost::lexical_cast<std::string>(lPort);
+    proc.addFilter("SID", "mySid", conf, tFilter::eFilterTypes::REGULAR);
+    tMultiCurl *sync = proc.initMultiCurl();
+    CPPUNIT_ASSERT(sync);
+
+    {
+        boost::shared_ptr<RequestInfo> ri(new RequestInfo("42", "/spp/main", "GET", "/spp/main", "SID=mySid"));
+        ri->mConf = &conf;
+        proc.runSync(ri, *sync);
+        CPPUNIT_ASSERT_EQUAL((int)CURLE_COULDNT_RESOLVE_HOST, ri->mCurlCompResponseStatus);
+    }
+
+    // The handles created from now on connect to the address pinned
+    proc.addResolve("dest.invalid", lPort, "127.0.0.1");
+    tMultiCurl *pinned = proc.initMultiCurl();
+    CPPUNIT_ASSERT(pinned);
+    {
+        boost::shared_ptr<RequestInfo> ri(new RequestInfo("43", "/spp/main", "GET", "/spp/main", "SID=mySid"));
+        ri->mConf = &conf;
+        proc.runSync(ri, *pinned);
+        CPPUNIT_ASSERT_EQUAL((int)CURLE_OPERATION_TIMEDOUT, ri->mCurlCompResponseStatus);
+    }
+    // Before the processor, whose caches they share
+    delete sync;
+    delete pinned;
+    close(lSocket);
+}
+
+void TestRequestProcessor::testConcurrentSends() {
+    // Two destinations which accept connections but never answer
+    int lSockets[2];
+    std::string lDestinations[2];
+    for (int i = 0; i < 2; ++i) {
+        lSockets[i] = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in lAddr;
+        memset(&lAddr, 0, sizeof(lAddr));
+        lAddr.sin_family = AF_INET;
+        lAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        CPPUNIT_ASSERT_EQUAL(0, bind(lSockets[i], (struct sockaddr *)&lAddr, sizeof(lAddr)));
+        CPPUNIT_ASSERT_EQUAL(0, listen(lSockets[i], 16));
+        socklen_t lLen = sizeof(lAddr);
+        getsockname(lSockets[i], (struct sockaddr *)&lAddr, &lLen);
+        lDestinations[i] = "127.0.0.1:" + boost::lexical_cast<std::string>(ntohs(lAddr.sin_port));
+    }
+
+    RequestProcessor proc;
+    proc.setTimeout(200);
+    DupConf conf;
+    conf.currentApplicationScope = ApplicationScope::ALL;
+    for (int i = 0; i < 2; ++i) {
+        conf.currentDupDestination = lDestinations[i];
+        proc.addFilter("SID", "mySid", conf, tFilter::eFilterTypes::REGULAR);
+        proc.setDestinationDuplicationPercentage(conf, conf.currentDupDestination, 200);
+    }
+    tMultiCurl *multi = proc.initMultiCurl();
+    CPPUNIT_ASSERT(multi);
+    const bool stillRunning = true;
+
+    {
+        // One duplication in flight per destination: two rounds of timeouts
+        boost::shared_ptr<RequestInfo> ri(new RequestInfo("42", "/spp/main", "GET", "/spp/main", "SID=mySid"));
+        ri->mConf = &conf;
+        boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+        proc.runConcurrently(std::vector<boost::shared_ptr<RequestInfo> >(1, ri), *multi, 4, 1, boost::posix_time::ptime(), stillRunning);
+        long elapsed = (boost::posix_time::microsec_clock::universal_time() - start).total_milliseconds();
+        CPPUNIT_ASSERT(elapsed >= 350);
+        CPPUNIT_ASSERT(elapsed < 750);
+        CPPUNIT_ASSERT_EQUAL((unsigned int)4, proc.getDuplicatedCount());
+        CPPUNIT_ASSERT_EQUAL((unsigned int)4, proc.getTimeoutCount());
+        CPPUNIT_ASSERT_EQUAL((size_t)2, multi->mHandles.size());
+    }
+    {
+        // All of them at once: one round, the handles are kept for the next requests
+        boost::shared_ptr<RequestInfo> ri(new RequestInfo("43", "/spp/main", "GET", "/spp/main", "SID=mySid"));
+        ri->mConf = &conf;
+        boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+        proc.runConcurrently(std::vector<boost::shared_ptr<RequestInfo> >(1, ri), *multi, 4, 4, boost::posix_time::ptime(), stillRunning);
+        long elapsed = (boost::posix_time::microsec_clock::universal_time() - start).total_milliseconds();
+        CPPUNIT_ASSERT(elapsed >= 150);
+        CPPUNIT_ASSERT(elapsed < 350);
+        CPPUNIT_ASSERT_EQUAL((unsigned int)4, proc.getDuplicatedCount());
+        CPPUNIT_ASSERT_EQUAL((size_t)4, multi->mHandles.size());
+    }
+    delete multi;
+    close(lSockets[0]);
+    close(lSockets[1]);
+}
+
+void TestRequestProcessor::testDropCounts() {
+    RequestProcessor proc;
+    DupConf conf;
+    conf.currentApplicationScope = ApplicationScope::ALL;
+    conf.currentDupDestination = "Honolulu:8080";
+    proc.addFilter("SID", "mySid", conf, tFilter::eFilterTypes::REGULAR);
+    conf.currentDupDestination = "Papeete:8080";
+    proc.addFilter("SID", "mySid", conf, tFilter::eFilterTypes::REGULAR);
+    conf.setPriority(QueuePriority::LOW);
+
+    boost::shared_ptr<RequestInfo> ri(new RequestInfo("42", "/spp/main", "GET", "/spp/main", "SID=mySid"));
+    ri->mConf = &conf;
+    CPPUNIT_ASSERT_EQUAL(QueuePriority::LOW, proc.queuePriority(ri));
+    boost::shared_ptr<RequestInfo> logged(new RequestInfo("43", "/spp/main", "GET", "/spp/main", "SID=mySid"));
+    logged->mConf = &conf;
+    logged->mValidationHeaderDup = true;
+    CPPUNIT_ASSERT_EQUAL(QueuePriority::PROTECTED, proc.queuePriority(logged));
+    boost::shared_ptr<RequestInfo> noConf(new RequestInfo("44", "/spp/main", "GET", "/spp/main", "SID=mySid"));
+    CPPUNIT_ASSERT_EQUAL(QueuePriority::NORMAL, proc.queuePriority(noConf));
+
+    CPPUNIT_ASSERT_EQUAL(std::string("0/0/0 0/0"), proc.getDropCounts());
+    // Once for the location whatever its number of destinations
+    conf.dirName = const_cast<char *>("/spp");
+    proc.dropped(ri, DropReason::REFUSED);
+    proc.dropped(ri, DropReason::EVICTED);
+    proc.dropped(noConf, DropReason::REFUSED);
+    CPPUNIT_ASSERT_EQUAL(std::string("2/1/0 2/1 /spp:2"), proc.getDropCounts());
+    // Reset by the call
+    CPPUNIT_ASSERT_EQUAL(std::string("0/0/0 0/0"), proc.getDropCounts());
+    conf.dirName = NULL;
+}
+
+void TestRequestProcessor::testFilterStats() {
+    RequestProcessor proc;
+    DupConf conf;
+    conf.currentDupDestination = "Honolulu:8080";
+    conf.currentApplicationScope = ApplicationScope::QUERY_STRING;
+    proc.addFilter("INFO", "myinfo", conf, tFilter::eFilterTypes::REGULAR);
+    proc.addFilter("NO", "dup", conf, tFilter::eFilterTypes::PREVENT_DUPLICATION);
+    conf.currentApplicationScope = ApplicationScope::PATH;
+    proc.addRawFilter("^/match", conf, tFilter::eFilterTypes::REGULAR);
+
+    CPPUNIT_ASSERT_EQUAL(std::string("-"), proc.getFilterStats());
+    {
+        MAKE_REQ_INFO("42", "/match", "/other", "INFO=myinfo", conf, proc);
+        CPPUNIT_ASSERT_EQUAL(size_t(1), proc.processRequest(ri).size());
+    }
+    {
+        MAKE_REQ_INFO("43", "/match", "/other", "NO=dup&INFO=myinfo", conf, proc);
+        CPPUNIT_ASSERT(proc.processRequest(ri).empty());
+    }
+    {
+        MAKE_REQ_INFO("44", "/match", "/match/pws", "INFO=other", conf, proc);
+        CPPUNIT_ASSERT_EQUAL(size_t(1), proc.processRequest(ri).size());
+        // The early evaluations are not counted
+        CPPUNIT_ASSERT(proc.mayMatchFilters(ri, false));
+    }
+
+    std::vector<std::pair<std::string, tFilterCounters> > totals;
+    proc.mFilterProfiler.getTotals(totals);
+    CPPUNIT_ASSERT_EQUAL(size_t(3), totals.size());
+    CPPUNIT_ASSERT_EQUAL(std::string("INFO~myinfo@Honolulu:8080"), totals[0].first);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(2), totals[0].second.mEvaluations);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(1), totals[0].second.mMatches);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(0), totals[0].second.mPrevents);
+    CPPUNIT_ASSERT_EQUAL(std::string("!NO~dup@Honolulu:8080"), totals[1].first);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(1), totals[1].second.mEvaluations);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(0), totals[1].second.mMatches);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(1), totals[1].second.mPrevents);
+    CPPUNIT_ASSERT_EQUAL(std::string("*~^/match@Honolulu:8080"), totals[2].first);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(1), totals[2].second.mEvaluations);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(1), totals[2].second.mMatches);
+    CPPUNIT_ASSERT(totals[0].second.mNs > 0);
+
+    // Counted since the start, not reset by the call
+    const std::string stats = proc.getFilterStats();
+    CPPUNIT_ASSERT(stats.find("INFO~myinfo@Honolulu:8080=2/1/0/") != std::string::npos);
+    CPPUNIT_ASSERT(stats.find("!NO~dup@Honolulu:8080=1/0/1/") != std::string::npos);
+    CPPUNIT_ASSERT(stats.find("*~^/match@Honolulu:8080=1/1/0/") != std::string::npos);
+
+    // Recorded by another thread
+    boost::thread thread(boost::bind(&RequestProcessor::searchFilter, &proc,
+                                     boost::cref(proc.mCommands[&conf]["Honolulu:8080"].mRawFilters.front()),
+                                     std::string("/nomatch"), (boost::smatch *)NULL));
+    thread.join();
+    proc.mFilterProfiler.getTotals(totals);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(2), totals[2].second.mEvaluations);
+    CPPUNIT_ASSERT_EQUAL(uint64_t(1), totals[2].second.mMatches);
+
+    // The separators of the stats line are escaped in the labels
+    proc.addRawFilter("a b=100%", conf, tFilter::eFilterTypes::REGULAR);
+    proc.searchFilter(proc.mCommands[&conf]["Honolulu:8080"].mRawFilters.back(), std::string("/nomatch"), NULL);
+    CPPUNIT_ASSERT(proc.getFilterStats().find("*~a%20b%3D100%25@Honolulu:8080=1/0/0/") != std::string::npos);
+
+    // Published in the scoreboard by the manager of the pool, off the request path
+    CPPUNIT_ASSERT(proc.getScoreboard().create("mod_dup_test_filter_stats", 2));
+    CPPUNIT_ASSERT(proc.getScoreboard().claimSlot());
+    proc.onLoad(0, 0, 1);
+    tScoreboardTotals scoreboardTotals;
+    proc.getScoreboard().aggregate(scoreboardTotals);
+    CPPUNIT_ASSERT_EQUAL(size_t(4), scoreboardTotals.mFilters.size());
+    for (unsigned i = 0; i < scoreboardTotals.mFilters.size(); ++i) {
+        if (scoreboardTotals.mFilters[i].first == "*~^/match@Honolulu:8080") {
+            CPPUNIT_ASSERT_EQUAL(uint64_t(2), scoreboardTotals.mFilters[i].second.mEvaluations);
+            CPPUNIT_ASSERT_EQUAL(uint64_t(1), scoreboardTotals.mFilters[i].second.mMatches);
+        }
+    }
+    proc.getScoreboard().destroy();
+}
+
+void TestRequestProcessor::testFilterReorder() {
+    RequestProcessor proc;
+    DupConf conf;
+    conf.currentDupDestination = "Honolulu:8080";
+    conf.currentApplicationScope = ApplicationScope::PATH;
+    conf.setCurrentDuplicationType(DuplicationType::HEADER_ONLY);
+    proc.addRawFilter("never", conf, tFilter::eFilterTypes::REGULAR);
+    proc.addRawFilter("^/never", conf, tFilter::eFilterTypes::PREVENT_DUPLICATION);
+    proc.addRawFilter("^/match", conf, tFilter::eFilterTypes::REGULAR);
+    conf.setCurrentDuplicationType(DuplicationType::COMPLETE_REQUEST);
+    proc.addRawFilter("pws", conf, tFilter::eFilterTypes::REGULAR);
+    const Commands &commands = proc.mCommands[&conf]["Honolulu:8080"];
+    const tFilter &never = commands.mRawFilters.front();
+    const tFilter &match = *std::next(commands.mRawFilters.begin(), 2);
+    const tFilter &pws = commands.mRawFilters.back();
+
+    // Configuration order by default
+    for (int i = 0; i < 2000; ++i) {
+        MAKE_REQ_INFO("42", "/match", "/match/pws", "", conf, proc);
+        CPPUNIT_ASSERT_EQUAL(size_t(1), proc.processRequest(ri).size());
+    }
+    proc.refreshFilters();
+    CPPUNIT_ASSERT(!commands.mRawFilterOrder);
+
+    // Then in the order computed by the manager of the pool, the configuration order until then
+    conf.reorderFilters = true;
+    std::vector<std::pair<std::string, tFilterCounters> > totals;
+    proc.mFilterProfiler.getTotals(totals);
+    const uint64_t neverEvaluations = totals[never.mProfileIndex].second.mEvaluations;
+    {
+        MAKE_REQ_INFO("42", "/match", "/match/pws", "", conf, proc);
+        CPPUNIT_ASSERT_EQUAL(size_t(1), proc.processRequest(ri).size());
+    }
+    CPPUNIT_ASSERT(!commands.mRawFilterOrder);
+    proc.refreshFilters();
+    {
+        MAKE_REQ_INFO("42", "/match", "/match/pws", "", conf, proc);
+        std::list<const tFilter *> matched = proc.processRequest(ri);
+        CPPUNIT_ASSERT_EQUAL(size_t(1), matched.size());
+        CPPUNIT_ASSERT_EQUAL(&match, matched.front());
+    }
+    // The filter which never matches goes after the one which always does, but not after one of another type
+    CPPUNIT_ASSERT(commands.mRawFilterOrder);
+    CPPUNIT_ASSERT_EQUAL(size_t(3), commands.mRawFilterOrder->size());
+    CPPUNIT_ASSERT_EQUAL(&match, (*commands.mRawFilterOrder)[0]);
+    CPPUNIT_ASSERT_EQUAL(&never, (*commands.mRawFilterOrder)[1]);
+    CPPUNIT_ASSERT_EQUAL(&pws, (*commands.mRawFilterOrder)[2]);
+    proc.mFilterProfiler.getTotals(totals);
+    CPPUNIT_ASSERT_EQUAL(neverEvaluations + 1, totals[never.mProfileIndex].second.mEvaluations);
+
+    // The prevent filters still apply
+    {
+        MAKE_REQ_INFO("42", "/match", "/never/pws", "", conf, proc);
+        CPPUNIT_ASSERT(proc.processRequest(ri).empty());
+    }
+    // The requests logging their duplication keep the configuration order
+    {
+        MAKE_REQ_INFO("42", "/match", "/match/pws", "", conf, proc);
+        ri.mValidationHeaderDup = true;
+        proc.mFilterProfiler.getTotals(totals);
+        const uint64_t neverBefore = totals[never.mProfileIndex].second.mEvaluations;
+        proc.processRequest(ri);
+        proc.mFilterProfiler.getTotals(totals);
+        CPPUNIT_ASSERT_EQUAL(neverBefore + 1, totals[never.mProfileIndex].second.mEvaluations);
+    }
+
+    // The order follows the recent requests, not the totals since the start
+    for (int i = 0; i < 20; ++i) {
+        for (int j = 0; j < 100; ++j) {
+            MAKE_REQ_INFO("42", "/match", "/other/never/pws", "", conf, proc);
+            CPPUNIT_ASSERT_EQUAL(size_t(1), proc.processRequest(ri).size());
+        }
+        proc.refreshFilters();
+    }
+    CPPUNIT_ASSERT_EQUAL(&never, (*commands.mRawFilterOrder)[0]);
+    CPPUNIT_ASSERT_EQUAL(&match, (*commands.mRawFilterOrder)[1]);
+    proc.mFilterProfiler.getTotals(totals);
+    CPPUNIT_ASSERT(totals[match.mProfileIndex].second.mMatches > totals[never.mProfileIndex].second.mMatches);
+}
+
+void TestRequestProcessor::testErrorLogSampling() {
+    RequestProcessor proc;
+    DupConf conf;
+    conf.currentDupDestination = "Honolulu:8080";
+    conf.currentApplicationScope = ApplicationScope::PATH;
+    proc.addRawFilter("^/match", conf, tFilter::eFilterTypes::REGULAR);
+    const tFilter &filter = proc.mCommands[&conf]["Honolulu:8080"].mRawFilters.front();
+
+    // Everything is logged by default
+    proc.logFailure(filter, "/match", std::string(4096, 'x'), 0, 500);
+    proc.logFailure(filter, "/match", "", 28, 0);
+    CPPUNIT_ASSERT_EQUAL(std::string("-"), proc.getErrorLogSkips());
+
+    // The first failure of a destination, then one out of three
+    proc.setErrorLog(16, 3);
+    for (int i = 0; i < 5; ++i) {
+        proc.logFailure(filter, "/match", "body", 0, 500);
+    }
+    proc.logFailure(filter, "/match", "body", 28, 0);
+    CPPUNIT_ASSERT_EQUAL(std::string("curl28@Honolulu:8080=1 http500@Honolulu:8080=3"), proc.getErrorLogSkips());
+    // Reset once read
+    CPPUNIT_ASSERT_EQUAL(std::string("-"), proc.getErrorLogSkips());
+
+    // A sampling of 0 logs everything
+    proc.setErrorLog(16, 0);
+    proc.logFailure(filter, "/match", "body", 0, 500);
+    CPPUNIT_ASSERT_EQUAL(std::string("-"), proc.getErrorLogSkips());
+
+    // Only the match is logged, bounded as the body
+    conf.setErrorLogBodyMatch("<error>.*</error>");
+    proc.addRawFilter("^/error", conf, tFilter::eFilterTypes::REGULAR);
+    const tFilter &matching = proc.mCommands[&conf]["Honolulu:8080"].mRawFilters.back();
+    CPPUNIT_ASSERT(!matching.mErrorLogBodyMatch.empty());
+    const std::string path = "/tmp/mod_dup_test_error_log.log";
+    unlink(path.c_str());
+    CPPUNIT_ASSERT_EQUAL(std::string(), Log::setAsync("file:" + path, 8, 0));
+    Log::startAsync();
+    proc.logFailure(matching, "/error", "<a><error>x</error></a>", 0, 500);
+    proc.logFailure(matching, "/error", "<a><error>" + std::string(64, 'x') + "</error></a>", 0, 500);
+    proc.logFailure(matching, "/error", "<a>nomatch</a>", 0, 500);
+    Log::stopAsync();
+
+    std::ifstream file(path.c_str());
+    std::stringstream logged;
+    logged << file.rdbuf();
+    CPPUNIT_ASSERT(logged.str().find("matched body (16 bytes): <error>x</error>\n") != std::string::npos);
+    CPPUNIT_ASSERT(logged.str().find("truncated matched body (79 bytes): <error>xxxxxxxxx\n") != std::string::npos);
+    CPPUNIT_ASSERT(logged.str().find(", body (14 bytes): <a>nomatch</a>\n") != std::string::npos);
+}
+
+void TestRequestProcessor::testKeyIndex() {
+    tKeyIndex<int> index;
+    CPPUNIT_ASSERT(!index.count("A"));
+
+    // The values of a key stay together, in insertion order, whatever the case of the key
+    index.insert("INFO", 1);
+    index.insert("other", 2);
+    index.insert("Info", 3);
+    for (int i = 0; i < 100; ++i) {
+        index.insert("KEY" + boost::lexical_cast<std::string>(i), 100 + i);
+    }
+    tKeyIndex<int>::tRange range = index.equal_range("info");
+    CPPUNIT_ASSERT_EQUAL(2, int(range.second - range.first));
+    CPPUNIT_ASSERT_EQUAL(1, range.first->second);
+    CPPUNIT_ASSERT_EQUAL(3, (range.first + 1)->second);
+    range = index.equal_range("OTHERS", 5);
+    CPPUNIT_ASSERT_EQUAL(1, int(range.second - range.first));
+    CPPUNIT_ASSERT_EQUAL(2, range.first->second);
+    for (int i = 0; i < 100; ++i) {
+        range = index.equal_range("key" + boost::lexical_cast<std::string>(i));
+        CPPUNIT_ASSERT_EQUAL(1, int(range.second - range.first));
+        CPPUNIT_ASSERT_EQUAL(100 + i, range.first->second);
+    }
+    CPPUNIT_ASSERT(!index.count("KEY100"));
+    CPPUNIT_ASSERT(!index.count("INF"));
+    CPPUNIT_ASSERT_EQUAL(size_t(103), index.size());
+
+    // Header substitutions apply whatever the case of the header
+    RequestProcessor proc;
+    DupConf conf;
+    conf.currentDupDestination = "Honolulu:8080";
+    conf.currentApplicationScope = ApplicationScope::HEADERS;
+    proc.addSubstitution("x-token", "[0-9]", "X", conf);
+    tHeaders headers;
+    headers.push_back("X-Token", "a1b2");
+    tSubstitutionScratch scratch;
+    const tSubstitutionProgram &program = proc.mCommands[&conf]["Honolulu:8080"].mHeadersSubstitutions;
+    CPPUNIT_ASSERT(program.matches(headers));
+    CPPUNIT_ASSERT(program.run(headers, scratch));
+    CPPUNIT_ASSERT_EQUAL(std::string("aXbX"), headers.value(0).to_string());
+}
+
+void TestRequestProcessor::testRequestArena() {
+    RequestArena *arena = RequestArena::acquire();
+    // Aligned, and in new blocks once the first is full
+    char *small = static_cast<char *>(arena->allocate(1, 1));
+    void *aligned = arena->allocate(8, 8);
+    CPPUNIT_ASSERT_EQUAL(uintptr_t(0), reinterpret_cast<uintptr_t>(aligned) % 8);
+    CPPUNIT_ASSERT(small != aligned);
+    const size_t big = 4 * RequestArena::recentSize();
+    memset(arena->allocate(big, 16), 'x', big);
+    CPPUNIT_ASSERT(arena->used() >= big + 9);
+    // Reset with a first block where it all fits
+    arena->reset();
+    CPPUNIT_ASSERT_EQUAL(size_t(0), arena->used());
+    char *first = static_cast<char *>(arena->allocate(1, 1));
+    CPPUNIT_ASSERT(static_cast<char *>(arena->allocate(big, 1)) == first + 1);
+    RequestArena::release(arena);
+
+    // The containers of a request use its arena, their copies the heap
+    tHeaders copy;
+    {
+        RequestInfo info("42", "/conf", "GET", "/path", "a=b&c=d");
+        CPPUNIT_ASSERT(info.mArena.get());
+        CPPUNIT_ASSERT(info.mHeadersIn.get_allocator().arena() == info.mArena.get());
+        for (int i = 0; i < 100; ++i) {
+            info.mHeadersIn.push_back("Header", "value");
+        }
+        RequestProcessor::parseArgs(info.mParsedArgs, info.mArgs);
+        CPPUNIT_ASSERT_EQUAL(size_t(2), info.mParsedArgs.size());
+        CPPUNIT_ASSERT(info.mArena.get()->used() > 100 * sizeof("value"));
+        copy = info.mHeadersIn;
+        RequestInfo other(info);
+        CPPUNIT_ASSERT(!other.mArena.get());
+        CPPUNIT_ASSERT(!other.mHeadersIn.get_allocator().arena());
+        CPPUNIT_ASSERT_EQUAL(size_t(100), other.mHeadersIn.size());
+    }
+    CPPUNIT_ASSERT(!copy.get_allocator().arena());
+    CPPUNIT_ASSERT_EQUAL(size_t(100), copy.size());
+    CPPUNIT_ASSERT_EQUAL(std::string("value"), copy.value(99).to_string());
+}
+
+void TestRequestProcessor::testHeaders() {
+    // Well-known names are interned whatever their case, and only copied if not spelled the usual way
+    tHeaders headers;
+    headers.push_back("Content-Type", "text/plain");
+    CPPUNIT_ASSERT_EQUAL(HeaderName::CONTENT_TYPE, headers.id(0));
+    CPPUNIT_ASSERT_EQUAL(std::string("text/plain").size(), headers.bytes());
+    headers.push_back("x-dup-count", "1");
+    CPPUNIT_ASSERT_EQUAL(HeaderName::X_DUP_COUNT, headers.id(1));
+    CPPUNIT_ASSERT_EQUAL(std::string("x-dup-count"), headers.name(1).to_string());
+    headers.push_back("X-Custom", "a");
+    headers.push_back("x-custom", "b");
+    CPPUNIT_ASSERT_EQUAL(HeaderName::OTHER, headers.id(2));
+    CPPUNIT_ASSERT_EQUAL(size_t(4), headers.size());
+
+    // Found by id or by name, case insensitive, the first one
+    CPPUNIT_ASSERT_EQUAL(size_t(1), headers.find(HeaderName::X_DUP_COUNT));
+    CPPUNIT_ASSERT_EQUAL(size_t(1), headers.find("X-DUP-COUNT"));
+    CPPUNIT_ASSERT_EQUAL(size_t(2), headers.find("X-CUSTOM"));
+    CPPUNIT_ASSERT_EQUAL(tHeaders::npos, headers.find(HeaderName::HOST));
+    CPPUNIT_ASSERT_EQUAL(tHeaders::npos, headers.find("X-Other"));
+
+    // A value can be replaced by a part of the buffer itself
+    headers.setValue(0, headers.value(0).substr(5));
+    CPPUNIT_ASSERT_EQUAL(std::string("plain"), headers.value(0).to_string());
+    CPPUNIT_ASSERT_EQUAL(std::string("Content-Type: plainx-dup-count: 1X-Custom: ax-custom: b"), RequestInfo::flatten(headers));
+
+    // In the map the last value of a name wins
+    RequestInfo::mapStr map;
+    headers.toMap(map);
+    CPPUNIT_ASSERT_EQUAL(size_t(4), map.size());
+    CPPUNIT_ASSERT_EQUAL(std::string("plain"), map["Content-Type"]);
+
+    // The request headers are archived as a map
+    RequestInfo::mapStr reqHeader;
+    reqHeader["ELAPSED_TIME_BY_DUP"] = "12";
+    RequestInfo request(reqHeader, "body", RequestInfo::mapStr(), "", RequestInfo::mapStr(), "");
+    std::stringstream archive;
+    {
+        boost::archive::text_oarchive oa(archive);
+        oa << request;
+    }
+    RequestInfo loaded;
+    {
+        boost::archive::text_iarchive ia(archive);
+        ia >> loaded;
+    }
+    CPPUNIT_ASSERT_EQUAL(size_t(1), loaded.mReqHeader.size());
+    CPPUNIT_ASSERT_EQUAL(HeaderName::ELAPSED_TIME_BY_DUP, loaded.mReqHeader.id(0));
+    CPPUNIT_ASSERT_EQUAL(std::string("12"), loaded.mReqHeader.value(0).to_string());
+    CPPUNIT_ASSERT_EQUAL(std::string("body"), loaded.mReqBody);
+}
+
+void TestRequestProcessor::testCurlHeaders() {
+    RequestInfo ri("42", "/conf", "GET", "/path", "");
+    ri.mHeadersIn.push_back("Host", "localhost");
+    ri.mHeadersIn.push_back("X-Custom", "a");
+    ri.mHeadersIn.push_back("Content-Type", "text/plain");
+    ri.mHeadersIn.push_back("x-custom", "b");
+    ri.mHeadersIn.push_back("expect", "100-continue");
+    ri.mHeadersIn.push_back("X_DUP_LOG", "ON");
+
+    tCurlHeaders headers;
+    headers.reserve(ri.mHeadersIn.size(), ri.mHeadersIn.bytes());
+    // The headers common to all the duplications are there without being added
+    CPPUNIT_ASSERT(headers.has(HeaderName::EXPECT));
+    CPPUNIT_ASSERT(!headers.has(HeaderName::CONTENT_TYPE));
+    headers.add(HeaderName::CONTENT_TYPE, "application/x-dup-serialized");
+    RequestProcessor::addOrigHeaders(RequestOverlay(ri), headers);
+    CPPUNIT_ASSERT_EQUAL(size_t(3), headers.size());
+
+    // Host, the second X-Custom, the Content-Type and Expect already there are skipped
+    std::vector<std::string> lines;
+    for (curl_slist *node = headers.list(); node; node = node->next) {
+        lines.push_back(node->data);
+    }
+    CPPUNIT_ASSERT_EQUAL(size_t(6), lines.size());
+    CPPUNIT_ASSERT_EQUAL(std::string("Content-Type: application/x-dup-serialized"), lines[0]);
+    CPPUNIT_ASSERT_EQUAL(std::string("X-Custom: a"), lines[1]);
+    CPPUNIT_ASSERT_EQUAL(std::string("X_DUP_LOG: ON"), lines[2]);
+    CPPUNIT_ASSERT_EQUAL(std::string("Expect:"), lines[3]);
+    CPPUNIT_ASSERT_EQUAL(std::string("X-DUPLICATED-REQUEST: 1"), lines[4]);
+    CPPUNIT_ASSERT_EQUAL(std::string("User-RealAgent: mod-dup"), lines[5]);
+
+    // Cleared for the next duplication, the common headers only
+    headers.clear();
+    CPPUNIT_ASSERT(!headers.has(HeaderName::CONTENT_TYPE));
+    CPPUNIT_ASSERT_EQUAL(std::string("Expect:"), std::string(headers.list()->data));
+}
+
 int main(int argc, char* argv[])
 {
     Log::init();
@@ -44,6 +44,21 @@ class TestRequestProcessor :
     CPPUNIT_TEST(testTimeout);
     CPPUNIT_TEST(testMultiDestination);
     CPPUNIT_TEST(testPerformCurlCall);
+    CPPUNIT_TEST(testMayMatchFilters);
+    CPPUNIT_TEST(testSubstitutionOverlay);
+    CPPUNIT_TEST(testSubstitutionProgram);
+    CPPUNIT_TEST(testRunSync);
+    CPPUNIT_TEST(testRunSyncNoTimeout);
+    CPPUNIT_TEST(testConcurrentSends);
+    CPPUNIT_TEST(testDropCounts);
+    CPPUNIT_TEST(testFilterStats);
+    CPPUNIT_TEST(testFilterReorder);
+    CPPUNIT_TEST(testErrorLogSampling);
+    CPPUNIT_TEST(testKeyIndex);
+    CPPUNIT_TEST(testRequestArena);
+    CPPUNIT_TEST(testHeaders);
+    CPPUNIT_TEST(testCurlHeaders);
+    CPPUNIT_TEST(testResolve);
     CPPUNIT_TEST_SUITE_END();
 
 public:
@@ -77,4 +92,73 @@ public:
      */
     void testMultiDestination();
 
+    /**
+     * @brief Tests the early filter evaluation done before the bodies are buffered
+     */
+    void testMayMatchFilters();
+
+    /**
+     * @brief Tests that substitutions leave the original request untouched and only hold the rewritten fields
+     */
+    void testSubstitutionOverlay();
+
+    /**
+     * @brief Tests the compiled substitutions of a field
+     */
+    void testSubstitutionProgram();
+
+    /**
+     * @brief Tests that the synchronous duplications run concurrently under one deadline
+     */
+    void testRunSync();
+
+    /**
+     * @brief Tests that the synchronous duplications wait for the answers when there is no timeout
+     */
+    void testRunSyncNoTimeout();
+
+    /**
+     * @brief Tests the caps on the duplications of a request sent at once
+     */
+    void testConcurrentSends();
+
+    /**
+     * @brief Tests the priority of the queued requests and the accounting of the dropped ones
+     */
+    void testDropCounts();
+
+    /**
+     * @brief Tests the evaluations, matches and prevents counted per filter
+     */
+    void testFilterStats();
+
+    /**
+     * @brief Tests the order of the raw filters adapted to their cost and selectivity
+     */
+    void testFilterReorder();
+
+    /**
+     * @brief Tests the sampling of the logs of the failed duplications
+     */
+    void testErrorLogSampling();
+
+    /**
+     * @brief Tests the case insensitive index of the filters and substitutions
+     */
+    void testKeyIndex();
+
+    /**
+     * @brief Tests the arena backing the containers of the requests
+     */
+    void testRequestArena();
+
+    void testHeaders();
+
+    void testCurlHeaders();
+
+    /**
+     * @brief Tests the destination names pinned to an address
+     */
+    void testResolve();
+
 };
@@ -0,0 +1,123 @@
+/*
+* mod_dup - duplicates apache requests
+* 
+* Copyright (C) 2013 Orange
+* 
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*     http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*/
+
+#include "RetryQueue.hh"
+#include "testRetryQueue.hh"
+
+// cppunit
+#include <cppunit/extensions/TestFactoryRegistry.h>
+#include <cppunit/ui/text/TestRunner.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+CPPUNIT_TEST_SUITE_REGISTRATION( TestRetryQueue );
+
+#define CPPUNIT_ASSERT_EQUAL_UINT(a, b) CPPUNIT_ASSERT_EQUAL(static_cast<unsigned int>(a), static_cast<unsigned int>(b))
+
+using namespace DupModule;
+
+static tRetryItem makeItem(const std::string &pId)
+{
+    tRetryItem lItem;
+    lItem.mRequest.reset(new RequestOverlay(boost::shared_ptr<const RequestInfo>(new RequestInfo(pId, 0))));
+    return lItem;
+}
+
+void TestRetryQueue::testBudget()
+{
+    unsigned lScheduled, lAbandoned;
+    RetryQueue queue;
+    CPPUNIT_ASSERT(!queue.isEnabled());
+
+    queue.setRetries(3, 10000, 1);
+    queue.setShare(10);
+    CPPUNIT_ASSERT(queue.isEnabled());
+
+    // No fresh duplication yet, no budget
+    CPPUNIT_ASSERT(!queue.schedule(makeItem("1")));
+
+    // 10% of 25 duplications: 2 retries
+    for (int i = 0; i < 25; ++i) {
+        queue.earn();
+    }
+    CPPUNIT_ASSERT(queue.schedule(makeItem("2")));
+    CPPUNIT_ASSERT(queue.schedule(makeItem("3")));
+    CPPUNIT_ASSERT(!queue.schedule(makeItem("4")));
+    CPPUNIT_ASSERT_EQUAL_UINT(2, queue.size());
+
+    queue.getCounters(lScheduled, lAbandoned);
+    CPPUNIT_ASSERT_EQUAL_UINT(2, lScheduled);
+    CPPUNIT_ASSERT_EQUAL_UINT(2, lAbandoned);
+    // Counters are reset
+    queue.getCounters(lScheduled, lAbandoned);
+    CPPUNIT_ASSERT_EQUAL_UINT(0, lScheduled);
+    CPPUNIT_ASSERT_EQUAL_UINT(0, lAbandoned);
+}
+
+void TestRetryQueue::testAttempts()
+{
+    RetryQueue queue;
+    queue.setRetries(2, 10000, 1);
+    queue.setShare(100);
+    for (int i = 0; i < 10; ++i) {
+        queue.earn();
+    }
+
+    tRetryItem lItem = makeItem("1");
+    CPPUNIT_ASSERT(queue.schedule(lItem));
+    CPPUNIT_ASSERT(queue.pop(lItem));
+    CPPUNIT_ASSERT_EQUAL_UINT(1, lItem.mAttempts);
+    CPPUNIT_ASSERT(!lItem.mDeadline.is_not_a_date_time());
+    CPPUNIT_ASSERT(queue.schedule(lItem));
+    CPPUNIT_ASSERT(queue.pop(lItem));
+    CPPUNIT_ASSERT_EQUAL_UINT(2, lItem.mAttempts);
+    // Maximum attempts reached
+    CPPUNIT_ASSERT(!queue.schedule(lItem));
+
+    // The backoff, at least half the base delay, would miss the deadline
+    queue.setRetries(10, 40, 100);
+    CPPUNIT_ASSERT(!queue.schedule(makeItem("2")));
+    CPPUNIT_ASSERT_EQUAL_UINT(0, queue.size());
+}
+
+void TestRetryQueue::testOrdering()
+{
+    RetryQueue queue;
+    queue.setShare(100);
+    for (int i = 0; i < 10; ++i) {
+        queue.earn();
+    }
+
+    // A late one first, then an early one
+    queue.setRetries(1, 10000, 200);
+    CPPUNIT_ASSERT(queue.schedule(makeItem("late")));
+    queue.setRetries(1, 10000, 2);
+    CPPUNIT_ASSERT(queue.schedule(makeItem("early")));
+
+    tRetryItem lItem;
+    CPPUNIT_ASSERT(queue.pop(lItem));
+    CPPUNIT_ASSERT_EQUAL(std::string("early"), lItem.mRequest->base().mId);
+    CPPUNIT_ASSERT(queue.pop(lItem));
+    CPPUNIT_ASSERT_EQUAL(std::string("late"), lItem.mRequest->base().mId);
+
+    // Stop releases a blocked popper
+    boost::thread lPopper(boost::bind(&RetryQueue::pop, &queue, boost::ref(lItem)));
+    usleep(10000);
+    queue.stop();
+    CPPUNIT_ASSERT(lPopper.timed_join(boost::posix_time::seconds(1)));
+    CPPUNIT_ASSERT(!queue.schedule(makeItem("stopped")));
+}
@@ -97,6 +97,44 @@ void TestThreadPool::run()
     CPPUNIT_ASSERT((pt::microsec_clock::universal_time() - lBefore).total_microseconds() < 1000000 );
 }
 
+void TestThreadPool::burst()
+{
+    ThreadPool<int> pool(&worker, POISON);
+    // Room for the whole burst in the queue
+    pool.setQueue(1, 25);
+    pool.setThreads(1, 8);
+    pool.start();
+    // Let the manager settle on a single thread
+    usleep(150000);
+    CPPUNIT_ASSERT_EQUAL_UINT(1, pool.getThreadCount());
+
+    {
+        boost::mutex::scoped_lock lock( mutex );
+        count = 0;
+    }
+    // 2 seconds worth of work for a single thread
+    for (int i=0; i<200; ++i)
+        pool.push(10000);
+
+    // Well below the manage interval, all the threads were started at once
+    usleep(30000);
+    CPPUNIT_ASSERT_EQUAL_UINT(8, pool.getThreadCount());
+    tPoolStats stats = pool.getStats();
+    CPPUNIT_ASSERT(stats.mSpikes >= 1);
+    CPPUNIT_ASSERT_EQUAL_UINT(7, stats.mThreadsStarted);
+    CPPUNIT_ASSERT_EQUAL_UINT(8, stats.mTargetThreads);
+
+    // 250ms of work with 8 threads, then the pool winds down
+    usleep(1500000);
+    CPPUNIT_ASSERT_EQUAL(200, count);
+    CPPUNIT_ASSERT_EQUAL_UINT(1, pool.getThreadCount());
+    stats = pool.getStats();
+    CPPUNIT_ASSERT(stats.mMeanServiceUs >= 9000);
+    CPPUNIT_ASSERT(stats.mMeanServiceUs < 50000);
+    CPPUNIT_ASSERT_EQUAL_UINT(7, stats.mThreadsStopped);
+    pool.stop();
+}
+
 #ifdef UNIT_TESTING
 //--------------------------------------
 // the main method
@@ -30,8 +30,14 @@ class TestThreadPool :
 
     CPPUNIT_TEST_SUITE(TestThreadPool);
     CPPUNIT_TEST(run);
+    CPPUNIT_TEST(burst);
     CPPUNIT_TEST_SUITE_END();
 
 public:
     void run();
+
+    /**
+     * @brief Tests that a burst of pushes gets its threads at once, without waiting for the manage interval
+     */
+    void burst();
 };
@@ -16,6 +16,12 @@
 * limitations under the License.
 */
 
+#include <httpd.h>
+// Work-around boost::chrono 1.53 conflict on CR typedef vs define in apache
+#undef CR
+#include <vector>
+#include <boost/foreach.hpp>
+#include <boost/algorithm/string/replace.hpp>
 #include <boost/scoped_ptr.hpp>
 
 #include "UrlCodec.hh"
@@ -33,30 +39,24 @@ using namespace DupModule;
 
 void TestUrlCodec::testUrlCodec()
 {
-    apr_pool_t *lPool = 0;
-    apr_pool_create(&lPool, NULL);
-
     boost::scoped_ptr<const IUrlCodec> urlCodec(getUrlCodec());
     CPPUNIT_ASSERT(urlCodec.get() != NULL);
     CPPUNIT_ASSERT_EQUAL(std::string(" "), urlCodec->decode("%20"));
-    CPPUNIT_ASSERT_EQUAL(std::string("%20"), urlCodec->encode(lPool, " "));
+    CPPUNIT_ASSERT_EQUAL(std::string("%20"), urlCodec->encode(" "));
 }
 
 void TestUrlCodec::testApacheCodec()
 {
-    apr_pool_t *lPool;
-    apr_pool_create(&lPool, 0);
-
 	boost::scoped_ptr<const IUrlCodec> urlCodec(getUrlCodec("apache"));
 	CPPUNIT_ASSERT(urlCodec.get() != NULL);
     CPPUNIT_ASSERT_EQUAL(std::string(" "), urlCodec->decode("%20"));
-    CPPUNIT_ASSERT_EQUAL(std::string("%20"), urlCodec->encode(lPool, " "));
+    CPPUNIT_ASSERT_EQUAL(std::string("%20"), urlCodec->encode(" "));
 
 	// Non-encoded characters:
 	CPPUNIT_ASSERT_EQUAL(std::string("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_.~"),
 			urlCodec->decode("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_.~"));
 	CPPUNIT_ASSERT_EQUAL(std::string("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_.~"),
-			urlCodec->encode(lPool, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_.~"));
+			urlCodec->encode("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_.~"));
 
 	CPPUNIT_ASSERT_EQUAL(std::string("!#$&'()*+,/:;=?@[]"),urlCodec->decode("%21%23%24%26%27%28%29%2A%2B%2C%2F%3A%3B%3D%3F%40%5B%5D"));
 
@@ -64,7 +64,7 @@ void TestUrlCodec::testApacheCodec()
 	CPPUNIT_ASSERT_EQUAL(std::string("!#$&'()*+,/:;=?@[]"),urlCodec->decode("%21%23%24%26%27%28%29%2a%2b%2c%2f%3a%3b%3d%3f%40%5b%5d"));
 
 	// We do not encode: !$&'()*+,:=@
-	CPPUNIT_ASSERT_EQUAL(std::string("!%23$&'()*+,%2f:%3b=%3f@%5b%5d"), urlCodec->encode(lPool, "!#$&'()*+,/:;=?@[]"));
+	CPPUNIT_ASSERT_EQUAL(std::string("!%23$&'()*+,%2f:%3b=%3f@%5b%5d"), urlCodec->encode("!#$&'()*+,/:;=?@[]"));
 
 	CPPUNIT_ASSERT_EQUAL(std::string(" \"%-.<>\\^_`{|}~"),urlCodec->decode("%20%22%25%2D%2E%3C%3E%5C%5E%5F%60%7B%7C%7D%7E"));
 
@@ -72,28 +72,25 @@ void TestUrlCodec::testApacheCodec()
 	CPPUNIT_ASSERT_EQUAL(std::string(" \"%-.<>\\^_`{|}~"),urlCodec->decode("%20%22%25%2d%2e%3c%3e%5c%5e%5f%60%7b%7c%7d%7e"));
 
 	// We do not encode: -._~
-	CPPUNIT_ASSERT_EQUAL(std::string("%20%22%25-.%3c%3e%5c%5e_%60%7b%7c%7d~"), urlCodec->encode(lPool, " \"%-.<>\\^_`{|}~"));
+	CPPUNIT_ASSERT_EQUAL(std::string("%20%22%25-.%3c%3e%5c%5e_%60%7b%7c%7d~"), urlCodec->encode(" \"%-.<>\\^_`{|}~"));
 
 	// Make sure it's symetric
 	CPPUNIT_ASSERT_EQUAL(std::string("!#$&'()*+,/:;=?@[] \"%-.<>\\^_`{|}~"),
-			urlCodec->decode(urlCodec->encode(lPool, "!#$&'()*+,/:;=?@[] \"%-.<>\\^_`{|}~")));
+			urlCodec->decode(urlCodec->encode("!#$&'()*+,/:;=?@[] \"%-.<>\\^_`{|}~")));
 }
 
 void TestUrlCodec::testDefaultCodec()
 {
-    apr_pool_t *lPool;
-    apr_pool_create(&lPool, 0);
-
 	boost::scoped_ptr<const IUrlCodec> urlCodec(getUrlCodec("default"));
 	CPPUNIT_ASSERT(urlCodec.get() != NULL);
     CPPUNIT_ASSERT_EQUAL(std::string(" "), urlCodec->decode("%20"));
-    CPPUNIT_ASSERT_EQUAL(std::string("%20"), urlCodec->encode(lPool, " "));
+    CPPUNIT_ASSERT_EQUAL(std::string("%20"), urlCodec->encode(" "));
 
 	// Non-encoded characters:
 	CPPUNIT_ASSERT_EQUAL(std::string("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_.~"),
 			urlCodec->decode("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_.~"));
 	CPPUNIT_ASSERT_EQUAL(std::string("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_.~"),
-			urlCodec->encode(lPool, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_.~"));
+			urlCodec->encode("ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_.~"));
 
 	CPPUNIT_ASSERT_EQUAL(std::string("!#$&'()*+,/:;=?@[]"),urlCodec->decode("%21%23%24%26%27%28%29%2A%2B%2C%2F%3A%3B%3D%3F%40%5B%5D"));
 
@@ -101,7 +98,7 @@ void TestUrlCodec::testDefaultCodec()
 	CPPUNIT_ASSERT_EQUAL(std::string("!#$&'()*+,/:;=?@[]"),urlCodec->decode("%21%23%24%26%27%28%29%2a%2b%2c%2f%3a%3b%3d%3f%40%5b%5d"));
 
 	// We do not encode: !$&'()*,:=@
-	CPPUNIT_ASSERT_EQUAL(std::string("!%23$&'()*%2b,%2f:%3b=%3f@%5b%5d"), urlCodec->encode(lPool, "!#$&'()*+,/:;=?@[]"));
+	CPPUNIT_ASSERT_EQUAL(std::string("!%23$&'()*%2b,%2f:%3b=%3f@%5b%5d"), urlCodec->encode("!#$&'()*+,/:;=?@[]"));
 
 	CPPUNIT_ASSERT_EQUAL(std::string(" \"%-.<>\\^_`{|}~"),urlCodec->decode("%20%22%25%2D%2E%3C%3E%5C%5E%5F%60%7B%7C%7D%7E"));
 
@@ -109,9 +106,85 @@ void TestUrlCodec::testDefaultCodec()
 	CPPUNIT_ASSERT_EQUAL(std::string(" \"%-.<>\\^_`{|}~"),urlCodec->decode("%20%22%25%2d%2e%3c%3e%5c%5e%5f%60%7b%7c%7d%7e"));
 
 	// We do not encode: -._~
-	CPPUNIT_ASSERT_EQUAL(std::string("%20%22%25-.%3c%3e%5c%5e_%60%7b%7c%7d~"), urlCodec->encode(lPool, " \"%-.<>\\^_`{|}~"));
+	CPPUNIT_ASSERT_EQUAL(std::string("%20%22%25-.%3c%3e%5c%5e_%60%7b%7c%7d~"), urlCodec->encode(" \"%-.<>\\^_`{|}~"));
 
 	// Make sure it's symetric
 	CPPUNIT_ASSERT_EQUAL(std::string("!#$&'()*+,/:;=?@[] \"%-.<>\\^_`{|}~"),
-			urlCodec->decode(urlCodec->encode(lPool, "!#$&'()*+,/:;=?@[] \"%-.<>\\^_`{|}~")));
+			urlCodec->decode(urlCodec->encode("!#$&'()*+,/:;=?@[] \"%-.<>\\^_`{|}~")));
+}
+
+namespace {
+
+// The default codec as it was implemented with the apache functions, for reference
+std::string legacyDecode(const std::string &pIn)
+{
+    std::string preDecoded = boost::replace_all_copy(pIn, "+", " ");
+    char *lBuffer = new char[preDecoded.size()+1];
+    strncpy(lBuffer, preDecoded.c_str(), preDecoded.size()+1);
+    ap_unescape_url(lBuffer);
+    std::string lOut(lBuffer);
+    delete[] lBuffer;
+    return lOut;
+}
+
+std::string legacyEncode(const std::string &pIn)
+{
+    // Allocated with malloc by the copy of the apache function
+    char *lEncoded = ap_escape_path_segment(NULL, pIn.c_str());
+    std::string encoded(lEncoded);
+    free(lEncoded);
+    return boost::replace_all_copy(encoded, "+", "%2b");
+}
+
+}
+
+void TestUrlCodec::testDefaultCodecEquivalence()
+{
+    boost::scoped_ptr<const IUrlCodec> urlCodec(getUrlCodec("default"));
+
+    // Short, long, plain and encoded values, around the 16 bytes scanned at once
+    std::vector<std::string> values;
+    values.push_back("");
+    values.push_back("%");
+    values.push_back("%4");
+    values.push_back("abc%2");
+    values.push_back("a+b%2Bc%2bd");
+    values.push_back("value%00truncated");
+    values.push_back(std::string("raw\0nul", 7));
+    values.push_back("0123456789abcdef0123456789abcdef");
+    values.push_back("0123456789abcde%200123456789abcdef+");
+    values.push_back("%C3%A9t%C3%A9+%E2%82%AC%2F%3F%26%3D");
+    std::string all;
+    for (int c = 1; c < 256; ++c) {
+        all.push_back(static_cast<char>(c));
+    }
+    values.push_back(all);
+    values.push_back(all + all);
+
+    BOOST_FOREACH(const std::string &value, values) {
+        CPPUNIT_ASSERT_EQUAL(legacyDecode(value), urlCodec->decode(value));
+        CPPUNIT_ASSERT_EQUAL(legacyEncode(value), urlCodec->encode(value));
+        CPPUNIT_ASSERT_EQUAL(legacyDecode(legacyEncode(value)), urlCodec->decode(urlCodec->encode(value)));
+    }
+
+    // Appended to what the buffer holds, false when nothing changed
+    std::string out("k=");
+    CPPUNIT_ASSERT(!urlCodec->decodeTo("plain", 5, out));
+    CPPUNIT_ASSERT(urlCodec->decodeTo("a+b", 3, out));
+    CPPUNIT_ASSERT(urlCodec->encodeTo(" ", 1, out));
+    CPPUNIT_ASSERT(!urlCodec->encodeTo("x", 1, out));
+    CPPUNIT_ASSERT_EQUAL(std::string("k=plaina b%20x"), out);
+
+    // Same as the former implementation on typical query values, through reused buffers
+    const char *queries[] = {"12345", "fr_FR", "John+Smith", "2017-06-01T10%3A00%3A00Z",
+                             "a-longer-value-without-anything-to-decode-in-it-at-all", "%7B%22id%22%3A42%7D"};
+    std::string decoded, encoded;
+    BOOST_FOREACH(const std::string query, queries) {
+        decoded.clear();
+        encoded.clear();
+        urlCodec->decodeTo(query.data(), query.size(), decoded);
+        urlCodec->encodeTo(decoded.data(), decoded.size(), encoded);
+        CPPUNIT_ASSERT_EQUAL(legacyDecode(query), decoded);
+        CPPUNIT_ASSERT_EQUAL(legacyEncode(legacyDecode(query)), encoded);
+    }
 }
@@ -32,10 +32,16 @@ class TestUrlCodec :
     CPPUNIT_TEST(testUrlCodec);
     CPPUNIT_TEST(testApacheCodec);
     CPPUNIT_TEST(testDefaultCodec);
+    CPPUNIT_TEST(testDefaultCodecEquivalence);
     CPPUNIT_TEST_SUITE_END();
 
 public:
     void testUrlCodec();
 	void testApacheCodec();
 	void testDefaultCodec();
+
+	/**
+	 * @brief Tests that the default codec gives the same results as with the apache functions, and times both
+	 */
+	void testDefaultCodecEquivalence();
 };